@@ -0,0 +1,332 @@
+// Metadata benchmark: manifest puts (one chunk per file) and size lookups
+// per second through db.c's cached statements, against the old way of
+// preparing and finalizing every statement on every call (kept below) and
+// parsing BEGIN/COMMIT with sqlite3_exec. synchronous=OFF on the scratch
+// database keeps fsync out of it, so what is left is the per-call SQL
+// overhead. Then size lookups from several threads at once, all on the
+// writer connection vs one reader connection per thread. Last, the
+// server's writes (db_put_manifest() and db_delete_file()) from several
+// threads with the default synchronous=FULL, one transaction each vs group
+// commit, where the fsync per commit is the cost.
+//
+//   bin/bench_db [--ops 200000] [--files 1000] [--threads 1,2,4,8] [--writes 2000] [--dir /tmp]
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "db.h"
+
+static double now_sec(void) {
+    struct timespec ts; clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+// One chunk per file, different for every write, so each put also drops
+// the previous version's chunk
+static void fake_ref(chunk_ref_t *r, long long seed) {
+    memset(r->hash, 0, sizeof(r->hash));
+    memcpy(r->hash, &seed, sizeof(seed));
+    r->size = 4096;
+}
+
+static sqlite3_stmt *prep(sqlite3 *conn, const char *sql) {
+    sqlite3_stmt *st = NULL;
+    if (sqlite3_prepare_v2(conn, sql, -1, &st, NULL) != SQLITE_OK) { sqlite3_finalize(st); return NULL; }
+    return st;
+}
+
+// Runs a prepared statement that returns no rows, and finalizes it
+static int step_done(sqlite3_stmt *st) {
+    int rc = st && sqlite3_step(st) == SQLITE_DONE ? 0 : -1;
+    sqlite3_finalize(st);
+    return rc;
+}
+
+// db_put_manifest() with a one-chunk manifest, preparing every statement
+// on every call as db.c used to
+static int legacy_put(sqlite3 *conn, long long user_id, const char *name, long long new_size, const chunk_ref_t *ref) {
+    int rc = 0;
+    sqlite3_exec(conn, "BEGIN IMMEDIATE", NULL, NULL, NULL);
+    long long old_size = 0, file_id = 0;
+    unsigned char old[SHA256_LEN];
+    int have_old = 0;
+    sqlite3_stmt *st = prep(conn, "SELECT id, size FROM files WHERE user_id=? AND name=?");
+    if (!st) { rc = -1; goto end; }
+    sqlite3_bind_int64(st, 1, user_id);
+    sqlite3_bind_text(st, 2, name, -1, SQLITE_TRANSIENT);
+    if (sqlite3_step(st) == SQLITE_ROW) { file_id = sqlite3_column_int64(st, 0); old_size = sqlite3_column_int64(st, 1); }
+    sqlite3_finalize(st);
+    if (file_id) {
+        if (!(st = prep(conn, "SELECT fc.hash FROM file_chunks fc JOIN chunks c ON c.hash=fc.hash WHERE fc.file_id=? ORDER BY fc.seq"))) { rc = -1; goto end; }
+        sqlite3_bind_int64(st, 1, file_id);
+        if (sqlite3_step(st) == SQLITE_ROW && sqlite3_column_bytes(st, 0) == SHA256_LEN) {
+            memcpy(old, sqlite3_column_blob(st, 0), SHA256_LEN);
+            have_old = 1;
+        }
+        sqlite3_finalize(st);
+        st = prep(conn, "DELETE FROM file_chunks WHERE file_id=?");
+        if (st) sqlite3_bind_int64(st, 1, file_id);
+        if (step_done(st) != 0) { rc = -1; goto end; }
+    }
+    st = prep(conn, "INSERT INTO files(user_id,name,size,created_at) VALUES(?,?,?,strftime('%s','now')) "
+                    "ON CONFLICT(user_id,name) DO UPDATE SET size=excluded.size");
+    if (st) {
+        sqlite3_bind_int64(st, 1, user_id);
+        sqlite3_bind_text(st, 2, name, -1, SQLITE_TRANSIENT);
+        sqlite3_bind_int64(st, 3, new_size);
+    }
+    if (step_done(st) != 0) { rc = -1; goto end; }
+    if (!file_id) {
+        if (!(st = prep(conn, "SELECT id, size FROM files WHERE user_id=? AND name=?"))) { rc = -1; goto end; }
+        sqlite3_bind_int64(st, 1, user_id);
+        sqlite3_bind_text(st, 2, name, -1, SQLITE_TRANSIENT);
+        if (sqlite3_step(st) == SQLITE_ROW) file_id = sqlite3_column_int64(st, 0);
+        sqlite3_finalize(st);
+    }
+    st = prep(conn, "INSERT INTO file_chunks(file_id,seq,hash) VALUES(?,0,?)");
+    if (st) { sqlite3_bind_int64(st, 1, file_id); sqlite3_bind_blob(st, 2, ref->hash, SHA256_LEN, SQLITE_TRANSIENT); }
+    if (step_done(st) != 0) { rc = -1; goto end; }
+    st = prep(conn, "UPDATE chunks SET refs=refs+1 WHERE hash=?");
+    if (st) sqlite3_bind_blob(st, 1, ref->hash, SHA256_LEN, SQLITE_TRANSIENT);
+    if (step_done(st) != 0) { rc = -1; goto end; }
+    if (sqlite3_changes(conn) == 0) {
+        st = prep(conn, "INSERT INTO chunks(hash,size,refs) VALUES(?,?,1)");
+        if (st) { sqlite3_bind_blob(st, 1, ref->hash, SHA256_LEN, SQLITE_TRANSIENT); sqlite3_bind_int64(st, 2, ref->size); }
+        if (step_done(st) != 0) { rc = -1; goto end; }
+    }
+    if (have_old) {
+        st = prep(conn, "UPDATE chunks SET refs=refs-1 WHERE hash=?");
+        if (st) sqlite3_bind_blob(st, 1, old, SHA256_LEN, SQLITE_TRANSIENT);
+        if (step_done(st) != 0) { rc = -1; goto end; }
+        st = prep(conn, "DELETE FROM chunks WHERE hash=? AND refs<=0");
+        if (st) sqlite3_bind_blob(st, 1, old, SHA256_LEN, SQLITE_TRANSIENT);
+        if (step_done(st) != 0) { rc = -1; goto end; }
+    }
+    st = prep(conn, "UPDATE users SET used_bytes=used_bytes+? WHERE id=?");
+    if (st) { sqlite3_bind_int64(st, 1, new_size - old_size); sqlite3_bind_int64(st, 2, user_id); }
+    if (step_done(st) != 0) rc = -1;
+end:
+    sqlite3_exec(conn, rc == 0 ? "COMMIT" : "ROLLBACK", NULL, NULL, NULL);
+    return rc;
+}
+
+// The cached-statement call it is measured against
+static int put(db_t *db, long long user_id, const char *name, long long new_size, const chunk_ref_t *ref) {
+    int nfreed, fresh;
+    long long fresh_bytes;
+    return db_put_manifest(db, user_id, name, new_size, NULL, ref, 1, 0, NULL, &nfreed, &fresh, &fresh_bytes);
+}
+
+// db_get_file_size() as it was before the cache
+static int legacy_get_size(sqlite3 *conn, long long user_id, const char *name, long long *out_size) {
+    sqlite3_stmt *st = NULL;
+    if (sqlite3_prepare_v2(conn, "SELECT size FROM files WHERE user_id=? AND name=?", -1, &st, NULL) != SQLITE_OK) return -1;
+    sqlite3_bind_int64(st, 1, user_id);
+    sqlite3_bind_text(st, 2, name, -1, SQLITE_TRANSIENT);
+    int rc = sqlite3_step(st) == SQLITE_ROW ? 0 : -1;
+    if (rc == 0) *out_size = sqlite3_column_int64(st, 0);
+    sqlite3_finalize(st);
+    return rc;
+}
+
+static void run(const char *path, int cached, long long ops, int files) {
+    unlink(path);
+    db_t db;
+    if (db_open(&db, path, 0) != 0) { fprintf(stderr, "db_open %s failed\n", path); exit(1); }
+    sqlite3_exec(db.writer.conn, "PRAGMA synchronous=OFF", NULL, NULL, NULL);
+    long long uid;
+    if (db_signup(&db, "bench", "x", 1LL << 40) != 0 || db_get_user(&db, "bench", &uid, NULL, NULL, NULL) != 0) {
+        fprintf(stderr, "signup failed\n");
+        exit(1);
+    }
+    char name[64];
+    double t0 = now_sec();
+    for (long long i = 0; i < ops; i++) {
+        snprintf(name, sizeof(name), "file-%06lld.bin", i % files);
+        chunk_ref_t ref;
+        fake_ref(&ref, i);
+        int rc = cached ? put(&db, uid, name, i, &ref) : legacy_put(db.writer.conn, uid, name, i, &ref);
+        if (rc != 0) { fprintf(stderr, "put failed\n"); exit(1); }
+    }
+    double t1 = now_sec();
+    long long size, sum = 0;
+    for (long long i = 0; i < ops; i++) {
+        snprintf(name, sizeof(name), "file-%06lld.bin", i % files);
+        int rc = cached ? db_get_file_size(&db, uid, name, &size) : legacy_get_size(db.writer.conn, uid, name, &size);
+        if (rc != 0) { fprintf(stderr, "lookup failed\n"); exit(1); }
+        sum += size;
+    }
+    double t2 = now_sec();
+    db_close(&db);
+    unlink(path);
+    printf("%-8s %14.0f %14.0f\n", cached ? "cached" : "prepare", (double)ops / (t1 - t0), (double)ops / (t2 - t1));
+    if (sum < 0) printf("?\n"); // keeps the lookups live
+}
+
+typedef struct {
+    db_t *db;
+    long long uid, ops;
+    int files, id, failed;
+} reader_arg_t;
+
+static void *reader_main(void *arg) {
+    reader_arg_t *a = (reader_arg_t*)arg;
+    char name[64];
+    long long size;
+    for (long long i = 0; i < a->ops; i++) {
+        snprintf(name, sizeof(name), "file-%06lld.bin", (i * 7 + a->id) % a->files);
+        if (db_get_file_size(a->db, a->uid, name, &size) != 0) { a->failed = 1; break; }
+    }
+    return NULL;
+}
+
+// Lookups per second, summed over threads, each doing ops of them
+static double run_readers(const char *path, int readers, int threads, long long ops, int files) {
+    db_t db;
+    if (db_open(&db, path, readers) != 0) { fprintf(stderr, "db_open %s failed\n", path); exit(1); }
+    long long uid;
+    if (db_get_user(&db, "bench", &uid, NULL, NULL, NULL) != 0) { fprintf(stderr, "no bench user\n"); exit(1); }
+    pthread_t th[threads];
+    reader_arg_t args[threads];
+    double t0 = now_sec();
+    for (int i = 0; i < threads; i++) {
+        args[i] = (reader_arg_t){ &db, uid, ops, files, i, 0 };
+        pthread_create(&th[i], NULL, reader_main, &args[i]);
+    }
+    for (int i = 0; i < threads; i++) pthread_join(th[i], NULL);
+    double dt = now_sec() - t0;
+    for (int i = 0; i < threads; i++) {
+        if (args[i].failed) { fprintf(stderr, "lookup failed\n"); exit(1); }
+    }
+    db_close(&db);
+    return (double)ops * threads / dt;
+}
+
+static void scaling(const char *path, const char *threads, long long ops, int files) {
+    unlink(path);
+    db_t db;
+    if (db_open(&db, path, 0) != 0) { fprintf(stderr, "db_open %s failed\n", path); exit(1); }
+    sqlite3_exec(db.writer.conn, "PRAGMA synchronous=OFF", NULL, NULL, NULL);
+    long long uid;
+    if (db_signup(&db, "bench", "x", 1LL << 40) != 0 || db_get_user(&db, "bench", &uid, NULL, NULL, NULL) != 0) {
+        fprintf(stderr, "signup failed\n");
+        exit(1);
+    }
+    char name[64];
+    for (int i = 0; i < files; i++) {
+        snprintf(name, sizeof(name), "file-%06d.bin", i);
+        chunk_ref_t ref;
+        fake_ref(&ref, i);
+        if (put(&db, uid, name, i, &ref) != 0) { fprintf(stderr, "put failed\n"); exit(1); }
+    }
+    db_close(&db);
+    printf("\n%-8s %14s %14s %8s\n", "threads", "writer only/s", "readers/s", "scale");
+    double base = 0;
+    char *list = strdup(threads);
+    for (char *tok = strtok(list, ","); tok; tok = strtok(NULL, ",")) {
+        int n = atoi(tok);
+        if (n < 1) continue;
+        double w = run_readers(path, 0, n, ops / n, files);
+        double r = run_readers(path, n, n, ops / n, files);
+        if (base == 0) base = r / n;
+        printf("%-8d %14.0f %14.0f %7.2fx\n", n, w, r, r / base);
+    }
+    free(list);
+    unlink(path);
+}
+
+// The server's write mix: a put per upload, and every fourth write a
+// delete of the file just put
+static void *writer_main(void *arg) {
+    reader_arg_t *a = (reader_arg_t*)arg;
+    char name[64];
+    for (long long i = 0; i < a->ops; i++) {
+        snprintf(name, sizeof(name), "t%d-file-%06lld.bin", a->id, (i / 4) % a->files);
+        long long size;
+        int nfreed, rc;
+        if (i % 4 == 3) {
+            rc = db_delete_file(a->db, a->uid, name, &size, &nfreed);
+        } else {
+            chunk_ref_t ref;
+            fake_ref(&ref, (long long)a->id << 40 | i);
+            rc = put(a->db, a->uid, name, i, &ref);
+        }
+        if (rc != 0) { a->failed = 1; break; }
+    }
+    return NULL;
+}
+
+// Writes per second, summed over threads, each doing ops of them
+static double run_writers(const char *path, int batch, int threads, long long ops, int files) {
+    unlink(path);
+    db_t db;
+    if (db_open(&db, path, 0) != 0) { fprintf(stderr, "db_open %s failed\n", path); exit(1); }
+    long long uid;
+    if (db_signup(&db, "bench", "x", 1LL << 40) != 0 || db_get_user(&db, "bench", &uid, NULL, NULL, NULL) != 0) {
+        fprintf(stderr, "signup failed\n");
+        exit(1);
+    }
+    if (db_group_commit(&db, batch, 0) != 0) { fprintf(stderr, "db_group_commit failed\n"); exit(1); }
+    pthread_t th[threads];
+    reader_arg_t args[threads];
+    double t0 = now_sec();
+    for (int i = 0; i < threads; i++) {
+        args[i] = (reader_arg_t){ &db, uid, ops, files, i, 0 };
+        pthread_create(&th[i], NULL, writer_main, &args[i]);
+    }
+    for (int i = 0; i < threads; i++) pthread_join(th[i], NULL);
+    double dt = now_sec() - t0;
+    for (int i = 0; i < threads; i++) {
+        if (args[i].failed) { fprintf(stderr, "write failed\n"); exit(1); }
+    }
+    db_close(&db);
+    unlink(path);
+    return (double)ops * threads / dt;
+}
+
+static void group(const char *path, const char *threads, long long writes, int files) {
+    printf("\n%-8s %14s %14s %8s\n", "threads", "per-write tx/s", "group/s", "ratio");
+    char *list = strdup(threads);
+    for (char *tok = strtok(list, ","); tok; tok = strtok(NULL, ",")) {
+        int n = atoi(tok);
+        if (n < 1) continue;
+        long long per = writes / n > 0 ? writes / n : 1;
+        double one = run_writers(path, 1, n, per, files);
+        double grp = run_writers(path, 64, n, per, files);
+        printf("%-8d %14.0f %14.0f %7.2fx\n", n, one, grp, grp / one);
+    }
+    free(list);
+}
+
+int main(int argc, char **argv) {
+    long long ops = 200000, writes = 2000;
+    int files = 1000;
+    const char *dir = "/tmp", *threads = "1,2,4,8";
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--ops") == 0 && i + 1 < argc) ops = atoll(argv[++i]);
+        else if (strcmp(argv[i], "--files") == 0 && i + 1 < argc) files = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) threads = argv[++i];
+        else if (strcmp(argv[i], "--writes") == 0 && i + 1 < argc) writes = atoll(argv[++i]);
+        else if (strcmp(argv[i], "--dir") == 0 && i + 1 < argc) dir = argv[++i];
+        else { fprintf(stderr, "usage: bench_db [--ops N] [--files N] [--threads 1,2,4,8] [--writes N] [--dir /tmp]\n"); return 1; }
+    }
+    if (ops < 1) ops = 1;
+    if (files < 1) files = 1;
+    if (writes < 1) writes = 1;
+    char path[1024];
+    snprintf(path, sizeof(path), "%s/bench_db.%d.sqlite", dir, (int)getpid());
+    printf("%-8s %14s %14s\n", "path", "puts/s", "lookups/s");
+    run(path, 0, ops, files);
+    run(path, 1, ops, files);
+    scaling(path, threads, ops, files);
+    group(path, threads, writes, files);
+    // WAL side files
+    char side[1100];
+    snprintf(side, sizeof(side), "%s-wal", path); unlink(side);
+    snprintf(side, sizeof(side), "%s-shm", path); unlink(side);
+    return 0;
+}
@@ -0,0 +1,144 @@
+// Download path benchmark: the old read()+write_n() loop against the
+// sendfile/splice/copy modes of xfer_send(), over TCP loopback.
+//
+//   bin/bench_download [--sizes 1M,100M,2G] [--dir /tmp]
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include "stats.h"
+#include "util.h"
+#include "xfer.h"
+
+typedef struct {
+    int fd;
+    long long expect;
+    long long got;
+} drain_arg_t;
+
+static void *drain_main(void *arg) {
+    drain_arg_t *d = (drain_arg_t*)arg;
+    static char buf[256 * 1024];
+    while (d->got < d->expect) {
+        ssize_t r = recv(d->fd, buf, sizeof(buf), 0);
+        if (r <= 0) break;
+        d->got += r;
+    }
+    return NULL;
+}
+
+static long long parse_size(const char *s) {
+    char *end = NULL;
+    long long v = strtoll(s, &end, 10);
+    if (*end == 'K' || *end == 'k') v <<= 10;
+    else if (*end == 'M' || *end == 'm') v <<= 20;
+    else if (*end == 'G' || *end == 'g') v <<= 30;
+    return v;
+}
+
+static double now_sec(clockid_t clk) {
+    struct timespec ts; clock_gettime(clk, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static int make_file(const char *dir, long long size, char *path, size_t path_sz) {
+    snprintf(path, path_sz, "%s/bench_download.XXXXXX", dir);
+    int fd = mkstemp(path);
+    if (fd < 0) return -1;
+    char block[1 << 20];
+    for (size_t i = 0; i < sizeof(block); i++) block[i] = (char)(rand() & 0xff);
+    for (long long left = size; left > 0; ) {
+        size_t n = left > (long long)sizeof(block) ? sizeof(block) : (size_t)left;
+        if (write_n(fd, block, n) < 0) { close(fd); unlink(path); return -1; }
+        left -= (long long)n;
+    }
+    return fd;
+}
+
+static void tcp_pair(int *snd, int *rcv) {
+    int lfd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in a; memset(&a, 0, sizeof(a));
+    a.sin_family = AF_INET; a.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t al = sizeof(a);
+    if (bind(lfd, (struct sockaddr*)&a, sizeof(a)) != 0 || listen(lfd, 1) != 0) { perror("listen"); exit(1); }
+    getsockname(lfd, (struct sockaddr*)&a, &al);
+    *rcv = socket(AF_INET, SOCK_STREAM, 0);
+    if (connect(*rcv, (struct sockaddr*)&a, sizeof(a)) != 0) { perror("connect"); exit(1); }
+    *snd = accept(lfd, NULL, NULL);
+    close(lfd);
+}
+
+// The pre-sendfile download loop from handle_client()
+static int send_loop(int sock, int fd) {
+    char buf[64 * 1024]; ssize_t r;
+    lseek(fd, 0, SEEK_SET);
+    while ((r = read(fd, buf, sizeof(buf))) > 0) {
+        if (write_n(sock, buf, (size_t)r) < 0) return -1;
+    }
+    return 0;
+}
+
+static int send_xfer(int sock, int fd, long long size, xfer_mode_t mode) {
+    xfer_t x; xfer_init(&x, mode);
+    off_t off = 0;
+    while (off < size) {
+        if (xfer_send(&x, sock, fd, &off, (size_t)(size - off)) < 0 && errno != EINTR) { xfer_close(&x); return -1; }
+    }
+    xfer_close(&x);
+    return 0;
+}
+
+static void run_one(int fd, long long size, const char *label, int mode) {
+    int snd, rcv;
+    tcp_pair(&snd, &rcv);
+    drain_arg_t d = { rcv, size, 0 };
+    pthread_t th; pthread_create(&th, NULL, drain_main, &d);
+    long long calls0 = stats_get(STAT_DL_SENDFILE_CALLS) + stats_get(STAT_DL_SPLICE_CALLS) + stats_get(STAT_DL_COPY_CALLS);
+    double t0 = now_sec(CLOCK_MONOTONIC), c0 = now_sec(CLOCK_THREAD_CPUTIME_ID);
+    int rc = (mode < 0) ? send_loop(snd, fd) : send_xfer(snd, fd, size, (xfer_mode_t)mode);
+    double c1 = now_sec(CLOCK_THREAD_CPUTIME_ID);
+    pthread_join(th, NULL);
+    double t1 = now_sec(CLOCK_MONOTONIC);
+    long long calls = stats_get(STAT_DL_SENDFILE_CALLS) + stats_get(STAT_DL_SPLICE_CALLS) + stats_get(STAT_DL_COPY_CALLS) - calls0;
+    if (mode < 0) calls = 2 * ((size + 65535) / 65536) + 1; // one read + one write per 64 KiB chunk
+    close(snd); close(rcv);
+    if (rc != 0 || d.got != size) { printf("%-10s %-9s FAILED\n", "", label); return; }
+    double secs = t1 - t0;
+    printf("%10lld %-9s %10.1f MiB/s %9.1f ms cpu %9lld syscalls %10lld B/syscall\n",
+           size, label, (double)size / (1 << 20) / secs, (c1 - c0) * 1000.0, calls, calls ? size / calls : 0);
+}
+
+int main(int argc, char **argv) {
+    const char *sizes = "1M,100M,2G";
+    const char *dir = "/tmp";
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--sizes") == 0 && i+1 < argc) sizes = argv[++i];
+        else if (strcmp(argv[i], "--dir") == 0 && i+1 < argc) dir = argv[++i];
+        else { fprintf(stderr, "usage: bench_download [--sizes 1M,100M,2G] [--dir /tmp]\n"); return 1; }
+    }
+    char *list = strdup(sizes);
+    for (char *tok = strtok(list, ","); tok; tok = strtok(NULL, ",")) {
+        long long size = parse_size(tok);
+        char path[512];
+        int fd = make_file(dir, size, path, sizeof(path));
+        if (fd < 0) { perror("bench file"); free(list); return 1; }
+        run_one(fd, size, "loop", -1); // also warms the page cache
+        run_one(fd, size, "loop", -1);
+        run_one(fd, size, "copy", XFER_COPY);
+        run_one(fd, size, "splice", XFER_SPLICE);
+        run_one(fd, size, "sendfile", XFER_SENDFILE);
+        close(fd);
+        unlink(path);
+    }
+    free(list);
+    return 0;
+}
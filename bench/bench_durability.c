@@ -0,0 +1,169 @@
+// Durability benchmark: small-file uploads per second under each
+// --durability mode, through the same steps a worker takes to commit an
+// upload (chunk store, then the manifest through group commit). strict
+// fsyncs every chunk and its directory and syncs the WAL at each commit;
+// batched leaves the chunks to one syncfs() shared by whoever is waiting;
+// relaxed flushes nothing. Each thread uploads its own files of random
+// content, so every chunk is new; --dir should sit on the disk under test.
+//
+//   bin/bench_durability [--threads 1,4,16] [--files N per thread] [--size 4K] [--dir /tmp]
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "chunk.h"
+#include "db.h"
+#include "syncer.h"
+#include "util.h"
+
+typedef struct {
+    const char *root;
+    db_t *db;
+    syncer_t *syncer;
+    long long uid;
+    int id, files;
+    long long size;
+    int failed;
+} thread_arg_t;
+
+static double now_sec(void) {
+    struct timespec ts; clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static long long parse_size(const char *s) {
+    char *end;
+    long long v = strtoll(s, &end, 10);
+    if (*end == 'K' || *end == 'k') v <<= 10;
+    else if (*end == 'M' || *end == 'm') v <<= 20;
+    return v;
+}
+
+static void src_path(const char *root, int id, int file, char *out, size_t cap) {
+    snprintf(out, cap, "%s/src-%d-%d", root, id, file);
+}
+
+// Random content, different for every file, so nothing is deduplicated
+static int make_file(const char *path, long long size, uint64_t seed) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) return -1;
+    static __thread uint64_t block[8192];
+    for (long long done = 0; done < size; ) {
+        for (size_t i = 0; i < sizeof(block) / sizeof(block[0]); i++) {
+            seed ^= seed << 13; seed ^= seed >> 7; seed ^= seed << 17;
+            block[i] = seed;
+        }
+        size_t n = size - done < (long long)sizeof(block) ? (size_t)(size - done) : sizeof(block);
+        if (write_n(fd, block, n) < 0) { close(fd); return -1; }
+        done += (long long)n;
+    }
+    close(fd);
+    return 0;
+}
+
+// worker_handle_upload() without the locks and the staging file's arrival
+static void *thread_main(void *arg) {
+    thread_arg_t *a = (thread_arg_t*)arg;
+    for (int f = 0; f < a->files; f++) {
+        char path[1024], name[64];
+        src_path(a->root, a->id, f, path, sizeof(path));
+        snprintf(name, sizeof(name), "t%d-%d", a->id, f);
+        chunk_ref_t *refs;
+        int n, nfreed = 0, fresh = 0;
+        long long delta = 0, fresh_bytes = 0;
+        if (chunk_store_file(a->root, path, &refs, &n, NULL, NULL) != 0) { a->failed = 1; return NULL; }
+        if (a->syncer && syncer_wait(a->syncer) != 0) { free(refs); a->failed = 1; return NULL; }
+        int rc = db_put_manifest(a->db, a->uid, name, a->size, path, refs, n, 0, &delta, &nfreed, &fresh, &fresh_bytes);
+        free(refs);
+        if (rc != 0) { a->failed = 1; return NULL; }
+    }
+    return NULL;
+}
+
+static int remove_entry(const char *path, const struct stat *st, int type, struct FTW *ftw) {
+    (void)st; (void)type; (void)ftw;
+    remove(path);
+    return 0;
+}
+
+// Uploads per second, summed over threads; a fresh store and database each run
+static double run(const char *dir, chunk_sync_t mode, int threads, int files, long long size) {
+    char root[900], dbpath[1024];
+    snprintf(root, sizeof(root), "%s/bench_durability.XXXXXX", dir);
+    if (!mkdtemp(root)) { perror(root); exit(1); }
+    snprintf(dbpath, sizeof(dbpath), "%s/meta.db", root);
+    static uint64_t seed = 0x9e3779b97f4a7c15ULL;
+    for (int t = 0; t < threads; t++) {
+        for (int f = 0; f < files; f++) {
+            char path[1024];
+            src_path(root, t, f, path, sizeof(path));
+            seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+            if (make_file(path, size, seed | 1) != 0) { perror(path); exit(1); }
+        }
+    }
+    // As the server sets itself up for the mode
+    db_t db;
+    long long uid;
+    if (db_open(&db, dbpath, 0) != 0 || db_group_commit(&db, 64, 0) != 0) { fprintf(stderr, "db_open %s failed\n", dbpath); exit(1); }
+    if (db_signup(&db, "bench", "x", 1LL << 40) != 0 || db_get_user(&db, "bench", &uid, NULL, NULL, NULL) != 0) {
+        fprintf(stderr, "signup failed\n");
+        exit(1);
+    }
+    db_set_chunk_root(&db, root);
+    chunk_set_sync(mode);
+    if (mode == CHUNK_SYNC_RELAXED) db_set_synchronous(&db, 0);
+    syncer_t *syncer = NULL;
+    if (mode == CHUNK_SYNC_BATCHED && syncer_start(&syncer, root, 0) != 0) { fprintf(stderr, "syncer_start failed\n"); exit(1); }
+    sync(); // the source files' writeback stays out of the timing
+    pthread_t th[threads];
+    thread_arg_t args[threads];
+    double t0 = now_sec();
+    for (int i = 0; i < threads; i++) {
+        args[i] = (thread_arg_t){ root, &db, syncer, uid, i, files, size, 0 };
+        pthread_create(&th[i], NULL, thread_main, &args[i]);
+    }
+    for (int i = 0; i < threads; i++) pthread_join(th[i], NULL);
+    double dt = now_sec() - t0;
+    for (int i = 0; i < threads; i++) {
+        if (args[i].failed) { fprintf(stderr, "upload failed (%s)\n", chunk_sync_name(mode)); exit(1); }
+    }
+    syncer_stop(syncer);
+    db_close(&db);
+    nftw(root, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+    return (double)threads * files / dt;
+}
+
+int main(int argc, char **argv) {
+    const char *threads = "1,4,16", *dir = "/tmp";
+    int files = 200;
+    long long size = 4LL << 10;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) threads = argv[++i];
+        else if (strcmp(argv[i], "--files") == 0 && i + 1 < argc) files = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--size") == 0 && i + 1 < argc) size = parse_size(argv[++i]);
+        else if (strcmp(argv[i], "--dir") == 0 && i + 1 < argc) dir = argv[++i];
+        else { fprintf(stderr, "usage: bench_durability [--threads 1,4,16] [--files N] [--size 4K] [--dir /tmp]\n"); return 1; }
+    }
+    if (files < 1) files = 1;
+    if (size < 1) size = 1;
+    printf("%-8s %16s %16s %16s %9s\n", "threads", "strict files/s", "batched files/s", "relaxed files/s", "b/s");
+    char *list = strdup(threads);
+    for (char *tok = strtok(list, ","); tok; tok = strtok(NULL, ",")) {
+        int n = atoi(tok);
+        if (n < 1) continue;
+        double s = run(dir, CHUNK_SYNC_STRICT, n, files, size);
+        double b = run(dir, CHUNK_SYNC_BATCHED, n, files, size);
+        double r = run(dir, CHUNK_SYNC_RELAXED, n, files, size);
+        printf("%-8d %16.0f %16.0f %16.0f %8.2fx\n", n, s, b, r, b / s);
+    }
+    free(list);
+    return 0;
+}
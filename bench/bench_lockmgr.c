@@ -0,0 +1,94 @@
+// Lock manager benchmark: lock/unlock pairs per second as threads are
+// added, and how that scales against one thread.
+//
+//   distinct: each thread locks files of its own user (IX on the user, X
+//             on the file, as an upload does), so threads only meet on
+//             shard mutexes
+//   shared:   every thread takes S on the same user, so all of them go
+//             through one entry and one shard
+//
+//   bin/bench_lockmgr [--threads 1,2,4,8] [--pairs 1000000]
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "lockmgr.h"
+
+#define FILES 16 // per user in distinct
+
+typedef struct {
+    lockmgr_t *lm;
+    int id;
+    int shared;
+    long long pairs;
+} thread_arg_t;
+
+static double now_sec(void) {
+    struct timespec ts; clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static void *thread_main(void *arg) {
+    thread_arg_t *a = (thread_arg_t*)arg;
+    char user[32], files[FILES][32];
+    snprintf(user, sizeof(user), a->shared ? "shared" : "user%d", a->id);
+    for (int f = 0; f < FILES; f++) snprintf(files[f], sizeof(files[f]), "file%d.bin", f);
+    for (long long i = 0; i < a->pairs; i++) {
+        if (a->shared) {
+            lockmgr_user_lock(a->lm, user, LOCK_S);
+            lockmgr_user_unlock(a->lm, user, LOCK_S);
+        } else {
+            // Two lock/unlock pairs per round
+            const char *file = files[i % FILES];
+            lockmgr_user_lock(a->lm, user, LOCK_IX);
+            lockmgr_file_lock(a->lm, user, file, LOCK_X);
+            lockmgr_file_unlock(a->lm, user, file, LOCK_X);
+            lockmgr_user_unlock(a->lm, user, LOCK_IX);
+            i++;
+        }
+    }
+    return NULL;
+}
+
+static double run(int threads, int shared, long long pairs) {
+    lockmgr_t *lm;
+    if (lockmgr_init(&lm) != 0) { fprintf(stderr, "lockmgr_init failed\n"); exit(1); }
+    pthread_t th[threads];
+    thread_arg_t args[threads];
+    double t0 = now_sec();
+    for (int i = 0; i < threads; i++) {
+        args[i] = (thread_arg_t){ lm, i, shared, pairs };
+        pthread_create(&th[i], NULL, thread_main, &args[i]);
+    }
+    for (int i = 0; i < threads; i++) pthread_join(th[i], NULL);
+    double dt = now_sec() - t0;
+    lockmgr_destroy(lm);
+    return (double)pairs * threads / dt;
+}
+
+int main(int argc, char **argv) {
+    const char *threads = "1,2,4,8";
+    long long pairs = 1000000;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) threads = argv[++i];
+        else if (strcmp(argv[i], "--pairs") == 0 && i + 1 < argc) pairs = atoll(argv[++i]);
+        else { fprintf(stderr, "usage: bench_lockmgr [--threads 1,2,4,8] [--pairs N per thread]\n"); return 1; }
+    }
+    if (pairs < 2) pairs = 2;
+    pairs &= ~1LL; // distinct runs two pairs a round
+    printf("%-8s %14s %8s %14s %8s\n", "threads", "distinct/s", "scale", "shared/s", "scale");
+    double base_d = 0, base_s = 0;
+    char *list = strdup(threads);
+    for (char *tok = strtok(list, ","); tok; tok = strtok(NULL, ",")) {
+        int n = atoi(tok);
+        if (n < 1) continue;
+        double d = run(n, 0, pairs), s = run(n, 1, pairs);
+        if (base_d == 0) { base_d = d / n; base_s = s / n; } // per-thread rate of the first row
+        printf("%-8d %14.0f %7.2fx %14.0f %7.2fx\n", n, d, d / base_d, s, s / base_s);
+    }
+    free(list);
+    return 0;
+}
@@ -0,0 +1,80 @@
+// Request framing benchmark: text lines (snprintf + sscanf) against v2
+// frames (varints + length-prefixed strings). Measures the client's encode
+// and the server's parse over a fixed command mix, plus bytes on the wire.
+//
+//   bin/bench_proto [--requests 1000000]
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "proto.h"
+
+static double now_sec(void) {
+    struct timespec ts; clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static request_t g_reqs[5];
+#define NREQS (sizeof(g_reqs) / sizeof(g_reqs[0]))
+
+static void setup(void) {
+    memset(g_reqs, 0, sizeof(g_reqs));
+    g_reqs[0].op = OP_LOGIN; strcpy(g_reqs[0].name, "alice"); strcpy(g_reqs[0].pass, "secret");
+    g_reqs[1].op = OP_LIST;
+    g_reqs[2].op = OP_DOWNLOAD; strcpy(g_reqs[2].name, "report-2024.pdf");
+    g_reqs[3].op = OP_DELETE; strcpy(g_reqs[3].name, "old-notes.txt");
+    g_reqs[4].op = OP_UPLOAD; strcpy(g_reqs[4].name, "holiday.jpg"); g_reqs[4].size = 3145728;
+}
+
+// One pass over count requests; parse = 0 only encodes
+static long long pass(int v2, int parse, int count, long long *bytes) {
+    char buf[PROTO_MAX_REQUEST];
+    char line[PROTO_MAX_REQUEST];
+    request_t out;
+    long long check = 0;
+    *bytes = 0;
+    for (int i = 0; i < count; i++) {
+        request_t q = g_reqs[i % NREQS];
+        q.tag = i;
+        int n = v2 ? proto_encode_request(buf, sizeof(buf), &q) : proto_format_line(buf, sizeof(buf), &q);
+        *bytes += n;
+        check += (unsigned char)buf[n / 2];
+        if (!parse) continue;
+        if (v2) {
+            check += proto_decode_request(buf, (size_t)n, &out);
+        } else {
+            // what the server does: copy the line out of its read buffer, then parse
+            memcpy(line, buf, (size_t)n - 1);
+            line[n - 1] = '\0';
+            check += proto_parse_line(line, &out);
+        }
+        check += out.op + out.size;
+    }
+    return check;
+}
+
+static void run(const char *label, int v2, int count) {
+    long long bytes;
+    double t0 = now_sec();
+    long long check = pass(v2, 0, count, &bytes);
+    double t1 = now_sec();
+    check += pass(v2, 1, count, &bytes);
+    double t2 = now_sec();
+    double enc = t1 - t0, dec = (t2 - t1) - enc;
+    printf("%-5s %8d reqs %6.1f bytes/req  encode %6.1f ns/req  parse %6.1f ns/req  (%lld)\n",
+           label, count, (double)bytes / count, enc * 1e9 / count, dec * 1e9 / count, check % 10);
+}
+
+int main(int argc, char **argv) {
+    int count = 1000000;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--requests") == 0 && i + 1 < argc) count = atoi(argv[++i]);
+        else { fprintf(stderr, "usage: bench_proto [--requests N]\n"); return 1; }
+    }
+    if (count <= 0) count = 1;
+    setup();
+    run("text", 0, count);
+    run("v2", 1, count);
+    return 0;
+}
@@ -0,0 +1,98 @@
+// Command-line reading benchmark: read_line() (one read() per byte) against
+// the buffered reader_t. Syscalls are taken from /proc/self/io (syscr), so
+// they are what the kernel actually saw.
+//
+//   bin/bench_reader [--commands 100000]
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+
+#include "util.h"
+
+static const char *g_cmds[] = {
+    "LOGIN alice secret\n",
+    "LIST\n",
+    "DOWNLOAD report-2024.pdf\n",
+    "DELETE old-notes.txt\n",
+    "UPLOAD holiday.jpg 0\n",
+};
+#define NCMDS (sizeof(g_cmds) / sizeof(g_cmds[0]))
+
+typedef struct {
+    int fd;
+    int ack_fd;  // interactive: wait for one byte per command before sending the next
+    int count;
+} writer_arg_t;
+
+static void *writer_main(void *arg) {
+    writer_arg_t *w = (writer_arg_t*)arg;
+    for (int i = 0; i < w->count; i++) {
+        const char *c = g_cmds[i % NCMDS];
+        write_n(w->fd, c, strlen(c));
+        if (w->ack_fd >= 0) { char b; if (read(w->ack_fd, &b, 1) != 1) break; }
+    }
+    shutdown(w->fd, SHUT_WR);
+    return NULL;
+}
+
+static long long read_syscalls(void) {
+    FILE *f = fopen("/proc/self/io", "r");
+    if (!f) return -1;
+    char key[64]; long long v = -1, out = -1;
+    while (fscanf(f, "%63s %lld", key, &v) == 2) {
+        if (strcmp(key, "syscr:") == 0) { out = v; break; }
+    }
+    fclose(f);
+    return out;
+}
+
+static double now_sec(void) {
+    struct timespec ts; clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static void run(const char *label, int buffered, int interactive, int count) {
+    int sv[2], ack[2] = { -1, -1 };
+    socketpair(AF_UNIX, SOCK_STREAM, 0, sv);
+    if (interactive) socketpair(AF_UNIX, SOCK_STREAM, 0, ack);
+    writer_arg_t w = { sv[0], interactive ? ack[1] : -1, count };
+    reader_t rd; reader_init(&rd, sv[1]);
+    char line[1024];
+    int got = 0;
+    long long sys0 = read_syscalls();
+    double t0 = now_sec();
+    pthread_t th; pthread_create(&th, NULL, writer_main, &w);
+    for (;;) {
+        int n = buffered ? reader_read_line(&rd, line, sizeof(line)) : read_line(sv[1], line, sizeof(line));
+        if (n <= 0) break;
+        got++;
+        if (interactive) write_n(ack[0], "k", 1);
+    }
+    pthread_join(th, NULL);
+    double t1 = now_sec();
+    // the writer's ack reads are syscalls too; count only ours
+    long long sys = read_syscalls() - sys0 - (interactive ? count : 0);
+    printf("%-12s %-8s %8d cmds %10lld read syscalls %7.2f per cmd %8.0f kcmd/s\n",
+           interactive ? "interactive" : "pipelined", label, got, sys, (double)sys / got, got / (t1 - t0) / 1000.0);
+    close(sv[0]); close(sv[1]);
+    if (interactive) { close(ack[0]); close(ack[1]); }
+}
+
+int main(int argc, char **argv) {
+    int count = 100000;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--commands") == 0 && i+1 < argc) count = atoi(argv[++i]);
+        else { fprintf(stderr, "usage: bench_reader [--commands N]\n"); return 1; }
+    }
+    if (read_syscalls() < 0) { fprintf(stderr, "bench_reader needs /proc/self/io\n"); return 1; }
+    run("read_line", 0, 0, count);
+    run("reader_t", 1, 0, count);
+    run("read_line", 0, 1, count / 10);
+    run("reader_t", 1, 1, count / 10);
+    return 0;
+}
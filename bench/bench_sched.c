@@ -0,0 +1,165 @@
+// Task scheduling benchmark: the single mutex ts_queue_t the worker pool
+// used to share against the work-stealing wsched_t, in tasks per second.
+//
+//   inject: 4 submitter threads (the event loops) feed every task from
+//           outside the pool, as the server does
+//   spawn:  tasks fan out into two children each, pushed from the worker
+//           itself, which is where per-worker deques avoid the shared lock
+//
+// --queue-impl ring swaps the Vyukov ring in for the mutex queue, both as
+// the baseline queue and as wsched's injection queue.
+//
+//   bin/bench_sched [--threads 4,16,64] [--tasks 1000000] [--work 100] [--queue-impl mutex|ring]
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "queue.h"
+#include "wsched.h"
+
+#define SUBMITTERS 4
+#define ROOTS 64 // spawn: trees, each a full binary tree of tasks
+
+typedef enum { IMPL_QUEUE, IMPL_WSCHED } impl_t;
+
+static ts_queue_impl_t g_queue_impl = TS_QUEUE_MUTEX;
+
+typedef struct {
+    impl_t impl;
+    int spawn;
+    ts_queue_t q;
+    wsched_t s;
+    long long total, done;
+    int work;
+} bench_t;
+
+typedef struct {
+    bench_t *b;
+    int id;
+    long long count; // submitter: tasks to push
+} thread_arg_t;
+
+static double now_sec(void) {
+    struct timespec ts; clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+// Stand-in for the task body; the result is kept so it is not optimized out
+static unsigned long long g_sink;
+static void do_work(int iters) {
+    unsigned long long x = 0x9e3779b97f4a7c15ull;
+    for (int i = 0; i < iters; i++) { x ^= x << 13; x ^= x >> 7; x ^= x << 17; }
+    __atomic_fetch_add(&g_sink, x, __ATOMIC_RELAXED);
+}
+
+// Items are tree depths + 1, so never NULL
+static void *item_of(int depth) { return (void*)(uintptr_t)(depth + 1); }
+static int depth_of(void *item) { return (int)(uintptr_t)item - 1; }
+
+static void *worker_main(void *arg) {
+    thread_arg_t *a = (thread_arg_t*)arg;
+    bench_t *b = a->b;
+    for (;;) {
+        void *item;
+        int rc = b->impl == IMPL_QUEUE ? ts_queue_pop(&b->q, &item) : wsched_pop(&b->s, a->id, &item);
+        if (rc < 0) break;
+        if (rc > 0) continue;
+        do_work(b->work);
+        int depth = depth_of(item);
+        if (b->spawn && depth > 0) {
+            for (int k = 0; k < 2; k++) {
+                if (b->impl == IMPL_QUEUE) ts_queue_push(&b->q, item_of(depth - 1));
+                else wsched_push_local(&b->s, a->id, item_of(depth - 1));
+            }
+        }
+        if (__atomic_add_fetch(&b->done, 1, __ATOMIC_ACQ_REL) == b->total) {
+            if (b->impl == IMPL_QUEUE) ts_queue_close(&b->q);
+            else wsched_close(&b->s);
+        }
+    }
+    return NULL;
+}
+
+static void *submitter_main(void *arg) {
+    thread_arg_t *a = (thread_arg_t*)arg;
+    for (long long i = 0; i < a->count; i++) {
+        if (a->b->impl == IMPL_QUEUE) ts_queue_push(&a->b->q, item_of(0));
+        else wsched_push(&a->b->s, item_of(0));
+    }
+    return NULL;
+}
+
+static double run(impl_t impl, int spawn, int threads, long long tasks, int work) {
+    bench_t b; memset(&b, 0, sizeof(b));
+    b.impl = impl;
+    b.spawn = spawn;
+    b.work = work;
+    int depth = 0;
+    if (spawn) {
+        while ((long long)ROOTS * ((2LL << (depth + 1)) - 1) <= tasks) depth++;
+        b.total = (long long)ROOTS * ((2LL << depth) - 1);
+    } else {
+        b.total = tasks;
+    }
+    // Worker pushes must never block with every worker waiting on room
+    size_t cap = spawn ? (size_t)b.total : 1024;
+    if (impl == IMPL_QUEUE) ts_queue_init_impl(&b.q, cap, g_queue_impl);
+    else wsched_init(&b.s, threads, cap, g_queue_impl);
+    pthread_t th[threads + SUBMITTERS];
+    thread_arg_t args[threads + SUBMITTERS];
+    double t0 = now_sec();
+    for (int i = 0; i < threads; i++) {
+        args[i] = (thread_arg_t){ &b, i, 0 };
+        pthread_create(&th[i], NULL, worker_main, &args[i]);
+    }
+    int nsub = 0;
+    if (spawn) {
+        for (int r = 0; r < ROOTS; r++) {
+            if (impl == IMPL_QUEUE) ts_queue_push(&b.q, item_of(depth));
+            else wsched_push(&b.s, item_of(depth));
+        }
+    } else {
+        nsub = SUBMITTERS;
+        for (int i = 0; i < nsub; i++) {
+            args[threads + i] = (thread_arg_t){ &b, i, tasks / nsub + (i < tasks % nsub) };
+            pthread_create(&th[threads + i], NULL, submitter_main, &args[threads + i]);
+        }
+    }
+    for (int i = 0; i < threads + nsub; i++) pthread_join(th[i], NULL);
+    double dt = now_sec() - t0;
+    if (b.done != b.total) { fprintf(stderr, "ran %lld of %lld tasks\n", b.done, b.total); exit(1); }
+    if (impl == IMPL_QUEUE) ts_queue_destroy(&b.q);
+    else wsched_destroy(&b.s);
+    return (double)b.total / dt;
+}
+
+int main(int argc, char **argv) {
+    const char *threads = "4,16,64";
+    long long tasks = 1000000;
+    int work = 100;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) threads = argv[++i];
+        else if (strcmp(argv[i], "--tasks") == 0 && i + 1 < argc) tasks = atoll(argv[++i]);
+        else if (strcmp(argv[i], "--work") == 0 && i + 1 < argc) work = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--queue-impl") == 0 && i + 1 < argc && ts_queue_parse_impl(argv[i + 1], &g_queue_impl) == 0) i++;
+        else { fprintf(stderr, "usage: bench_sched [--threads 4,16,64] [--tasks N] [--work ITERS] [--queue-impl mutex|ring]\n"); return 1; }
+    }
+    if (tasks < ROOTS * 3) tasks = ROOTS * 3;
+    printf("%-8s %-7s %14s %14s %8s\n", "threads", "load", "ts_queue/s", "wsched/s", "ratio");
+    char *list = strdup(threads);
+    for (char *tok = strtok(list, ","); tok; tok = strtok(NULL, ",")) {
+        int n = atoi(tok);
+        if (n < 1) continue;
+        for (int spawn = 0; spawn < 2; spawn++) {
+            double q = run(IMPL_QUEUE, spawn, n, tasks, work);
+            double s = run(IMPL_WSCHED, spawn, n, tasks, work);
+            printf("%-8d %-7s %14.0f %14.0f %7.2fx\n", n, spawn ? "spawn" : "inject", q, s, s / q);
+        }
+    }
+    free(list);
+    return 0;
+}
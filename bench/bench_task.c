@@ -0,0 +1,186 @@
+// Task round trip benchmark: an event loop thread hands tasks to workers
+// through a ts_queue_t and takes them back on completion, as the server
+// does, counting heap allocations on the way (malloc and friends are
+// wrapped below).
+//
+//   malloc: the old path: calloc'd task, strdup'd names and error, a
+//           mutex-guarded completion list and an eventfd write per task
+//   pool:   task_pool_t with inline names, the lock-free task_list_push
+//           and a wake only when the list was empty
+//
+//   bin/bench_task [--tasks 1000000] [--workers 4] [--inflight 64]
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+
+#include "queue.h"
+#include "threadpool.h"
+
+// Allocation counter: the executable's definitions win over libc's
+extern void *__libc_malloc(size_t n);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *p, size_t n);
+extern void __libc_free(void *p);
+static long long g_allocs;
+
+void *malloc(size_t n) { __atomic_add_fetch(&g_allocs, 1, __ATOMIC_RELAXED); return __libc_malloc(n); }
+void *calloc(size_t n, size_t size) { __atomic_add_fetch(&g_allocs, 1, __ATOMIC_RELAXED); return __libc_calloc(n, size); }
+void *realloc(void *p, size_t n) { __atomic_add_fetch(&g_allocs, 1, __ATOMIC_RELAXED); return __libc_realloc(p, n); }
+void free(void *p) { __libc_free(p); }
+
+// The task as it was: names and the error message on the heap
+typedef struct legacy_task {
+    char *username, *filename, *err_msg;
+    int status;
+    struct legacy_task *next;
+} legacy_task_t;
+
+typedef struct {
+    int pool;
+    ts_queue_t q;
+    int wake_fd;
+    // malloc mode's completion list
+    pthread_mutex_t mu;
+    legacy_task_t *done_head, *done_tail;
+    // pool mode's
+    task_t *done;
+} bench_t;
+
+static bench_t g_b;
+
+static double now_sec(void) {
+    struct timespec ts; clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static void wake(void) {
+    uint64_t one = 1;
+    ssize_t r = write(g_b.wake_fd, &one, sizeof(one));
+    (void)r;
+}
+
+static void pooled_done(task_t *t) {
+    if (task_list_push(&g_b.done, t)) wake();
+}
+
+static void *worker_main(void *arg) {
+    (void)arg;
+    void *item;
+    while (ts_queue_pop(&g_b.q, &item) == 0) {
+        if (g_b.pool) {
+            task_t *t = (task_t*)item;
+            t->result.status = 0;
+            t->on_done(t);
+        } else {
+            legacy_task_t *t = (legacy_task_t*)item;
+            t->status = 0;
+            t->next = NULL;
+            pthread_mutex_lock(&g_b.mu);
+            if (g_b.done_tail) g_b.done_tail->next = t; else g_b.done_head = t;
+            g_b.done_tail = t;
+            pthread_mutex_unlock(&g_b.mu);
+            wake();
+        }
+    }
+    return NULL;
+}
+
+// Takes back whatever has completed, blocking until something has
+static long long reap(task_pool_t *pool) {
+    uint64_t v;
+    ssize_t r = read(g_b.wake_fd, &v, sizeof(v));
+    (void)r;
+    long long n = 0;
+    if (g_b.pool) {
+        for (task_t *t = task_list_take(&g_b.done), *next; t; t = next, n++) {
+            next = t->next;
+            task_pool_put(pool, t);
+        }
+    } else {
+        pthread_mutex_lock(&g_b.mu);
+        legacy_task_t *t = g_b.done_head;
+        g_b.done_head = g_b.done_tail = NULL;
+        pthread_mutex_unlock(&g_b.mu);
+        for (legacy_task_t *next; t; t = next, n++) {
+            next = t->next;
+            free(t->username); free(t->filename); free(t->err_msg);
+            free(t);
+        }
+    }
+    return n;
+}
+
+static void submit(task_pool_t *pool, long long i) {
+    char name[64];
+    snprintf(name, sizeof(name), "file-%lld.bin", i % 1000);
+    if (g_b.pool) {
+        task_t *t = task_pool_get(pool);
+        t->type = TASK_LIST;
+        snprintf(t->username, sizeof(t->username), "%s", "alice");
+        snprintf(t->filename, sizeof(t->filename), "%s", name);
+        t->on_done = pooled_done;
+        ts_queue_push(&g_b.q, t);
+    } else {
+        legacy_task_t *t = (legacy_task_t*)calloc(1, sizeof(*t));
+        t->username = strdup("alice");
+        t->filename = strdup(name);
+        ts_queue_push(&g_b.q, t);
+    }
+}
+
+static void run(int pool, long long tasks, int workers, int inflight) {
+    memset(&g_b, 0, sizeof(g_b));
+    g_b.pool = pool;
+    ts_queue_init(&g_b.q, (size_t)inflight);
+    g_b.wake_fd = eventfd(0, 0);
+    pthread_mutex_init(&g_b.mu, NULL);
+    pthread_t th[workers];
+    for (int i = 0; i < workers; i++) pthread_create(&th[i], NULL, worker_main, NULL);
+    task_pool_t tp = {0};
+    // Warm up the pool (and malloc's arenas) before counting
+    long long out = 0, done = 0;
+    for (long long i = 0; i < inflight; i++) { submit(&tp, i); out++; }
+    while (done < out) done += reap(&tp);
+    long long allocs0 = __atomic_load_n(&g_allocs, __ATOMIC_RELAXED);
+    double t0 = now_sec();
+    out = done = 0;
+    for (long long i = 0; i < tasks; i++) {
+        while (out - done >= inflight) done += reap(&tp);
+        submit(&tp, i);
+        out++;
+    }
+    while (done < out) done += reap(&tp);
+    double dt = now_sec() - t0;
+    long long allocs = __atomic_load_n(&g_allocs, __ATOMIC_RELAXED) - allocs0;
+    ts_queue_close(&g_b.q);
+    for (int i = 0; i < workers; i++) pthread_join(th[i], NULL);
+    task_pool_destroy(&tp);
+    ts_queue_destroy(&g_b.q);
+    close(g_b.wake_fd);
+    pthread_mutex_destroy(&g_b.mu);
+    printf("%-7s %12.0f %12.2f\n", pool ? "pool" : "malloc", (double)tasks / dt, (double)allocs / (double)tasks);
+}
+
+int main(int argc, char **argv) {
+    long long tasks = 1000000;
+    int workers = 4, inflight = 64;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--tasks") == 0 && i + 1 < argc) tasks = atoll(argv[++i]);
+        else if (strcmp(argv[i], "--workers") == 0 && i + 1 < argc) workers = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--inflight") == 0 && i + 1 < argc) inflight = atoi(argv[++i]);
+        else { fprintf(stderr, "usage: bench_task [--tasks N] [--workers N] [--inflight N]\n"); return 1; }
+    }
+    if (tasks < 1) tasks = 1;
+    if (workers < 1) workers = 1;
+    if (inflight < 1) inflight = 1;
+    printf("%-7s %12s %12s\n", "path", "tasks/s", "allocs/task");
+    run(0, tasks, workers, inflight);
+    run(1, tasks, workers, inflight);
+    return 0;
+}
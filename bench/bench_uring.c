@@ -0,0 +1,167 @@
+// Chunk store benchmark: concurrent uploads committed into the chunk store
+// (cut, hash, existence check, write, fsync, rename per new chunk), with
+// the blocking syscalls vs the io_uring backend. Each thread stores its own
+// files of random content, so every chunk is new; --dir should sit on the
+// disk under test, since the fsyncs dominate.
+//
+//   bin/bench_uring [--threads 1,4,16] [--files N per thread] [--size 4M] [--dir /tmp]
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "chunk.h"
+#include "util.h"
+
+typedef struct {
+    const char *root;
+    int id, files;
+    long long size;
+    int failed;
+} thread_arg_t;
+
+static double now_sec(void) {
+    struct timespec ts; clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static long long parse_size(const char *s) {
+    char *end;
+    long long v = strtoll(s, &end, 10);
+    if (*end == 'K' || *end == 'k') v <<= 10;
+    else if (*end == 'M' || *end == 'm') v <<= 20;
+    else if (*end == 'G' || *end == 'g') v <<= 30;
+    return v;
+}
+
+static void src_path(const char *root, int id, int file, char *out, size_t cap) {
+    snprintf(out, cap, "%s/src-%d-%d", root, id, file);
+}
+
+// Random content, different on every run, so nothing is deduplicated
+static int make_file(const char *path, long long size, uint64_t seed) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) return -1;
+    static __thread uint64_t block[8192];
+    for (long long done = 0; done < size; ) {
+        for (size_t i = 0; i < sizeof(block) / sizeof(block[0]); i++) {
+            seed ^= seed << 13; seed ^= seed >> 7; seed ^= seed << 17;
+            block[i] = seed;
+        }
+        size_t n = size - done < (long long)sizeof(block) ? (size_t)(size - done) : sizeof(block);
+        if (write_n(fd, block, n) < 0) { close(fd); return -1; }
+        done += (long long)n;
+    }
+    close(fd);
+    return 0;
+}
+
+static void *thread_main(void *arg) {
+    thread_arg_t *a = (thread_arg_t*)arg;
+    for (int f = 0; f < a->files; f++) {
+        char path[1024];
+        src_path(a->root, a->id, f, path, sizeof(path));
+        chunk_ref_t *refs; int n;
+        if (chunk_store_file(a->root, path, &refs, &n, NULL, NULL) != 0) { a->failed = 1; return NULL; }
+        free(refs);
+    }
+    return NULL;
+}
+
+// Chunks go away between runs so the next one stores them all again
+static void clear_chunks(const char *root, int threads, int files) {
+    for (int t = 0; t < threads; t++) {
+        for (int f = 0; f < files; f++) {
+            char path[1024];
+            src_path(root, t, f, path, sizeof(path));
+            chunk_ref_t *refs; int n;
+            // Storing again finds every chunk present and writes nothing
+            if (chunk_store_file(root, path, &refs, &n, NULL, NULL) != 0) continue;
+            chunk_store_remove(root, refs, n);
+            free(refs);
+        }
+    }
+}
+
+static double run(const char *root, chunk_io_t io, int threads, int files, long long size) {
+    chunk_set_io(io);
+    static uint64_t seed = 0x9e3779b97f4a7c15ULL;
+    for (int t = 0; t < threads; t++) {
+        for (int f = 0; f < files; f++) {
+            char path[1024];
+            src_path(root, t, f, path, sizeof(path));
+            seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+            if (make_file(path, size, seed | 1) != 0) { perror(path); exit(1); }
+        }
+    }
+    sync();
+    pthread_t th[threads];
+    thread_arg_t args[threads];
+    double t0 = now_sec();
+    for (int i = 0; i < threads; i++) {
+        args[i] = (thread_arg_t){ root, i, files, size, 0 };
+        pthread_create(&th[i], NULL, thread_main, &args[i]);
+    }
+    for (int i = 0; i < threads; i++) pthread_join(th[i], NULL);
+    double dt = now_sec() - t0;
+    for (int i = 0; i < threads; i++) {
+        if (args[i].failed) { fprintf(stderr, "chunk_store_file failed (%s)\n", chunk_io_name(io)); exit(1); }
+    }
+    clear_chunks(root, threads, files);
+    for (int t = 0; t < threads; t++) {
+        for (int f = 0; f < files; f++) {
+            char path[1024];
+            src_path(root, t, f, path, sizeof(path));
+            unlink(path);
+        }
+    }
+    return (double)size * threads * files / dt / (1 << 20);
+}
+
+int main(int argc, char **argv) {
+    const char *threads = "1,4,16", *dir = "/tmp";
+    int files = 4;
+    long long size = 4LL << 20;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) threads = argv[++i];
+        else if (strcmp(argv[i], "--files") == 0 && i + 1 < argc) files = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--size") == 0 && i + 1 < argc) size = parse_size(argv[++i]);
+        else if (strcmp(argv[i], "--dir") == 0 && i + 1 < argc) dir = argv[++i];
+        else { fprintf(stderr, "usage: bench_uring [--threads 1,4,16] [--files N] [--size 4M] [--dir /tmp]\n"); return 1; }
+    }
+    if (files < 1) files = 1;
+    if (size < 1) size = 1;
+    int uring = chunk_set_io(CHUNK_IO_URING) == 0;
+    if (!uring) fprintf(stderr, "io_uring unavailable, blocking only\n");
+    char root[1024];
+    snprintf(root, sizeof(root), "%s/bench_uring.XXXXXX", dir);
+    if (!mkdtemp(root)) { perror(root); return 1; }
+    printf("%-8s %14s %14s %8s\n", "threads", "blocking MB/s", "uring MB/s", "ratio");
+    char *list = strdup(threads);
+    for (char *tok = strtok(list, ","); tok; tok = strtok(NULL, ",")) {
+        int n = atoi(tok);
+        if (n < 1) continue;
+        double b = run(root, CHUNK_IO_BLOCKING, n, files, size);
+        if (!uring) { printf("%-8d %14.1f %14s %8s\n", n, b, "-", "-"); continue; }
+        double u = run(root, CHUNK_IO_URING, n, files, size);
+        printf("%-8d %14.1f %14.1f %7.2fx\n", n, b, u, u / b);
+    }
+    free(list);
+    char top[1100];
+    snprintf(top, sizeof(top), "%s/" CHUNK_DIR, root);
+    // Empty by now apart from the fan-out directories
+    for (int i = 0; i < 256; i++) {
+        char sub[1200];
+        snprintf(sub, sizeof(sub), "%s/%02x", top, i);
+        rmdir(sub);
+    }
+    rmdir(top);
+    rmdir(root);
+    return 0;
+}
@@ -0,0 +1,561 @@
+#define _GNU_SOURCE
+#include "chunk.h"
+#include "util.h"
+#include "uring.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <dirent.h>
+
+// Normalized chunking: a cut is harder to hit before CHUNK_AVG (more mask
+// bits) and easier after it, which pulls chunk sizes in around the average.
+// The masks take high bits, which mix in the most recent bytes.
+#define MASK_S (((1ULL << 18) - 1) << 46)
+#define MASK_L (((1ULL << 14) - 1) << 50)
+#define READ_BUF (4 * CHUNK_MAX)
+// Most chunks one window can hold: all CHUNK_MIN but a short last one
+#define BATCH (READ_BUF / CHUNK_MIN + 1)
+// A batch's write+fsync pairs fit, so uring_sqe never submits early
+#define RING_ENTRIES 256
+
+static int g_sync = CHUNK_SYNC_STRICT;
+
+static uint64_t g_gear[256];
+static pthread_once_t g_gear_once = PTHREAD_ONCE_INIT;
+
+// Fixed seed: boundaries must not move between runs or stored chunks
+// would stop matching
+static void gear_init(void) {
+    uint64_t x = 0x2545f4914f6cdd1dULL;
+    for (int i = 0; i < 256; i++) {
+        uint64_t z = (x += 0x9e3779b97f4a7c15ULL);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        g_gear[i] = z ^ (z >> 31);
+    }
+}
+
+size_t chunk_cut(const unsigned char *p, size_t n) {
+    pthread_once(&g_gear_once, gear_init);
+    if (n <= CHUNK_MIN) return n;
+    size_t normal = n < CHUNK_AVG ? n : CHUNK_AVG;
+    uint64_t fp = 0;
+    size_t i = CHUNK_MIN; // nothing shorter is cut, so skip hashing it
+    for (; i < normal; i++) {
+        fp = (fp << 1) + g_gear[p[i]];
+        if (!(fp & MASK_S)) return i + 1;
+    }
+    for (; i < n; i++) {
+        fp = (fp << 1) + g_gear[p[i]];
+        if (!(fp & MASK_L)) return i + 1;
+    }
+    return n;
+}
+
+static int strict(void) {
+    return __atomic_load_n(&g_sync, __ATOMIC_RELAXED) == CHUNK_SYNC_STRICT;
+}
+
+static int fsync_dir(const char *dir) {
+    int fd = open(dir, O_RDONLY | O_DIRECTORY);
+    if (fd < 0) return -1;
+    int rc = fsync(fd);
+    close(fd);
+    return rc;
+}
+
+int chunk_path(const char *root, const unsigned char *hash, char *out, size_t cap, int make_dirs) {
+    static const char hex[] = "0123456789abcdef";
+    char name[2 * SHA256_LEN + 1];
+    for (int i = 0; i < SHA256_LEN; i++) {
+        name[2*i] = hex[hash[i] >> 4];
+        name[2*i+1] = hex[hash[i] & 0xf];
+    }
+    name[2 * SHA256_LEN] = '\0';
+    int n = snprintf(out, cap, "%s/" CHUNK_DIR "/%.2s", root, name);
+    if (n <= 0 || (size_t)n >= cap) return -1;
+    if (make_dirs) {
+        char top[1024];
+        if (snprintf(top, sizeof(top), "%s/" CHUNK_DIR, root) >= (int)sizeof(top)) return -1;
+        // A new directory's own entry needs its parent synced
+        if (mkdir(top, 0755) == 0 && strict()) fsync_dir(root);
+        if (mkdir(out, 0755) == 0 && strict()) fsync_dir(top);
+    }
+    int m = snprintf(out + n, cap - (size_t)n, "/%s", name);
+    if (m <= 0 || (size_t)m >= cap - (size_t)n) return -1;
+    return 0;
+}
+
+// Chunks a chunk_store_file() call put on disk itself (its *written)
+typedef struct {
+    chunk_ref_t *v;
+    int n, cap;
+} ref_list_t;
+
+// Losing one only leaves an orphan for the startup sweep
+static void ref_list_add(ref_list_t *l, const chunk_ref_t *r) {
+    if (!l) return;
+    if (l->n == l->cap) {
+        int cap = l->cap ? l->cap * 2 : 16;
+        chunk_ref_t *v = (chunk_ref_t*)realloc(l->v, sizeof(*v) * (size_t)cap);
+        if (!v) return;
+        l->v = v;
+        l->cap = cap;
+    }
+    l->v[l->n++] = *r;
+}
+
+// Writes one chunk unless it is already there: temp file, rename, so a
+// chunk path only ever holds complete content. With sync the file is
+// fsynced before the rename and its directory after. *wrote is set once
+// the chunk is in place under its name.
+static int store_one(const char *root, const unsigned char *hash, const unsigned char *data, size_t n, int sync, int *wrote) {
+    *wrote = 0;
+    char path[1024], tmp[1024];
+    if (chunk_path(root, hash, path, sizeof(path), 1) != 0) return -1;
+    if (access(path, F_OK) == 0) return 0;
+    if (snprintf(tmp, sizeof(tmp), "%s/" CHUNK_DIR "/.tmp.XXXXXX", root) >= (int)sizeof(tmp)) return -1;
+    int fd = mkstemp(tmp);
+    if (fd < 0) return -1;
+    if (write_n(fd, data, n) < 0 || (sync && fsync(fd) != 0)) { close(fd); unlink(tmp); return -1; }
+    close(fd);
+    if (rename(tmp, path) != 0) { unlink(tmp); return -1; }
+    *wrote = 1;
+    if (sync) {
+        *strrchr(path, '/') = '\0';
+        if (fsync_dir(path) != 0) return -1;
+    }
+    return 0;
+}
+
+// Fills buf[*have..cap) from fd; sets *eof once read() returns 0
+static int fill(int fd, unsigned char *buf, size_t cap, size_t *have, int *eof) {
+    while (*have < cap) {
+        ssize_t r = read(fd, buf + *have, cap - *have);
+        if (r < 0 && errno == EINTR) continue;
+        if (r < 0) return -1;
+        if (r == 0) { *eof = 1; break; }
+        *have += (size_t)r;
+    }
+    return 0;
+}
+
+int chunk_parse_io(const char *s, chunk_io_t *out) {
+    if (strcmp(s, "blocking") == 0) *out = CHUNK_IO_BLOCKING;
+    else if (strcmp(s, "uring") == 0) *out = CHUNK_IO_URING;
+    else return -1;
+    return 0;
+}
+
+const char *chunk_io_name(chunk_io_t io) {
+    return io == CHUNK_IO_URING ? "uring" : "blocking";
+}
+
+static int g_io = CHUNK_IO_BLOCKING;
+
+int chunk_set_io(chunk_io_t io) {
+    if (io == CHUNK_IO_URING) {
+        uring_t u;
+        if (uring_init(&u, 4) != 0) return -1;
+        uring_free(&u);
+    }
+    __atomic_store_n(&g_io, (int)io, __ATOMIC_RELAXED);
+    return 0;
+}
+
+chunk_io_t chunk_get_io(void) {
+    return (chunk_io_t)__atomic_load_n(&g_io, __ATOMIC_RELAXED);
+}
+
+int chunk_parse_sync(const char *s, chunk_sync_t *out) {
+    if (strcmp(s, "strict") == 0) *out = CHUNK_SYNC_STRICT;
+    else if (strcmp(s, "batched") == 0) *out = CHUNK_SYNC_BATCHED;
+    else if (strcmp(s, "relaxed") == 0) *out = CHUNK_SYNC_RELAXED;
+    else return -1;
+    return 0;
+}
+
+const char *chunk_sync_name(chunk_sync_t sync) {
+    return sync == CHUNK_SYNC_BATCHED ? "batched" : sync == CHUNK_SYNC_RELAXED ? "relaxed" : "strict";
+}
+
+void chunk_set_sync(chunk_sync_t sync) {
+    __atomic_store_n(&g_sync, (int)sync, __ATOMIC_RELAXED);
+}
+
+chunk_sync_t chunk_get_sync(void) {
+    return (chunk_sync_t)__atomic_load_n(&g_sync, __ATOMIC_RELAXED);
+}
+
+// Per-thread ring with its window buffer and room for one batch's paths,
+// statx results and temp files
+typedef struct {
+    uring_t u;
+    unsigned char *buf; // READ_BUF, registered as buffer 0 when u.fixed
+    char path[BATCH][1024];
+    char tmp[BATCH][1024];
+    struct statx stx[BATCH];
+    int fd[BATCH];
+} ring_t;
+
+static pthread_key_t g_ring_key;
+static pthread_once_t g_ring_once = PTHREAD_ONCE_INIT;
+static ring_t g_no_ring; // marks a thread whose ring could not be set up
+
+static void ring_free(void *p) {
+    ring_t *r = (ring_t*)p;
+    if (r == &g_no_ring) return;
+    uring_free(&r->u);
+    free(r->buf);
+    free(r);
+}
+
+static void ring_key_init(void) {
+    pthread_key_create(&g_ring_key, ring_free);
+}
+
+// This thread's ring; NULL to run blocking
+static ring_t *ring_get(void) {
+    if (chunk_get_io() != CHUNK_IO_URING) return NULL;
+    pthread_once(&g_ring_once, ring_key_init);
+    ring_t *r = (ring_t*)pthread_getspecific(g_ring_key);
+    if (r) return r == &g_no_ring ? NULL : r;
+    r = (ring_t*)calloc(1, sizeof(*r));
+    if (r) r->buf = (unsigned char*)aligned_alloc(4096, READ_BUF);
+    if (!r || !r->buf || uring_init(&r->u, RING_ENTRIES) != 0) {
+        if (r) free(r->buf);
+        free(r);
+        pthread_setspecific(g_ring_key, &g_no_ring);
+        return NULL;
+    }
+    // Pinning counts against RLIMIT_MEMLOCK; without it the plain
+    // READ/WRITE ops do the same job
+    struct iovec iov = { r->buf, READ_BUF };
+    uring_register_buffers(&r->u, &iov, 1);
+    pthread_setspecific(g_ring_key, r);
+    return r;
+}
+
+// After a failed uring_wait(): reaps the completions still owed, so that
+// nothing in flight writes to r or uses its descriptors once the caller
+// has cleaned up. A ring that cannot deliver them is retired: closing it
+// cancels the rest, this thread runs blocking from then on, and r itself
+// is left allocated for any late completion to land in.
+static void ring_drain(ring_t *r, int pending) {
+    for (int tries = 0; pending > 0 && tries < 100; ) {
+        uint64_t ud; int res;
+        if (uring_wait(&r->u, &ud, &res) == 0) pending--;
+        else if (++tries < 100) usleep(1000);
+    }
+    if (pending > 0) {
+        uring_free(&r->u);
+        pthread_setspecific(g_ring_key, &g_no_ring);
+    }
+}
+
+static int ring_buf_index(const ring_t *r) {
+    return r->u.fixed ? 0 : -1;
+}
+
+// fill() through the ring into r->buf; *off is the file offset of buf + *have
+static int ring_fill(ring_t *r, int fd, off_t *off, size_t *have, int *eof) {
+    while (*have < READ_BUF) {
+        uring_prep_read(uring_sqe(&r->u), fd, r->buf + *have, (unsigned)(READ_BUF - *have), (uint64_t)*off, ring_buf_index(r), 0);
+        uint64_t ud; int res;
+        if (uring_wait(&r->u, &ud, &res) != 0) { ring_drain(r, 1); return -1; }
+        if (res == -EINTR || res == -EAGAIN) continue;
+        if (res < 0) { errno = -res; return -1; }
+        if (res == 0) { *eof = 1; break; }
+        *have += (size_t)res;
+        *off += res;
+    }
+    return 0;
+}
+
+// Existence checks for refs[0..k): one STATX each, one submission.
+// r->path[i] is left holding each chunk's path and r->fd[i] is 1 where the
+// chunk is on disk, 0 where it is not.
+static int ring_stat_batch(ring_t *r, const char *root, const chunk_ref_t *refs, int k, int make_dirs) {
+    for (int i = 0; i < k; i++) {
+        if (chunk_path(root, refs[i].hash, r->path[i], sizeof(r->path[i]), make_dirs) != 0) return -1;
+        uring_prep_statx(uring_sqe(&r->u), r->path[i], &r->stx[i], (uint64_t)i);
+    }
+    for (int i = 0; i < k; i++) {
+        uint64_t ud; int res;
+        if (uring_wait(&r->u, &ud, &res) != 0) { ring_drain(r, k - i); return -1; }
+        r->fd[ud] = res == 0;
+    }
+    return 0;
+}
+
+// Syncs the directories of the chunks r->path[idx[0..n)], each once, in
+// one submission
+static int ring_sync_dirs(ring_t *r, const int *idx, int n) {
+    int dfd[BATCH], nd = 0, rc = 0;
+    for (int j = 0; j < n; j++) {
+        const char *p = r->path[idx[j]];
+        size_t len = (size_t)(strrchr(p, '/') - p);
+        int seen = 0;
+        for (int m = 0; m < j && !seen; m++) seen = strncmp(r->path[idx[m]], p, len + 1) == 0;
+        if (seen) continue;
+        char dir[1024];
+        memcpy(dir, p, len);
+        dir[len] = '\0';
+        if ((dfd[nd] = open(dir, O_RDONLY | O_DIRECTORY)) < 0) { rc = -1; continue; }
+        uring_prep_fsync(uring_sqe(&r->u), dfd[nd], (uint64_t)nd);
+        nd++;
+    }
+    for (int j = 0; j < nd; j++) {
+        uint64_t ud; int res;
+        if (uring_wait(&r->u, &ud, &res) != 0) { ring_drain(r, nd - j); rc = -1; break; }
+        if (res != 0) rc = -1;
+    }
+    for (int j = 0; j < nd; j++) close(dfd[j]);
+    return rc;
+}
+
+// store_one() for a window's chunks at once; chunk i is refs[i].size bytes
+// at r->buf + offs[i]. Those renamed into place go on *written.
+static int ring_store_batch(ring_t *r, const char *root, const chunk_ref_t *refs, const size_t *offs, int k, ref_list_t *written) {
+    if (k == 0) return 0;
+    if (ring_stat_batch(r, root, refs, k, 1) != 0) return -1;
+    int rc = 0, writing = 0, sync = strict();
+    for (int i = 0; i < k; i++) {
+        if (r->fd[i]) { r->fd[i] = -1; continue; } // already stored
+        r->fd[i] = -1;
+        if (rc != 0) continue;
+        if (snprintf(r->tmp[i], sizeof(r->tmp[i]), "%s/" CHUNK_DIR "/.tmp.XXXXXX", root) >= (int)sizeof(r->tmp[i])) { rc = -1; continue; }
+        if ((r->fd[i] = mkstemp(r->tmp[i])) < 0) { rc = -1; continue; }
+        struct io_uring_sqe *w = uring_sqe(&r->u);
+        uring_prep_write(w, r->fd[i], r->buf + offs[i], (unsigned)refs[i].size, 0, ring_buf_index(r), (uint64_t)i << 1);
+        if (sync) {
+            w->flags |= IOSQE_IO_LINK; // the fsync runs after it, or is cancelled
+            uring_prep_fsync(uring_sqe(&r->u), r->fd[i], (uint64_t)i << 1 | 1);
+        }
+        writing++;
+    }
+    int ok[BATCH], failed = 0;
+    for (int i = 0; i < k; i++) ok[i] = r->fd[i] >= 0;
+    for (int i = 0, n = (sync ? 2 : 1) * writing; i < n; i++) {
+        uint64_t ud; int res;
+        if (uring_wait(&r->u, &ud, &res) != 0) { ring_drain(r, n - i); failed = 1; break; }
+        int c = (int)(ud >> 1);
+        if (ud & 1 ? res != 0 : res != refs[c].size) ok[c] = 0;
+    }
+    int renaming = 0, queued[BATCH] = { 0 };
+    for (int i = 0; i < k; i++) {
+        if (r->fd[i] < 0) continue;
+        close(r->fd[i]);
+        if (ok[i] && !failed) { uring_prep_rename(uring_sqe(&r->u), r->tmp[i], r->path[i], (uint64_t)i); queued[i] = 1; renaming++; }
+        else { unlink(r->tmp[i]); rc = -1; }
+    }
+    if (failed) return -1;
+    int renamed[BATCH], nrenamed = 0;
+    for (int i = 0; i < renaming; i++) {
+        uint64_t ud; int res;
+        if (uring_wait(&r->u, &ud, &res) != 0) {
+            // Those whose outcome never came back: a temp file that is gone
+            // was renamed into place
+            ring_drain(r, renaming - i);
+            for (int j = 0; j < k; j++) {
+                if (queued[j] && unlink(r->tmp[j]) != 0 && errno == ENOENT) ref_list_add(written, &refs[j]);
+            }
+            return -1;
+        }
+        queued[ud] = 0;
+        if (res != 0) { unlink(r->tmp[ud]); rc = -1; }
+        else { renamed[nrenamed++] = (int)ud; ref_list_add(written, &refs[ud]); }
+    }
+    if (sync && nrenamed > 0 && ring_sync_dirs(r, renamed, nrenamed) != 0) rc = -1;
+    return rc;
+}
+
+static int ring_store_file(ring_t *r, const char *root, const char *path, chunk_ref_t **out, int *count, ref_list_t *written) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return -1;
+    unsigned char *buf = r->buf;
+    chunk_ref_t *refs = NULL;
+    size_t offs[BATCH];
+    int n = 0, cap = 0, rc = 0, eof = 0;
+    size_t have = 0, pos = 0;
+    off_t off = 0;
+    for (;;) {
+        if (!eof && have - pos < CHUNK_MAX) {
+            memmove(buf, buf + pos, have - pos);
+            have -= pos; pos = 0;
+            if (ring_fill(r, fd, &off, &have, &eof) != 0) { rc = -1; break; }
+        }
+        if (pos == have) break;
+        // Cut what the window settles (the same cuts as the blocking loop),
+        // then store the lot before the window moves
+        int first = n;
+        while (pos < have && (eof || have - pos >= CHUNK_MAX)) {
+            size_t avail = have - pos;
+            size_t len = chunk_cut(buf + pos, avail < CHUNK_MAX ? avail : CHUNK_MAX);
+            if (n == cap) { cap = cap ? cap * 2 : 64; refs = (chunk_ref_t*)realloc(refs, sizeof(*refs) * (size_t)cap); }
+            sha256(buf + pos, len, refs[n].hash);
+            refs[n].size = (long long)len;
+            offs[n - first] = pos;
+            n++;
+            pos += len;
+        }
+        if (ring_store_batch(r, root, refs + first, offs, n - first, written) != 0) { rc = -1; break; }
+    }
+    close(fd);
+    if (rc != 0) { free(refs); return -1; }
+    *out = refs;
+    *count = n;
+    return 0;
+}
+
+static int blocking_store_file(const char *root, const char *path, chunk_ref_t **out, int *count, ref_list_t *written) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return -1;
+    unsigned char *buf = (unsigned char*)malloc(READ_BUF);
+    chunk_ref_t *refs = NULL;
+    int n = 0, cap = 0, rc = 0, eof = 0;
+    size_t have = 0, pos = 0;
+    for (;;) {
+        if (!eof && have - pos < CHUNK_MAX) {
+            memmove(buf, buf + pos, have - pos);
+            have -= pos; pos = 0;
+            if (fill(fd, buf, READ_BUF, &have, &eof) != 0) { rc = -1; break; }
+        }
+        if (pos == have) break;
+        size_t avail = have - pos;
+        size_t len = chunk_cut(buf + pos, avail < CHUNK_MAX ? avail : CHUNK_MAX);
+        if (n == cap) { cap = cap ? cap * 2 : 64; refs = (chunk_ref_t*)realloc(refs, sizeof(*refs) * (size_t)cap); }
+        sha256(buf + pos, len, refs[n].hash);
+        refs[n].size = (long long)len;
+        int wrote;
+        rc = store_one(root, refs[n].hash, buf + pos, len, strict(), &wrote);
+        if (wrote) ref_list_add(written, &refs[n]);
+        if (rc != 0) break;
+        n++;
+        pos += len;
+    }
+    free(buf);
+    close(fd);
+    if (rc != 0) { free(refs); return -1; }
+    *out = refs;
+    *count = n;
+    return 0;
+}
+
+int chunk_store_file(const char *root, const char *path, chunk_ref_t **out, int *count,
+                     chunk_ref_t **written, int *nwritten) {
+    *out = NULL; *count = 0;
+    ref_list_t w = { NULL, 0, 0 };
+    ring_t *r = ring_get();
+    int rc = r ? ring_store_file(r, root, path, out, count, written ? &w : NULL)
+               : blocking_store_file(root, path, out, count, written ? &w : NULL);
+    if (written) { *written = w.v; *nwritten = w.n; }
+    return rc;
+}
+
+int chunk_store_ensure(const char *root, const char *path, const chunk_ref_t *refs, int count) {
+    int fd = -1, rc = 0;
+    unsigned char *buf = NULL;
+    off_t off = 0;
+    ring_t *r = ring_get();
+    for (int i = 0; i < count && rc == 0; off += refs[i].size, i++) {
+        // With a ring the checks go out BATCH at a time; a missing chunk is
+        // rare (a racing release) and is rewritten the blocking way
+        int b = i % BATCH;
+        if (r && b == 0 && ring_stat_batch(r, root, refs + i, count - i < BATCH ? count - i : BATCH, 0) != 0) { rc = -1; break; }
+        if (r && r->fd[b]) continue;
+        char cpath[1024];
+        if (!r) {
+            if (chunk_path(root, refs[i].hash, cpath, sizeof(cpath), 0) != 0) { rc = -1; break; }
+            if (access(cpath, F_OK) == 0) continue;
+        }
+        if (fd < 0 && (fd = open(path, O_RDONLY)) < 0) { rc = -1; break; }
+        if (!buf) buf = (unsigned char*)malloc(CHUNK_MAX);
+        if (pread(fd, buf, (size_t)refs[i].size, off) != refs[i].size) { rc = -1; break; }
+        // Past the caller's flush: synced here unless nothing is
+        int wrote;
+        rc = store_one(root, refs[i].hash, buf, (size_t)refs[i].size, chunk_get_sync() != CHUNK_SYNC_RELAXED, &wrote);
+    }
+    if (fd >= 0) close(fd);
+    free(buf);
+    return rc;
+}
+
+int chunk_store_remove(const char *root, const chunk_ref_t *refs, int count) {
+    int failed = 0;
+    ring_t *r = ring_get();
+    if (r) {
+        for (int i = 0; i < count; i += BATCH) {
+            int k = count - i < BATCH ? count - i : BATCH, queued = 0;
+            for (int j = 0; j < k; j++) {
+                if (chunk_path(root, refs[i + j].hash, r->path[j], sizeof(r->path[j]), 0) != 0) { failed++; continue; }
+                uring_prep_unlink(uring_sqe(&r->u), r->path[j], (uint64_t)j);
+                queued++;
+            }
+            for (int j = 0; j < queued; j++) {
+                uint64_t ud; int res;
+                if (uring_wait(&r->u, &ud, &res) != 0) {
+                    ring_drain(r, queued - j);
+                    return -1;
+                }
+                if (res != 0 && res != -ENOENT) failed++;
+            }
+        }
+        return failed ? -1 : 0;
+    }
+    for (int i = 0; i < count; i++) {
+        char path[1024];
+        if (chunk_path(root, refs[i].hash, path, sizeof(path), 0) != 0 || (unlink(path) != 0 && errno != ENOENT)) failed++;
+    }
+    return failed ? -1 : 0;
+}
+
+// 64 hex digits, nothing else
+static int parse_hash(const char *name, unsigned char *hash) {
+    for (int i = 0; i < 2 * SHA256_LEN; i++) {
+        char c = name[i];
+        int v = c >= '0' && c <= '9' ? c - '0' : c >= 'a' && c <= 'f' ? c - 'a' + 10 : -1;
+        if (v < 0) return -1;
+        if (i & 1) hash[i / 2] |= (unsigned char)v;
+        else hash[i / 2] = (unsigned char)(v << 4);
+    }
+    return name[2 * SHA256_LEN] == '\0' ? 0 : -1;
+}
+
+int chunk_store_sweep(const char *root, int (*keep)(const unsigned char *hash, void *arg), void *arg) {
+    char top[1024], path[1400];
+    if (snprintf(top, sizeof(top), "%s/" CHUNK_DIR, root) >= (int)sizeof(top)) return 0;
+    DIR *d = opendir(top);
+    if (!d) return 0;
+    int removed = 0;
+    struct dirent *e;
+    while ((e = readdir(d))) {
+        if (strncmp(e->d_name, ".tmp.", 5) == 0) {
+            snprintf(path, sizeof(path), "%s/%s", top, e->d_name);
+            if (unlink(path) == 0) removed++;
+            continue;
+        }
+        if (strlen(e->d_name) != 2 || e->d_name[0] == '.') continue;
+        char sub[1100];
+        snprintf(sub, sizeof(sub), "%s/%s", top, e->d_name);
+        DIR *sd = opendir(sub);
+        if (!sd) continue;
+        struct dirent *f;
+        while ((f = readdir(sd))) {
+            unsigned char hash[SHA256_LEN];
+            if (parse_hash(f->d_name, hash) != 0 || keep(hash, arg)) continue;
+            snprintf(path, sizeof(path), "%s/%s", sub, f->d_name);
+            if (unlink(path) == 0) removed++;
+        }
+        closedir(sd);
+    }
+    closedir(d);
+    return removed;
+}
@@ -0,0 +1,85 @@
+#ifndef CHUNK_H
+#define CHUNK_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#include "sha256.h"
+
+// Content-defined chunking and the chunk store. Uploaded files are cut into
+// chunks at content-defined boundaries (FastCDC: a gear rolling hash with
+// normalized chunking), so an edit only disturbs the chunks around it, and
+// each chunk is stored once under its SHA-256:
+//
+//   <root>/.chunks/<first two hex digits>/<64 hex digits>
+//
+// A file is its manifest, the ordered list of chunks (db.h); chunks are
+// reference counted across every manifest and removed when unreferenced.
+
+#define CHUNK_DIR ".chunks"
+#define CHUNK_MIN (16 * 1024)
+#define CHUNK_AVG (64 * 1024)
+#define CHUNK_MAX (256 * 1024)
+
+typedef struct {
+    unsigned char hash[SHA256_LEN];
+    long long size;
+} chunk_ref_t;
+
+// How the chunk store does its file I/O. blocking is one syscall per read,
+// existence check, write, fsync and rename. uring batches them on a
+// per-thread io_uring: a window's existence checks go out as one
+// submission, and so do all its new chunks' write+fsync pairs (linked, so
+// each fsync follows its write) and then their renames; reads and writes
+// use a registered buffer.
+typedef enum { CHUNK_IO_BLOCKING, CHUNK_IO_URING } chunk_io_t;
+
+int chunk_parse_io(const char *s, chunk_io_t *out);
+const char *chunk_io_name(chunk_io_t io);
+// Process-wide; -1 (leaving the backend as it was) if the kernel has no
+// usable io_uring. A thread whose ring cannot be set up runs blocking.
+int chunk_set_io(chunk_io_t io);
+chunk_io_t chunk_get_io(void);
+
+// What a stored chunk is worth after a crash (--durability). strict:
+// each chunk is fsynced before its rename and its directory after, so it
+// is on disk once chunk_store_file() returns. batched: no fsync here; the
+// caller flushes the filesystem (syncer.h) before the manifest commits.
+// relaxed: nothing is flushed, the page cache writes back when it will.
+// Chunks chunk_store_ensure() has to rewrite are synced unless relaxed.
+typedef enum { CHUNK_SYNC_STRICT, CHUNK_SYNC_BATCHED, CHUNK_SYNC_RELAXED } chunk_sync_t;
+
+int chunk_parse_sync(const char *s, chunk_sync_t *out);
+const char *chunk_sync_name(chunk_sync_t sync);
+// Process-wide, like chunk_set_io()
+void chunk_set_sync(chunk_sync_t sync);
+chunk_sync_t chunk_get_sync(void);
+
+// Length of the chunk starting at p. n is CHUNK_MAX, or less only where the
+// data ends.
+size_t chunk_cut(const unsigned char *p, size_t n);
+
+// <root>/.chunks/xx/<hex>; make_dirs creates the directories on the way
+int chunk_path(const char *root, const unsigned char *hash, char *out, size_t cap, int make_dirs);
+
+// Cuts the file at path into chunks and stores those not on disk yet.
+// Returns 0 with a malloc'd array of *count refs (NULL when empty). Unless
+// written is NULL, the chunks this call put on disk come back in a
+// malloc'd *written, on failure too, so a caller whose commit does not
+// happen can discard them (db_discard_chunks()).
+int chunk_store_file(const char *root, const char *path, chunk_ref_t **out, int *count,
+                     chunk_ref_t **written, int *nwritten);
+
+// Makes sure every chunk of a manifest is on disk, rewriting from the
+// source file (refs cover it in order) any a concurrent release removed
+int chunk_store_ensure(const char *root, const char *path, const chunk_ref_t *refs, int count);
+
+// Removes stored chunks. -1 if any could not be removed (one already gone
+// counts as removed).
+int chunk_store_remove(const char *root, const chunk_ref_t *refs, int count);
+
+// Startup: removes chunk files keep() rejects (no row in the chunks
+// table) and temp files left by interrupted writes. Returns how many.
+int chunk_store_sweep(const char *root, int (*keep)(const unsigned char *hash, void *arg), void *arg);
+
+#endif
@@ -1,215 +1,723 @@
-#define _POSIX_C_SOURCE 200809L
-#include <stdio.h>
-#include <stdlib.h>
-#include <string.h>
-#include <errno.h>
-#include <unistd.h>
-#include <arpa/inet.h>
-#include <netinet/in.h>
-#include <sys/socket.h>
-#include <sys/stat.h>
-#include <fcntl.h>
-
-#include "util.h"
-
-static int connect_to(const char *host, int port) {
-    int fd = socket(AF_INET, SOCK_STREAM, 0);
-    struct sockaddr_in addr; memset(&addr, 0, sizeof(addr));
-    addr.sin_family = AF_INET; addr.sin_port = htons((uint16_t)port); inet_pton(AF_INET, host, &addr.sin_addr);
-    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) { perror("connect"); exit(1);} 
-    return fd;
-}
-
-static int file_exists(const char *path) {
-    struct stat st; return stat(path, &st) == 0 && S_ISREG(st.st_mode);
-}
-
-static long long file_size(const char *path) {
-    struct stat st; if (stat(path, &st) != 0) return -1; return st.st_size;
-}
-
-static int ensure_test_file(const char *path) {
-    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
-    if (fd < 0) return -1;
-    const char *msg = "TEST FILE GENERATED BY CLIENT\n";
-    for (int i = 0; i < 2048; i++) {
-        if (write_n(fd, msg, strlen(msg)) < 0) { close(fd); return -1; }
-    }
-    close(fd);
-    return 0;
-}
-
-static const char *base_name(const char *path) {
-    const char *s = strrchr(path, '/');
-    if (!s) s = strrchr(path, '\\');
-    return s ? s + 1 : path;
-}
-
-static void usage(void) {
-    fprintf(stderr, "Usage: client --host 127.0.0.1 --port 9000\n");
-}
-
-static void help_commands(void) {
-    fprintf(stdout, "Commands:\n");
-    fprintf(stdout, "  signup <user> <pass>\n");
-    fprintf(stdout, "  login <user> <pass>\n");
-    fprintf(stdout, "  upload <local_path>\n");
-    fprintf(stdout, "  list\n");
-    fprintf(stdout, "  download <name> <out_path>\n");
-    fprintf(stdout, "  delete <name>\n");
-    fprintf(stdout, "  help\n");
-    fprintf(stdout, "  quit\n");
-}
-
-int main(int argc, char **argv) {
-    const char *host = "127.0.0.1"; int port = 9000;
-    int i = 1;
-    for (; i < argc; i++) {
-        if (strcmp(argv[i], "--host") == 0 && i+1 < argc) host = argv[++i];
-        else if (strcmp(argv[i], "--port") == 0 && i+1 < argc) port = atoi(argv[++i]);
-        else break;
-    }
-    int fd;
-    if (i < argc) {
-        // One-shot mode for scripts: ./client [--host ... --port ...] <cmd> args...
-        const char *cmd = argv[i++];
-        fd = connect_to(host, port);
-        if (strcmp(cmd, "signup") == 0) {
-            if (i+1 >= argc) { usage(); return 1; }
-            const char *u = argv[i++], *p = argv[i++];
-            send_fmt(fd, "SIGNUP %s %s\n", u, p);
-            char line[1024]; if (read_line(fd, line, sizeof(line)) <= 0) return 1; printf("%s\n", line);
-        } else if (strcmp(cmd, "login") == 0) {
-            if (i+1 >= argc) { usage(); return 1; }
-            const char *u = argv[i++], *p = argv[i++];
-            send_fmt(fd, "LOGIN %s %s\n", u, p);
-            char line[1024]; if (read_line(fd, line, sizeof(line)) <= 0) return 1; printf("%s\n", line);
-        } else if (strcmp(cmd, "upload") == 0) {
-            if (i >= argc) { usage(); return 1; }
-            const char *path = argv[i++];
-            if (!file_exists(path)) { if (ensure_test_file(path) != 0) return 1; }
-            long long sz = file_size(path);
-            int in = open(path, O_RDONLY); if (in < 0) return 1;
-            const char *name = base_name(path);
-            send_fmt(fd, "UPLOAD %s %lld\n", name, sz);
-            char buf[64 * 1024]; ssize_t r; while ((r = read(in, buf, sizeof(buf))) > 0) { if (write_n(fd, buf, (size_t)r) < 0) { close(in); return 1; } }
-            close(in);
-            char line[1024]; if (read_line(fd, line, sizeof(line)) <= 0) return 1; printf("%s\n", line);
-        } else if (strcmp(cmd, "list") == 0) {
-            send_fmt(fd, "LIST\n");
-            char line[1024]; if (read_line(fd, line, sizeof(line)) <= 0) return 1; printf("%s\n", line);
-            int n = 0; if (sscanf(line, "OK %d", &n) == 1) { for (int k = 0; k < n; k++) { read_line(fd, line, sizeof(line)); printf("%s\n", line); } }
-        } else if (strcmp(cmd, "download") == 0) {
-            if (i+1 >= argc) { usage(); return 1; }
-            const char *name = argv[i++]; const char *outp = argv[i++];
-            send_fmt(fd, "DOWNLOAD %s\n", name);
-            char line[1024]; if (read_line(fd, line, sizeof(line)) <= 0) return 1;
-            long long sz = 0; if (sscanf(line, "OK %lld", &sz) != 1) { fprintf(stderr, "%s\n", line); return 1; }
-            int out = open(outp, O_WRONLY | O_CREAT | O_TRUNC, 0644); if (out < 0) return 1;
-            char buf[64 * 1024]; long long remain = sz;
-            while (remain > 0) { size_t chunk = (remain > (long long)sizeof(buf)) ? sizeof(buf) : (size_t)remain; int rr = read_n(fd, buf, chunk); if (rr <= 0) { close(out); return 1; } if (write_n(out, buf, chunk) < 0) { close(out); return 1; } remain -= (long long)chunk; }
-            close(out);
-            fprintf(stdout, "OK\n");
-        } else if (strcmp(cmd, "delete") == 0) {
-            if (i >= argc) { usage(); return 1; }
-            const char *name = argv[i++];
-            send_fmt(fd, "DELETE %s\n", name);
-            char line[1024]; if (read_line(fd, line, sizeof(line)) <= 0) return 1; printf("%s\n", line);
-        } else {
-            usage();
-        }
-        close(fd);
-        return 0;
-    }
-    fd = connect_to(host, port);
-    help_commands();
-    // Interactive loop
-    char input[1024];
-    for (;;) {
-        fprintf(stdout, "> "); fflush(stdout);
-        if (!fgets(input, sizeof(input), stdin)) break;
-        // strip trailing newline
-        size_t len = strlen(input); if (len > 0 && (input[len-1] == '\n' || input[len-1] == '\r')) input[--len] = '\0';
-        if (len == 0) continue;
-        if (strcmp(input, "quit") == 0 || strcmp(input, "exit") == 0) break;
-        if (strcmp(input, "help") == 0) { help_commands(); continue; }
-
-        char cmd[32];
-        if (sscanf(input, "%31s", cmd) != 1) continue;
-        if (strcmp(cmd, "signup") == 0) {
-            char u[256], p[256];
-            if (sscanf(input, "signup %255s %255s", u, p) != 2) { fprintf(stderr, "usage: signup <user> <pass>\n"); continue; }
-            send_fmt(fd, "SIGNUP %s %s\n", u, p);
-            char line[1024]; if (read_line(fd, line, sizeof(line)) <= 0) { perror("read"); break; } printf("%s\n", line);
-        } else if (strcmp(cmd, "login") == 0) {
-            char u[256], p[256];
-            if (sscanf(input, "login %255s %255s", u, p) != 2) { fprintf(stderr, "usage: login <user> <pass>\n"); continue; }
-            send_fmt(fd, "LOGIN %s %s\n", u, p);
-            char line[1024]; if (read_line(fd, line, sizeof(line)) <= 0) { perror("read"); break; } printf("%s\n", line);
-        } else if (strcmp(cmd, "upload") == 0) {
-            char path[512];
-            if (sscanf(input, "upload %511s", path) != 1) { fprintf(stderr, "usage: upload <local_path>\n"); continue; }
-            if (!file_exists(path)) {
-                if (ensure_test_file(path) != 0) { fprintf(stderr, "failed to create test file\n"); continue; }
-            }
-            long long sz = file_size(path);
-            int in = open(path, O_RDONLY);
-            if (in < 0) { perror("open"); continue; }
-            const char *name = base_name(path);
-            send_fmt(fd, "UPLOAD %s %lld\n", name, sz);
-            char buf[64 * 1024]; ssize_t r;
-            while ((r = read(in, buf, sizeof(buf))) > 0) {
-                if (write_n(fd, buf, (size_t)r) < 0) { perror("write"); break; }
-            }
-            close(in);
-            char line[1024]; if (read_line(fd, line, sizeof(line)) <= 0) { perror("read"); break; } printf("%s\n", line);
-        } else if (strcmp(cmd, "list") == 0) {
-            send_fmt(fd, "LIST\n");
-            char line[1024]; if (read_line(fd, line, sizeof(line)) <= 0) { perror("read"); break; }
-            printf("%s\n", line);
-            int n = 0; if (sscanf(line, "OK %d", &n) == 1) {
-                for (int k = 0; k < n; k++) { read_line(fd, line, sizeof(line)); printf("%s\n", line); }
-            }
-        } else if (strcmp(cmd, "download") == 0) {
-            char name[256], outp[512];
-            if (sscanf(input, "download %255s %511s", name, outp) != 2) { fprintf(stderr, "usage: download <name> <out_path>\n"); continue; }
-            send_fmt(fd, "DOWNLOAD %s\n", name);
-            char line[1024]; if (read_line(fd, line, sizeof(line)) <= 0) { perror("read"); break; }
-            long long sz = 0; if (sscanf(line, "OK %lld", &sz) != 1) { fprintf(stderr, "%s\n", line); continue; }
-            int out = open(outp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
-            char buf[64 * 1024]; long long remain = sz;
-            if (out < 0) {
-                // Drain server payload to keep protocol in sync
-                while (remain > 0) {
-                    size_t chunk = (remain > (long long)sizeof(buf)) ? sizeof(buf) : (size_t)remain;
-                    int rr = read_n(fd, buf, chunk);
-                    if (rr <= 0) { break; }
-                    remain -= (long long)chunk;
-                }
-                perror("open");
-                continue;
-            }
-            //Normal streaming to file
-            while (remain > 0) {
-                size_t chunk = (remain > (long long)sizeof(buf)) ? sizeof(buf) : (size_t)remain;
-                int rr = read_n(fd, buf, chunk);
-                if (rr <= 0) { perror("read"); close(out); break; }
-                if (write_n(out, buf, chunk) < 0) { perror("write"); close(out); break; }
-                remain -= (long long)chunk;
-            }
-            close(out);
-            fprintf(stdout, "OK\n");
-        } else if (strcmp(cmd, "delete") == 0) {
-            char name[256];
-            if (sscanf(input, "delete %255s", name) != 1) { fprintf(stderr, "usage: delete <name>\n"); continue; }
-            send_fmt(fd, "DELETE %s\n", name);
-            char line[1024]; if (read_line(fd, line, sizeof(line)) <= 0) { perror("read"); break; } printf("%s\n", line);
-        } else {
-            fprintf(stderr, "unknown command\n");
-        }
-    }
-    close(fd);
-    return 0;
-}
-
-
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <pthread.h>
+
+#include "util.h"
+#include "proto.h"
+#include "compress.h"
+
+static int connect_to(const char *host, int port) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr; memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET; addr.sin_port = htons((uint16_t)port); inet_pton(AF_INET, host, &addr.sin_addr);
+    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) { close(fd); return -1; }
+    return fd;
+}
+
+static int file_exists(const char *path) {
+    struct stat st; return stat(path, &st) == 0 && S_ISREG(st.st_mode);
+}
+
+static long long file_size(const char *path) {
+    struct stat st; if (stat(path, &st) != 0) return -1; return st.st_size;
+}
+
+static int ensure_test_file(const char *path) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) return -1;
+    const char *msg = "TEST FILE GENERATED BY CLIENT\n";
+    for (int i = 0; i < 2048; i++) {
+        if (write_n(fd, msg, strlen(msg)) < 0) { close(fd); return -1; }
+    }
+    close(fd);
+    return 0;
+}
+
+static const char *base_name(const char *path) {
+    const char *s = strrchr(path, '/');
+    if (!s) s = strrchr(path, '\\');
+    return s ? s + 1 : path;
+}
+
+static void usage(void) {
+    fprintf(stderr, "Usage: client --host 127.0.0.1 --port 9000 [--proto v2|text] [--compress lz4] [--resume-above BYTES] [--streams N] [command args...]\n");
+}
+
+// Server connection in whichever protocol was negotiated
+typedef struct {
+    int fd;
+    reader_t rd; // all server replies go through here, never straight read()s on fd
+    int v2;
+    int lz4; // server takes and sends LZ4-framed bodies
+    int resume; // server keeps resumable upload sessions
+    int stripe; // and takes striped ones (UPLOAD_PART)
+    // What reconnecting needs: how the connection was opened, and the last
+    // login that succeeded on it
+    const char *host;
+    int port, want_v2, want_codec;
+    char user[128], pass[128];
+} conn_t;
+
+typedef struct {
+    long long tag;   // -1: untagged text reply
+    int ok;
+    char err[64];    // ERR code
+    long long value; // OK <n>: DOWNLOAD size, LIST/STATS item count; -1 if absent
+    char cursor[PROTO_NAME_MAX + 1]; // paged LIST: where the next page starts, "" on the last
+    codec_t codec;   // DOWNLOAD body encoding
+} reply_t;
+
+#define LIST_PAGE 1000 // names per LIST request when the client walks a listing
+
+static codec_t g_codec = CODEC_NONE; // --compress, once the server has offered it
+static long long g_resume_above = 8LL * 1024 * 1024; // --resume-above
+static int g_streams = 1; // --streams: connections a session upload is striped over
+
+#define RESUME_PIECE (8LL * 1024 * 1024) // body bytes per UPLOAD_APPEND
+#define RESUME_TRIES 5 // reconnects (1s, 2s, 4s... apart) or BUSY retries in a row
+#define STRIPE_ALIGN (1LL << 20) // stream ranges start on these boundaries
+
+// Asks for v2 framing; a server that does not answer "OK v2" (including
+// one that predates HELLO) is spoken to in text. The HELLO reply also lists
+// the body codecs and features the server has, so text clients say
+// "HELLO v1" to learn them.
+static int conn_open(conn_t *c, const char *host, int port, int want_v2, int want_codec) {
+    c->host = host;
+    c->port = port;
+    c->want_v2 = want_v2;
+    c->want_codec = want_codec;
+    c->v2 = 0;
+    c->lz4 = 0;
+    c->resume = 0;
+    c->stripe = 0;
+    if ((c->fd = connect_to(host, port)) < 0) return -1;
+    reader_init(&c->rd, c->fd);
+    if (send_fmt(c->fd, "HELLO v%d\n", want_v2 ? 2 : 1) < 0) return -1;
+    char line[256];
+    if (reader_read_line(&c->rd, line, sizeof(line)) <= 0) return -1;
+    int version = 0, off = 0;
+    if (sscanf(line, "OK v%d%n", &version, &off) != 1) return 0;
+    c->v2 = (version == 2);
+    char word[32];
+    for (const char *p = line + off; sscanf(p, "%31s%n", word, &off) == 1; p += off) {
+        if (strcmp(word, "lz4") == 0) c->lz4 = 1;
+        else if (strcmp(word, "resume") == 0) c->resume = 1;
+        else if (strcmp(word, "stripe") == 0) c->stripe = 1;
+    }
+    return 0;
+}
+
+static int conn_send(conn_t *c, const request_t *req) {
+    char buf[PROTO_MAX_REQUEST];
+    int n = c->v2 ? proto_encode_request(buf, sizeof(buf), req) : proto_format_line(buf, sizeof(buf), req);
+    if (n < 0) { errno = EMSGSIZE; return -1; }
+    return write_n(c->fd, buf, (size_t)n) < 0 ? -1 : 0;
+}
+
+static int read_varint(reader_t *rd, uint64_t *v) {
+    char b[PROTO_VARINT_MAX];
+    for (int i = 0; i < PROTO_VARINT_MAX; i++) {
+        if (reader_read_n(rd, &b[i], 1) <= 0) return -1;
+        if (!(b[i] & 0x80)) return proto_get_varint(b, (size_t)i + 1, v) > 0 ? 0 : -1;
+    }
+    return -1;
+}
+
+// v2 string into buf (truncated to cap-1, the rest skipped)
+static int read_str(reader_t *rd, char *buf, size_t cap) {
+    uint64_t len;
+    if (read_varint(rd, &len) != 0) return -1;
+    size_t keep = len < cap ? (size_t)len : cap - 1;
+    if (keep && reader_read_n(rd, buf, keep) <= 0) return -1;
+    buf[keep] = '\0';
+    for (uint64_t skip = len - keep; skip > 0; skip--) { char ch; if (reader_read_n(rd, &ch, 1) <= 0) return -1; }
+    return 0;
+}
+
+// Reads one reply header; DOWNLOAD bodies and LIST/STATS items follow
+static int conn_read_reply(conn_t *c, reply_t *r) {
+    memset(r, 0, sizeof(*r));
+    r->tag = -1;
+    r->value = -1;
+    if (c->v2) {
+        unsigned char hdr[2];
+        uint64_t id, len, v;
+        if (reader_read_n(&c->rd, hdr, 2) <= 0 || hdr[0] != PROTO_MAGIC) return -1;
+        if (read_varint(&c->rd, &id) != 0 || read_varint(&c->rd, &len) != 0) return -1;
+        r->tag = (long long)id;
+        if (hdr[1] == OP_ERR) return read_str(&c->rd, r->err, sizeof(r->err));
+        if (hdr[1] != OP_OK) return -1;
+        r->ok = 1;
+        if (len > 0) { if (read_varint(&c->rd, &v) != 0) return -1; r->value = (long long)v; }
+        return 0;
+    }
+    char line[1024];
+    if (reader_read_line(&c->rd, line, sizeof(line)) <= 0) return -1;
+    const char *p = line;
+    int off = 0;
+    if (sscanf(p, "#%lld %n", &r->tag, &off) == 1 && off > 0) p += off;
+    else r->tag = -1;
+    if (strncmp(p, "OK", 2) == 0) {
+        char cursor[2 * PROTO_NAME_MAX + 2];
+        r->ok = 1;
+        char codec[16];
+        int k = sscanf(p, "OK %lld %511s %15s", &r->value, cursor, codec);
+        if (k < 1) r->value = -1;
+        if (k == 3 && strcmp(cursor, "COMPRESSED") == 0) r->codec = codec_parse(codec);
+        else if (k == 2 && proto_cursor_decode(cursor, r->cursor, sizeof(r->cursor)) != 0) r->cursor[0] = '\0';
+    } else if (sscanf(p, "ERR %63s", r->err) != 1) {
+        snprintf(r->err, sizeof(r->err), "%.63s", p);
+    }
+    return 0;
+}
+
+// Next LIST name or STATS line
+static int conn_read_item(conn_t *c, char *buf, size_t cap) {
+    if (c->v2) return read_str(&c->rd, buf, cap);
+    return reader_read_line(&c->rd, buf, cap) <= 0 ? -1 : 0;
+}
+
+static void format_reply(const reply_t *r, char *buf, size_t cap) {
+    if (!r->ok) snprintf(buf, cap, "ERR %s", r->err);
+    else if (r->value >= 0) snprintf(buf, cap, "OK %lld", r->value);
+    else snprintf(buf, cap, "OK");
+}
+
+// One command in interactive syntax, ready to send in either protocol
+typedef struct {
+    request_t req;
+    char path[512]; // upload source or download destination
+} job_t;
+
+static int parse_command(const char *input, job_t *j) {
+    char cmd[32], a[256], b[512];
+    memset(j, 0, sizeof(*j));
+    j->req.tag = -1;
+    if (sscanf(input, "%31s", cmd) != 1) return -1;
+    request_t *q = &j->req;
+    if ((strcmp(cmd, "signup") == 0 || strcmp(cmd, "login") == 0) && sscanf(input, "%*s %127s %127s", q->name, q->pass) == 2) {
+        q->op = (cmd[0] == 's') ? OP_SIGNUP : OP_LOGIN;
+    } else if (strcmp(cmd, "upload") == 0 && sscanf(input, "upload %511s", b) == 1) {
+        if (!file_exists(b) && ensure_test_file(b) != 0) { fprintf(stderr, "failed to create test file\n"); return -1; }
+        const char *name = base_name(b);
+        if (strlen(name) > PROTO_NAME_MAX) return -1;
+        q->op = OP_UPLOAD;
+        q->size = file_size(b);
+        q->codec = g_codec;
+        snprintf(j->path, sizeof(j->path), "%s", b);
+        memcpy(q->name, name, strlen(name) + 1);
+    } else if (strcmp(cmd, "download") == 0 && sscanf(input, "download %255s %511s", a, b) == 2) {
+        q->op = OP_DOWNLOAD;
+        q->codec = g_codec;
+        snprintf(q->name, sizeof(q->name), "%s", a);
+        snprintf(j->path, sizeof(j->path), "%s", b);
+    } else if (strcmp(cmd, "delete") == 0 && sscanf(input, "delete %255s", a) == 1) {
+        q->op = OP_DELETE;
+        snprintf(q->name, sizeof(q->name), "%s", a);
+    } else if (strcmp(cmd, "list") == 0) {
+        q->op = OP_LIST;
+        if (sscanf(input, "list %lld", &q->size) == 1 && q->size < 1) return -1;
+    } else if (strcmp(cmd, "stats") == 0) {
+        q->op = OP_STATS;
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+// Command line as the text protocol would carry it, for display
+static const char *job_wire(const job_t *j, char *buf, size_t cap) {
+    request_t q = j->req;
+    q.tag = -1;
+    int n = proto_format_line(buf, cap, &q);
+    if (n > 0) buf[n - 1] = '\0';
+    return buf;
+}
+
+// Returns 0, -1 if nothing sane can follow on c, 1 if an UPLOAD body was
+// cut short by the server hanging up: it refuses an upload over quota
+// without reading the body, and its reply may still be there to read.
+static int send_job(conn_t *c, const job_t *j) {
+    if (conn_send(c, &j->req) != 0) return -1;
+    if (j->req.op != OP_UPLOAD) return 0;
+    int in = open(j->path, O_RDONLY);
+    if (in < 0) return -1; // the server is waiting on the body; nothing sane left to send
+    char buf[ZFRAME_RAW_MAX], frame[ZFRAME_MAX];
+    zenc_t z;
+    zenc_init(&z);
+    ssize_t r; long long sent = 0;
+    while (sent < j->req.size && (r = read(in, buf, sizeof(buf))) > 0) {
+        if (r > j->req.size - sent) r = (ssize_t)(j->req.size - sent); // file grew since stat
+        int w = (j->req.codec == CODEC_LZ4) ? write_n(c->fd, frame, zenc_frame(&z, buf, (size_t)r, frame))
+                                            : write_n(c->fd, buf, (size_t)r);
+        if (w < 0) { close(in); return 1; }
+        sent += r;
+    }
+    close(in);
+    return sent == j->req.size ? 0 : -1;
+}
+
+// Reads a compressed body of size raw bytes frame by frame into out (-1:
+// discard). Returns 0, -1 if the stream broke, 1 if out could not be written.
+static int read_frames(conn_t *c, long long size, int out) {
+    char frame[ZFRAME_MAX], raw[ZFRAME_RAW_MAX];
+    int rc = 0;
+    while (size > 0) {
+        uint32_t raw_len, stored_len;
+        if (reader_read_n(&c->rd, frame, ZFRAME_HDR) <= 0) return -1;
+        if (zframe_header(frame, &raw_len, &stored_len) != 0 || raw_len > size) return -1;
+        if (reader_read_n(&c->rd, frame, stored_len) <= 0) return -1;
+        if (zframe_decode(frame, stored_len, raw, raw_len) != 0) return -1;
+        if (out >= 0 && rc == 0 && write_n(out, raw, raw_len) < 0) { perror("write"); rc = 1; }
+        size -= raw_len;
+    }
+    return rc;
+}
+
+// Consumes whatever follows an OK reply to j. Returns -1 if the connection
+// broke, 1 if a download could not be saved, 0 otherwise.
+static int finish_reply(conn_t *c, const job_t *j, reply_t *r, const char *indent) {
+    if (!r->ok || r->value < 0) return 0;
+    if (j->req.op == OP_DOWNLOAD) {
+        if (c->v2 && j->req.codec != CODEC_NONE) {
+            uint64_t v;
+            if (read_varint(&c->rd, &v) != 0) return -1;
+            r->codec = (v == CODEC_LZ4) ? CODEC_LZ4 : v == CODEC_NONE ? CODEC_NONE : CODEC_UNKNOWN;
+        }
+        if (r->codec == CODEC_UNKNOWN) return -1; // cannot tell where the body ends
+        int out = open(j->path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (out < 0) perror(j->path); // still drain the payload to keep the stream in sync
+        if (r->codec == CODEC_LZ4) {
+            int rc = read_frames(c, r->value, out);
+            if (out >= 0) close(out);
+            return rc < 0 ? -1 : (out < 0 || rc) ? 1 : 0;
+        }
+        char buf[64 * 1024]; long long remain = r->value;
+        while (remain > 0) {
+            size_t chunk = (remain > (long long)sizeof(buf)) ? sizeof(buf) : (size_t)remain;
+            if (reader_read_n(&c->rd, buf, chunk) <= 0) { if (out >= 0) close(out); return -1; }
+            if (out >= 0 && write_n(out, buf, chunk) < 0) { perror("write"); close(out); out = -1; }
+            remain -= (long long)chunk;
+        }
+        if (out < 0) return 1;
+        close(out);
+    } else if (j->req.op == OP_LIST || j->req.op == OP_STATS) {
+        char line[1024];
+        for (long long k = 0; k < r->value; k++) {
+            if (conn_read_item(c, line, sizeof(line)) != 0) return -1;
+            printf("%s%s\n", indent, line);
+        }
+        // v2 sends the next-page cursor after the names; text had it in the header
+        if (c->v2 && j->req.op == OP_LIST && j->req.size > 0 && read_str(&c->rd, r->cursor, sizeof(r->cursor)) != 0) return -1;
+    }
+    return 0;
+}
+
+// Walks the whole listing a page at a time, following the server's cursor;
+// "list <n>" sets the page size
+static int run_list(conn_t *c, job_t *j) {
+    if (j->req.size <= 0) j->req.size = LIST_PAGE;
+    for (;;) {
+        j->req.tag = c->v2 ? 1 : -1;
+        reply_t r;
+        if (send_job(c, j) != 0 || conn_read_reply(c, &r) != 0) return -1;
+        char text[128];
+        format_reply(&r, text, sizeof(text));
+        printf("%s\n", text);
+        int rc = finish_reply(c, j, &r, "");
+        if (rc != 0 || !r.ok || !r.cursor[0]) return rc;
+        memcpy(j->req.name, r.cursor, sizeof(j->req.name));
+    }
+}
+
+// Opens c like from and logs it in as from's last login. Returns 0, -1 if
+// the connection failed, -2 if the login was refused.
+static int conn_clone(conn_t *c, const conn_t *from) {
+    if (c != from) memcpy(c->user, from->user, sizeof(c->user));
+    if (c != from) memcpy(c->pass, from->pass, sizeof(c->pass));
+    if (conn_open(c, from->host, from->port, from->want_v2, from->want_codec) != 0) return -1;
+    if (!c->user[0]) return 0;
+    request_t q; memset(&q, 0, sizeof(q));
+    q.op = OP_LOGIN;
+    q.tag = c->v2 ? 1 : -1;
+    memcpy(q.name, c->user, sizeof(c->user));
+    memcpy(q.pass, c->pass, sizeof(c->pass));
+    reply_t r;
+    if (conn_send(c, &q) != 0 || conn_read_reply(c, &r) != 0) return -1;
+    return r.ok ? 0 : -2;
+}
+
+// Replaces a broken connection with a new one, logged in again as before.
+// Waits longer before each attempt, giving a restarting server time.
+static int conn_reopen(conn_t *c) {
+    close(c->fd);
+    c->fd = -1;
+    for (int attempt = 0; attempt < RESUME_TRIES; attempt++) {
+        sleep(1u << attempt);
+        fprintf(stderr, "reconnecting...\n");
+        int rc = conn_clone(c, c);
+        if (rc == 0) return 0;
+        if (c->fd >= 0) { close(c->fd); c->fd = -1; }
+        if (rc == -2) break;
+    }
+    return -1;
+}
+
+// Sends len bytes of in from offset. Returns -1 if the connection broke,
+// -2 if the file could not be read (it shrank, say).
+static int send_range(conn_t *c, int in, long long offset, long long len) {
+    char buf[64 * 1024];
+    while (len > 0) {
+        size_t want = len < (long long)sizeof(buf) ? (size_t)len : sizeof(buf);
+        ssize_t r = pread(in, buf, want, (off_t)offset);
+        if (r <= 0) return -2;
+        if (write_n(c->fd, buf, (size_t)r) < 0) return -1;
+        offset += r;
+        len -= r;
+    }
+    return 0;
+}
+
+// One round trip of a resumable upload; APPEND and PART carry their body
+// from in. Same return contract as send_range().
+static int resume_step(conn_t *c, request_t *q, int in, reply_t *r) {
+    q->tag = c->v2 ? 1 : -1;
+    if (conn_send(c, q) != 0) return -1;
+    if (q->op == OP_UPLOAD_APPEND || q->op == OP_UPLOAD_PART) {
+        int rc = send_range(c, in, q->offset, q->size);
+        if (rc != 0) return rc;
+    }
+    return conn_read_reply(c, r) != 0 ? -1 : 0;
+}
+
+// Large uploads go up as a session: UPLOAD_BEGIN, RESUME_PIECE sized
+// UPLOAD_APPENDs, UPLOAD_COMMIT. If the connection drops, the client
+// reconnects, logs in again and asks UPLOAD_STATUS how much is staged, so
+// only the unacknowledged tail is sent again. Bodies go uncompressed.
+static int run_resumable(conn_t *c, job_t *j) {
+    int in = open(j->path, O_RDONLY);
+    if (in < 0) { perror(j->path); return 1; }
+    long long size = j->req.size, token = 0, offset = 0;
+    int tries = 0, rc;
+    request_t q = j->req;
+    q.codec = CODEC_NONE;
+    for (;;) {
+        if (token == 0) {
+            q.op = OP_UPLOAD_BEGIN;
+            q.size = size;
+        } else if (offset < size) {
+            q.op = OP_UPLOAD_APPEND;
+            q.token = token;
+            q.offset = offset;
+            q.size = size - offset < RESUME_PIECE ? size - offset : RESUME_PIECE;
+        } else {
+            q.op = OP_UPLOAD_COMMIT;
+            q.token = token;
+        }
+        reply_t r;
+        int step = resume_step(c, &q, in, &r);
+        if (step == -2) { perror(j->path); rc = -1; break; } // the server still expects body bytes
+        if (step != 0) {
+            if (tries++ == RESUME_TRIES || conn_reopen(c) != 0) { fprintf(stderr, "upload: connection lost\n"); rc = -1; break; }
+            if (token == 0) continue; // an unacknowledged BEGIN just expires
+            q.op = OP_UPLOAD_STATUS;
+            q.token = token;
+            if (resume_step(c, &q, in, &r) != 0) continue;
+            if (!r.ok) { printf("ERR %s\n", r.err); rc = 1; break; }
+            offset = r.value;
+            continue;
+        }
+        // The dropped connection may still hold the session until the
+        // server notices it is gone
+        if (!r.ok && strcmp(r.err, "BUSY") == 0 && tries++ < RESUME_TRIES) { sleep(1); continue; }
+        if (!r.ok) { printf("ERR %s\n", r.err); rc = 1; break; }
+        tries = 0;
+        if (q.op == OP_UPLOAD_BEGIN) token = r.value;
+        else if (q.op == OP_UPLOAD_APPEND) offset = r.value;
+        else { printf("OK\n"); rc = 0; break; }
+    }
+    close(in);
+    return rc;
+}
+
+// One stream of a striped upload: its range as RESUME_PIECE sized parts
+typedef struct {
+    conn_t conn;
+    int in;
+    long long token, offset, len;
+    int rc; // 0, or -1 with err set
+    char err[64];
+} stream_t;
+
+static void *stream_main(void *arg) {
+    stream_t *s = (stream_t*)arg;
+    request_t q; memset(&q, 0, sizeof(q));
+    q.op = OP_UPLOAD_PART;
+    q.token = s->token;
+    for (long long done = 0; done < s->len; done += q.size) {
+        q.offset = s->offset + done;
+        q.size = s->len - done < RESUME_PIECE ? s->len - done : RESUME_PIECE;
+        reply_t r;
+        int step = resume_step(&s->conn, &q, s->in, &r);
+        if (step != 0) { snprintf(s->err, sizeof(s->err), "%s", step == -2 ? "READ" : "CONNECTION"); s->rc = -1; break; }
+        if (!r.ok) { snprintf(s->err, sizeof(s->err), "%s", r.err); s->rc = -1; break; }
+    }
+    return NULL;
+}
+
+// --streams N: one striped session (UPLOAD_BEGIN ... STRIPED) whose file
+// is cut into N ranges, each sent by its own thread over its own
+// connection (c and N - 1 new ones, logged in the same way), then one
+// UPLOAD_COMMIT on c once every range is in. No reconnecting: a stream
+// that fails fails the upload, and the session expires on the server.
+static int run_striped(conn_t *c, job_t *j) {
+    int in = open(j->path, O_RDONLY);
+    if (in < 0) { perror(j->path); return 1; }
+    long long size = j->req.size;
+    int n = g_streams;
+    long long range = (size + n - 1) / n;
+    range = (range + STRIPE_ALIGN - 1) / STRIPE_ALIGN * STRIPE_ALIGN;
+    if (range == 0) range = STRIPE_ALIGN;
+    if ((size + range - 1) / range < n) n = (int)((size + range - 1) / range);
+    if (n < 1) n = 1;
+    request_t q = j->req;
+    q.codec = CODEC_NONE;
+    q.op = OP_UPLOAD_BEGIN;
+    q.striped = 1;
+    reply_t r;
+    int rc = resume_step(c, &q, in, &r);
+    if (rc != 0 || !r.ok) {
+        if (rc == 0) printf("ERR %s\n", r.err);
+        close(in);
+        return rc != 0 ? -1 : 1;
+    }
+    long long token = r.value;
+    stream_t *s = (stream_t*)calloc((size_t)n, sizeof(*s));
+    pthread_t *th = (pthread_t*)calloc((size_t)n, sizeof(*th));
+    int started = 0;
+    for (int i = 0; i < n; i++) {
+        s[i].in = in;
+        s[i].token = token;
+        s[i].offset = (long long)i * range;
+        s[i].len = size - s[i].offset < range ? size - s[i].offset : range;
+        if (i == 0) s[i].conn = *c;
+        else if (conn_clone(&s[i].conn, c) != 0) {
+            if (s[i].conn.fd >= 0) close(s[i].conn.fd);
+            s[i].conn.fd = -1;
+            snprintf(s[i].err, sizeof(s[i].err), "CONNECT");
+            s[i].rc = -1;
+            break;
+        }
+        pthread_create(&th[i], NULL, stream_main, &s[i]);
+        started++;
+    }
+    for (int i = 0; i < started; i++) {
+        pthread_join(th[i], NULL);
+        if (i > 0) close(s[i].conn.fd);
+    }
+    c->rd = s[0].conn.rd; // stream 0 read c's replies through its copy
+    rc = 0;
+    for (int i = 0; i < n && rc == 0; i++) {
+        if (s[i].rc != 0) { printf("ERR %s\n", s[i].err); rc = 1; }
+    }
+    free(th);
+    free(s);
+    if (rc == 0) {
+        q.op = OP_UPLOAD_COMMIT;
+        q.token = token;
+        if (resume_step(c, &q, in, &r) != 0) rc = -1;
+        else if (!r.ok) { printf("ERR %s\n", r.err); rc = 1; }
+        else printf("OK\n");
+    }
+    close(in);
+    return rc;
+}
+
+// Runs one command and prints its reply; same return contract as finish_reply()
+static int run_command(conn_t *c, job_t *j) {
+    if (j->req.op == OP_LIST) return run_list(c, j);
+    if (j->req.op == OP_UPLOAD && c->stripe && g_streams > 1 && j->req.size > g_resume_above) return run_striped(c, j);
+    if (j->req.op == OP_UPLOAD && c->resume && j->req.size > g_resume_above) return run_resumable(c, j);
+    j->req.tag = c->v2 ? 1 : -1; // v2 frames always carry an id
+    reply_t r;
+    if (send_job(c, j) < 0 || conn_read_reply(c, &r) != 0) return -1;
+    char text[128];
+    format_reply(&r, text, sizeof(text));
+    // The server hangs up after refusing an upload over quota
+    if (j->req.op == OP_UPLOAD && !r.ok && strcmp(r.err, "QUOTA") == 0) {
+        printf("%s\n", text);
+        close(c->fd);
+        c->fd = -1;
+        return conn_clone(c, c) == 0 ? 0 : -1;
+    }
+    if (j->req.op == OP_DOWNLOAD) {
+        if (!r.ok) { fprintf(stderr, "%s\n", text); return 1; }
+        int rc = finish_reply(c, j, &r, "");
+        if (rc == 0) printf("OK\n");
+        return rc;
+    }
+    printf("%s\n", text);
+    if (j->req.op == OP_LOGIN && r.ok) {
+        memcpy(c->user, j->req.name, sizeof(c->user));
+        memcpy(c->pass, j->req.pass, sizeof(c->pass));
+    }
+    return finish_reply(c, j, &r, "");
+}
+
+// Batch mode: every command goes out tagged (a "#<n>" prefix, or the frame's
+// request id in v2) without waiting, and replies are matched by tag as the
+// server finishes them, in any order.
+typedef struct {
+    conn_t *conn;
+    job_t *jobs;
+    int count;
+} batch_t;
+
+static void *batch_writer(void *arg) {
+    batch_t *b = (batch_t*)arg;
+    for (int i = 0; i < b->count; i++) {
+        if (send_job(b->conn, &b->jobs[i]) != 0) break;
+    }
+    return NULL;
+}
+
+// Reads commands (interactive syntax, one per line) from path or "-" for
+// stdin and runs them pipelined on c. Returns 0 if every reply arrived.
+static int run_batch(conn_t *c, const char *path) {
+    FILE *f = strcmp(path, "-") == 0 ? stdin : fopen(path, "r");
+    if (!f) { perror("batch"); return -1; }
+    batch_t b = { c, NULL, 0 };
+    int cap = 0;
+    char input[1024];
+    while (fgets(input, sizeof(input), f)) {
+        size_t len = strlen(input);
+        while (len > 0 && (input[len-1] == '\n' || input[len-1] == '\r')) input[--len] = '\0';
+        if (len == 0 || input[0] == '#') continue;
+        if (b.count == cap) { cap = cap ? cap * 2 : 16; b.jobs = (job_t*)realloc(b.jobs, sizeof(job_t) * (size_t)cap); }
+        if (parse_command(input, &b.jobs[b.count]) != 0) { fprintf(stderr, "batch: skipping '%s'\n", input); continue; }
+        b.jobs[b.count].req.tag = b.count + 1;
+        b.count++;
+    }
+    if (f != stdin) fclose(f);
+
+    pthread_t writer;
+    pthread_create(&writer, NULL, batch_writer, &b);
+    int pending = b.count, rc = 0;
+    while (pending > 0) {
+        reply_t r;
+        if (conn_read_reply(c, &r) != 0) { fprintf(stderr, "batch: connection lost with %d replies pending\n", pending); rc = -1; break; }
+        char text[128], wire[PROTO_MAX_REQUEST];
+        format_reply(&r, text, sizeof(text));
+        if (r.tag < 1 || r.tag > b.count) { fprintf(stderr, "batch: unexpected reply '%s'\n", text); continue; }
+        job_t *j = &b.jobs[r.tag - 1];
+        printf("[%lld] %s -> %s\n", r.tag, job_wire(j, wire, sizeof(wire)), text);
+        pending--;
+        if (finish_reply(c, j, &r, "    ") < 0) { rc = -1; break; }
+    }
+    if (rc != 0) shutdown(c->fd, SHUT_RDWR); // unblock the writer
+    pthread_join(writer, NULL);
+    free(b.jobs);
+    return rc;
+}
+
+static void help_commands(void) {
+    fprintf(stdout, "Commands:\n");
+    fprintf(stdout, "  signup <user> <pass>\n");
+    fprintf(stdout, "  login <user> <pass>\n");
+    fprintf(stdout, "  upload <local_path>\n");
+    fprintf(stdout, "  list\n");
+    fprintf(stdout, "  download <name> <out_path>\n");
+    fprintf(stdout, "  delete <name>\n");
+    fprintf(stdout, "  stats\n");
+    fprintf(stdout, "  batch <file|->   (pipelined, one command per line)\n");
+    fprintf(stdout, "  help\n");
+    fprintf(stdout, "  quit\n");
+}
+
+int main(int argc, char **argv) {
+    const char *host = "127.0.0.1"; int port = 9000;
+    int want_v2 = 1;
+    codec_t want_codec = CODEC_NONE;
+    int i = 1;
+    for (; i < argc; i++) {
+        if (strcmp(argv[i], "--host") == 0 && i+1 < argc) host = argv[++i];
+        else if (strcmp(argv[i], "--port") == 0 && i+1 < argc) port = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--proto") == 0 && i+1 < argc) {
+            const char *p = argv[++i];
+            if (strcmp(p, "v2") == 0) want_v2 = 1;
+            else if (strcmp(p, "text") == 0) want_v2 = 0;
+            else { usage(); return 1; }
+        }
+        else if (strcmp(argv[i], "--compress") == 0 && i+1 < argc) {
+            want_codec = codec_parse(argv[++i]);
+            if (want_codec == CODEC_UNKNOWN) { usage(); return 1; }
+        }
+        else if (strcmp(argv[i], "--resume-above") == 0 && i+1 < argc) g_resume_above = atoll(argv[++i]);
+        else if (strcmp(argv[i], "--streams") == 0 && i+1 < argc) {
+            g_streams = atoi(argv[++i]);
+            if (g_streams < 1 || g_streams > 64) { usage(); return 1; }
+        }
+        else break;
+    }
+    // A dropped connection shows up as a write error, not a signal, so a
+    // resumable upload can reconnect
+    signal(SIGPIPE, SIG_IGN);
+    conn_t conn; memset(&conn, 0, sizeof(conn));
+    if (i < argc) {
+        // One-shot mode for scripts: ./client [--host ... --port ...] <cmd> args...
+        char input[1024]; size_t off = 0;
+        input[0] = '\0';
+        for (; i < argc && off < sizeof(input); i++) {
+            int n = snprintf(input + off, sizeof(input) - off, "%s%s", off ? " " : "", argv[i]);
+            if (n < 0) break;
+            off += (size_t)n;
+        }
+        if (conn_open(&conn, host, port, want_v2, want_codec != CODEC_NONE) != 0) { perror("connect"); return 1; }
+        if (conn.lz4) g_codec = want_codec;
+        char path[512];
+        int rc;
+        job_t j;
+        if (sscanf(input, "batch %511s", path) == 1) rc = run_batch(&conn, path);
+        else if (parse_command(input, &j) == 0) rc = run_command(&conn, &j);
+        else { usage(); rc = 1; }
+        close(conn.fd);
+        return rc != 0;
+    }
+    if (conn_open(&conn, host, port, want_v2, want_codec != CODEC_NONE) != 0) { perror("connect"); return 1; }
+    if (conn.lz4) g_codec = want_codec;
+    help_commands();
+    // Interactive loop
+    char input[1024];
+    for (;;) {
+        fprintf(stdout, "> "); fflush(stdout);
+        if (!fgets(input, sizeof(input), stdin)) break;
+        // strip trailing newline
+        size_t len = strlen(input); if (len > 0 && (input[len-1] == '\n' || input[len-1] == '\r')) input[--len] = '\0';
+        if (len == 0) continue;
+        if (strcmp(input, "quit") == 0 || strcmp(input, "exit") == 0) break;
+        if (strcmp(input, "help") == 0) { help_commands(); continue; }
+
+        char cmd[32], path[512];
+        if (sscanf(input, "%31s", cmd) != 1) continue;
+        if (strcmp(cmd, "batch") == 0) {
+            if (sscanf(input, "batch %511s", path) != 1) { fprintf(stderr, "usage: batch <file|->\n"); continue; }
+            if (run_batch(&conn, path) != 0) break;
+            continue;
+        }
+        job_t j;
+        if (parse_command(input, &j) != 0) { fprintf(stderr, "bad command, try 'help'\n"); continue; }
+        if (run_command(&conn, &j) < 0) { perror("read"); break; }
+    }
+    close(conn.fd);
+    return 0;
+}
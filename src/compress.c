@@ -0,0 +1,154 @@
+#include "compress.h"
+
+#include <string.h>
+
+#define HASH_LOG 12
+#define MIN_MATCH 4
+#define LAST_LITERALS 5  // a block always ends in at least this many literals
+#define MF_LIMIT 12      // and no match starts within this distance of the end
+#define SAMPLE_KEEP_PCT 90 // first frame must shrink below this to keep compressing
+
+static uint32_t read32(const uint8_t *p) { uint32_t v; memcpy(&v, p, 4); return v; }
+
+static uint32_t hash4(uint32_t v) { return (v * 2654435761u) >> (32 - HASH_LOG); }
+
+static uint8_t *put_length(uint8_t *op, size_t len) {
+    while (len >= 255) { *op++ = 255; len -= 255; }
+    *op++ = (uint8_t)len;
+    return op;
+}
+
+static uint8_t *put_sequence(uint8_t *op, const uint8_t *lit, size_t lit_len, size_t off, size_t match_len) {
+    uint8_t *token = op++;
+    *token = (uint8_t)((lit_len >= 15 ? 15 : lit_len) << 4);
+    if (lit_len >= 15) op = put_length(op, lit_len - 15);
+    memcpy(op, lit, lit_len);
+    op += lit_len;
+    if (off == 0) return op; // final literals-only sequence
+    *op++ = (uint8_t)(off & 0xff);
+    *op++ = (uint8_t)(off >> 8);
+    size_t ml = match_len - MIN_MATCH;
+    *token |= (uint8_t)(ml >= 15 ? 15 : ml);
+    if (ml >= 15) op = put_length(op, ml - 15);
+    return op;
+}
+
+// Greedy single-probe matcher: fast rather than tight, which is the point
+// of LZ4. Misses widen the step so incompressible input goes by quickly.
+size_t lz4_compress(const char *src_, size_t n, char *dst_) {
+    const uint8_t *src = (const uint8_t*)src_;
+    uint8_t *op = (uint8_t*)dst_;
+    const uint8_t *ip = src, *anchor = src, *end = src + n;
+    if (n > MF_LIMIT) {
+        uint32_t table[1 << HASH_LOG];
+        memset(table, 0, sizeof(table));
+        const uint8_t *mflimit = end - MF_LIMIT, *matchlimit = end - LAST_LITERALS;
+        unsigned misses = 0;
+        while (ip < mflimit) {
+            uint32_t seq = read32(ip);
+            uint32_t h = hash4(seq);
+            const uint8_t *ref = src + table[h];
+            table[h] = (uint32_t)(ip - src);
+            if (ref >= ip || ip - ref > 65535 || read32(ref) != seq) {
+                ip += 1 + (misses++ >> 6);
+                continue;
+            }
+            misses = 0;
+            const uint8_t *m = ip + MIN_MATCH, *r = ref + MIN_MATCH;
+            while (m < matchlimit && *m == *r) { m++; r++; }
+            op = put_sequence(op, anchor, (size_t)(ip - anchor), (size_t)(ip - ref), (size_t)(m - ip));
+            ip = anchor = m;
+        }
+    }
+    op = put_sequence(op, anchor, (size_t)(end - anchor), 0, 0);
+    return (size_t)(op - (uint8_t*)dst_);
+}
+
+int lz4_decompress(const char *src_, size_t n, char *dst_, size_t cap) {
+    const uint8_t *ip = (const uint8_t*)src_, *iend = ip + n;
+    uint8_t *dst = (uint8_t*)dst_, *op = dst, *oend = dst + cap;
+    while (ip < iend) {
+        unsigned token = *ip++;
+        size_t lit = token >> 4;
+        if (lit == 15) {
+            uint8_t b;
+            do { if (ip >= iend) return -1; b = *ip++; lit += b; } while (b == 255);
+        }
+        if (lit > (size_t)(iend - ip) || lit > (size_t)(oend - op)) return -1;
+        memcpy(op, ip, lit);
+        op += lit; ip += lit;
+        if (ip == iend) break; // last sequence carries no match
+        if (iend - ip < 2) return -1;
+        size_t off = (size_t)ip[0] | ((size_t)ip[1] << 8);
+        ip += 2;
+        if (off == 0 || off > (size_t)(op - dst)) return -1;
+        size_t ml = token & 15;
+        if (ml == 15) {
+            uint8_t b;
+            do { if (ip >= iend) return -1; b = *ip++; ml += b; } while (b == 255);
+        }
+        ml += MIN_MATCH;
+        if (ml > (size_t)(oend - op)) return -1;
+        const uint8_t *m = op - off;
+        if (off >= ml) {
+            memcpy(op, m, ml);
+            op += ml;
+        } else {
+            // overlapping match: it repeats bytes it is producing
+            while (ml--) *op++ = *m++;
+        }
+    }
+    return (int)(op - dst);
+}
+
+void zenc_init(zenc_t *z) {
+    z->frames = 0;
+    z->skip = 0;
+}
+
+static void put32(char *p, uint32_t v) {
+    p[0] = (char)(v & 0xff); p[1] = (char)((v >> 8) & 0xff);
+    p[2] = (char)((v >> 16) & 0xff); p[3] = (char)(v >> 24);
+}
+
+static uint32_t get32(const char *p) {
+    const uint8_t *u = (const uint8_t*)p;
+    return (uint32_t)u[0] | ((uint32_t)u[1] << 8) | ((uint32_t)u[2] << 16) | ((uint32_t)u[3] << 24);
+}
+
+size_t zenc_frame(zenc_t *z, const char *raw, size_t n, char *out) {
+    size_t stored = n;
+    if (!z->skip) {
+        size_t c = lz4_compress(raw, n, out + ZFRAME_HDR);
+        if (z->frames == 0 && c * 100 >= n * SAMPLE_KEEP_PCT) z->skip = 1;
+        if (c < n) stored = c;
+    }
+    if (stored == n) memcpy(out + ZFRAME_HDR, raw, n);
+    put32(out, (uint32_t)n);
+    put32(out + 4, (uint32_t)stored);
+    z->frames++;
+    return ZFRAME_HDR + stored;
+}
+
+int zframe_header(const char *hdr, uint32_t *raw_len, uint32_t *stored_len) {
+    *raw_len = get32(hdr);
+    *stored_len = get32(hdr + 4);
+    if (*raw_len == 0 || *raw_len > ZFRAME_RAW_MAX) return -1;
+    if (*stored_len == 0 || *stored_len > LZ4_BOUND(*raw_len)) return -1;
+    return 0;
+}
+
+int zframe_decode(const char *stored, uint32_t stored_len, char *raw, uint32_t raw_len) {
+    if (stored_len == raw_len) { memcpy(raw, stored, raw_len); return 0; }
+    return lz4_decompress(stored, stored_len, raw, raw_len) == (int)raw_len ? 0 : -1;
+}
+
+codec_t codec_parse(const char *name) {
+    if (strcmp(name, "none") == 0) return CODEC_NONE;
+    if (strcmp(name, "lz4") == 0) return CODEC_LZ4;
+    return CODEC_UNKNOWN;
+}
+
+const char *codec_name(codec_t c) {
+    return c == CODEC_LZ4 ? "lz4" : "none";
+}
@@ -0,0 +1,48 @@
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Transfer compression. A compressed UPLOAD/DOWNLOAD body is a run of
+// frames, each
+//
+//   u32 raw length (LE) | u32 stored length (LE) | stored bytes
+//
+// where the stored bytes are an LZ4 block, or the raw bytes verbatim when
+// both lengths are equal. Frames carry at most ZFRAME_RAW_MAX raw bytes and
+// the body ends once the declared (uncompressed) size has been produced.
+
+#define ZFRAME_HDR 8
+#define ZFRAME_RAW_MAX (64 * 1024)
+#define LZ4_BOUND(n) ((n) + (n) / 255 + 16)
+#define ZFRAME_MAX (ZFRAME_HDR + LZ4_BOUND(ZFRAME_RAW_MAX))
+
+typedef enum { CODEC_NONE = 0, CODEC_LZ4 = 1, CODEC_UNKNOWN = -1 } codec_t;
+
+// LZ4 block format. compress writes at most LZ4_BOUND(n) bytes; decompress
+// returns the bytes produced, or -1 on malformed input or overflow.
+size_t lz4_compress(const char *src, size_t n, char *dst);
+int lz4_decompress(const char *src, size_t n, char *dst, size_t cap);
+
+// Frame encoder. The first frame is a sample: if LZ4 does not shrink it
+// enough, the rest of the transfer is stored without trying again.
+typedef struct {
+    int frames;
+    int skip; // first frame did not compress; store everything
+} zenc_t;
+
+void zenc_init(zenc_t *z);
+// One frame from n <= ZFRAME_RAW_MAX raw bytes into out (ZFRAME_MAX bytes);
+// returns the frame length
+size_t zenc_frame(zenc_t *z, const char *raw, size_t n, char *out);
+
+// Validates a frame header; returns 0 and the lengths, -1 if malformed
+int zframe_header(const char *hdr, uint32_t *raw_len, uint32_t *stored_len);
+// Stored bytes -> raw (raw_len bytes); -1 if they do not decode to exactly that
+int zframe_decode(const char *stored, uint32_t stored_len, char *raw, uint32_t raw_len);
+
+codec_t codec_parse(const char *name);
+const char *codec_name(codec_t c);
+
+#endif
@@ -3,6 +3,62 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "stats.h"
+
+// Every statement the functions below run, compiled once per connection by
+// db_open() and reset after each use. Text and blob parameters are bound SQLITE_STATIC:
+// the caller's buffer outlives the step, and stmt_done() clears them.
+typedef enum {
+    S_BEGIN, S_BEGIN_READ, S_COMMIT, S_ROLLBACK, S_SAVEPOINT, S_RELEASE, S_ROLLBACK_TO,
+    S_USER_INSERT, S_USER_GET, S_USER_QUOTA, S_USER_ADD_USED,
+    S_FILE_LIST, S_FILE_ALL, S_FILE_SIZE, S_FILE_GET, S_FILE_UPSERT, S_FILE_DELETE,
+    S_MANIFEST_GET, S_MANIFEST_DELETE, S_MANIFEST_ADD,
+    S_CHUNK_INC, S_CHUNK_ADD, S_CHUNK_DEC, S_CHUNK_DROP, S_CHUNK_HAS,
+    S_SESSION_CREATE, S_SESSION_GET, S_SESSION_DELETE, S_SESSION_TOUCH, S_SESSION_STALE,
+    S_COUNT
+} stmt_id_t;
+
+static const char *const g_sql[S_COUNT] = {
+    [S_BEGIN] = "BEGIN IMMEDIATE",
+    // On a reader: one snapshot across several statements
+    [S_BEGIN_READ] = "BEGIN",
+    [S_COMMIT] = "COMMIT",
+    [S_ROLLBACK] = "ROLLBACK",
+    // Around each write of a group commit (db_write())
+    [S_SAVEPOINT] = "SAVEPOINT op",
+    [S_RELEASE] = "RELEASE op",
+    [S_ROLLBACK_TO] = "ROLLBACK TO op",
+    [S_USER_INSERT] = "INSERT INTO users(username, pass_hash, quota_bytes, created_at) VALUES(?,?,?,strftime('%s','now'))",
+    [S_USER_GET] = "SELECT id, pass_hash, quota_bytes, used_bytes FROM users WHERE username=?",
+    [S_USER_QUOTA] = "SELECT quota_bytes, used_bytes FROM users WHERE id=?",
+    [S_USER_ADD_USED] = "UPDATE users SET used_bytes=used_bytes+? WHERE id=?",
+    // Keyset page on the (user_id, name) index; one extra row tells whether more follow
+    [S_FILE_LIST] = "SELECT name FROM files WHERE user_id=? AND name>? ORDER BY name LIMIT ?",
+    [S_FILE_ALL] = "SELECT name, size FROM files WHERE user_id=? ORDER BY name",
+    [S_FILE_SIZE] = "SELECT size FROM files WHERE user_id=? AND name=?",
+    [S_FILE_GET] = "SELECT id, size FROM files WHERE user_id=? AND name=?",
+    [S_FILE_UPSERT] = "INSERT INTO files(user_id,name,size,created_at) VALUES(?,?,?,strftime('%s','now')) "
+                      "ON CONFLICT(user_id,name) DO UPDATE SET size=excluded.size",
+    [S_FILE_DELETE] = "DELETE FROM files WHERE user_id=? AND name=?",
+    [S_MANIFEST_GET] = "SELECT fc.hash, c.size FROM file_chunks fc JOIN chunks c ON c.hash=fc.hash "
+                       "WHERE fc.file_id=? ORDER BY fc.seq",
+    [S_MANIFEST_DELETE] = "DELETE FROM file_chunks WHERE file_id=?",
+    [S_MANIFEST_ADD] = "INSERT INTO file_chunks(file_id,seq,hash) VALUES(?,?,?)",
+    [S_CHUNK_INC] = "UPDATE chunks SET refs=refs+1 WHERE hash=?",
+    [S_CHUNK_ADD] = "INSERT INTO chunks(hash,size,refs) VALUES(?,?,1)",
+    [S_CHUNK_DEC] = "UPDATE chunks SET refs=refs-1 WHERE hash=?",
+    [S_CHUNK_DROP] = "DELETE FROM chunks WHERE hash=? AND refs<=0",
+    [S_CHUNK_HAS] = "SELECT 1 FROM chunks WHERE hash=?",
+    [S_SESSION_CREATE] = "INSERT INTO upload_sessions(token,user_id,name,size,path,touched) VALUES(?,?,?,?,?,strftime('%s','now'))",
+    [S_SESSION_GET] = "SELECT name, size FROM upload_sessions WHERE token=? AND user_id=?",
+    [S_SESSION_DELETE] = "DELETE FROM upload_sessions WHERE token=?",
+    [S_SESSION_TOUCH] = "UPDATE upload_sessions SET touched=? WHERE token=?",
+    [S_SESSION_STALE] = "SELECT token, path FROM upload_sessions WHERE touched<?",
+};
 
 static int exec_sql(sqlite3 *db, const char *sql) {
     char *errmsg = NULL;
@@ -14,218 +70,770 @@ static int exec_sql(sqlite3 *db, const char *sql) {
     return 0;
 }
 
-int db_open(db_t *db, const char *path) {
-    if (sqlite3_open(path, &db->conn) != SQLITE_OK) return -1;
-    exec_sql(db->conn, "PRAGMA journal_mode=WAL;");
-    exec_sql(db->conn, "PRAGMA foreign_keys=ON;");
-    exec_sql(db->conn, "PRAGMA busy_timeout=5000;");
-    const char *schema =
-        "CREATE TABLE IF NOT EXISTS users(" \
-        " id INTEGER PRIMARY KEY, username TEXT UNIQUE, pass_hash TEXT," \
-        " quota_bytes INTEGER, used_bytes INTEGER DEFAULT 0, created_at INTEGER);" \
-        "CREATE TABLE IF NOT EXISTS files(" \
-        " id INTEGER PRIMARY KEY, user_id INTEGER, name TEXT, size INTEGER, created_at INTEGER,"
-        " UNIQUE(user_id,name), FOREIGN KEY(user_id) REFERENCES users(id) ON DELETE CASCADE);" \
-        "CREATE INDEX IF NOT EXISTS files_user_name ON files(user_id,name);";
-    if (exec_sql(db->conn, schema) != 0) return -1;
-    return 0;
+static sqlite3_stmt *stmt(db_conn_t *c, stmt_id_t id) {
+    return c->stmts[id];
 }
 
-void db_close(db_t *db) {
-    if (db->conn) sqlite3_close(db->conn);
-    db->conn = NULL;
+// Ends a statement's run: a SELECT left mid-rows would hold its read
+// transaction open
+static void stmt_done(sqlite3_stmt *st) {
+    sqlite3_reset(st);
+    sqlite3_clear_bindings(st);
 }
 
-int db_signup(db_t *db, const char *username, const char *pass_hash, long long quota_bytes) {
-    const char *sql = "INSERT INTO users(username, pass_hash, quota_bytes, created_at) VALUES(?,?,?,strftime('%s','now'))";
-    sqlite3_stmt *st = NULL;
-    if (sqlite3_prepare_v2(db->conn, sql, -1, &st, NULL) != SQLITE_OK) return -1;
-    sqlite3_bind_text(st, 1, username, -1, SQLITE_TRANSIENT);
-    sqlite3_bind_text(st, 2, pass_hash, -1, SQLITE_TRANSIENT);
-    sqlite3_bind_int64(st, 3, quota_bytes);
+// Runs a statement that returns no rows
+static int stmt_exec(sqlite3_stmt *st) {
     int rc = sqlite3_step(st);
-    sqlite3_finalize(st);
-    if (rc != SQLITE_DONE) return -1;
-    return 0;
+    stmt_done(st);
+    return rc == SQLITE_DONE ? 0 : -1;
 }
 
-int db_get_user(db_t *db, const char *username, long long *out_user_id, char **out_pass_hash, long long *out_quota, long long *out_used) {
-    const char *sql = "SELECT id, pass_hash, quota_bytes, used_bytes FROM users WHERE username=?";
-    sqlite3_stmt *st = NULL;
-    if (sqlite3_prepare_v2(db->conn, sql, -1, &st, NULL) != SQLITE_OK) return -1;
-    sqlite3_bind_text(st, 1, username, -1, SQLITE_TRANSIENT);
-    int rc = sqlite3_step(st);
-    if (rc != SQLITE_ROW) {
-        sqlite3_finalize(st);
+static void conn_close(db_conn_t *c) {
+    if (c->stmts) {
+        for (int i = 0; i < S_COUNT; i++) sqlite3_finalize(c->stmts[i]);
+        free(c->stmts);
+        c->stmts = NULL;
+    }
+    if (c->conn) sqlite3_close(c->conn);
+    c->conn = NULL;
+    free(c->gone);
+    c->gone = NULL;
+    if (c->mu_init) pthread_mutex_destroy(&c->mu);
+    c->mu_init = 0;
+}
+
+// NOMUTEX: SQLite's own per-connection lock would only repeat c->mu
+static int conn_open(db_conn_t *c, const char *path, int reader) {
+    memset(c, 0, sizeof(*c));
+    if (sqlite3_open_v2(path, &c->conn, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_NOMUTEX, NULL) != SQLITE_OK) {
+        conn_close(c);
         return -1;
     }
-    if (out_user_id) *out_user_id = sqlite3_column_int64(st, 0);
-    if (out_pass_hash) {
-        const unsigned char *ph = sqlite3_column_text(st, 1);
-        *out_pass_hash = ph ? strdup((const char*)ph) : NULL;
+    exec_sql(c->conn, "PRAGMA busy_timeout=5000;");
+    if (reader) {
+        exec_sql(c->conn, "PRAGMA query_only=ON;");
+    } else {
+        exec_sql(c->conn, "PRAGMA journal_mode=WAL;");
+        exec_sql(c->conn, "PRAGMA foreign_keys=ON;");
+        const char *schema =
+            "CREATE TABLE IF NOT EXISTS users(" \
+            " id INTEGER PRIMARY KEY, username TEXT UNIQUE, pass_hash TEXT," \
+            " quota_bytes INTEGER, used_bytes INTEGER DEFAULT 0, created_at INTEGER);" \
+            "CREATE TABLE IF NOT EXISTS files(" \
+            " id INTEGER PRIMARY KEY, user_id INTEGER, name TEXT, size INTEGER, created_at INTEGER,"
+            " UNIQUE(user_id,name), FOREIGN KEY(user_id) REFERENCES users(id) ON DELETE CASCADE);" \
+            "CREATE INDEX IF NOT EXISTS files_user_name ON files(user_id,name);" \
+            "CREATE TABLE IF NOT EXISTS chunks(" \
+            " hash BLOB PRIMARY KEY, size INTEGER, refs INTEGER) WITHOUT ROWID;" \
+            "CREATE TABLE IF NOT EXISTS file_chunks(" \
+            " file_id INTEGER, seq INTEGER, hash BLOB, PRIMARY KEY(file_id,seq)," \
+            " FOREIGN KEY(file_id) REFERENCES files(id) ON DELETE CASCADE) WITHOUT ROWID;" \
+            "CREATE TABLE IF NOT EXISTS upload_sessions(" \
+            " token INTEGER PRIMARY KEY, user_id INTEGER, name TEXT, size INTEGER, path TEXT, touched INTEGER," \
+            " FOREIGN KEY(user_id) REFERENCES users(id) ON DELETE CASCADE);" \
+            "CREATE INDEX IF NOT EXISTS upload_sessions_touched ON upload_sessions(touched);";
+        if (exec_sql(c->conn, schema) != 0) { conn_close(c); return -1; }
+    }
+    c->stmts = (sqlite3_stmt**)calloc(S_COUNT, sizeof(sqlite3_stmt*));
+    if (!c->stmts) { conn_close(c); return -1; }
+    for (int i = 0; i < S_COUNT; i++) {
+        // Kept for the connection's lifetime: hint SQLite not to take them
+        // from its lookaside pool
+        if (sqlite3_prepare_v3(c->conn, g_sql[i], -1, SQLITE_PREPARE_PERSISTENT, &c->stmts[i], NULL) != SQLITE_OK) {
+            conn_close(c);
+            return -1;
+        }
+    }
+    pthread_mutex_init(&c->mu, NULL);
+    c->mu_init = 1;
+    return 0;
+}
+
+int db_open(db_t *db, const char *path, int readers) {
+    memset(db, 0, sizeof(*db));
+    // The writer goes first: it creates the schema and switches the file to
+    // WAL, which is what lets the readers run beside it
+    if (conn_open(&db->writer, path, 0) != 0) return -1;
+    if (readers > 0) {
+        db->readers = (db_conn_t*)calloc((size_t)readers, sizeof(db_conn_t));
+        if (!db->readers) { db_close(db); return -1; }
+        for (; db->nreaders < readers; db->nreaders++) {
+            if (conn_open(&db->readers[db->nreaders], path, 1) != 0) { db_close(db); return -1; }
+        }
+    }
+    return 0;
+}
+
+void db_close(db_t *db) {
+    if (db->gc_running) {
+        pthread_mutex_lock(&db->gc_mu);
+        db->gc_stop = 1;
+        pthread_cond_signal(&db->gc_cond);
+        pthread_mutex_unlock(&db->gc_mu);
+        pthread_join(db->committer, NULL);
+        pthread_cond_destroy(&db->gc_done);
+        pthread_cond_destroy(&db->gc_cond);
+        pthread_mutex_destroy(&db->gc_mu);
+        db->gc_running = 0;
+    }
+    for (int i = 0; i < db->nreaders; i++) conn_close(&db->readers[i]);
+    free(db->readers);
+    db->readers = NULL;
+    db->nreaders = 0;
+    conn_close(&db->writer);
+}
+
+static db_conn_t *writer_get(db_t *db) {
+    pthread_mutex_lock(&db->writer.mu);
+    return &db->writer;
+}
+
+// A thread keeps coming back to the same reader, so with as many readers
+// as workers each one mostly has its own; when that one is busy any idle
+// reader will do, and only if all are taken does the thread queue on its own
+static db_conn_t *reader_get(db_t *db) {
+    static __thread unsigned t_home;
+    static __thread int t_home_set;
+    if (db->nreaders == 0) return writer_get(db);
+    if (!t_home_set) {
+        t_home = __atomic_fetch_add(&db->next_home, 1, __ATOMIC_RELAXED);
+        t_home_set = 1;
+    }
+    unsigned home = t_home % (unsigned)db->nreaders;
+    for (int i = 0; i < db->nreaders; i++) {
+        db_conn_t *c = &db->readers[(home + (unsigned)i) % (unsigned)db->nreaders];
+        if (pthread_mutex_trylock(&c->mu) == 0) return c;
+    }
+    pthread_mutex_lock(&db->readers[home].mu);
+    return &db->readers[home];
+}
+
+static void conn_put(db_conn_t *c) {
+    pthread_mutex_unlock(&c->mu);
+}
+
+// One write waiting for the committer: fn runs inside a batch transaction
+// on the writer and leaves its result in rc
+typedef struct db_op {
+    int (*fn)(db_conn_t *c, void *arg);
+    void *arg;
+    int rc;
+    int done;
+    struct db_op *next;
+} db_op_t;
+
+// Files of the chunks the batch dropped, unless a later op (or the same
+// one) took them again. Runs before the next batch can begin, so nothing
+// adds a row between the check and the unlink.
+static void remove_gone(db_t *db, db_conn_t *c) {
+    if (db->chunk_root && c->ngone > 0) {
+        sqlite3_stmt *has = stmt(c, S_CHUNK_HAS);
+        int n = 0;
+        for (int i = 0; i < c->ngone; i++) {
+            sqlite3_bind_blob(has, 1, c->gone[i].hash, SHA256_LEN, SQLITE_STATIC);
+            int rc = sqlite3_step(has);
+            stmt_done(has);
+            if (rc == SQLITE_DONE) c->gone[n++] = c->gone[i];
+        }
+        // What stays behind has no row, and the startup sweep removes it
+        chunk_store_remove(db->chunk_root, c->gone, n);
+    }
+    c->ngone = 0;
+}
+
+// The ops in order in one transaction, each under its own savepoint: one
+// that fails is undone alone, and the rest commit together. If the commit
+// itself fails they all fail.
+static void run_batch(db_t *db, db_op_t *ops) {
+    db_conn_t *c = writer_get(db);
+    int rc = stmt_exec(stmt(c, S_BEGIN)), n = 0;
+    for (db_op_t *op = ops; op; op = op->next) {
+        n++;
+        if (rc != 0) { op->rc = -1; continue; }
+        stmt_exec(stmt(c, S_SAVEPOINT));
+        op->rc = op->fn(c, op->arg);
+        if (op->rc != 0) stmt_exec(stmt(c, S_ROLLBACK_TO));
+        stmt_exec(stmt(c, S_RELEASE));
+    }
+    if (rc == 0 && stmt_exec(stmt(c, S_COMMIT)) != 0) {
+        stmt_exec(stmt(c, S_ROLLBACK));
+        rc = -1;
+    }
+    if (rc != 0) {
+        for (db_op_t *op = ops; op; op = op->next) op->rc = -1;
+    }
+    remove_gone(db, c);
+    conn_put(c);
+    stats_add(STAT_DB_COMMITS, 1);
+    stats_add(STAT_DB_COMMIT_OPS, n);
+}
+
+static void *committer_main(void *arg) {
+    db_t *db = (db_t*)arg;
+    pthread_mutex_lock(&db->gc_mu);
+    for (;;) {
+        while (!db->gc_head && !db->gc_stop) pthread_cond_wait(&db->gc_cond, &db->gc_mu);
+        if (!db->gc_head) break; // stopping, and nothing left to commit
+        // Hold the first op back up to gc_wait_us for company, unless the
+        // batch is already full
+        if (db->gc_wait_us > 0 && db->gc_pending < db->gc_batch && !db->gc_stop) {
+            struct timespec ts;
+            clock_gettime(CLOCK_REALTIME, &ts);
+            ts.tv_sec += db->gc_wait_us / 1000000;
+            ts.tv_nsec += (db->gc_wait_us % 1000000) * 1000;
+            if (ts.tv_nsec >= 1000000000L) { ts.tv_sec++; ts.tv_nsec -= 1000000000L; }
+            while (db->gc_pending < db->gc_batch && !db->gc_stop) {
+                if (pthread_cond_timedwait(&db->gc_cond, &db->gc_mu, &ts) == ETIMEDOUT) break;
+            }
+        }
+        db_op_t *batch = db->gc_head, *last = batch;
+        int n = 1;
+        while (n < db->gc_batch && last->next) { last = last->next; n++; }
+        db->gc_head = last->next;
+        if (!db->gc_head) db->gc_tail = NULL;
+        last->next = NULL;
+        db->gc_pending -= n;
+        pthread_mutex_unlock(&db->gc_mu);
+        run_batch(db, batch);
+        pthread_mutex_lock(&db->gc_mu);
+        // The ops live on their submitters' stacks: done under gc_mu, and
+        // nothing touched after
+        for (db_op_t *op = batch, *next; op; op = next) {
+            next = op->next;
+            op->done = 1;
+        }
+        pthread_cond_broadcast(&db->gc_done);
+    }
+    pthread_mutex_unlock(&db->gc_mu);
+    return NULL;
+}
+
+int db_group_commit(db_t *db, int max_batch, long long max_wait_us) {
+    if (max_batch <= 1) return 0;
+    db->gc_batch = max_batch;
+    db->gc_wait_us = max_wait_us > 0 ? max_wait_us : 0;
+    pthread_mutex_init(&db->gc_mu, NULL);
+    pthread_cond_init(&db->gc_cond, NULL);
+    pthread_cond_init(&db->gc_done, NULL);
+    if (pthread_create(&db->committer, NULL, committer_main, db) != 0) {
+        pthread_cond_destroy(&db->gc_done);
+        pthread_cond_destroy(&db->gc_cond);
+        pthread_mutex_destroy(&db->gc_mu);
+        return -1;
     }
-    if (out_quota) *out_quota = sqlite3_column_int64(st, 2);
-    if (out_used) *out_used = sqlite3_column_int64(st, 3);
-    sqlite3_finalize(st);
+    db->gc_running = 1;
     return 0;
 }
 
-int db_list_files(db_t *db, long long user_id, char ***out_names, int *out_count) {
-    *out_names = NULL; *out_count = 0;
-    const char *sql = "SELECT name FROM files WHERE user_id=? ORDER BY name";
-    sqlite3_stmt *st = NULL;
-    if (sqlite3_prepare_v2(db->conn, sql, -1, &st, NULL) != SQLITE_OK) return -1;
+void db_set_chunk_root(db_t *db, const char *root) {
+    db->chunk_root = root;
+}
+
+int db_set_synchronous(db_t *db, int full) {
+    db_conn_t *c = writer_get(db);
+    int rc = exec_sql(c->conn, full ? "PRAGMA synchronous=FULL;" : "PRAGMA synchronous=NORMAL;");
+    conn_put(c);
+    return rc;
+}
+
+// Runs fn in a write transaction and returns its result once committed:
+// queued for the committer when group commit is on, else right here as a
+// batch of one. Either way writes commit in the order they were submitted.
+static int db_write(db_t *db, int (*fn)(db_conn_t *c, void *arg), void *arg) {
+    db_op_t op = { fn, arg, 0, 0, NULL };
+    if (!db->gc_running) {
+        run_batch(db, &op);
+        return op.rc;
+    }
+    pthread_mutex_lock(&db->gc_mu);
+    if (db->gc_tail) db->gc_tail->next = &op; else db->gc_head = &op;
+    db->gc_tail = &op;
+    db->gc_pending++;
+    pthread_cond_signal(&db->gc_cond);
+    while (!op.done) pthread_cond_wait(&db->gc_done, &db->gc_mu);
+    pthread_mutex_unlock(&db->gc_mu);
+    return op.rc;
+}
+
+typedef struct {
+    const char *username, *pass_hash;
+    long long quota_bytes;
+} signup_arg_t;
+
+static int signup_op(db_conn_t *c, void *arg) {
+    signup_arg_t *a = (signup_arg_t*)arg;
+    sqlite3_stmt *st = stmt(c, S_USER_INSERT);
+    sqlite3_bind_text(st, 1, a->username, -1, SQLITE_STATIC);
+    sqlite3_bind_text(st, 2, a->pass_hash, -1, SQLITE_STATIC);
+    sqlite3_bind_int64(st, 3, a->quota_bytes);
+    return stmt_exec(st);
+}
+
+int db_signup(db_t *db, const char *username, const char *pass_hash, long long quota_bytes) {
+    signup_arg_t a = { username, pass_hash, quota_bytes };
+    return db_write(db, signup_op, &a);
+}
+
+int db_get_user(db_t *db, const char *username, long long *out_user_id, char **out_pass_hash, long long *out_quota, long long *out_used) {
+    db_conn_t *c = reader_get(db);
+    sqlite3_stmt *st = stmt(c, S_USER_GET);
+    sqlite3_bind_text(st, 1, username, -1, SQLITE_STATIC);
+    int rc = -1;
+    if (sqlite3_step(st) == SQLITE_ROW) {
+        if (out_user_id) *out_user_id = sqlite3_column_int64(st, 0);
+        if (out_pass_hash) {
+            const unsigned char *ph = sqlite3_column_text(st, 1);
+            *out_pass_hash = ph ? strdup((const char*)ph) : NULL;
+        }
+        if (out_quota) *out_quota = sqlite3_column_int64(st, 2);
+        if (out_used) *out_used = sqlite3_column_int64(st, 3);
+        rc = 0;
+    }
+    stmt_done(st);
+    conn_put(c);
+    return rc;
+}
+
+int db_list_files(db_t *db, long long user_id, const char *after, int limit,
+                  char **out_buf, size_t *out_len, int *out_count, int *out_more) {
+    *out_buf = NULL; *out_len = 0; *out_count = 0; *out_more = 0;
+    db_conn_t *c = reader_get(db);
+    sqlite3_stmt *st = stmt(c, S_FILE_LIST);
     sqlite3_bind_int64(st, 1, user_id);
-    int cap = 8;
-    char **names = (char**)malloc(sizeof(char*) * (size_t)cap);
+    sqlite3_bind_text(st, 2, after ? after : "", -1, SQLITE_STATIC);
+    sqlite3_bind_int64(st, 3, limit > 0 ? (long long)limit + 1 : -1);
+    size_t cap = 4096, len = 0;
+    char *buf = (char*)malloc(cap);
     int n = 0;
     int rc;
     while ((rc = sqlite3_step(st)) == SQLITE_ROW) {
-        const unsigned char *name = sqlite3_column_text(st, 0);
-        if (n == cap) {
-            cap *= 2;
-            names = (char**)realloc(names, sizeof(char*) * (size_t)cap);
+        if (limit > 0 && n == limit) { *out_more = 1; rc = SQLITE_DONE; break; }
+        const char *name = (const char*)sqlite3_column_text(st, 0);
+        size_t k = (size_t)sqlite3_column_bytes(st, 0);
+        if (len + k + 1 > cap) {
+            while (len + k + 1 > cap) cap *= 2;
+            buf = (char*)realloc(buf, cap);
         }
-        names[n++] = strdup((const char*)name);
+        memcpy(buf + len, name, k);
+        len += k;
+        buf[len++] = '\n';
+        n++;
     }
-    sqlite3_finalize(st);
+    stmt_done(st);
+    conn_put(c);
     if (rc != SQLITE_DONE) {
-        for (int i = 0; i < n; i++) free(names[i]);
-        free(names);
+        free(buf);
+        *out_more = 0;
         return -1;
     }
-    *out_names = names;
+    *out_buf = buf;
+    *out_len = len;
     *out_count = n;
     return 0;
 }
 
+int db_list_all_files(db_t *db, long long user_id, db_file_t **out, int *count) {
+    *out = NULL; *count = 0;
+    db_conn_t *c = reader_get(db);
+    sqlite3_stmt *st = stmt(c, S_FILE_ALL);
+    sqlite3_bind_int64(st, 1, user_id);
+    // Names pile up in pool at offsets; the block is laid out at the end
+    db_file_t *files = NULL;
+    size_t *offs = NULL, cap = 0, pool_len = 0, pool_cap = 4096;
+    char *pool = (char*)malloc(pool_cap);
+    int n = 0, rc;
+    while ((rc = sqlite3_step(st)) == SQLITE_ROW) {
+        if ((size_t)n == cap) {
+            cap = cap ? cap * 2 : 64;
+            files = (db_file_t*)realloc(files, sizeof(db_file_t) * cap);
+            offs = (size_t*)realloc(offs, sizeof(size_t) * cap);
+        }
+        size_t k = (size_t)sqlite3_column_bytes(st, 0);
+        const char *name = (const char*)sqlite3_column_text(st, 0);
+        if (pool_len + k + 1 > pool_cap) {
+            while (pool_len + k + 1 > pool_cap) pool_cap *= 2;
+            pool = (char*)realloc(pool, pool_cap);
+        }
+        memcpy(pool + pool_len, name, k);
+        pool[pool_len + k] = '\0';
+        offs[n] = pool_len;
+        files[n].size = sqlite3_column_int64(st, 1);
+        pool_len += k + 1;
+        n++;
+    }
+    stmt_done(st);
+    conn_put(c);
+    db_file_t *block = NULL;
+    if (rc == SQLITE_DONE) block = (db_file_t*)malloc(sizeof(db_file_t) * (size_t)n + pool_len + 1);
+    if (block) {
+        char *names = (char*)(block + n);
+        memcpy(names, pool, pool_len);
+        for (int i = 0; i < n; i++) {
+            block[i].name = names + offs[i];
+            block[i].size = files[i].size;
+        }
+        *out = block;
+        *count = n;
+    }
+    free(files);
+    free(offs);
+    free(pool);
+    return block ? 0 : -1;
+}
+
 int db_get_file_size(db_t *db, long long user_id, const char *name, long long *out_size) {
-    const char *sql = "SELECT size FROM files WHERE user_id=? AND name=?";
-    sqlite3_stmt *st = NULL;
-    if (sqlite3_prepare_v2(db->conn, sql, -1, &st, NULL) != SQLITE_OK) return -1;
+    db_conn_t *c = reader_get(db);
+    sqlite3_stmt *st = stmt(c, S_FILE_SIZE);
     sqlite3_bind_int64(st, 1, user_id);
-    sqlite3_bind_text(st, 2, name, -1, SQLITE_TRANSIENT);
-    int rc = sqlite3_step(st);
-    if (rc != SQLITE_ROW) {
-        sqlite3_finalize(st);
-        return -1;
+    sqlite3_bind_text(st, 2, name, -1, SQLITE_STATIC);
+    int rc = -1;
+    if (sqlite3_step(st) == SQLITE_ROW) {
+        *out_size = sqlite3_column_int64(st, 0);
+        rc = 0;
+    }
+    stmt_done(st);
+    conn_put(c);
+    return rc;
+}
+
+// id and size of a file; 0 if it exists
+static int file_get(db_conn_t *c, long long user_id, const char *name, long long *id, long long *size) {
+    sqlite3_stmt *st = stmt(c, S_FILE_GET);
+    sqlite3_bind_int64(st, 1, user_id);
+    sqlite3_bind_text(st, 2, name, -1, SQLITE_STATIC);
+    int rc = -1;
+    if (sqlite3_step(st) == SQLITE_ROW) {
+        *id = sqlite3_column_int64(st, 0);
+        *size = sqlite3_column_int64(st, 1);
+        rc = 0;
+    }
+    stmt_done(st);
+    return rc;
+}
+
+static int file_upsert(db_conn_t *c, long long user_id, const char *name, long long size) {
+    sqlite3_stmt *st = stmt(c, S_FILE_UPSERT);
+    sqlite3_bind_int64(st, 1, user_id);
+    sqlite3_bind_text(st, 2, name, -1, SQLITE_STATIC);
+    sqlite3_bind_int64(st, 3, size);
+    return stmt_exec(st);
+}
+
+static int add_used(db_conn_t *c, long long user_id, long long delta) {
+    sqlite3_stmt *st = stmt(c, S_USER_ADD_USED);
+    sqlite3_bind_int64(st, 1, delta);
+    sqlite3_bind_int64(st, 2, user_id);
+    return stmt_exec(st);
+}
+
+// Takes the manifest of file_id out of the table, returned in *out
+static int take_manifest(db_conn_t *c, long long file_id, chunk_ref_t **out, int *count) {
+    *out = NULL; *count = 0;
+    sqlite3_stmt *st = stmt(c, S_MANIFEST_GET);
+    sqlite3_bind_int64(st, 1, file_id);
+    int cap = 0, rc;
+    while ((rc = sqlite3_step(st)) == SQLITE_ROW) {
+        if (*count == cap) { cap = cap ? cap * 2 : 64; *out = (chunk_ref_t*)realloc(*out, sizeof(chunk_ref_t) * (size_t)cap); }
+        chunk_ref_t *r = &(*out)[(*count)++];
+        memset(r->hash, 0, sizeof(r->hash));
+        if (sqlite3_column_bytes(st, 0) == SHA256_LEN) memcpy(r->hash, sqlite3_column_blob(st, 0), SHA256_LEN);
+        r->size = sqlite3_column_int64(st, 1);
+    }
+    stmt_done(st);
+    if (rc != SQLITE_DONE) { free(*out); *out = NULL; *count = 0; return -1; }
+    return 0;
+}
+
+static int manifest_delete(db_conn_t *c, long long file_id) {
+    sqlite3_stmt *st = stmt(c, S_MANIFEST_DELETE);
+    sqlite3_bind_int64(st, 1, file_id);
+    return stmt_exec(st);
+}
+
+// Queues a chunk for remove_gone()
+static int gone_add(db_conn_t *c, const chunk_ref_t *r) {
+    if (c->ngone == c->gone_cap) {
+        int cap = c->gone_cap ? c->gone_cap * 2 : 64;
+        chunk_ref_t *g = (chunk_ref_t*)realloc(c->gone, sizeof(chunk_ref_t) * (size_t)cap);
+        if (!g) return -1;
+        c->gone = g;
+        c->gone_cap = cap;
+    }
+    c->gone[c->ngone++] = *r;
+    return 0;
+}
+
+// Drops a reference on each of refs; those left unreferenced are deleted,
+// counted in *nfreed and queued for remove_gone()
+static int release_chunks(db_conn_t *c, const chunk_ref_t *refs, int count, int *nfreed) {
+    sqlite3_stmt *dec = stmt(c, S_CHUNK_DEC), *del = stmt(c, S_CHUNK_DROP);
+    for (int i = 0; i < count; i++) {
+        sqlite3_bind_blob(dec, 1, refs[i].hash, SHA256_LEN, SQLITE_STATIC);
+        if (stmt_exec(dec) != 0) return -1;
+    }
+    // second pass: a chunk listed twice must lose both references first
+    for (int i = 0; i < count; i++) {
+        sqlite3_bind_blob(del, 1, refs[i].hash, SHA256_LEN, SQLITE_STATIC);
+        if (stmt_exec(del) != 0) return -1;
+        if (sqlite3_changes(c->conn) > 0) {
+            if (gone_add(c, &refs[i]) != 0) return -1;
+            (*nfreed)++;
+        }
     }
-    *out_size = sqlite3_column_int64(st, 0);
-    sqlite3_finalize(st);
     return 0;
 }
 
-int db_upsert_file(db_t *db, long long user_id, const char *name, long long new_size, long long *delta_used) {
+// put_manifest_op(): a chunk it adds a row for has no file any more
+#define DB_MISSING (-3)
+// Rounds of restoring missing chunks before db_put_manifest() gives up
+#define MISSING_RETRIES 3
+
+typedef struct {
+    const char *root;
+    long long user_id;
+    const char *name;
+    long long size;
+    const chunk_ref_t *refs;
+    int count, check_quota;
+    long long *delta_used;
+    int *nfreed, *new_chunks;
+    long long *new_bytes;
+} put_manifest_arg_t;
+
+static int put_manifest_op(db_conn_t *c, void *arg) {
+    put_manifest_arg_t *a = (put_manifest_arg_t*)arg;
     int rc = 0;
-    sqlite3_exec(db->conn, "BEGIN IMMEDIATE", NULL, NULL, NULL);
-    long long old_size = 0;
-    {
-        const char *sqls = "SELECT size FROM files WHERE user_id=? AND name=?";
-        sqlite3_stmt *st = NULL;
-        if (sqlite3_prepare_v2(db->conn, sqls, -1, &st, NULL) != SQLITE_OK) { rc = -1; goto end; }
-        sqlite3_bind_int64(st, 1, user_id);
-        sqlite3_bind_text(st, 2, name, -1, SQLITE_TRANSIENT);
-        int stepr = sqlite3_step(st);
-        if (stepr == SQLITE_ROW) old_size = sqlite3_column_int64(st, 0);
-        sqlite3_finalize(st);
-    }
-    {
-        const char *sqlu = "INSERT INTO files(user_id,name,size,created_at) VALUES(?,?,?,strftime('%s','now')) "
-                           "ON CONFLICT(user_id,name) DO UPDATE SET size=excluded.size";
-        sqlite3_stmt *st = NULL;
-        if (sqlite3_prepare_v2(db->conn, sqlu, -1, &st, NULL) != SQLITE_OK) { rc = -1; goto end; }
-        sqlite3_bind_int64(st, 1, user_id);
-        sqlite3_bind_text(st, 2, name, -1, SQLITE_TRANSIENT);
-        sqlite3_bind_int64(st, 3, new_size);
-        if (sqlite3_step(st) != SQLITE_DONE) { sqlite3_finalize(st); rc = -1; goto end; }
-        sqlite3_finalize(st);
-    }
-    {
-        long long delta = new_size - old_size;
-        if (delta_used) *delta_used = delta;
-        const char *sqlu = "UPDATE users SET used_bytes=used_bytes+? WHERE id=?";
-        sqlite3_stmt *st = NULL;
-        if (sqlite3_prepare_v2(db->conn, sqlu, -1, &st, NULL) != SQLITE_OK) { rc = -1; goto end; }
-        sqlite3_bind_int64(st, 1, delta);
-        sqlite3_bind_int64(st, 2, user_id);
-        if (sqlite3_step(st) != SQLITE_DONE) { sqlite3_finalize(st); rc = -1; goto end; }
-        sqlite3_finalize(st);
+    long long old_size = 0, file_id = 0;
+    chunk_ref_t *old = NULL;
+    int nold = 0;
+    if (file_get(c, a->user_id, a->name, &file_id, &old_size) == 0) {
+        if (take_manifest(c, file_id, &old, &nold) != 0 || manifest_delete(c, file_id) != 0) { rc = -1; goto end; }
+    } else {
+        file_id = 0;
+        old_size = 0;
+    }
+    if (file_upsert(c, a->user_id, a->name, a->size) != 0) { rc = -1; goto end; }
+    if (!file_id) {
+        long long ignored;
+        if (file_get(c, a->user_id, a->name, &file_id, &ignored) != 0) { rc = -1; goto end; }
+    }
+    // New references go on before the old ones come off, so chunks shared
+    // by both versions never touch zero
+    sqlite3_stmt *row = stmt(c, S_MANIFEST_ADD), *inc = stmt(c, S_CHUNK_INC), *add = stmt(c, S_CHUNK_ADD);
+    int missing = 0;
+    for (int i = 0; i < a->count; i++) {
+        const chunk_ref_t *r = &a->refs[i];
+        sqlite3_bind_int64(row, 1, file_id);
+        sqlite3_bind_int(row, 2, i);
+        sqlite3_bind_blob(row, 3, r->hash, SHA256_LEN, SQLITE_STATIC);
+        if (stmt_exec(row) != 0) { rc = -1; goto end; }
+        sqlite3_bind_blob(inc, 1, r->hash, SHA256_LEN, SQLITE_STATIC);
+        if (stmt_exec(inc) != 0) { rc = -1; goto end; }
+        if (sqlite3_changes(c->conn) > 0) continue;
+        sqlite3_bind_blob(add, 1, r->hash, SHA256_LEN, SQLITE_STATIC);
+        sqlite3_bind_int64(add, 2, r->size);
+        if (stmt_exec(add) != 0) { rc = -1; goto end; }
+        (*a->new_chunks)++;
+        *a->new_bytes += r->size;
+        // Without a row its file may have gone with an earlier batch's
+        // release since the upload found or wrote it
+        char path[1024];
+        if (a->root && (chunk_path(a->root, r->hash, path, sizeof(path), 0) != 0 || access(path, F_OK) != 0)) { missing = 1; break; }
     }
+    // Rewriting it here would hold every op of the batch behind file I/O;
+    // the caller does it and tries again
+    if (missing) { rc = DB_MISSING; goto end; }
+    if (release_chunks(c, old, nold, a->nfreed) != 0) { rc = -1; goto end; }
+    long long delta = a->size - old_size;
+    if (a->delta_used) *a->delta_used = delta;
+    if (a->check_quota && delta > 0) {
+        sqlite3_stmt *st = stmt(c, S_USER_QUOTA);
+        sqlite3_bind_int64(st, 1, a->user_id);
+        if (sqlite3_step(st) != SQLITE_ROW) rc = -1;
+        else if (sqlite3_column_int64(st, 1) + delta > sqlite3_column_int64(st, 0)) rc = DB_QUOTA;
+        stmt_done(st);
+        if (rc != 0) goto end;
+    }
+    if (add_used(c, a->user_id, delta) != 0) rc = -1;
 end:
-    if (rc == 0) sqlite3_exec(db->conn, "COMMIT", NULL, NULL, NULL);
-    else sqlite3_exec(db->conn, "ROLLBACK", NULL, NULL, NULL);
+    free(old);
     return rc;
 }
 
-int db_delete_file(db_t *db, long long user_id, const char *name, long long *size_deleted) {
-    int rc = 0;
-    sqlite3_exec(db->conn, "BEGIN IMMEDIATE", NULL, NULL, NULL);
-    long long sz = 0;
-    {
-        const char *sqls = "SELECT size FROM files WHERE user_id=? AND name=?";
-        sqlite3_stmt *st = NULL;
-        if (sqlite3_prepare_v2(db->conn, sqls, -1, &st, NULL) != SQLITE_OK) { rc = -1; goto end; }
-        sqlite3_bind_int64(st, 1, user_id);
-        sqlite3_bind_text(st, 2, name, -1, SQLITE_TRANSIENT);
-        int stepr = sqlite3_step(st);
-        if (stepr == SQLITE_ROW) sz = sqlite3_column_int64(st, 0);
-        else { sqlite3_finalize(st); rc = -1; goto end; }
-        sqlite3_finalize(st);
-    }
-    {
-        const char *sqld = "DELETE FROM files WHERE user_id=? AND name=?";
-        sqlite3_stmt *st = NULL;
-        if (sqlite3_prepare_v2(db->conn, sqld, -1, &st, NULL) != SQLITE_OK) { rc = -1; goto end; }
-        sqlite3_bind_int64(st, 1, user_id);
-        sqlite3_bind_text(st, 2, name, -1, SQLITE_TRANSIENT);
-        if (sqlite3_step(st) != SQLITE_DONE) { sqlite3_finalize(st); rc = -1; goto end; }
-        sqlite3_finalize(st);
-    }
-    {
-        const char *sqlu = "UPDATE users SET used_bytes=used_bytes-? WHERE id=?";
-        sqlite3_stmt *st = NULL;
-        if (sqlite3_prepare_v2(db->conn, sqlu, -1, &st, NULL) != SQLITE_OK) { rc = -1; goto end; }
-        sqlite3_bind_int64(st, 1, sz);
-        sqlite3_bind_int64(st, 2, user_id);
-        if (sqlite3_step(st) != SQLITE_DONE) { sqlite3_finalize(st); rc = -1; goto end; }
-        sqlite3_finalize(st);
+int db_put_manifest(db_t *db, long long user_id, const char *name, long long size, const char *src,
+                    const chunk_ref_t *refs, int count, int check_quota, long long *delta_used,
+                    int *nfreed, int *new_chunks, long long *new_bytes) {
+    put_manifest_arg_t a = { db->chunk_root, user_id, name, size, refs, count, check_quota, delta_used, nfreed, new_chunks, new_bytes };
+    int rc;
+    for (int tries = 0; ; tries++) {
+        *nfreed = 0; *new_chunks = 0; *new_bytes = 0;
+        rc = db_write(db, put_manifest_op, &a);
+        if (rc != DB_MISSING) break;
+        // Outside the transaction, on the caller's thread
+        if (!src || tries == MISSING_RETRIES || chunk_store_ensure(db->chunk_root, src, refs, count) != 0) { rc = -1; break; }
     }
-end:
-    if (rc == 0) sqlite3_exec(db->conn, "COMMIT", NULL, NULL, NULL);
-    else sqlite3_exec(db->conn, "ROLLBACK", NULL, NULL, NULL);
-    if (rc == 0 && size_deleted) *size_deleted = sz;
+    if (rc != 0) { *nfreed = 0; *new_chunks = 0; *new_bytes = 0; }
     return rc;
 }
 
-int db_adjust_used_bytes(db_t *db, long long user_id, long long delta, int check_quota) {
-    int rc = 0;
-    sqlite3_exec(db->conn, "BEGIN IMMEDIATE", NULL, NULL, NULL);
-    long long quota = 0, used = 0;
-    {
-        const char *sql = "SELECT quota_bytes, used_bytes FROM users WHERE id=?";
-        sqlite3_stmt *st = NULL;
-        if (sqlite3_prepare_v2(db->conn, sql, -1, &st, NULL) != SQLITE_OK) { rc = -1; goto end; }
-        sqlite3_bind_int64(st, 1, user_id);
-        int stepr = sqlite3_step(st);
-        if (stepr != SQLITE_ROW) { sqlite3_finalize(st); rc = -1; goto end; }
-        quota = sqlite3_column_int64(st, 0);
-        used = sqlite3_column_int64(st, 1);
-        sqlite3_finalize(st);
-    }
-    if (check_quota && used + delta > quota) { rc = -1; goto end; }
-    {
-        const char *sqlu = "UPDATE users SET used_bytes=used_bytes+? WHERE id=?";
-        sqlite3_stmt *st = NULL;
-        if (sqlite3_prepare_v2(db->conn, sqlu, -1, &st, NULL) != SQLITE_OK) { rc = -1; goto end; }
-        sqlite3_bind_int64(st, 1, delta);
-        sqlite3_bind_int64(st, 2, user_id);
-        if (sqlite3_step(st) != SQLITE_DONE) { sqlite3_finalize(st); rc = -1; goto end; }
-        sqlite3_finalize(st);
+typedef struct {
+    const chunk_ref_t *refs;
+    int count;
+} discard_arg_t;
+
+static int discard_op(db_conn_t *c, void *arg) {
+    discard_arg_t *a = (discard_arg_t*)arg;
+    for (int i = 0; i < a->count; i++) {
+        if (gone_add(c, &a->refs[i]) != 0) return -1;
     }
+    return 0;
+}
+
+int db_discard_chunks(db_t *db, const chunk_ref_t *refs, int count) {
+    if (count <= 0 || !db->chunk_root) return 0;
+    discard_arg_t a = { refs, count };
+    return db_write(db, discard_op, &a);
+}
+
+int db_chunk_exists(db_t *db, const unsigned char *hash) {
+    db_conn_t *c = reader_get(db);
+    sqlite3_stmt *st = stmt(c, S_CHUNK_HAS);
+    sqlite3_bind_blob(st, 1, hash, SHA256_LEN, SQLITE_STATIC);
+    int rc = sqlite3_step(st);
+    stmt_done(st);
+    conn_put(c);
+    return rc != SQLITE_DONE;
+}
+
+int db_get_manifest(db_t *db, long long user_id, const char *name,
+                    chunk_ref_t **out, int *count, long long *size) {
+    *out = NULL; *count = 0;
+    long long file_id;
+    db_conn_t *c = reader_get(db);
+    stmt_exec(stmt(c, S_BEGIN_READ));
+    int rc = file_get(c, user_id, name, &file_id, size);
+    if (rc == 0) rc = take_manifest(c, file_id, out, count);
+    stmt_exec(stmt(c, S_COMMIT));
+    conn_put(c);
+    return rc;
+}
+
+typedef struct {
+    long long user_id;
+    const char *name;
+    long long *size_deleted;
+    int *nfreed;
+} delete_arg_t;
+
+static int delete_op(db_conn_t *c, void *arg) {
+    delete_arg_t *a = (delete_arg_t*)arg;
+    int rc = 0;
+    chunk_ref_t *old = NULL;
+    int nold = 0;
+    long long sz = 0, file_id = 0;
+    if (file_get(c, a->user_id, a->name, &file_id, &sz) != 0) return -1;
+    if (take_manifest(c, file_id, &old, &nold) != 0 || manifest_delete(c, file_id) != 0) { rc = -1; goto end; }
+    if (release_chunks(c, old, nold, a->nfreed) != 0) { rc = -1; goto end; }
+    sqlite3_stmt *st = stmt(c, S_FILE_DELETE);
+    sqlite3_bind_int64(st, 1, a->user_id);
+    sqlite3_bind_text(st, 2, a->name, -1, SQLITE_STATIC);
+    if (stmt_exec(st) != 0 || add_used(c, a->user_id, -sz) != 0) rc = -1;
+    if (rc == 0 && a->size_deleted) *a->size_deleted = sz;
 end:
-    if (rc == 0) sqlite3_exec(db->conn, "COMMIT", NULL, NULL, NULL);
-    else sqlite3_exec(db->conn, "ROLLBACK", NULL, NULL, NULL);
+    free(old);
+    return rc;
+}
+
+int db_delete_file(db_t *db, long long user_id, const char *name, long long *size_deleted, int *nfreed) {
+    *nfreed = 0;
+    delete_arg_t a = { user_id, name, size_deleted, nfreed };
+    int rc = db_write(db, delete_op, &a);
+    if (rc != 0) *nfreed = 0;
     return rc;
 }
 
+typedef struct {
+    long long token, user_id;
+    const char *name;
+    long long size;
+    const char *path;
+} session_create_arg_t;
 
+static int session_create_op(db_conn_t *c, void *arg) {
+    session_create_arg_t *a = (session_create_arg_t*)arg;
+    sqlite3_stmt *st = stmt(c, S_SESSION_CREATE);
+    sqlite3_bind_int64(st, 1, a->token);
+    sqlite3_bind_int64(st, 2, a->user_id);
+    sqlite3_bind_text(st, 3, a->name, -1, SQLITE_STATIC);
+    sqlite3_bind_int64(st, 4, a->size);
+    sqlite3_bind_text(st, 5, a->path, -1, SQLITE_STATIC);
+    return stmt_exec(st);
+}
+
+int db_session_create(db_t *db, long long token, long long user_id, const char *name, long long size, const char *path) {
+    session_create_arg_t a = { token, user_id, name, size, path };
+    return db_write(db, session_create_op, &a);
+}
+
+int db_session_get(db_t *db, long long token, long long user_id, char *out_name, size_t name_cap, long long *out_size) {
+    db_conn_t *c = reader_get(db);
+    sqlite3_stmt *st = stmt(c, S_SESSION_GET);
+    sqlite3_bind_int64(st, 1, token);
+    sqlite3_bind_int64(st, 2, user_id);
+    int rc = -1;
+    if (sqlite3_step(st) == SQLITE_ROW) {
+        const unsigned char *name = sqlite3_column_text(st, 0);
+        snprintf(out_name, name_cap, "%s", name ? (const char*)name : "");
+        *out_size = sqlite3_column_int64(st, 1);
+        rc = 0;
+    }
+    stmt_done(st);
+    conn_put(c);
+    return rc;
+}
+
+static int session_delete_op(db_conn_t *c, void *arg) {
+    sqlite3_stmt *st = stmt(c, S_SESSION_DELETE);
+    sqlite3_bind_int64(st, 1, *(long long*)arg);
+    return stmt_exec(st);
+}
+
+int db_session_delete(db_t *db, long long token) {
+    return db_write(db, session_delete_op, &token);
+}
+
+typedef struct {
+    long long token, when;
+} session_touch_arg_t;
+
+static int session_touch_op(db_conn_t *c, void *arg) {
+    session_touch_arg_t *a = (session_touch_arg_t*)arg;
+    sqlite3_stmt *st = stmt(c, S_SESSION_TOUCH);
+    sqlite3_bind_int64(st, 1, a->when);
+    sqlite3_bind_int64(st, 2, a->token);
+    return stmt_exec(st);
+}
+
+int db_session_touch(db_t *db, long long token, long long when) {
+    session_touch_arg_t a = { token, when };
+    return db_write(db, session_touch_op, &a);
+}
+
+int db_session_stale(db_t *db, long long before, db_session_t **out, int *count) {
+    *out = NULL; *count = 0;
+    db_conn_t *c = reader_get(db);
+    sqlite3_stmt *st = stmt(c, S_SESSION_STALE);
+    sqlite3_bind_int64(st, 1, before);
+    int cap = 0, rc;
+    while ((rc = sqlite3_step(st)) == SQLITE_ROW) {
+        if (*count == cap) { cap = cap ? cap * 2 : 8; *out = (db_session_t*)realloc(*out, sizeof(db_session_t) * (size_t)cap); }
+        db_session_t *s = &(*out)[(*count)++];
+        const unsigned char *path = sqlite3_column_text(st, 1);
+        s->token = sqlite3_column_int64(st, 0);
+        snprintf(s->path, sizeof(s->path), "%s", path ? (const char*)path : "");
+    }
+    stmt_done(st);
+    conn_put(c);
+    if (rc != SQLITE_DONE) { free(*out); *out = NULL; *count = 0; return -1; }
+    return 0;
+}
@@ -1,13 +1,69 @@
 #ifndef DB_H
 #define DB_H
 
+#include <stddef.h>
+#include <pthread.h>
 #include <sqlite3.h>
 
+#include "chunk.h"
+
+// One SQLite connection with its own prepared statements, used by one
+// thread at a time under mu
 typedef struct {
     sqlite3 *conn;
+    sqlite3_stmt **stmts;
+    pthread_mutex_t mu;
+    int mu_init;
+    // Writer only: chunks the current batch dropped from the table
+    chunk_ref_t *gone;
+    int ngone, gone_cap;
+} db_conn_t;
+
+// A writer connection and nreaders read-only ones on the same WAL file.
+// Every call below runs whole (transaction included) on one connection:
+// writes queue on the writer's mu, while reads (logins, listings, size and
+// manifest lookups, session checks) take whichever reader is free, starting
+// from the calling thread's own, and see the last committed state without
+// waiting on a write in progress. With no readers everything goes through
+// the writer.
+//
+// Writes can also go through a group commit (db_group_commit()): callers
+// queue them for one committer thread, which runs whatever is pending, up
+// to gc_batch, as a single transaction and then wakes them all, so a burst
+// of small uploads pays one WAL sync instead of one each.
+//
+// With a chunk store attached (db_set_chunk_root()) the writer also keeps
+// the chunk files in step with the chunks table, so uploads and deletes
+// need no lock of their own around their commits: after each batch it
+// removes the files of chunks the batch left without a row, and an upload
+// that would add a row for a chunk whose file is gone is backed out, to
+// rewrite the chunk outside the batch and try again.
+struct db_op;
+typedef struct {
+    db_conn_t writer;
+    db_conn_t *readers;
+    int nreaders;
+    unsigned next_home; // hands each thread its first reader
+    pthread_mutex_t gc_mu;
+    pthread_cond_t gc_cond, gc_done; // committer wakeup; batch committed
+    struct db_op *gc_head, *gc_tail; // submitted, not yet taken
+    int gc_pending, gc_batch, gc_running, gc_stop;
+    long long gc_wait_us;
+    pthread_t committer;
+    const char *chunk_root; // NULL: the table alone, no files
 } db_t;
 
-int db_open(db_t *db, const char *path); // initializes schema, WAL
+int db_open(db_t *db, const char *path, int readers); // initializes schema, WAL
+// Starts the committer: batches of at most max_batch writes, the first of
+// which waits up to max_wait_us for others to join (0: take only what is
+// already queued). max_batch <= 1 leaves every write its own transaction.
+int db_group_commit(db_t *db, int max_batch, long long max_wait_us);
+// The chunk store root (kept by the caller) whose files the writer manages
+void db_set_chunk_root(db_t *db, const char *root);
+// PRAGMA synchronous on the writer: full (the default) syncs the WAL at
+// every commit; otherwise only at checkpoints, so a crash can lose the
+// last commits but never leaves the database inconsistent
+int db_set_synchronous(db_t *db, int full);
 void db_close(db_t *db);
 
 // returns 0 on success, -1 on conflict
@@ -17,13 +73,60 @@ int db_signup(db_t *db, const char *username, const char *pass_hash, long long q
 int db_get_user(db_t *db, const char *username, long long *out_user_id, char **out_pass_hash, long long *out_quota, long long *out_used);
 
 // file metadata ops
-int db_list_files(db_t *db, long long user_id, char ***out_names, int *out_count);
+// Names after `after` ("" = from the start) in name order, at most limit
+// of them (<= 0: all), packed into one malloc'd buffer of '\n'-terminated
+// lines. *out_more is set when further names exist past the page.
+int db_list_files(db_t *db, long long user_id, const char *after, int limit,
+                  char **out_buf, size_t *out_len, int *out_count, int *out_more);
+// Every file of the user with its size, in name order, in one malloc'd
+// block (the names live inside it)
+typedef struct {
+    const char *name;
+    long long size;
+} db_file_t;
+int db_list_all_files(db_t *db, long long user_id, db_file_t **out, int *count);
 int db_get_file_size(db_t *db, long long user_id, const char *name, long long *out_size);
-int db_upsert_file(db_t *db, long long user_id, const char *name, long long new_size, long long *delta_used);
-int db_delete_file(db_t *db, long long user_id, const char *name, long long *size_deleted);
+// Also drops the file's manifest; *nfreed counts the chunks nothing
+// references any more (their files go once the batch commits)
+int db_delete_file(db_t *db, long long user_id, const char *name, long long *size_deleted, int *nfreed);
+
+// Chunked files (chunk.h). put creates or replaces name with the given
+// manifest, taking a reference on each chunk and dropping the old
+// manifest's; *nfreed as for db_delete_file. src is the file the refs were
+// cut from (refs cover it in order): if a release removed one of the chunks
+// since it was stored, the commit backs out that put alone, the chunk is
+// rewritten from src on the calling thread and the put goes in again.
+// *new_chunks and *new_bytes count what was not in the store before. With
+// check_quota, growing the user's used_bytes past quota_bytes fails with
+// DB_QUOTA instead.
+#define DB_QUOTA (-2)
+int db_put_manifest(db_t *db, long long user_id, const char *name, long long size, const char *src,
+                    const chunk_ref_t *refs, int count, int check_quota, long long *delta_used,
+                    int *nfreed, int *new_chunks, long long *new_bytes);
+// Chunks an upload stored but will not commit: their files go with the
+// next batch unless something holds a row for them by then
+int db_discard_chunks(db_t *db, const chunk_ref_t *refs, int count);
+// 1 if the chunks table has hash (or the lookup failed), else 0
+int db_chunk_exists(db_t *db, const unsigned char *hash);
+// Chunks of a file in order (none for files stored whole, from before the
+// chunk store); -1 if there is no such file
+int db_get_manifest(db_t *db, long long user_id, const char *name,
+                    chunk_ref_t **out, int *count, long long *size);
+
+// Resumable upload sessions: the staged file lives at path; touched is the
+// unix time of the last sign of life
+typedef struct {
+    long long token;
+    char path[1024];
+} db_session_t;
 
-// updates used_bytes by delta; checks quota if check_quota != 0; returns -1 if exceeds
-int db_adjust_used_bytes(db_t *db, long long user_id, long long delta, int check_quota);
+int db_session_create(db_t *db, long long token, long long user_id, const char *name, long long size, const char *path);
+// -1 unless the session exists and belongs to user_id
+int db_session_get(db_t *db, long long token, long long user_id, char *out_name, size_t name_cap, long long *out_size);
+int db_session_delete(db_t *db, long long token);
+int db_session_touch(db_t *db, long long token, long long when);
+// Sessions last touched before `before`, in a malloc'd array
+int db_session_stale(db_t *db, long long before, db_session_t **out, int *count);
 
 #endif
 
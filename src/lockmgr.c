@@ -1,161 +1,218 @@
-#include "lockmgr.h"
-
-#include <stdlib.h>
-#include <string.h>
-
-typedef struct lock_entry {
-    char *key;
-    pthread_rwlock_t rw;
-    int refcnt;
-    struct lock_entry *next;
-} lock_entry_t;
-
-struct lockmgr {
-    pthread_mutex_t mu;
-    lock_entry_t **buckets;
-    size_t nbuckets;
-};
-
-static unsigned long hash_str(const char *s) {
-    unsigned long h = 1469598103934665603ULL;
-    while (*s) { h ^= (unsigned char)(*s++); h *= 1099511628211ULL; }
-    return h;
-}
-
-static char *make_user_key(const char *u) {
-    size_t n = strlen(u);
-    char *k = (char*)malloc(n + 3);
-    if (!k) return NULL;
-    k[0] = 'U'; k[1] = ':'; memcpy(k+2, u, n+1);
-    return k;
-}
-
-static char *make_file_key(const char *u, const char *f) {
-    size_t nu = strlen(u), nf = strlen(f);
-    char *k = (char*)malloc(nu + nf + 5);
-    if (!k) return NULL;
-    k[0] = 'F'; k[1] = ':';
-    memcpy(k+2, u, nu); k[2+nu] = '|';
-    memcpy(k+3+nu, f, nf+1);
-    return k;
-}
-
-int lockmgr_init(lockmgr_t **out) {
-    lockmgr_t *lm = (lockmgr_t*)calloc(1, sizeof(*lm));
-    if (!lm) return -1;
-    lm->nbuckets = 256;
-    lm->buckets = (lock_entry_t**)calloc(lm->nbuckets, sizeof(lock_entry_t*));
-    if (!lm->buckets) { free(lm); return -1; }
-    pthread_mutex_init(&lm->mu, NULL);
-    *out = lm;
-    return 0;
-}
-
-static lock_entry_t *get_or_create(lockmgr_t *lm, const char *key) {
-    unsigned long h = hash_str(key);
-    size_t idx = h % lm->nbuckets;
-    lock_entry_t *e = lm->buckets[idx];
-    for (; e; e = e->next) {
-        if (strcmp(e->key, key) == 0) {
-            e->refcnt++;
-            return e;
-        }
-    }
-    e = (lock_entry_t*)calloc(1, sizeof(*e));
-    if (!e) return NULL;
-    e->key = strdup(key);
-    pthread_rwlock_init(&e->rw, NULL);
-    e->refcnt = 1;
-    e->next = lm->buckets[idx];
-    lm->buckets[idx] = e;
-    return e;
-}
-
-static void release(lockmgr_t *lm, const char *key) {
-    unsigned long h = hash_str(key);
-    size_t idx = h % lm->nbuckets;
-    lock_entry_t *prev = NULL, *e = lm->buckets[idx];
-    while (e) {
-        if (strcmp(e->key, key) == 0) {
-            if (--e->refcnt == 0) {
-                if (prev) prev->next = e->next; else lm->buckets[idx] = e->next;
-                pthread_rwlock_destroy(&e->rw);
-                free(e->key);
-                free(e);
-            }
-            return;
-        }
-        prev = e; e = e->next;
-    }
-}
-
-void lockmgr_destroy(lockmgr_t *lm) {
-    if (!lm) return;
-    for (size_t i = 0; i < lm->nbuckets; i++) {
-        lock_entry_t *e = lm->buckets[i];
-        while (e) {
-            lock_entry_t *n = e->next;
-            pthread_rwlock_destroy(&e->rw);
-            free(e->key);
-            free(e);
-            e = n;
-        }
-    }
-    free(lm->buckets);
-    pthread_mutex_destroy(&lm->mu);
-    free(lm);
-}
-
-void lockmgr_user_lock(lockmgr_t *lm, const char *username, int write) {
-    char *k = make_user_key(username);
-    pthread_mutex_lock(&lm->mu);
-    lock_entry_t *e = get_or_create(lm, k);
-    pthread_mutex_unlock(&lm->mu);
-    free(k);
-    if (!e) return;
-    if (write) pthread_rwlock_wrlock(&e->rw); else pthread_rwlock_rdlock(&e->rw);
-}
-
-void lockmgr_user_unlock(lockmgr_t *lm, const char *username, int write) {
-    (void)write;
-    char *k = make_user_key(username);
-    pthread_mutex_lock(&lm->mu);
-    unsigned long h = hash_str(k);
-    size_t idx = h % lm->nbuckets;
-    lock_entry_t *e = lm->buckets[idx];
-    while (e && strcmp(e->key, k) != 0) e = e->next;
-    pthread_mutex_unlock(&lm->mu);
-    if (e) pthread_rwlock_unlock(&e->rw);
-    pthread_mutex_lock(&lm->mu);
-    release(lm, k);
-    pthread_mutex_unlock(&lm->mu);
-    free(k);
-}
-
-void lockmgr_file_lock(lockmgr_t *lm, const char *username, const char *filename, int write) {
-    char *k = make_file_key(username, filename);
-    pthread_mutex_lock(&lm->mu);
-    lock_entry_t *e = get_or_create(lm, k);
-    pthread_mutex_unlock(&lm->mu);
-    free(k);
-    if (!e) return;
-    if (write) pthread_rwlock_wrlock(&e->rw); else pthread_rwlock_rdlock(&e->rw);
-}
-
-void lockmgr_file_unlock(lockmgr_t *lm, const char *username, const char *filename, int write) {
-    (void)write;
-    char *k = make_file_key(username, filename);
-    pthread_mutex_lock(&lm->mu);
-    unsigned long h = hash_str(k);
-    size_t idx = h % lm->nbuckets;
-    lock_entry_t *e = lm->buckets[idx];
-    while (e && strcmp(e->key, k) != 0) e = e->next;
-    pthread_mutex_unlock(&lm->mu);
-    if (e) pthread_rwlock_unlock(&e->rw);
-    pthread_mutex_lock(&lm->mu);
-    release(lm, k);
-    pthread_mutex_unlock(&lm->mu);
-    free(k);
-}
-
-
+#include "lockmgr.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// The table is split into shards, each with its own mutex, chains and free
+// list, so lock traffic on different users or files rarely meets. Keys are
+// hashed and compared in place from the caller's strings; entries keep
+// their condvar and key buffer when released and go back on the shard's
+// free list, so the steady state allocates nothing. Waiting happens on the
+// entry's condvar under the shard's mutex.
+#define LOCK_SHARDS 64   // power of two
+#define SHARD_BUCKETS 64 // power of two
+#define KEY_MIN_CAP 64
+
+typedef struct lock_entry {
+    pthread_cond_t cv; // initialized once, kept across reuse
+    int held[4];       // holders per lock_mode_t
+    int waiting[4];
+    unsigned long hash;
+    char kind; // 'U' user, 'F' file
+    size_t ulen, flen;
+    char *key; // username then filename, unterminated; kept across reuse
+    size_t keycap;
+    int refcnt;
+    struct lock_entry *next; // bucket chain, or the free list
+} lock_entry_t;
+
+typedef struct {
+    pthread_mutex_t mu;
+    lock_entry_t *buckets[SHARD_BUCKETS];
+    lock_entry_t *free;
+} __attribute__((aligned(64))) lock_shard_t;
+
+struct lockmgr {
+    lock_shard_t shards[LOCK_SHARDS];
+};
+
+typedef struct {
+    char kind;
+    const char *user, *file;
+    size_t ulen, flen;
+    unsigned long hash;
+} lock_key_t;
+
+static unsigned long hash_bytes(unsigned long h, const char *s, size_t n) {
+    for (size_t i = 0; i < n; i++) { h ^= (unsigned char)s[i]; h *= 1099511628211ULL; }
+    return h;
+}
+
+static void key_make(lock_key_t *k, char kind, const char *user, const char *file) {
+    k->kind = kind;
+    k->user = user; k->ulen = strlen(user);
+    k->file = file ? file : ""; k->flen = strlen(k->file);
+    unsigned long h = 1469598103934665603ULL;
+    h = hash_bytes(h, &kind, 1);
+    h = hash_bytes(h, k->user, k->ulen);
+    h = hash_bytes(h, "", 1); // separator, so ("ab","c") and ("a","bc") differ
+    h = hash_bytes(h, k->file, k->flen);
+    k->hash = h;
+}
+
+static int key_match(const lock_entry_t *e, const lock_key_t *k) {
+    return e->hash == k->hash && e->kind == k->kind && e->ulen == k->ulen && e->flen == k->flen &&
+           memcmp(e->key, k->user, k->ulen) == 0 && memcmp(e->key + k->ulen, k->file, k->flen) == 0;
+}
+
+static lock_shard_t *shard_of(lockmgr_t *lm, const lock_key_t *k) {
+    return &lm->shards[k->hash & (LOCK_SHARDS - 1)];
+}
+
+static lock_entry_t **bucket_of(lock_shard_t *sh, const lock_key_t *k) {
+    return &sh->buckets[(k->hash / LOCK_SHARDS) & (SHARD_BUCKETS - 1)];
+}
+
+int lockmgr_init(lockmgr_t **out) {
+    lockmgr_t *lm = (lockmgr_t*)aligned_alloc(64, sizeof(*lm));
+    if (!lm) return -1;
+    memset(lm, 0, sizeof(*lm));
+    for (int i = 0; i < LOCK_SHARDS; i++) pthread_mutex_init(&lm->shards[i].mu, NULL);
+    *out = lm;
+    return 0;
+}
+
+// Under the shard's mutex: the entry for k with a reference taken, from the
+// chain, the free list or, failing both, the heap
+static lock_entry_t *get_or_create(lock_shard_t *sh, const lock_key_t *k) {
+    lock_entry_t **b = bucket_of(sh, k);
+    for (lock_entry_t *e = *b; e; e = e->next) {
+        if (key_match(e, k)) { e->refcnt++; return e; }
+    }
+    size_t need = k->ulen + k->flen;
+    lock_entry_t *e = sh->free;
+    if (e) {
+        if (e->keycap < need) {
+            char *key = (char*)realloc(e->key, need);
+            if (!key) return NULL;
+            e->key = key; e->keycap = need;
+        }
+        sh->free = e->next;
+    } else {
+        e = (lock_entry_t*)calloc(1, sizeof(*e));
+        if (!e) return NULL;
+        e->keycap = need > KEY_MIN_CAP ? need : KEY_MIN_CAP;
+        e->key = (char*)malloc(e->keycap);
+        if (!e->key) { free(e); return NULL; }
+        pthread_cond_init(&e->cv, NULL);
+    }
+    e->hash = k->hash;
+    e->kind = k->kind;
+    e->ulen = k->ulen; e->flen = k->flen;
+    memcpy(e->key, k->user, k->ulen);
+    memcpy(e->key + k->ulen, k->file, k->flen);
+    e->refcnt = 1;
+    e->next = *b;
+    *b = e;
+    return e;
+}
+
+static void free_chain(lock_entry_t *e) {
+    while (e) {
+        lock_entry_t *n = e->next;
+        pthread_cond_destroy(&e->cv);
+        free(e->key);
+        free(e);
+        e = n;
+    }
+}
+
+void lockmgr_destroy(lockmgr_t *lm) {
+    if (!lm) return;
+    for (int i = 0; i < LOCK_SHARDS; i++) {
+        lock_shard_t *sh = &lm->shards[i];
+        for (int b = 0; b < SHARD_BUCKETS; b++) free_chain(sh->buckets[b]);
+        free_chain(sh->free);
+        pthread_mutex_destroy(&sh->mu);
+    }
+    free(lm);
+}
+
+// Bit m of g_compat[n]: mode m may be held alongside mode n
+static const unsigned g_compat[4] = {
+    [LOCK_IS] = 1u << LOCK_IS | 1u << LOCK_IX | 1u << LOCK_S,
+    [LOCK_IX] = 1u << LOCK_IS | 1u << LOCK_IX,
+    [LOCK_S] = 1u << LOCK_IS | 1u << LOCK_S,
+    [LOCK_X] = 0,
+};
+
+static int conflicts(const int counts[4], lock_mode_t mode) {
+    for (int m = 0; m < 4; m++) {
+        if (counts[m] > 0 && !(g_compat[mode] & 1u << m)) return 1;
+    }
+    return 0;
+}
+
+static int lock_key(lockmgr_t *lm, const lock_key_t *k, lock_mode_t mode) {
+    lock_shard_t *sh = shard_of(lm, k);
+    pthread_mutex_lock(&sh->mu);
+    lock_entry_t *e = get_or_create(sh, k);
+    if (!e) {
+        pthread_mutex_unlock(&sh->mu);
+        return -1;
+    }
+    // Newcomers line up behind conflicting waiters; once waiting, only
+    // the holders count, or two waiters could block each other
+    if (conflicts(e->held, mode) || conflicts(e->waiting, mode)) {
+        e->waiting[mode]++;
+        do pthread_cond_wait(&e->cv, &sh->mu); while (conflicts(e->held, mode));
+        e->waiting[mode]--;
+    }
+    e->held[mode]++;
+    pthread_mutex_unlock(&sh->mu);
+    return 0;
+}
+
+static void unlock_key(lockmgr_t *lm, const lock_key_t *k, lock_mode_t mode) {
+    lock_shard_t *sh = shard_of(lm, k);
+    pthread_mutex_lock(&sh->mu);
+    lock_entry_t **pp = bucket_of(sh, k);
+    while (*pp && !key_match(*pp, k)) pp = &(*pp)->next;
+    lock_entry_t *e = *pp;
+    if (e) {
+        e->held[mode]--;
+        if (e->waiting[LOCK_IS] + e->waiting[LOCK_IX] + e->waiting[LOCK_S] + e->waiting[LOCK_X] > 0) {
+            pthread_cond_broadcast(&e->cv);
+        }
+        if (--e->refcnt == 0) {
+            *pp = e->next;
+            e->next = sh->free;
+            sh->free = e;
+        }
+    }
+    pthread_mutex_unlock(&sh->mu);
+}
+
+int lockmgr_user_lock(lockmgr_t *lm, const char *username, lock_mode_t mode) {
+    lock_key_t k;
+    key_make(&k, 'U', username, NULL);
+    return lock_key(lm, &k, mode);
+}
+
+void lockmgr_user_unlock(lockmgr_t *lm, const char *username, lock_mode_t mode) {
+    lock_key_t k;
+    key_make(&k, 'U', username, NULL);
+    unlock_key(lm, &k, mode);
+}
+
+int lockmgr_file_lock(lockmgr_t *lm, const char *username, const char *filename, lock_mode_t mode) {
+    lock_key_t k;
+    key_make(&k, 'F', username, filename);
+    return lock_key(lm, &k, mode);
+}
+
+void lockmgr_file_unlock(lockmgr_t *lm, const char *username, const char *filename, lock_mode_t mode) {
+    lock_key_t k;
+    key_make(&k, 'F', username, filename);
+    unlock_key(lm, &k, mode);
+}
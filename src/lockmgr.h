@@ -1,21 +1,39 @@
-#ifndef LOCKMGR_H
-#define LOCKMGR_H
-
-#include <pthread.h>
-
-typedef struct lockmgr lockmgr_t;
-
-int lockmgr_init(lockmgr_t **out);
-void lockmgr_destroy(lockmgr_t *lm);
-
-// Acquire per-user lock: write=1 for mutating ops; write=0 for readers like LIST
-void lockmgr_user_lock(lockmgr_t *lm, const char *username, int write);
-void lockmgr_user_unlock(lockmgr_t *lm, const char *username, int write);
-
-// Acquire per-file lock under a user: write=1 for upload/delete; read=0 for download
-void lockmgr_file_lock(lockmgr_t *lm, const char *username, const char *filename, int write);
-void lockmgr_file_unlock(lockmgr_t *lm, const char *username, const char *filename, int write);
-
-#endif
-
-
+#ifndef LOCKMGR_H
+#define LOCKMGR_H
+
+#include <pthread.h>
+
+typedef struct lockmgr lockmgr_t;
+
+int lockmgr_init(lockmgr_t **out);
+void lockmgr_destroy(lockmgr_t *lm);
+
+// Hierarchical lock modes: a user's account is the parent of its files.
+// IS/IX announce reading/writing some files below; S/X cover the whole
+// account (on a user) or one file.
+//
+//        IS  IX  S   X
+//   IS   +   +   +   -
+//   IX   +   +   -   -
+//   S    +   -   +   -
+//   X    -   -   -   -
+//
+// So uploads and deletes of different files of one user (IX on the user,
+// X on the file) run side by side, while S or X on the user waits for all
+// of them. A request also queues behind earlier waiters it conflicts
+// with, so a stream of IX cannot starve an S.
+typedef enum { LOCK_IS, LOCK_IX, LOCK_S, LOCK_X } lock_mode_t;
+
+// Per-user lock. The lock calls return 0 once the lock is held, or -1
+// without it if the table could not grow to track it (out of memory).
+int lockmgr_user_lock(lockmgr_t *lm, const char *username, lock_mode_t mode);
+void lockmgr_user_unlock(lockmgr_t *lm, const char *username, lock_mode_t mode);
+
+// Per-file lock under a user: S to read, X to write. Take IS or IX on the
+// user first.
+int lockmgr_file_lock(lockmgr_t *lm, const char *username, const char *filename, lock_mode_t mode);
+void lockmgr_file_unlock(lockmgr_t *lm, const char *username, const char *filename, lock_mode_t mode);
+
+#endif
+
+
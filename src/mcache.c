@@ -0,0 +1,427 @@
+#include "mcache.h"
+#include "stats.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Sharded by username hash like the lock manager: each shard has its own
+// mutex, chained table, LRU list (most recent first) and an equal share of
+// the memory budget, and evicts only its own entries.
+#define MC_SHARDS 16       // power of two
+#define MC_MIN_BUCKETS 64  // power of two; doubles as the shard fills
+
+typedef struct {
+    char *name;
+    long long size;
+} mc_file_t;
+
+typedef struct mc_entry {
+    unsigned long hash;
+    char *username;
+    int have_user, have_files;
+    long long user_id, quota, used;
+    char *pass_hash;
+    mc_file_t *files; // sorted by name (strcmp, as SQLite's BINARY collation)
+    int nfiles, capfiles;
+    size_t bytes; // charged to the shard
+    struct mc_entry *chain;
+    struct mc_entry *prev, *next; // LRU
+} mc_entry_t;
+
+typedef struct {
+    pthread_mutex_t mu;
+    mc_entry_t **buckets;
+    size_t nbuckets, count;
+    mc_entry_t *head, *tail;
+    size_t bytes, budget;
+    unsigned long gen; // bumped by every write-through
+} __attribute__((aligned(64))) mc_shard_t;
+
+struct mcache {
+    mc_shard_t shards[MC_SHARDS];
+};
+
+static unsigned long hash_str(const char *s) {
+    unsigned long h = 1469598103934665603ULL;
+    for (; *s; s++) { h ^= (unsigned char)*s; h *= 1099511628211ULL; }
+    return h;
+}
+
+static mc_shard_t *shard_of(mcache_t *mc, unsigned long hash) {
+    return &mc->shards[hash & (MC_SHARDS - 1)];
+}
+
+static mc_entry_t **bucket_of(mc_shard_t *sh, unsigned long hash) {
+    return &sh->buckets[(hash / MC_SHARDS) & (sh->nbuckets - 1)];
+}
+
+int mcache_init(mcache_t **out, size_t max_bytes) {
+    mcache_t *mc = (mcache_t*)aligned_alloc(64, sizeof(*mc));
+    if (!mc) return -1;
+    memset(mc, 0, sizeof(*mc));
+    for (int i = 0; i < MC_SHARDS; i++) {
+        mc_shard_t *sh = &mc->shards[i];
+        pthread_mutex_init(&sh->mu, NULL);
+        sh->nbuckets = MC_MIN_BUCKETS;
+        sh->buckets = (mc_entry_t**)calloc(sh->nbuckets, sizeof(mc_entry_t*));
+        sh->budget = max_bytes / MC_SHARDS;
+        if (!sh->buckets) { mcache_destroy(mc); return -1; }
+    }
+    *out = mc;
+    return 0;
+}
+
+static void charge(mc_shard_t *sh, mc_entry_t *e, long long delta) {
+    e->bytes = (size_t)((long long)e->bytes + delta);
+    sh->bytes = (size_t)((long long)sh->bytes + delta);
+    stats_add(STAT_MCACHE_BYTES, delta);
+}
+
+static void files_free(mc_shard_t *sh, mc_entry_t *e) {
+    long long freed = (long long)(sizeof(mc_file_t) * (size_t)e->capfiles);
+    for (int i = 0; i < e->nfiles; i++) {
+        freed += (long long)strlen(e->files[i].name) + 1;
+        free(e->files[i].name);
+    }
+    free(e->files);
+    e->files = NULL;
+    e->nfiles = e->capfiles = 0;
+    e->have_files = 0;
+    charge(sh, e, -freed);
+}
+
+static void lru_unlink(mc_shard_t *sh, mc_entry_t *e) {
+    if (e->prev) e->prev->next = e->next; else sh->head = e->next;
+    if (e->next) e->next->prev = e->prev; else sh->tail = e->prev;
+    e->prev = e->next = NULL;
+}
+
+static void lru_push(mc_shard_t *sh, mc_entry_t *e) {
+    e->next = sh->head;
+    if (sh->head) sh->head->prev = e; else sh->tail = e;
+    sh->head = e;
+}
+
+static void touch(mc_shard_t *sh, mc_entry_t *e) {
+    if (sh->head == e) return;
+    lru_unlink(sh, e);
+    lru_push(sh, e);
+}
+
+static void entry_drop(mc_shard_t *sh, mc_entry_t *e) {
+    for (mc_entry_t **pp = bucket_of(sh, e->hash); *pp; pp = &(*pp)->chain) {
+        if (*pp == e) { *pp = e->chain; break; }
+    }
+    lru_unlink(sh, e);
+    files_free(sh, e);
+    charge(sh, e, -(long long)e->bytes);
+    free(e->username);
+    free(e->pass_hash);
+    free(e);
+    sh->count--;
+}
+
+static void entry_destroy(mc_entry_t *e) {
+    for (int i = 0; i < e->nfiles; i++) free(e->files[i].name);
+    free(e->files);
+    free(e->username);
+    free(e->pass_hash);
+    free(e);
+}
+
+void mcache_destroy(mcache_t *mc) {
+    if (!mc) return;
+    for (int i = 0; i < MC_SHARDS; i++) {
+        mc_shard_t *sh = &mc->shards[i];
+        for (mc_entry_t *e = sh->head, *next; e; e = next) {
+            next = e->next;
+            entry_destroy(e);
+        }
+        stats_add(STAT_MCACHE_BYTES, -(long long)sh->bytes);
+        free(sh->buckets);
+        pthread_mutex_destroy(&sh->mu);
+    }
+    free(mc);
+}
+
+static mc_entry_t *find(mc_shard_t *sh, unsigned long hash, const char *username) {
+    for (mc_entry_t *e = *bucket_of(sh, hash); e; e = e->chain) {
+        if (e->hash == hash && strcmp(e->username, username) == 0) return e;
+    }
+    return NULL;
+}
+
+static void grow(mc_shard_t *sh) {
+    size_t n = sh->nbuckets * 2;
+    mc_entry_t **b = (mc_entry_t**)calloc(n, sizeof(mc_entry_t*));
+    if (!b) return; // chains just get longer
+    for (size_t i = 0; i < sh->nbuckets; i++) {
+        for (mc_entry_t *e = sh->buckets[i], *next; e; e = next) {
+            next = e->chain;
+            mc_entry_t **pp = &b[(e->hash / MC_SHARDS) & (n - 1)];
+            e->chain = *pp;
+            *pp = e;
+        }
+    }
+    free(sh->buckets);
+    sh->buckets = b;
+    sh->nbuckets = n;
+}
+
+static mc_entry_t *find_or_add(mc_shard_t *sh, unsigned long hash, const char *username) {
+    mc_entry_t *e = find(sh, hash, username);
+    if (e) { touch(sh, e); return e; }
+    e = (mc_entry_t*)calloc(1, sizeof(*e));
+    if (!e) return NULL;
+    e->username = strdup(username);
+    if (!e->username) { free(e); return NULL; }
+    e->hash = hash;
+    if (sh->count >= sh->nbuckets) grow(sh);
+    mc_entry_t **pp = bucket_of(sh, hash);
+    e->chain = *pp;
+    *pp = e;
+    lru_push(sh, e);
+    sh->count++;
+    charge(sh, e, (long long)(sizeof(*e) + strlen(username) + 1));
+    return e;
+}
+
+// Cold accounts go until the shard fits its budget again; keep (just
+// filled) is spared, and if it alone is too big its file list goes instead
+static void evict(mc_shard_t *sh, mc_entry_t *keep) {
+    while (sh->bytes > sh->budget) {
+        mc_entry_t *victim = sh->tail;
+        if (victim == keep) victim = keep->prev;
+        if (!victim) {
+            if (keep && keep->have_files) files_free(sh, keep);
+            break;
+        }
+        entry_drop(sh, victim);
+        stats_add(STAT_MCACHE_EVICTIONS, 1);
+    }
+}
+
+unsigned long mcache_gen(mcache_t *mc, const char *username) {
+    mc_shard_t *sh = shard_of(mc, hash_str(username));
+    pthread_mutex_lock(&sh->mu);
+    unsigned long gen = sh->gen;
+    pthread_mutex_unlock(&sh->mu);
+    return gen;
+}
+
+int mcache_get_user(mcache_t *mc, const char *username, long long *out_user_id, char **out_pass_hash,
+                    long long *out_quota, long long *out_used) {
+    unsigned long hash = hash_str(username);
+    mc_shard_t *sh = shard_of(mc, hash);
+    int rc = -1;
+    pthread_mutex_lock(&sh->mu);
+    mc_entry_t *e = find(sh, hash, username);
+    if (e && e->have_user) {
+        if (out_user_id) *out_user_id = e->user_id;
+        if (out_pass_hash) *out_pass_hash = e->pass_hash ? strdup(e->pass_hash) : NULL;
+        if (out_quota) *out_quota = e->quota;
+        if (out_used) *out_used = e->used;
+        touch(sh, e);
+        rc = 0;
+    }
+    pthread_mutex_unlock(&sh->mu);
+    stats_add(rc == 0 ? STAT_MCACHE_HITS : STAT_MCACHE_MISSES, 1);
+    return rc;
+}
+
+void mcache_put_user(mcache_t *mc, unsigned long gen, const char *username, long long user_id,
+                     const char *pass_hash, long long quota, long long used) {
+    unsigned long hash = hash_str(username);
+    mc_shard_t *sh = shard_of(mc, hash);
+    pthread_mutex_lock(&sh->mu);
+    mc_entry_t *e = gen == sh->gen ? find_or_add(sh, hash, username) : NULL;
+    if (e) {
+        long long old = e->pass_hash ? (long long)strlen(e->pass_hash) + 1 : 0;
+        char *ph = pass_hash ? strdup(pass_hash) : NULL;
+        free(e->pass_hash);
+        e->pass_hash = ph;
+        charge(sh, e, (ph ? (long long)strlen(ph) + 1 : 0) - old);
+        e->user_id = user_id;
+        e->quota = quota;
+        e->used = used;
+        e->have_user = 1;
+        evict(sh, e);
+    }
+    pthread_mutex_unlock(&sh->mu);
+}
+
+// First index whose name sorts after `after`
+static int upper_bound(const mc_entry_t *e, const char *after) {
+    int lo = 0, hi = e->nfiles;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (strcmp(e->files[mid].name, after) <= 0) lo = mid + 1; else hi = mid;
+    }
+    return lo;
+}
+
+// Index of name, or -(insertion point) - 1
+static int find_file(const mc_entry_t *e, const char *name) {
+    int lo = 0, hi = e->nfiles;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        int c = strcmp(e->files[mid].name, name);
+        if (c == 0) return mid;
+        if (c < 0) lo = mid + 1; else hi = mid;
+    }
+    return -lo - 1;
+}
+
+// A page of e's names in db_list_files() form; -1 if out of memory
+static int list_page(const mc_entry_t *e, const char *after, int limit,
+                     char **out_buf, size_t *out_len, int *out_count, int *out_more) {
+    int first = upper_bound(e, after ? after : ""), last = e->nfiles, more = 0;
+    if (limit > 0 && last - first > limit) { last = first + limit; more = 1; }
+    size_t len = 0;
+    for (int i = first; i < last; i++) len += strlen(e->files[i].name) + 1;
+    char *buf = (char*)malloc(len ? len : 1);
+    if (!buf) return -1;
+    size_t off = 0;
+    for (int i = first; i < last; i++) {
+        size_t k = strlen(e->files[i].name);
+        memcpy(buf + off, e->files[i].name, k);
+        off += k;
+        buf[off++] = '\n';
+    }
+    *out_buf = buf;
+    *out_len = len;
+    *out_count = last - first;
+    *out_more = more;
+    return 0;
+}
+
+int mcache_list(mcache_t *mc, const char *username, const char *after, int limit,
+                char **out_buf, size_t *out_len, int *out_count, int *out_more) {
+    *out_buf = NULL; *out_len = 0; *out_count = 0; *out_more = 0;
+    unsigned long hash = hash_str(username);
+    mc_shard_t *sh = shard_of(mc, hash);
+    int rc = -1;
+    pthread_mutex_lock(&sh->mu);
+    mc_entry_t *e = find(sh, hash, username);
+    if (e && e->have_files && list_page(e, after, limit, out_buf, out_len, out_count, out_more) == 0) {
+        touch(sh, e);
+        rc = 0;
+    }
+    pthread_mutex_unlock(&sh->mu);
+    stats_add(rc == 0 ? STAT_MCACHE_HITS : STAT_MCACHE_MISSES, 1);
+    return rc;
+}
+
+int mcache_fill_list(mcache_t *mc, unsigned long gen, const char *username, const db_file_t *files, int count,
+                     const char *after, int limit, char **out_buf, size_t *out_len, int *out_count, int *out_more) {
+    *out_buf = NULL; *out_len = 0; *out_count = 0; *out_more = 0;
+    unsigned long hash = hash_str(username);
+    mc_shard_t *sh = shard_of(mc, hash);
+    long long need = (long long)(sizeof(mc_file_t) * (size_t)count);
+    for (int i = 0; i < count; i++) need += (long long)strlen(files[i].name) + 1;
+    if ((size_t)need > sh->budget) return -1; // would only evict everyone else
+    mc_file_t *copy = (mc_file_t*)malloc(sizeof(mc_file_t) * (size_t)(count ? count : 1));
+    if (!copy) return -1;
+    int n = 0;
+    for (; n < count; n++) {
+        copy[n].name = strdup(files[n].name);
+        if (!copy[n].name) break;
+        copy[n].size = files[n].size;
+    }
+    int rc = -1;
+    pthread_mutex_lock(&sh->mu);
+    mc_entry_t *e = n == count && gen == sh->gen ? find_or_add(sh, hash, username) : NULL;
+    if (e) {
+        files_free(sh, e);
+        e->files = copy;
+        e->nfiles = e->capfiles = count;
+        e->have_files = 1;
+        charge(sh, e, need);
+        copy = NULL;
+        rc = list_page(e, after, limit, out_buf, out_len, out_count, out_more);
+        evict(sh, e);
+    }
+    pthread_mutex_unlock(&sh->mu);
+    if (copy) {
+        for (int i = 0; i < n; i++) free(copy[i].name);
+        free(copy);
+    }
+    return rc;
+}
+
+int mcache_file_size(mcache_t *mc, const char *username, const char *name, long long *out_size) {
+    unsigned long hash = hash_str(username);
+    mc_shard_t *sh = shard_of(mc, hash);
+    int rc = -1;
+    pthread_mutex_lock(&sh->mu);
+    mc_entry_t *e = find(sh, hash, username);
+    if (e && e->have_files) {
+        int i = find_file(e, name);
+        *out_size = i >= 0 ? e->files[i].size : 0;
+        touch(sh, e);
+        rc = 0;
+    }
+    pthread_mutex_unlock(&sh->mu);
+    stats_add(rc == 0 ? STAT_MCACHE_HITS : STAT_MCACHE_MISSES, 1);
+    return rc;
+}
+
+void mcache_file_set(mcache_t *mc, const char *username, const char *name, long long size) {
+    unsigned long hash = hash_str(username);
+    mc_shard_t *sh = shard_of(mc, hash);
+    pthread_mutex_lock(&sh->mu);
+    sh->gen++;
+    mc_entry_t *e = find(sh, hash, username);
+    if (e) e->have_user = 0;
+    if (e && e->have_files) {
+        int i = find_file(e, name);
+        if (i >= 0) {
+            e->files[i].size = size;
+        } else {
+            i = -i - 1;
+            char *copy = strdup(name);
+            if (e->nfiles == e->capfiles) {
+                int cap = e->capfiles ? e->capfiles * 2 : 8;
+                mc_file_t *grown = copy ? (mc_file_t*)realloc(e->files, sizeof(mc_file_t) * (size_t)cap) : NULL;
+                if (grown) {
+                    charge(sh, e, (long long)(sizeof(mc_file_t) * (size_t)(cap - e->capfiles)));
+                    e->files = grown;
+                    e->capfiles = cap;
+                }
+            }
+            if (copy && e->nfiles < e->capfiles) {
+                memmove(&e->files[i + 1], &e->files[i], sizeof(mc_file_t) * (size_t)(e->nfiles - i));
+                e->files[i].name = copy;
+                e->files[i].size = size;
+                e->nfiles++;
+                charge(sh, e, (long long)strlen(copy) + 1);
+            } else {
+                // Out of memory: the list is no longer whole, so stop serving it
+                free(copy);
+                files_free(sh, e);
+            }
+        }
+        evict(sh, e);
+    }
+    pthread_mutex_unlock(&sh->mu);
+}
+
+void mcache_file_remove(mcache_t *mc, const char *username, const char *name) {
+    unsigned long hash = hash_str(username);
+    mc_shard_t *sh = shard_of(mc, hash);
+    pthread_mutex_lock(&sh->mu);
+    sh->gen++;
+    mc_entry_t *e = find(sh, hash, username);
+    if (e) e->have_user = 0;
+    if (e && e->have_files) {
+        int i = find_file(e, name);
+        if (i >= 0) {
+            charge(sh, e, -((long long)strlen(e->files[i].name) + 1));
+            free(e->files[i].name);
+            memmove(&e->files[i], &e->files[i + 1], sizeof(mc_file_t) * (size_t)(e->nfiles - i - 1));
+            e->nfiles--;
+        }
+    }
+    pthread_mutex_unlock(&sh->mu);
+}
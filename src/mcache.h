@@ -0,0 +1,54 @@
+#ifndef MCACHE_H
+#define MCACHE_H
+
+#include <stddef.h>
+
+#include "db.h"
+
+// In-memory copy of hot accounts' metadata, keyed by username: the users
+// row (id, password hash, quota, used_bytes) for LOGIN and quota checks,
+// and the sorted name index with sizes for LIST. Entries fill on a miss,
+// from what the caller read from SQLite, and are updated write-through
+// after each committed upload or delete. Memory is bounded; past it the
+// least recently used accounts are dropped whole.
+//
+// A fill races with writes committed between the caller's read and the
+// fill; every write-through bumps a generation, and a fill made from a
+// read that began before the last bump is discarded (the caller answers
+// from what it read, uncached). Take mcache_gen() before the read.
+typedef struct mcache mcache_t;
+
+// max_bytes of entries in total (names, hashes, bookkeeping)
+int mcache_init(mcache_t **out, size_t max_bytes);
+void mcache_destroy(mcache_t *mc);
+
+unsigned long mcache_gen(mcache_t *mc, const char *username);
+
+// 0 and the account as db_get_user() returns it on a hit; -1 on a miss
+int mcache_get_user(mcache_t *mc, const char *username, long long *out_user_id, char **out_pass_hash,
+                    long long *out_quota, long long *out_used);
+void mcache_put_user(mcache_t *mc, unsigned long gen, const char *username, long long user_id,
+                     const char *pass_hash, long long quota, long long used);
+
+// 0 and a page as db_list_files() returns it on a hit; -1 on a miss
+int mcache_list(mcache_t *mc, const char *username, const char *after, int limit,
+                char **out_buf, size_t *out_len, int *out_count, int *out_more);
+// After a miss: caches the user's whole file list, in name order
+// (db_list_all_files()), and returns the page from it as mcache_list()
+// would. -1 if the fill was discarded or the list is too big to cache.
+int mcache_fill_list(mcache_t *mc, unsigned long gen, const char *username, const db_file_t *files, int count,
+                     const char *after, int limit, char **out_buf, size_t *out_len, int *out_count, int *out_more);
+
+// Size of name (0 if the user has no such file) when the user's file list
+// is cached; -1 otherwise
+int mcache_file_size(mcache_t *mc, const char *username, const char *name, long long *out_size);
+
+// Write-through, after the change committed: name now has size (or is
+// gone). The cached users row is dropped rather than moved by the change:
+// a LOGIN fill that read the row after the commit but got in before this
+// call would otherwise count the change twice, so the next LOGIN reads
+// used_bytes afresh.
+void mcache_file_set(mcache_t *mc, const char *username, const char *name, long long size);
+void mcache_file_remove(mcache_t *mc, const char *username, const char *name);
+
+#endif
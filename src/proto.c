@@ -0,0 +1,353 @@
+#include "proto.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <limits.h>
+
+size_t proto_put_varint(char *p, uint64_t v) {
+    size_t n = 0;
+    while (v >= 0x80) { p[n++] = (char)(v | 0x80); v >>= 7; }
+    p[n++] = (char)v;
+    return n;
+}
+
+int proto_get_varint(const char *p, size_t n, uint64_t *v) {
+    uint64_t r = 0;
+    for (size_t i = 0; i < PROTO_VARINT_MAX; i++) {
+        if (i == n) return 0;
+        uint8_t b = (uint8_t)p[i];
+        r |= (uint64_t)(b & 0x7f) << (7 * i);
+        if (!(b & 0x80)) { *v = r; return (int)i + 1; }
+    }
+    return -1;
+}
+
+size_t proto_put_str(char *p, const char *s, size_t len) {
+    size_t n = proto_put_varint(p, len);
+    memcpy(p + n, s, len);
+    return n + len;
+}
+
+size_t proto_put_header(char *p, proto_op_t op, uint64_t id, uint64_t payload_len) {
+    p[0] = (char)PROTO_MAGIC;
+    p[1] = (char)op;
+    size_t n = 2;
+    n += proto_put_varint(p + n, id);
+    n += proto_put_varint(p + n, payload_len);
+    return n;
+}
+
+int proto_valid_name(const char *name) {
+    if (name[0] == '\0' || strcmp(name, ".") == 0 || strcmp(name, "..") == 0) return 0;
+    for (const unsigned char *p = (const unsigned char*)name; *p; p++) {
+        if (*p == '/' || *p < 0x20 || *p == 0x7f) return 0;
+    }
+    return 1;
+}
+
+void proto_cursor_encode(const char *name, char *out) {
+    static const char hex[] = "0123456789abcdef";
+    if (!name[0]) { strcpy(out, "-"); return; }
+    for (; *name; name++) {
+        *out++ = hex[(unsigned char)*name >> 4];
+        *out++ = hex[(unsigned char)*name & 0xf];
+    }
+    *out = '\0';
+}
+
+int proto_cursor_decode(const char *in, char *out, size_t cap) {
+    if (strcmp(in, "-") == 0) { out[0] = '\0'; return 0; }
+    size_t n = strlen(in);
+    if (n == 0 || n % 2 || n / 2 >= cap) return -1;
+    for (size_t i = 0; i < n / 2; i++) {
+        unsigned v;
+        if (sscanf(in + 2 * i, "%2x", &v) != 1 || v == 0) return -1;
+        out[i] = (char)v;
+    }
+    out[n / 2] = '\0';
+    return 0;
+}
+
+int proto_parse_line(const char *line, request_t *req) {
+    memset(req, 0, sizeof(*req));
+    req->tag = -1;
+    if (line[0] == '#') {
+        // "#<tag> CMD ...": pipelined; the reply carries the tag back
+        char *end = NULL;
+        long long tag = strtoll(line + 1, &end, 10);
+        if (end == line + 1 || tag < 0 || *end != ' ') return -1;
+        req->tag = tag;
+        line = end + 1;
+    }
+    char cmd[32];
+    if (sscanf(line, "%31s", cmd) != 1) return -1;
+    if (strcmp(cmd, "STATS") == 0) {
+        req->op = OP_STATS;
+    } else if (strcmp(cmd, "LIST") == 0) {
+        req->op = OP_LIST;
+        char cursor[2 * PROTO_NAME_MAX + 2];
+        int k = sscanf(line, "LIST %511s %lld", cursor, &req->size);
+        if (k == 2) {
+            if (req->size < 1 || proto_cursor_decode(cursor, req->name, sizeof(req->name)) != 0) return -1;
+        } else if (k != EOF && k != 0) {
+            return -1;
+        } else {
+            req->size = 0;
+        }
+    } else if (strcmp(cmd, "SIGNUP") == 0 || strcmp(cmd, "LOGIN") == 0) {
+        req->op = (cmd[0] == 'S') ? OP_SIGNUP : OP_LOGIN;
+        if (sscanf(line, "%*s %127s %127s", req->name, req->pass) != 2) return -1;
+    } else if (strcmp(cmd, "UPLOAD") == 0) {
+        char codec[16];
+        req->op = OP_UPLOAD;
+        int k = sscanf(line, "UPLOAD %255s %lld COMPRESSED %15s", req->name, &req->size, codec);
+        if (k < 2 || req->size < 0) return -1;
+        if (k == 3) req->codec = codec_parse(codec);
+    } else if (strcmp(cmd, "DOWNLOAD") == 0 || strcmp(cmd, "DELETE") == 0) {
+        char codec[16];
+        req->op = (cmd[1] == 'O') ? OP_DOWNLOAD : OP_DELETE;
+        int k = sscanf(line, "%*s %255s COMPRESSED %15s", req->name, codec);
+        if (k < 1) return -1;
+        if (k == 2) req->codec = codec_parse(codec);
+    } else if (strcmp(cmd, "UPLOAD_BEGIN") == 0) {
+        char mode[16];
+        req->op = OP_UPLOAD_BEGIN;
+        int k = sscanf(line, "%*s %255s %lld %15s", req->name, &req->size, mode);
+        if (k < 2 || req->size < 0) return -1;
+        if (k == 3) {
+            if (strcmp(mode, "STRIPED") != 0) return -1;
+            req->striped = 1;
+        }
+    } else if (strcmp(cmd, "UPLOAD_APPEND") == 0 || strcmp(cmd, "UPLOAD_PART") == 0) {
+        req->op = (cmd[7] == 'A') ? OP_UPLOAD_APPEND : OP_UPLOAD_PART;
+        if (sscanf(line, "%*s %lld %lld %lld", &req->token, &req->offset, &req->size) != 3 ||
+            req->token < 0 || req->offset < 0 || req->size < 0) return -1;
+    } else if (strcmp(cmd, "UPLOAD_COMMIT") == 0 || strcmp(cmd, "UPLOAD_STATUS") == 0) {
+        req->op = (cmd[7] == 'C') ? OP_UPLOAD_COMMIT : OP_UPLOAD_STATUS;
+        if (sscanf(line, "%*s %lld", &req->token) != 1 || req->token < 0) return -1;
+    } else if (strcmp(cmd, "HELLO") == 0) {
+        req->op = OP_HELLO;
+        if (sscanf(line, "HELLO v%lld", &req->size) != 1) return -1;
+    }
+    return 0;
+}
+
+typedef struct { const char *p; size_t n; } cursor_t;
+
+static int take_varint(cursor_t *c, uint64_t *v) {
+    int k = proto_get_varint(c->p, c->n, v);
+    if (k <= 0) return -1;
+    c->p += k; c->n -= (size_t)k;
+    return 0;
+}
+
+static int take_str(cursor_t *c, char *out, size_t cap) {
+    uint64_t len;
+    if (take_varint(c, &len) != 0 || len >= cap || len > c->n) return -1;
+    if (memchr(c->p, '\0', (size_t)len)) return -1;
+    memcpy(out, c->p, (size_t)len);
+    out[len] = '\0';
+    c->p += len; c->n -= (size_t)len;
+    return 0;
+}
+
+static int take_ll(cursor_t *c, long long *out) {
+    uint64_t v;
+    if (take_varint(c, &v) != 0 || v > LLONG_MAX) return -1;
+    *out = (long long)v;
+    return 0;
+}
+
+// Optional trailing codec field
+static int take_codec(cursor_t *c, request_t *req) {
+    uint64_t v;
+    if (c->n == 0) return 0;
+    if (take_varint(c, &v) != 0) return -1;
+    req->codec = (v == CODEC_NONE || v == CODEC_LZ4) ? (codec_t)v : CODEC_UNKNOWN;
+    return 0;
+}
+
+int proto_decode_request(const char *buf, size_t n, request_t *req) {
+    if (n == 0) return 0;
+    if ((uint8_t)buf[0] != PROTO_MAGIC) return -1;
+    if (n < 2) return 0;
+    size_t pos = 2;
+    uint64_t id, len;
+    int k = proto_get_varint(buf + pos, n - pos, &id);
+    if (k <= 0) return k;
+    pos += (size_t)k;
+    k = proto_get_varint(buf + pos, n - pos, &len);
+    if (k <= 0) return k;
+    pos += (size_t)k;
+    if (id > LLONG_MAX || len > PROTO_MAX_REQUEST - pos) return -1;
+    if (n - pos < len) return 0;
+
+    memset(req, 0, sizeof(*req));
+    req->tag = (long long)id;
+    cursor_t c = { buf + pos, (size_t)len };
+    uint64_t size = 0;
+    int bad = 0;
+    switch ((uint8_t)buf[1]) {
+    case OP_SIGNUP:
+    case OP_LOGIN:
+        bad = take_str(&c, req->name, 128) || take_str(&c, req->pass, sizeof(req->pass));
+        break;
+    case OP_UPLOAD:
+        bad = take_str(&c, req->name, sizeof(req->name)) || take_varint(&c, &size) || size > LLONG_MAX ||
+              take_codec(&c, req);
+        req->size = (long long)size;
+        break;
+    case OP_DOWNLOAD:
+        bad = take_str(&c, req->name, sizeof(req->name)) || take_codec(&c, req);
+        break;
+    case OP_DELETE:
+        bad = take_str(&c, req->name, sizeof(req->name));
+        break;
+    case OP_LIST:
+        if (c.n == 0) break;
+        bad = take_str(&c, req->name, sizeof(req->name)) || take_varint(&c, &size) || size < 1 || size > LLONG_MAX;
+        req->size = (long long)size;
+        break;
+    case OP_STATS:
+        break;
+    case OP_UPLOAD_BEGIN: {
+        uint64_t flags = 0;
+        bad = take_str(&c, req->name, sizeof(req->name)) || take_varint(&c, &size) || size > LLONG_MAX ||
+              (c.n > 0 && (take_varint(&c, &flags) || flags > 1));
+        req->size = (long long)size;
+        req->striped = (int)flags;
+        break;
+    }
+    case OP_UPLOAD_APPEND:
+    case OP_UPLOAD_PART:
+        bad = take_ll(&c, &req->token) || take_ll(&c, &req->offset) || take_ll(&c, &req->size);
+        break;
+    case OP_UPLOAD_COMMIT:
+    case OP_UPLOAD_STATUS:
+        bad = take_ll(&c, &req->token);
+        break;
+    default:
+        // Length is known, so an unknown opcode skips cleanly and gets ERR UNKNOWN
+        return (int)(pos + len);
+    }
+    if (bad || c.n != 0) return -1;
+    req->op = (proto_op_t)(uint8_t)buf[1];
+    return (int)(pos + len);
+}
+
+static const char *op_word(proto_op_t op) {
+    switch (op) {
+    case OP_SIGNUP: return "SIGNUP";
+    case OP_LOGIN: return "LOGIN";
+    case OP_UPLOAD: return "UPLOAD";
+    case OP_DOWNLOAD: return "DOWNLOAD";
+    case OP_DELETE: return "DELETE";
+    case OP_LIST: return "LIST";
+    case OP_STATS: return "STATS";
+    case OP_HELLO: return "HELLO";
+    case OP_UPLOAD_BEGIN: return "UPLOAD_BEGIN";
+    case OP_UPLOAD_APPEND: return "UPLOAD_APPEND";
+    case OP_UPLOAD_COMMIT: return "UPLOAD_COMMIT";
+    case OP_UPLOAD_STATUS: return "UPLOAD_STATUS";
+    case OP_UPLOAD_PART: return "UPLOAD_PART";
+    default: return NULL;
+    }
+}
+
+int proto_format_line(char *buf, size_t cap, const request_t *req) {
+    const char *word = op_word(req->op);
+    if (!word) return -1;
+    int n = 0;
+    if (req->tag >= 0) n = snprintf(buf, cap, "#%lld ", req->tag);
+    if (n < 0 || (size_t)n >= cap) return -1;
+    int m;
+    switch (req->op) {
+    case OP_SIGNUP:
+    case OP_LOGIN: m = snprintf(buf + n, cap - (size_t)n, "%s %s %s\n", word, req->name, req->pass); break;
+    case OP_UPLOAD:
+        m = req->codec ? snprintf(buf + n, cap - (size_t)n, "%s %s %lld COMPRESSED %s\n", word, req->name, req->size, codec_name(req->codec))
+                       : snprintf(buf + n, cap - (size_t)n, "%s %s %lld\n", word, req->name, req->size);
+        break;
+    case OP_DOWNLOAD:
+        m = req->codec ? snprintf(buf + n, cap - (size_t)n, "%s %s COMPRESSED %s\n", word, req->name, codec_name(req->codec))
+                       : snprintf(buf + n, cap - (size_t)n, "%s %s\n", word, req->name);
+        break;
+    case OP_DELETE: m = snprintf(buf + n, cap - (size_t)n, "%s %s\n", word, req->name); break;
+    case OP_HELLO: m = snprintf(buf + n, cap - (size_t)n, "%s v%lld\n", word, req->size); break;
+    case OP_UPLOAD_BEGIN:
+        m = snprintf(buf + n, cap - (size_t)n, "%s %s %lld%s\n", word, req->name, req->size, req->striped ? " STRIPED" : "");
+        break;
+    case OP_UPLOAD_APPEND:
+    case OP_UPLOAD_PART:
+        m = snprintf(buf + n, cap - (size_t)n, "%s %lld %lld %lld\n", word, req->token, req->offset, req->size);
+        break;
+    case OP_UPLOAD_COMMIT:
+    case OP_UPLOAD_STATUS: m = snprintf(buf + n, cap - (size_t)n, "%s %lld\n", word, req->token); break;
+    case OP_LIST:
+        if (req->size > 0) {
+            char cursor[2 * PROTO_NAME_MAX + 2];
+            proto_cursor_encode(req->name, cursor);
+            m = snprintf(buf + n, cap - (size_t)n, "%s %s %lld\n", word, cursor, req->size);
+        } else {
+            m = snprintf(buf + n, cap - (size_t)n, "%s\n", word);
+        }
+        break;
+    default: m = snprintf(buf + n, cap - (size_t)n, "%s\n", word); break;
+    }
+    if (m < 0 || (size_t)m >= cap - (size_t)n) return -1;
+    return n + m;
+}
+
+int proto_encode_request(char *buf, size_t cap, const request_t *req) {
+    char payload[PROTO_MAX_REQUEST];
+    size_t n = 0;
+    size_t name_len = strlen(req->name), pass_len = strlen(req->pass);
+    switch (req->op) {
+    case OP_SIGNUP:
+    case OP_LOGIN:
+        n += proto_put_str(payload, req->name, name_len);
+        n += proto_put_str(payload + n, req->pass, pass_len);
+        break;
+    case OP_UPLOAD:
+        n += proto_put_str(payload, req->name, name_len);
+        n += proto_put_varint(payload + n, (uint64_t)req->size);
+        if (req->codec > 0) n += proto_put_varint(payload + n, (uint64_t)req->codec);
+        break;
+    case OP_DOWNLOAD:
+        n += proto_put_str(payload, req->name, name_len);
+        if (req->codec > 0) n += proto_put_varint(payload + n, (uint64_t)req->codec);
+        break;
+    case OP_DELETE:
+        n += proto_put_str(payload, req->name, name_len);
+        break;
+    case OP_LIST:
+        if (req->size <= 0) break;
+        n += proto_put_str(payload, req->name, name_len);
+        n += proto_put_varint(payload + n, (uint64_t)req->size);
+        break;
+    case OP_STATS:
+        break;
+    case OP_UPLOAD_BEGIN:
+        n += proto_put_str(payload, req->name, name_len);
+        n += proto_put_varint(payload + n, (uint64_t)req->size);
+        if (req->striped) n += proto_put_varint(payload + n, 1);
+        break;
+    case OP_UPLOAD_APPEND:
+    case OP_UPLOAD_PART:
+        n += proto_put_varint(payload, (uint64_t)req->token);
+        n += proto_put_varint(payload + n, (uint64_t)req->offset);
+        n += proto_put_varint(payload + n, (uint64_t)req->size);
+        break;
+    case OP_UPLOAD_COMMIT:
+    case OP_UPLOAD_STATUS:
+        n += proto_put_varint(payload, (uint64_t)req->token);
+        break;
+    default:
+        return -1;
+    }
+    if (PROTO_HEADER_MAX + n > cap) return -1;
+    size_t h = proto_put_header(buf, req->op, (uint64_t)req->tag, n);
+    memcpy(buf + h, payload, n);
+    return (int)(h + n);
+}
@@ -0,0 +1,119 @@
+#ifndef PROTO_H
+#define PROTO_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "compress.h"
+
+// Wire protocol v2: length-prefixed binary frames, negotiated per
+// connection. The client sends the text line "HELLO v2"; a server that
+// answers "OK v2" speaks frames from then on, anything else means stay on
+// text. Every frame is
+//
+//   u8 PROTO_MAGIC | u8 opcode | varint request id | varint payload length | payload
+//
+// Integers are unsigned LEB128 varints and strings are a varint length
+// followed by the bytes, so names may contain spaces. Replies echo the
+// request id and may arrive out of order, like tagged text commands; an
+// ERR with id 0 is about the connection (a malformed frame) and ends it.
+//
+//   SIGNUP, LOGIN   str user, str pass
+//   UPLOAD          str name, varint size [, varint codec]; then the body, unframed
+//   DOWNLOAD        str name [, varint codec]
+//   DELETE          str name
+//   LIST            (empty) | str cursor, varint limit (one page)
+//   STATS           (empty)
+//   UPLOAD_BEGIN    str name, varint size [, varint flags (1: striped)]
+//   UPLOAD_APPEND   varint token, varint offset, varint len; then len raw bytes
+//   UPLOAD_COMMIT   varint token
+//   UPLOAD_STATUS   varint token
+//   UPLOAD_PART     varint token, varint offset, varint len; then len raw bytes
+//
+//   OK              (empty) | varint size [, varint codec] (DOWNLOAD; body follows)
+//                           | varint token (UPLOAD_BEGIN)
+//                           | varint staged bytes (UPLOAD_APPEND, UPLOAD_STATUS, UPLOAD_PART)
+//                           | varint n, n x str (LIST names, STATS lines)
+//                             [, str cursor (paged LIST; empty on the last page)]
+//   ERR             str code
+//
+// LIST pages are keyset-based: the cursor is the last name of the previous
+// page (empty for the first). In text it travels hex-encoded, "-" when
+// empty: "LIST <cursor> <limit>" -> "OK <n> [<next cursor>]".
+//
+// Bodies are raw bytes, or compress.h frames when a codec was asked for:
+// "UPLOAD <name> <size> COMPRESSED lz4", "DOWNLOAD <name> COMPRESSED lz4"
+// -> "OK <size> COMPRESSED lz4". Sizes are always the uncompressed length.
+// Servers list the codecs they take in the HELLO reply ("OK v2 lz4").
+//
+// Resumable uploads ("resume" in the HELLO reply) stage a file across any
+// number of connections: UPLOAD_BEGIN opens a session and returns its token,
+// UPLOAD_APPEND writes a byte range at an offset no later than what is
+// staged (dropping anything past it), UPLOAD_STATUS says how much is staged
+// after a reconnect, and UPLOAD_COMMIT stores the file once all of it is.
+// In text the token is a decimal number: "UPLOAD_APPEND <token> <offset>
+// <len>" and so on.
+//
+// Striped sessions ("stripe" in the HELLO reply; "UPLOAD_BEGIN <name>
+// <size> STRIPED" in text) take their bytes as UPLOAD_PARTs instead, which
+// may arrive in any order and over any number of connections at once, each
+// writing its own range of the staged file. Staged bytes then count what
+// the finished parts cover, and UPLOAD_COMMIT refuses (INCOMPLETE) until
+// that is the whole file. APPEND and PART do not mix (ERR STRIPE).
+
+#define PROTO_MAGIC 0xD2
+#define PROTO_VARINT_MAX 10
+#define PROTO_HEADER_MAX (2 + 2 * PROTO_VARINT_MAX)
+#define PROTO_MAX_REQUEST 1024 // largest request frame a server accepts
+#define PROTO_NAME_MAX 255
+#define PROTO_PASS_MAX 127
+#define PROTO_LIST_PAGE_MAX 10000 // larger LIST limits are clamped to this
+
+typedef enum {
+    OP_NONE = 0,
+    OP_SIGNUP, OP_LOGIN, OP_UPLOAD, OP_DOWNLOAD, OP_DELETE, OP_LIST, OP_STATS,
+    OP_HELLO,            // text only: protocol negotiation
+    OP_UPLOAD_BEGIN, OP_UPLOAD_APPEND, OP_UPLOAD_COMMIT, OP_UPLOAD_STATUS,
+    OP_UPLOAD_PART,
+    OP_OK = 0x40, OP_ERR
+} proto_op_t;
+
+// A parsed request, whichever protocol it arrived in
+typedef struct {
+    proto_op_t op;       // OP_NONE: unknown command
+    long long tag;       // text: "#<tag>" prefix or -1; v2: request id
+    char name[PROTO_NAME_MAX + 1]; // file name, or user for SIGNUP/LOGIN
+    char pass[PROTO_PASS_MAX + 1];
+    long long size;      // UPLOAD/UPLOAD_APPEND/UPLOAD_PART body length; LIST page size (0: everything); HELLO version
+    codec_t codec;       // UPLOAD/DOWNLOAD body encoding
+    long long token;     // upload session
+    long long offset;    // UPLOAD_APPEND/UPLOAD_PART: where the body goes in the staged file
+    int striped;         // UPLOAD_BEGIN: the session takes UPLOAD_PARTs
+} request_t;
+
+size_t proto_put_varint(char *p, uint64_t v);
+// Returns bytes used, 0 if p[0..n) ends mid-varint, -1 if malformed
+int proto_get_varint(const char *p, size_t n, uint64_t *v);
+size_t proto_put_str(char *p, const char *s, size_t len);
+size_t proto_put_header(char *p, proto_op_t op, uint64_t id, uint64_t payload_len);
+
+// Text line -> request. Returns 0, or -1 on a malformed line; a bad "#tag"
+// prefix leaves tag at -1 so the error goes back untagged.
+int proto_parse_line(const char *line, request_t *req);
+// Frame at buf[0..n) -> request. Returns bytes consumed, 0 if the frame is
+// not complete yet, -1 if malformed or longer than PROTO_MAX_REQUEST.
+int proto_decode_request(const char *buf, size_t n, request_t *req);
+// Request -> text line (with newline) or v2 frame; returns bytes written,
+// or -1 if cap is too small. cap >= PROTO_MAX_REQUEST always suffices.
+int proto_format_line(char *buf, size_t cap, const request_t *req);
+int proto_encode_request(char *buf, size_t cap, const request_t *req);
+
+// Names go into paths under the user's directory and LIST lines, so no
+// separators, dot entries or control characters; spaces are fine in v2.
+int proto_valid_name(const char *name);
+
+// Text LIST cursor: hex of the name, "-" for none. out needs 2 * len + 2.
+void proto_cursor_encode(const char *name, char *out);
+int proto_cursor_decode(const char *in, char *out, size_t cap);
+
+#endif
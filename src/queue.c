@@ -1,8 +1,133 @@
+#define _GNU_SOURCE
 #include "queue.h"
 
 #include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+static void futex_wait(uint32_t *addr, uint32_t val) {
+    syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+}
+
+static void futex_wake(uint32_t *addr, int n) {
+    syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, n, NULL, NULL, 0);
+}
+
+// Ring: a cell is free for the producer at pos when seq == pos, and holds
+// an item for the consumer at pos when seq == pos + 1; the consumer hands
+// it to the next lap with seq = pos + mask + 1. A capacity short of the
+// ring's size is kept by the producer: pos may run at most capacity ahead
+// of deq_pos (a stale deq_pos only makes the ring look fuller, and ring_pop
+// wakes a pusher waiting on that).
+static int ring_try_push(ts_queue_t *q, void *item) {
+    size_t pos = __atomic_load_n(&q->enq_pos, __ATOMIC_RELAXED);
+    for (;;) {
+        ts_cell_t *c = &q->cells[pos & q->mask];
+        size_t seq = __atomic_load_n(&c->seq, __ATOMIC_ACQUIRE);
+        intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+        if (diff == 0) {
+            intptr_t queued = (intptr_t)(pos - __atomic_load_n(&q->deq_pos, __ATOMIC_ACQUIRE));
+            if (queued >= (intptr_t)q->capacity) return -1; // full short of the ring's size
+            if (__atomic_compare_exchange_n(&q->enq_pos, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                c->item = item;
+                __atomic_store_n(&c->seq, pos + 1, __ATOMIC_RELEASE);
+                return 0;
+            }
+        } else if (diff < 0) {
+            return -1; // full: the cell still holds last lap's item
+        } else {
+            pos = __atomic_load_n(&q->enq_pos, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+static int ring_try_pop(ts_queue_t *q, void **out_item) {
+    size_t pos = __atomic_load_n(&q->deq_pos, __ATOMIC_RELAXED);
+    for (;;) {
+        ts_cell_t *c = &q->cells[pos & q->mask];
+        size_t seq = __atomic_load_n(&c->seq, __ATOMIC_ACQUIRE);
+        intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&q->deq_pos, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                *out_item = c->item;
+                __atomic_store_n(&c->seq, pos + q->mask + 1, __ATOMIC_RELEASE);
+                return 0;
+            }
+        } else if (diff < 0) {
+            return -1; // empty
+        } else {
+            pos = __atomic_load_n(&q->deq_pos, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+// After publishing an item (or freeing a cell): wake up to n threads
+// waiting for one. The fence orders the publish before the waiter check,
+// pairing with the waiter's increment before its last look.
+static void ring_wake(uint32_t *gen, int *waiters, int n) {
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(waiters, __ATOMIC_RELAXED) == 0) return;
+    __atomic_add_fetch(gen, 1, __ATOMIC_RELEASE);
+    futex_wake(gen, n);
+}
+
+static int ring_push(ts_queue_t *q, void *item) {
+    for (;;) {
+        if (__atomic_load_n(&q->closed, __ATOMIC_ACQUIRE)) return -1;
+        int ok = ring_try_push(q, item) == 0;
+        if (!ok) {
+            uint32_t gen = __atomic_load_n(&q->space_gen, __ATOMIC_ACQUIRE);
+            __atomic_add_fetch(&q->space_waiters, 1, __ATOMIC_SEQ_CST);
+            ok = ring_try_push(q, item) == 0;
+            // A bump of space_gen since the load makes this return at once
+            if (!ok && !__atomic_load_n(&q->closed, __ATOMIC_ACQUIRE)) futex_wait(&q->space_gen, gen);
+            __atomic_sub_fetch(&q->space_waiters, 1, __ATOMIC_RELAXED);
+        }
+        if (ok) {
+            ring_wake(&q->items_gen, &q->item_waiters, 1);
+            return 0;
+        }
+    }
+}
+
+static int ring_pop(ts_queue_t *q, void **out_item) {
+    for (;;) {
+        int ok = ring_try_pop(q, out_item) == 0;
+        if (!ok) {
+            if (__atomic_load_n(&q->closed, __ATOMIC_ACQUIRE)) return -1;
+            uint32_t gen = __atomic_load_n(&q->items_gen, __ATOMIC_ACQUIRE);
+            __atomic_add_fetch(&q->item_waiters, 1, __ATOMIC_SEQ_CST);
+            ok = ring_try_pop(q, out_item) == 0;
+            if (!ok && !__atomic_load_n(&q->closed, __ATOMIC_ACQUIRE)) futex_wait(&q->items_gen, gen);
+            __atomic_sub_fetch(&q->item_waiters, 1, __ATOMIC_RELAXED);
+        }
+        if (ok) {
+            ring_wake(&q->space_gen, &q->space_waiters, 1);
+            return 0;
+        }
+    }
+}
 
 int ts_queue_init(ts_queue_t *q, size_t capacity) {
+    return ts_queue_init_impl(q, capacity, TS_QUEUE_MUTEX);
+}
+
+int ts_queue_init_impl(ts_queue_t *q, size_t capacity, ts_queue_impl_t impl) {
+    memset(q, 0, sizeof(*q));
+    q->impl = impl;
+    if (impl == TS_QUEUE_RING) {
+        size_t n = 2;
+        while (n < capacity) n <<= 1;
+        q->cells = (ts_cell_t*)calloc(n, sizeof(ts_cell_t));
+        if (!q->cells) return -1;
+        for (size_t i = 0; i < n; i++) q->cells[i].seq = i;
+        q->mask = n - 1;
+        q->capacity = capacity;
+        return 0;
+    }
     q->buffer = (void**)calloc(capacity, sizeof(void*));
     if (!q->buffer) return -1;
     q->capacity = capacity;
@@ -14,7 +139,22 @@ int ts_queue_init(ts_queue_t *q, size_t capacity) {
     return 0;
 }
 
+int ts_queue_parse_impl(const char *s, ts_queue_impl_t *out) {
+    if (strcmp(s, "mutex") == 0) *out = TS_QUEUE_MUTEX;
+    else if (strcmp(s, "ring") == 0) *out = TS_QUEUE_RING;
+    else return -1;
+    return 0;
+}
+
 void ts_queue_close(ts_queue_t *q) {
+    if (q->impl == TS_QUEUE_RING) {
+        __atomic_store_n(&q->closed, 1, __ATOMIC_RELEASE);
+        __atomic_add_fetch(&q->items_gen, 1, __ATOMIC_SEQ_CST);
+        __atomic_add_fetch(&q->space_gen, 1, __ATOMIC_SEQ_CST);
+        futex_wake(&q->items_gen, INT_MAX);
+        futex_wake(&q->space_gen, INT_MAX);
+        return;
+    }
     pthread_mutex_lock(&q->mutex);
     q->closed = 1;
     pthread_cond_broadcast(&q->not_empty);
@@ -23,6 +163,10 @@ void ts_queue_close(ts_queue_t *q) {
 }
 
 void ts_queue_destroy(ts_queue_t *q) {
+    if (q->impl == TS_QUEUE_RING) {
+        free(q->cells);
+        return;
+    }
     pthread_mutex_destroy(&q->mutex);
     pthread_cond_destroy(&q->not_empty);
     pthread_cond_destroy(&q->not_full);
@@ -30,6 +174,7 @@ void ts_queue_destroy(ts_queue_t *q) {
 }
 
 int ts_queue_push(ts_queue_t *q, void *item) {
+    if (q->impl == TS_QUEUE_RING) return ring_push(q, item);
     pthread_mutex_lock(&q->mutex);
     while (!q->closed && q->count == q->capacity) {
         pthread_cond_wait(&q->not_full, &q->mutex);
@@ -46,7 +191,27 @@ int ts_queue_push(ts_queue_t *q, void *item) {
     return 0;
 }
 
+int ts_queue_try_push(ts_queue_t *q, void *item) {
+    if (q->impl == TS_QUEUE_RING) {
+        if (__atomic_load_n(&q->closed, __ATOMIC_ACQUIRE) || ring_try_push(q, item) != 0) return -1;
+        ring_wake(&q->items_gen, &q->item_waiters, 1);
+        return 0;
+    }
+    pthread_mutex_lock(&q->mutex);
+    if (q->closed || q->count == q->capacity) {
+        pthread_mutex_unlock(&q->mutex);
+        return -1;
+    }
+    q->buffer[q->tail] = item;
+    q->tail = (q->tail + 1) % q->capacity;
+    q->count++;
+    pthread_cond_signal(&q->not_empty);
+    pthread_mutex_unlock(&q->mutex);
+    return 0;
+}
+
 int ts_queue_pop(ts_queue_t *q, void **out_item) {
+    if (q->impl == TS_QUEUE_RING) return ring_pop(q, out_item);
     pthread_mutex_lock(&q->mutex);
     while (!q->closed && q->count == 0) {
         pthread_cond_wait(&q->not_empty, &q->mutex);
@@ -63,4 +228,37 @@ int ts_queue_pop(ts_queue_t *q, void **out_item) {
     return 0;
 }
 
+int ts_queue_try_pop(ts_queue_t *q, void **out_item) {
+    return ts_queue_try_pop_n(q, out_item, 1) == 1 ? 0 : -1;
+}
+
+size_t ts_queue_try_pop_n(ts_queue_t *q, void **out_items, size_t max) {
+    size_t n = 0;
+    if (q->impl == TS_QUEUE_RING) {
+        while (n < max && ring_try_pop(q, &out_items[n]) == 0) n++;
+        if (n > 0) ring_wake(&q->space_gen, &q->space_waiters, (int)n);
+        return n;
+    }
+    pthread_mutex_lock(&q->mutex);
+    for (; n < max && q->count > 0; n++) {
+        out_items[n] = q->buffer[q->head];
+        q->head = (q->head + 1) % q->capacity;
+        q->count--;
+    }
+    if (n > 1) pthread_cond_broadcast(&q->not_full);
+    else if (n == 1) pthread_cond_signal(&q->not_full);
+    pthread_mutex_unlock(&q->mutex);
+    return n;
+}
 
+size_t ts_queue_size(ts_queue_t *q) {
+    if (q->impl == TS_QUEUE_RING) {
+        size_t deq = __atomic_load_n(&q->deq_pos, __ATOMIC_RELAXED);
+        size_t enq = __atomic_load_n(&q->enq_pos, __ATOMIC_RELAXED);
+        return enq > deq ? enq - deq : 0;
+    }
+    pthread_mutex_lock(&q->mutex);
+    size_t n = q->count;
+    pthread_mutex_unlock(&q->mutex);
+    return n;
+}
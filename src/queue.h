@@ -3,27 +3,68 @@
 
 #include <pthread.h>
 #include <stddef.h>
+#include <stdint.h>
+
+// Bounded blocking queue of pointers, in one of two implementations:
+//
+//   mutex: ring buffer under a mutex, two condvars
+//   ring:  Vyukov's bounded MPMC ring, where each slot carries a sequence
+//          number saying whose turn it is, so producers and consumers only
+//          CAS their own position. Threads block on a futex only when the
+//          ring is empty (pop) or full (push); otherwise nothing sleeps or
+//          signals. The cells round up to a power of two, but pushes stop
+//          at capacity all the same.
+//
+// Both behave the same, close semantics included.
+typedef enum { TS_QUEUE_MUTEX, TS_QUEUE_RING } ts_queue_impl_t;
+
+typedef struct {
+    size_t seq;
+    void *item;
+} ts_cell_t;
 
 typedef struct {
+    ts_queue_impl_t impl;
+    int closed;
+    // mutex
     void **buffer;
-    size_t capacity;
+    size_t capacity; // both: the most items queued at once
     size_t head;
     size_t tail;
     size_t count;
     pthread_mutex_t mutex;
     pthread_cond_t not_empty;
     pthread_cond_t not_full;
-    int closed;
+    // ring; the two positions sit on their own cache lines
+    ts_cell_t *cells;
+    size_t mask;
+    char pad0[64];
+    size_t enq_pos;
+    char pad1[64];
+    size_t deq_pos;
+    char pad2[64];
+    // futex words, bumped to wake: pops wait on items, pushes on space
+    uint32_t items_gen, space_gen;
+    int item_waiters, space_waiters;
 } ts_queue_t;
 
-int ts_queue_init(ts_queue_t *q, size_t capacity);
+int ts_queue_init(ts_queue_t *q, size_t capacity); // mutex
+int ts_queue_init_impl(ts_queue_t *q, size_t capacity, ts_queue_impl_t impl);
+// "mutex" or "ring"
+int ts_queue_parse_impl(const char *s, ts_queue_impl_t *out);
 void ts_queue_close(ts_queue_t *q); // wake all blocked ops
 void ts_queue_destroy(ts_queue_t *q);
 // returns 0 on success, -1 if closed
 int ts_queue_push(ts_queue_t *q, void *item);
+// non-blocking push; returns 0 on success, -1 if full or closed
+int ts_queue_try_push(ts_queue_t *q, void *item);
 // returns 0 on success, -1 if closed and empty
 int ts_queue_pop(ts_queue_t *q, void **out_item);
+// non-blocking pop; returns 0 on success, -1 if empty
+int ts_queue_try_pop(ts_queue_t *q, void **out_item);
+// non-blocking; takes up to max items in order, returns how many
+size_t ts_queue_try_pop_n(ts_queue_t *q, void **out_items, size_t max);
+// Items queued right now; only a hint under concurrency
+size_t ts_queue_size(ts_queue_t *q);
 
 #endif
-
-
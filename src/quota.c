@@ -0,0 +1,237 @@
+#include "quota.h"
+#include "stats.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Sharded by username hash like mcache.c; an account is a few dozen bytes
+// and stays once seeded. Session holds sit in one small table of their own.
+#define QUOTA_SHARDS 16  // power of two
+#define QUOTA_BUCKETS 256 // per shard, power of two
+#define HOLD_BUCKETS 256  // power of two
+
+typedef struct q_account {
+    unsigned long hash;
+    char *username;
+    long long quota, used, reserved;
+    int writing; // quota_begin() without its quota_end()
+    struct q_account *chain;
+} q_account_t;
+
+typedef struct {
+    pthread_mutex_t mu;
+    q_account_t *buckets[QUOTA_BUCKETS];
+    unsigned long gen; // bumped whenever used moves
+} __attribute__((aligned(64))) q_shard_t;
+
+typedef struct q_hold {
+    long long token, bytes;
+    char *username;
+    struct q_hold *chain;
+} q_hold_t;
+
+struct quota {
+    q_shard_t shards[QUOTA_SHARDS];
+    pthread_mutex_t hold_mu;
+    q_hold_t *holds[HOLD_BUCKETS];
+};
+
+static unsigned long hash_str(const char *s) {
+    unsigned long h = 1469598103934665603ULL;
+    for (; *s; s++) { h ^= (unsigned char)*s; h *= 1099511628211ULL; }
+    return h;
+}
+
+static q_shard_t *shard_of(quota_t *q, unsigned long hash) {
+    return &q->shards[hash & (QUOTA_SHARDS - 1)];
+}
+
+static q_account_t **bucket_of(q_shard_t *sh, unsigned long hash) {
+    return &sh->buckets[(hash / QUOTA_SHARDS) & (QUOTA_BUCKETS - 1)];
+}
+
+static q_account_t *find(q_shard_t *sh, unsigned long hash, const char *username) {
+    for (q_account_t *a = *bucket_of(sh, hash); a; a = a->chain) {
+        if (a->hash == hash && strcmp(a->username, username) == 0) return a;
+    }
+    return NULL;
+}
+
+int quota_init(quota_t **out) {
+    quota_t *q = (quota_t*)aligned_alloc(64, sizeof(*q));
+    if (!q) return -1;
+    memset(q, 0, sizeof(*q));
+    for (int i = 0; i < QUOTA_SHARDS; i++) pthread_mutex_init(&q->shards[i].mu, NULL);
+    pthread_mutex_init(&q->hold_mu, NULL);
+    *out = q;
+    return 0;
+}
+
+void quota_destroy(quota_t *q) {
+    if (!q) return;
+    for (int i = 0; i < QUOTA_SHARDS; i++) {
+        q_shard_t *sh = &q->shards[i];
+        for (int b = 0; b < QUOTA_BUCKETS; b++) {
+            for (q_account_t *a = sh->buckets[b], *next; a; a = next) {
+                next = a->chain;
+                stats_add(STAT_QUOTA_RESERVED, -a->reserved);
+                free(a->username);
+                free(a);
+            }
+        }
+        pthread_mutex_destroy(&sh->mu);
+    }
+    for (int b = 0; b < HOLD_BUCKETS; b++) {
+        for (q_hold_t *h = q->holds[b], *next; h; h = next) {
+            next = h->chain;
+            free(h->username);
+            free(h);
+        }
+    }
+    pthread_mutex_destroy(&q->hold_mu);
+    free(q);
+}
+
+unsigned long quota_gen(quota_t *q, const char *username) {
+    q_shard_t *sh = shard_of(q, hash_str(username));
+    pthread_mutex_lock(&sh->mu);
+    unsigned long gen = sh->gen;
+    pthread_mutex_unlock(&sh->mu);
+    return gen;
+}
+
+void quota_sync(quota_t *q, unsigned long gen, const char *username, long long quota, long long used) {
+    unsigned long hash = hash_str(username);
+    q_shard_t *sh = shard_of(q, hash);
+    pthread_mutex_lock(&sh->mu);
+    q_account_t *a = find(sh, hash, username);
+    if (!a) {
+        a = (q_account_t*)calloc(1, sizeof(*a));
+        if (a && !(a->username = strdup(username))) { free(a); a = NULL; }
+        if (a) {
+            a->hash = hash;
+            a->used = used;
+            q_account_t **pp = bucket_of(sh, hash);
+            a->chain = *pp;
+            *pp = a;
+        }
+    } else if (a->reserved == 0 && a->writing == 0 && gen == sh->gen) {
+        // Nothing in flight and nothing committed since the read: the row
+        // is the truth
+        a->used = used;
+    }
+    if (a) a->quota = quota;
+    pthread_mutex_unlock(&sh->mu);
+}
+
+long long quota_reserve(quota_t *q, const char *username, long long bytes) {
+    if (bytes <= 0) return 0;
+    unsigned long hash = hash_str(username);
+    q_shard_t *sh = shard_of(q, hash);
+    long long got = 0;
+    pthread_mutex_lock(&sh->mu);
+    q_account_t *a = find(sh, hash, username);
+    if (a && a->used + a->reserved + bytes > a->quota) {
+        got = -1;
+    } else if (a) {
+        a->reserved += bytes;
+        got = bytes;
+        stats_add(STAT_QUOTA_RESERVED, bytes);
+    }
+    pthread_mutex_unlock(&sh->mu);
+    return got;
+}
+
+// Takes back what was reserved and applies delta to used
+static void settle(quota_t *q, const char *username, long long reserved, long long delta) {
+    unsigned long hash = hash_str(username);
+    q_shard_t *sh = shard_of(q, hash);
+    pthread_mutex_lock(&sh->mu);
+    q_account_t *a = find(sh, hash, username);
+    if (a) {
+        if (reserved > a->reserved) reserved = a->reserved; // never below zero
+        if (reserved > 0) {
+            a->reserved -= reserved;
+            stats_add(STAT_QUOTA_RESERVED, -reserved);
+        }
+        a->used += delta;
+    }
+    if (delta != 0) sh->gen++;
+    pthread_mutex_unlock(&sh->mu);
+}
+
+void quota_release(quota_t *q, const char *username, long long bytes) {
+    if (bytes > 0) settle(q, username, bytes, 0);
+}
+
+void quota_commit(quota_t *q, const char *username, long long reserved, long long delta) {
+    settle(q, username, reserved, delta);
+}
+
+void quota_charge(quota_t *q, const char *username, long long delta) {
+    settle(q, username, 0, delta);
+}
+
+static void writing_add(quota_t *q, const char *username, int n) {
+    unsigned long hash = hash_str(username);
+    q_shard_t *sh = shard_of(q, hash);
+    pthread_mutex_lock(&sh->mu);
+    q_account_t *a = find(sh, hash, username);
+    if (a) a->writing += n;
+    pthread_mutex_unlock(&sh->mu);
+}
+
+void quota_begin(quota_t *q, const char *username) {
+    writing_add(q, username, 1);
+}
+
+void quota_end(quota_t *q, const char *username) {
+    writing_add(q, username, -1);
+}
+
+static q_hold_t **hold_bucket(quota_t *q, long long token) {
+    return &q->holds[((unsigned long long)token * 0x9e3779b97f4a7c15ULL >> 56) & (HOLD_BUCKETS - 1)];
+}
+
+void quota_hold(quota_t *q, long long token, const char *username, long long bytes) {
+    if (bytes <= 0) return;
+    q_hold_t *h = (q_hold_t*)calloc(1, sizeof(*h));
+    if (h && !(h->username = strdup(username))) { free(h); h = NULL; }
+    // Without a record the bytes could never be given back
+    if (!h) { quota_release(q, username, bytes); return; }
+    h->token = token;
+    h->bytes = bytes;
+    pthread_mutex_lock(&q->hold_mu);
+    q_hold_t **pp = hold_bucket(q, token);
+    h->chain = *pp;
+    *pp = h;
+    pthread_mutex_unlock(&q->hold_mu);
+}
+
+long long quota_held(quota_t *q, long long token) {
+    long long bytes = 0;
+    pthread_mutex_lock(&q->hold_mu);
+    for (q_hold_t *h = *hold_bucket(q, token); h; h = h->chain) {
+        if (h->token == token) { bytes = h->bytes; break; }
+    }
+    pthread_mutex_unlock(&q->hold_mu);
+    return bytes;
+}
+
+void quota_unhold(quota_t *q, long long token, int release) {
+    q_hold_t *h = NULL;
+    pthread_mutex_lock(&q->hold_mu);
+    for (q_hold_t **pp = hold_bucket(q, token); *pp; pp = &(*pp)->chain) {
+        if ((*pp)->token == token) {
+            h = *pp;
+            *pp = h->chain;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&q->hold_mu);
+    if (!h) return;
+    if (release) quota_release(q, h->username, h->bytes);
+    free(h->username);
+    free(h);
+}
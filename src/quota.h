@@ -0,0 +1,47 @@
+#ifndef QUOTA_H
+#define QUOTA_H
+
+// Per-user byte reservations against the quota, in memory, so an upload
+// that cannot fit is refused from its header alone, before its body is
+// staged. Each account (keyed by username) carries its quota, its
+// used_bytes as last known, and the bytes reserved by uploads in flight;
+// a reservation fits if used + reserved + bytes <= quota.
+//
+// LOGIN seeds an account from the users row and, while nothing is
+// reserved or being written, reconciles used with it (quota_gen() before
+// the read, as with mcache.h). A committed upload converts its reservation into the delta it
+// actually applied; a failed one releases it. The commit transaction still
+// checks the quota itself, which covers whatever the counters missed (a
+// restart, a delete racing an upload).
+typedef struct quota quota_t;
+
+int quota_init(quota_t **out);
+void quota_destroy(quota_t *q);
+
+unsigned long quota_gen(quota_t *q, const char *username);
+void quota_sync(quota_t *q, unsigned long gen, const char *username, long long quota, long long used);
+
+// The bytes now reserved (what to hand back later), or -1 if they would
+// take the account past its quota (the caller answers QUOTA and counts it). An account never seeded is not
+// tracked: 0, nothing reserved.
+long long quota_reserve(quota_t *q, const char *username, long long bytes);
+void quota_release(quota_t *q, const char *username, long long bytes);
+// The upload that reserved `reserved` committed, moving used_bytes by delta
+void quota_commit(quota_t *q, const char *username, long long reserved, long long delta);
+// used_bytes moved by delta with no reservation (DELETE)
+void quota_charge(quota_t *q, const char *username, long long delta);
+// Around a write that moves used_bytes, from before its transaction until
+// after its commit or charge. A LOGIN that reads the users row in between
+// may see the change before the counters do, so quota_sync() leaves used
+// alone until the write ends.
+void quota_begin(quota_t *q, const char *username);
+void quota_end(quota_t *q, const char *username);
+
+// Reservations owned by a resumable upload session rather than by one
+// request: made at UPLOAD_BEGIN, looked up at UPLOAD_COMMIT, and dropped
+// once the session is gone (released unless they were committed)
+void quota_hold(quota_t *q, long long token, const char *username, long long bytes);
+long long quota_held(quota_t *q, long long token);
+void quota_unhold(quota_t *q, long long token, int release);
+
+#endif
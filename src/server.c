@@ -1,288 +1,1148 @@
-#define _POSIX_C_SOURCE 200809L
-#include <stdio.h>
-#include <stdlib.h>
-#include <string.h>
-#include <errno.h>
-#include <unistd.h>
-#include <signal.h>
-#include <arpa/inet.h>
-#include <netinet/in.h>
-#include <sys/socket.h>
-#include <sys/stat.h>
-#include <fcntl.h>
-
-#include "queue.h"
-#include "threadpool.h"
-#include "util.h"
-#include "db.h"
-#include "lockmgr.h"
-
-typedef struct {
-    int client_fd;
-    long long user_id;
-    char username[128];
-    int authenticated;
-} session_t;
-
-static volatile int g_running = 1;
-static void handle_sigint(int sig) { (void)sig; g_running = 0; }
-
-typedef struct {
-    ts_queue_t client_queue;
-    ts_queue_t task_queue;
-    pthread_t *client_threads;
-    int client_thread_count;
-    worker_pool_t worker_pool;
-    db_t db;
-    char root_dir[512];
-    lockmgr_t *locks;
-    // track active client sockets for shutdown
-    pthread_mutex_t clients_mu;
-    int *client_fds;
-    int client_fds_cap;
-    int client_fds_count;
-} server_state_t;
-
-static int create_listener(int port) {
-    int fd = socket(AF_INET, SOCK_STREAM, 0);
-    int on = 1; setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
-    struct sockaddr_in addr; memset(&addr, 0, sizeof(addr));
-    addr.sin_family = AF_INET; addr.sin_addr.s_addr = htonl(INADDR_ANY); addr.sin_port = htons((uint16_t)port);
-    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) { perror("bind"); exit(1);} 
-    if (listen(fd, 128) < 0) { perror("listen"); exit(1);} 
-    return fd;
-}
-
-static char *hash_password(const char *pw) {
-    // For MVP: NOT secure; replace with argon2/bcrypt later
-    size_t n = strlen(pw);
-    char *out = (char*)malloc(n * 2 + 1);
-    for (size_t i = 0; i < n; i++) { out[i*2] = pw[i]; out[i*2+1] = 'x'; }
-    out[n*2] = '\0';
-    return out;
-}
-
-static int read_command_line(int fd, char *cmd, size_t sz) {
-    int r = read_line(fd, cmd, sz);
-    return r;
-}
-
-static int ensure_user_dir_base(const char *root, const char *username, char *out_path, size_t out_sz) {
-    int n = snprintf(out_path, out_sz, "%s/%s", root, username);
-    if (n <= 0 || (size_t)n >= out_sz) return -1;
-    mkdir(out_path, 0755);
-    return 0;
-}
-
-static int recv_upload_payload(int fd, const char *root, const char *username, long long size, char *tmp_path_out, size_t tmp_sz) {
-    char basedir[1024];
-    if (ensure_user_dir_base(root, username, basedir, sizeof(basedir)) != 0) return -1;
-    char tmpl[1024];
-    int n = snprintf(tmpl, sizeof(tmpl), "%s/.tmp.upload.XXXXXX", basedir);
-    if (n <= 0 || (size_t)n >= sizeof(tmpl)) return -1;
-    int tfd = mkstemp(tmpl);
-    if (tfd < 0) return -1;
-    int n_copied = snprintf(tmp_path_out, tmp_sz, "%s", tmpl);
-    if (n_copied < 0 || (size_t)n_copied >= tmp_sz) return -1;
-    char buf[64 * 1024];
-    long long remain = size;
-    while (remain > 0) {
-        long long chunk_ll = (remain > (long long)sizeof(buf)) ? (long long)sizeof(buf) : remain;
-        size_t chunk = (size_t)chunk_ll;
-        int rr = read_n(fd, buf, chunk);
-        if (rr <= 0) { close(tfd); return -1; }
-        if (write_n(tfd, buf, chunk) < 0) { close(tfd); return -1; }
-        remain -= (long long)chunk;
-    }
-    fsync(tfd);
-    close(tfd);
-    return 0;
-}
-
-static void respond_ok(int fd) { send_fmt(fd, "OK\n"); }
-static void respond_err(int fd, const char *code) { send_fmt(fd, "ERR %s\n", code); }
-
-static void handle_client(server_state_t *st, int client_fd) {
-    session_t sess; memset(&sess, 0, sizeof(sess)); sess.client_fd = client_fd;
-    char line[1024];
-    for (;;) {
-        int rr = read_command_line(client_fd, line, sizeof(line));
-        if (rr <= 0) break;
-        char cmd[32];
-        if (sscanf(line, "%31s", cmd) != 1) { respond_err(client_fd, "PROTO"); continue; }
-        if (strcmp(cmd, "SIGNUP") == 0) {
-            char user[128], pass[128]; long long quota = 104857600LL; /* 100MB default */
-            if (sscanf(line, "SIGNUP %127s %127s", user, pass) != 2) { respond_err(client_fd, "PROTO"); continue; }
-            char *ph = hash_password(pass);
-            if (db_signup(&st->db, user, ph, quota) != 0) { free(ph); respond_err(client_fd, "EXISTS"); continue; }
-            free(ph);
-            respond_ok(client_fd);
-        } else if (strcmp(cmd, "LOGIN") == 0) {
-            char user[128], pass[128];
-            if (sscanf(line, "LOGIN %127s %127s", user, pass) != 2) { respond_err(client_fd, "PROTO"); continue; }
-            long long uid = 0, quota=0, used=0; char *stored = NULL;
-            if (db_get_user(&st->db, user, &uid, &stored, &quota, &used) != 0) { respond_err(client_fd, "AUTH"); continue; }
-            char *ph = hash_password(pass);
-            int ok = (stored && strcmp(stored, ph) == 0);
-            free(stored); free(ph);
-            if (!ok) { respond_err(client_fd, "AUTH"); continue; }
-            sess.user_id = uid; snprintf(sess.username, sizeof(sess.username), "%s", user); sess.authenticated = 1;
-            respond_ok(client_fd);
-        } else {
-            if (!sess.authenticated) { respond_err(client_fd, "AUTH"); continue; }
-            if (strcmp(cmd, "UPLOAD") == 0) {
-                char fname[256]; long long size = 0;
-                if (sscanf(line, "UPLOAD %255s %lld", fname, &size) != 2 || size < 0) { respond_err(client_fd, "PROTO"); continue; }
-                char tmp_path[256];
-                if (recv_upload_payload(client_fd, st->root_dir, sess.username, size, tmp_path, sizeof(tmp_path)) != 0) { respond_err(client_fd, "IO"); continue; }
-                task_t *t = (task_t*)calloc(1, sizeof(task_t));
-                task_init(t);
-                t->type = TASK_UPLOAD;
-                t->client_fd = client_fd;
-                t->user_id = sess.user_id;
-                t->username = strdup(sess.username);
-                t->filename = strdup(fname);
-                t->size = size;
-                t->upload_tmp_path = strdup(tmp_path);
-                ts_queue_push(&st->task_queue, t);
-                pthread_mutex_lock(&t->result.mutex);
-                while (!t->result.done) pthread_cond_wait(&t->result.done_cv, &t->result.mutex);
-                pthread_mutex_unlock(&t->result.mutex);
-                if (t->result.status == 0) respond_ok(client_fd); else respond_err(client_fd, t->result.err_msg ? t->result.err_msg : "ERR");
-                task_free(t); free(t);
-            } else if (strcmp(cmd, "DOWNLOAD") == 0) {
-                char fname[256];
-                if (sscanf(line, "DOWNLOAD %255s", fname) != 1) { respond_err(client_fd, "PROTO"); continue; }
-                task_t *t = (task_t*)calloc(1, sizeof(task_t));
-                task_init(t);
-                t->type = TASK_DOWNLOAD; t->client_fd = client_fd; t->user_id = sess.user_id; t->username = strdup(sess.username); t->filename = strdup(fname);
-                ts_queue_push(&st->task_queue, t);
-                pthread_mutex_lock(&t->result.mutex);
-                while (!t->result.done) pthread_cond_wait(&t->result.done_cv, &t->result.mutex);
-                pthread_mutex_unlock(&t->result.mutex);
-                if (t->result.status != 0 || !t->result.resp_path) { respond_err(client_fd, t->result.err_msg ? t->result.err_msg : "ERR"); task_free(t); free(t); continue; }
-                // stream file
-                int fd = open(t->result.resp_path, O_RDONLY);
-                if (fd < 0) { respond_err(client_fd, "IO"); task_free(t); free(t); continue; }
-                struct stat st;
-                fstat(fd, &st);
-                send_fmt(client_fd, "OK %lld\n", (long long)st.st_size);
-                char buf[64 * 1024]; ssize_t r;
-                while ((r = read(fd, buf, sizeof(buf))) > 0) {
-                    if (write_n(client_fd, buf, (size_t)r) < 0) { break; }
-                }
-                close(fd);
-                task_free(t); free(t);
-            } else if (strcmp(cmd, "DELETE") == 0) {
-                char fname[256];
-                if (sscanf(line, "DELETE %255s", fname) != 1) { respond_err(client_fd, "PROTO"); continue; }
-                task_t *t = (task_t*)calloc(1, sizeof(task_t));
-                task_init(t);
-                t->type = TASK_DELETE; t->client_fd = client_fd; t->user_id = sess.user_id; t->username = strdup(sess.username); t->filename = strdup(fname);
-                ts_queue_push(&st->task_queue, t);
-                pthread_mutex_lock(&t->result.mutex);
-                while (!t->result.done) pthread_cond_wait(&t->result.done_cv, &t->result.mutex);
-                pthread_mutex_unlock(&t->result.mutex);
-                if (t->result.status == 0) respond_ok(client_fd); else respond_err(client_fd, t->result.err_msg ? t->result.err_msg : "ERR");
-                task_free(t); free(t);
-            } else if (strcmp(cmd, "LIST") == 0) {
-                task_t *t = (task_t*)calloc(1, sizeof(task_t));
-                task_init(t);
-                t->type = TASK_LIST; t->client_fd = client_fd; t->user_id = sess.user_id; t->username = strdup(sess.username);
-                ts_queue_push(&st->task_queue, t);
-                pthread_mutex_lock(&t->result.mutex);
-                while (!t->result.done) pthread_cond_wait(&t->result.done_cv, &t->result.mutex);
-                pthread_mutex_unlock(&t->result.mutex);
-                if (t->result.status != 0) { respond_err(client_fd, t->result.err_msg ? t->result.err_msg : "ERR"); task_free(t); free(t); continue; }
-                send_fmt(client_fd, "OK %d\n", t->result.list_count);
-                for (int i = 0; i < t->result.list_count; i++) {
-                    send_fmt(client_fd, "%s\n", t->result.list_names[i]);
-                }
-                task_free(t); free(t);
-            } else {
-                respond_err(client_fd, "UNKNOWN");
-            }
-        }
-    }
-    close(client_fd);
-}
-
-static void *client_thread_main(void *arg) {
-    server_state_t *st = (server_state_t*)arg;
-    for (;;) {
-        void *item = NULL;
-        if (ts_queue_pop(&st->client_queue, &item) != 0) break;
-        int client_fd = (int)(intptr_t)item;
-        handle_client(st, client_fd);
-    }
-    return NULL;
-}
-
-int main(int argc, char **argv) {
-    int port = 9000; const char *root = "storage"; const char *dbpath = "storage/meta.db";
-    long long default_quota = 104857600LL;
-    for (int i = 1; i < argc; i++) {
-        if (strcmp(argv[i], "--port") == 0 && i+1 < argc) port = atoi(argv[++i]);
-        else if (strcmp(argv[i], "--root") == 0 && i+1 < argc) root = argv[++i];
-        else if (strcmp(argv[i], "--db") == 0 && i+1 < argc) dbpath = argv[++i];
-        else if (strcmp(argv[i], "--quota-bytes") == 0 && i+1 < argc) default_quota = atoll(argv[++i]);
-    }
-    signal(SIGINT, handle_sigint);
-    mkdir(root, 0755);
-
-    server_state_t st; memset(&st, 0, sizeof(st));
-    snprintf(st.root_dir, sizeof(st.root_dir), "%s", root);
-    if (ts_queue_init(&st.client_queue, 128) != 0) return 1;
-    if (ts_queue_init(&st.task_queue, 1024) != 0) return 1;
-    if (db_open(&st.db, dbpath) != 0) { fprintf(stderr, "DB open failed\n"); return 1; }
-    if (lockmgr_init(&st.locks) != 0) { fprintf(stderr, "Lockmgr init failed\n"); return 1; }
-    pthread_mutex_init(&st.clients_mu, NULL);
-    st.client_fds_cap = 64; st.client_fds_count = 0; st.client_fds = (int*)calloc((size_t)st.client_fds_cap, sizeof(int));
-
-    int client_threads = 4; st.client_thread_count = client_threads;
-    st.client_threads = (pthread_t*)calloc((size_t)client_threads, sizeof(pthread_t));
-    for (int i = 0; i < client_threads; i++) pthread_create(&st.client_threads[i], NULL, client_thread_main, &st);
-
-    worker_pool_start(&st.worker_pool, &st.task_queue, 4, st.root_dir, &st.db, st.locks);
-
-    int lfd = create_listener(port);
-    fprintf(stdout, "Server listening on %d\n", port);
-    while (g_running) {
-        struct sockaddr_in cli; socklen_t cl = sizeof(cli);
-        int cfd = accept(lfd, (struct sockaddr*)&cli, &cl);
-        if (cfd < 0) { if (errno == EINTR) continue; perror("accept"); break; }
-        char ip[64];
-        const char *ipstr = inet_ntop(AF_INET, &cli.sin_addr, ip, sizeof(ip)) ? ip : "?";
-        int cport = ntohs(cli.sin_port);
-        fprintf(stdout, "Client connected %s:%d\n", ipstr, cport);
-        pthread_mutex_lock(&st.clients_mu);
-        if (st.client_fds_count == st.client_fds_cap) {
-            st.client_fds_cap *= 2;
-            st.client_fds = (int*)realloc(st.client_fds, (size_t)st.client_fds_cap * sizeof(int));
-        }
-        st.client_fds[st.client_fds_count++] = cfd;
-        pthread_mutex_unlock(&st.clients_mu);
-        ts_queue_push(&st.client_queue, (void*)(intptr_t)cfd);
-    }
-    close(lfd);
-
-    ts_queue_close(&st.client_queue);
-    // Proactively close active client sockets to unblock reads
-    pthread_mutex_lock(&st.clients_mu);
-    for (int i = 0; i < st.client_fds_count; i++) close(st.client_fds[i]);
-    pthread_mutex_unlock(&st.clients_mu);
-    for (int i = 0; i < st.client_thread_count; i++) pthread_join(st.client_threads[i], NULL);
-    free(st.client_threads);
-
-    worker_pool_stop(&st.worker_pool);
-    ts_queue_destroy(&st.client_queue);
-    ts_queue_destroy(&st.task_queue);
-    db_close(&st.db);
-    pthread_mutex_destroy(&st.clients_mu);
-    free(st.client_fds);
-    lockmgr_destroy(st.locks);
-    (void)default_quota; // currently default quota applies on signup
-    return 0;
-}
-
-
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <signal.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+#include <sys/file.h>
+#include <fcntl.h>
+
+#include "queue.h"
+#include "threadpool.h"
+#include "util.h"
+#include "db.h"
+#include "lockmgr.h"
+#include "mcache.h"
+#include "quota.h"
+#include "syncer.h"
+#include "stats.h"
+#include "xfer.h"
+#include "proto.h"
+#include "compress.h"
+#include "chunk.h"
+
+#define CONN_LINE_MAX 1024
+#define CONN_IO_CHUNK (64 * 1024)
+#define LOOP_MAX_EVENTS 256
+#define CONN_MAX_INFLIGHT 32 // tagged commands a connection may have queued at once
+#define CONN_FLUSH_IOV 64     // inline chunks gathered into one sendmsg()
+#define LISTEN_BACKLOG 128    // also bounds accepted sockets waiting for a loop
+
+typedef struct {
+    int client_fd;
+    long long user_id;
+    char username[PROTO_NAME_MAX + 1];
+    int authenticated;
+} session_t;
+
+static volatile sig_atomic_t g_running = 1;
+static void handle_sigint(int sig) { (void)sig; g_running = 0; }
+
+typedef struct server_state server_state_t;
+typedef struct conn conn_t;
+
+// One event loop per client thread: an edge-triggered epoll set of
+// non-blocking connections, plus an eventfd that the acceptor and the
+// workers use to hand over new sockets and completed tasks.
+typedef struct {
+    server_state_t *st;
+    int epfd;
+    int wake_fd;
+    pthread_t thread;
+    int stop;
+    task_t *done;                  // completed by workers, not yet seen by the loop (task_list_push)
+    task_pool_t tasks;             // this loop's spare tasks
+    conn_t *conns;                 // live connections owned by this loop
+    conn_t *graveyard;             // closed during the current batch, freed after it
+} io_loop_t;
+
+struct server_state {
+    ts_queue_t client_queue;
+    io_loop_t *loops;
+    int loop_count;
+    worker_pool_t worker_pool;
+    db_t db;
+    char root_dir[512];
+    lockmgr_t *locks;
+    mcache_t *mcache; // NULL with --meta-cache-mb 0
+    quota_t *quota;
+    syncer_t *syncer; // --durability batched only
+    xfer_mode_t download_mode;
+    xfer_mode_t upload_mode;
+    int prealloc; // reserve staging blocks up front from the declared UPLOAD size
+};
+
+// CONN_WAIT_SETUP: a body follows the command, left in the socket until
+// the task preparing for it completes
+typedef enum { CONN_READ_CMD, CONN_READ_UPLOAD, CONN_WAIT_TASK, CONN_WAIT_SETUP } conn_state_t;
+
+// Pending output: either inline bytes, a byte range of an open file, or a
+// chunked file (chunk.h) whose chunks are opened in turn as each drains
+typedef struct out_chunk {
+    struct out_chunk *next;
+    int file_fd;      // -1 for inline data
+    off_t file_off;
+    long long len;    // bytes still to send
+    size_t data_off;
+    xfer_t xfer;      // file chunks: sendfile/splice/copy state
+    char *zbuf;       // compressed file chunks: frame being sent, then raw scratch
+    size_t zlen, zoff;
+    zenc_t zenc;
+    chunk_ref_t *parts; // chunked file: all its chunks; part is the next to open
+    int nparts, part;
+    char *ext;        // inline bytes in a heap buffer we took over, else data[]
+    char data[];
+} out_chunk_t;
+
+struct conn {
+    io_loop_t *loop;
+    conn_state_t state;
+    session_t sess;
+    int closed; // socket closed; freed once no task is in flight
+    int v2;     // negotiated binary framing (proto.h) instead of text lines
+    reader_t in;
+    out_chunk_t *out_head, *out_tail;
+    // UPLOAD body being staged
+    int up_fd;
+    const char *up_err; // set: drain the body, then reply with this error
+    char up_tmp[256];
+    char up_name[256];
+    long long up_size, up_remain;
+    long long up_tag;
+    long long up_reserved; // UPLOAD: bytes reserved against the quota, handed to the task
+    int up_append;      // UPLOAD_APPEND into a session's staged file, up_offset onwards
+    int up_part;        // UPLOAD_PART: the same, but listed in up_token's .parts when whole
+    long long up_token;
+    long long up_offset;
+    xfer_t up_xfer;
+    codec_t up_codec;
+    char *up_z;         // compressed body: frame being collected, then raw scratch
+    size_t up_zlen;
+    int inflight; // tasks queued or running for this connection
+    conn_t *prev, *next;
+};
+
+static int create_listener(int port) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    int on = 1; setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    struct sockaddr_in addr; memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET; addr.sin_addr.s_addr = htonl(INADDR_ANY); addr.sin_port = htons((uint16_t)port);
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) { perror("bind"); exit(1);} 
+    if (listen(fd, LISTEN_BACKLOG) < 0) { perror("listen"); exit(1);} 
+    return fd;
+}
+
+static int ensure_user_dir_base(const char *root, const char *username, char *out_path, size_t out_sz) {
+    int n = snprintf(out_path, out_sz, "%s/%s", root, username);
+    if (n <= 0 || (size_t)n >= out_sz) return -1;
+    mkdir(out_path, 0755);
+    return 0;
+}
+
+static void loop_wake(io_loop_t *lp) {
+    uint64_t one = 1;
+    ssize_t w = write(lp->wake_fd, &one, sizeof(one));
+    (void)w;
+}
+
+static out_chunk_t *out_append(conn_t *c, size_t data_cap) {
+    out_chunk_t *o = (out_chunk_t*)malloc(sizeof(*o) + data_cap);
+    o->next = NULL; o->file_fd = -1; o->file_off = 0; o->len = 0; o->data_off = 0; o->ext = NULL;
+    o->zbuf = NULL; o->zlen = o->zoff = 0;
+    o->parts = NULL; o->nparts = o->part = 0;
+    if (c->out_tail) c->out_tail->next = o; else c->out_head = o;
+    c->out_tail = o;
+    return o;
+}
+
+// Response lines of a tagged command start with the same "#<tag> "
+static void out_printf(conn_t *c, long long tag, const char *fmt, ...) {
+    char buf[1024];
+    int n = 0;
+    if (tag >= 0) n = snprintf(buf, sizeof(buf), "#%lld ", tag);
+    va_list ap;
+    va_start(ap, fmt);
+    int m = vsnprintf(buf + n, sizeof(buf) - (size_t)n, fmt, ap);
+    va_end(ap);
+    if (m < 0) return;
+    n += m;
+    if ((size_t)n >= sizeof(buf)) n = (int)sizeof(buf) - 1;
+    out_chunk_t *o = out_append(c, (size_t)n);
+    memcpy(o->data, buf, (size_t)n);
+    o->len = n;
+}
+
+static void out_file(conn_t *c, int fd, long long len, codec_t codec) {
+    out_chunk_t *o = out_append(c, 0);
+    o->file_fd = fd;
+    o->len = len;
+    xfer_init(&o->xfer, c->loop->st->download_mode);
+    if (codec == CODEC_LZ4) {
+        o->zbuf = (char*)malloc(ZFRAME_MAX + ZFRAME_RAW_MAX);
+        zenc_init(&o->zenc);
+    }
+}
+
+// Takes over parts; only the chunk being sent is open at any time
+static void out_parts(conn_t *c, chunk_ref_t *parts, int nparts, codec_t codec) {
+    out_file(c, -1, 0, codec);
+    c->out_tail->parts = parts;
+    c->out_tail->nparts = nparts;
+}
+
+// Moves a chunked file on to its next chunk. A chunk that is gone (the file
+// was deleted or replaced mid-download) fails the connection, as a file
+// shrinking under sendfile() does.
+static int out_next_part(conn_t *c, out_chunk_t *o) {
+    const chunk_ref_t *r = &o->parts[o->part];
+    char path[1024];
+    if (chunk_path(c->loop->st->root_dir, r->hash, path, sizeof(path), 0) != 0) { errno = ENAMETOOLONG; return -1; }
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return -1;
+    if (o->file_fd >= 0) close(o->file_fd);
+    o->file_fd = fd;
+    o->file_off = 0;
+    o->len = r->size;
+    o->part++;
+    return 0;
+}
+
+// Queues a malloc'd buffer as is; the chunk frees it once sent
+static void out_take(conn_t *c, char *buf, size_t len) {
+    out_chunk_t *o = out_append(c, 0);
+    o->ext = buf;
+    o->len = (long long)len;
+}
+
+static void out_chunk_free(out_chunk_t *o) {
+    if (o->file_fd >= 0) { close(o->file_fd); xfer_close(&o->xfer); }
+    free(o->zbuf);
+    free(o->parts);
+    free(o->ext);
+    free(o);
+}
+
+static void out_free_all(conn_t *c) {
+    while (c->out_head) {
+        out_chunk_t *o = c->out_head;
+        c->out_head = o->next;
+        out_chunk_free(o);
+    }
+    c->out_tail = NULL;
+}
+
+// v2 reply: one frame, payload copied in after the header
+static void out_frame(conn_t *c, proto_op_t op, long long tag, const char *payload, size_t n) {
+    out_chunk_t *o = out_append(c, PROTO_HEADER_MAX + n);
+    size_t h = proto_put_header(o->data, op, tag < 0 ? 0 : (uint64_t)tag, n);
+    if (n) memcpy(o->data + h, payload, n);
+    o->len = (long long)(h + n);
+}
+
+static void respond_ok(conn_t *c, long long tag) {
+    if (c->v2) out_frame(c, OP_OK, tag, NULL, 0);
+    else out_printf(c, tag, "OK\n");
+}
+
+static void respond_err(conn_t *c, long long tag, const char *code) {
+    if (c->v2) {
+        char p[PROTO_VARINT_MAX + 64];
+        size_t len = strnlen(code, 64);
+        out_frame(c, OP_ERR, tag, p, proto_put_str(p, code, len));
+    } else {
+        out_printf(c, tag, "ERR %s\n", code);
+    }
+}
+
+// "OK <size> [COMPRESSED <codec>]"; the caller queues the payload right after
+static void respond_size(conn_t *c, long long tag, long long size, codec_t codec) {
+    if (c->v2) {
+        char p[2 * PROTO_VARINT_MAX];
+        size_t n = proto_put_varint(p, (uint64_t)size);
+        if (codec != CODEC_NONE) n += proto_put_varint(p + n, (uint64_t)codec);
+        out_frame(c, OP_OK, tag, p, n);
+    } else if (codec != CODEC_NONE) {
+        out_printf(c, tag, "OK %lld COMPRESSED %s\n", size, codec_name(codec));
+    } else {
+        out_printf(c, tag, "OK %lld\n", size);
+    }
+}
+
+// "OK <n>" and n items (text lines, or v2 strings) taken from buf, where
+// each ends in '\n'. Text sends buf as is right behind the header (it is
+// freed once sent); v2 re-encodes it into one frame. A paged LIST also
+// carries the cursor for the next page: its last name, if more follow.
+static void respond_items(conn_t *c, long long tag, char *buf, size_t len, int count, int paged, int more) {
+    const char *last = "";
+    char cursor_name[PROTO_NAME_MAX + 1];
+    if (paged && more && count > 0) {
+        const char *end = buf + len - 1, *start = end;
+        while (start > buf && start[-1] != '\n') start--;
+        size_t n = (size_t)(end - start);
+        if (n > PROTO_NAME_MAX) n = PROTO_NAME_MAX;
+        memcpy(cursor_name, start, n);
+        cursor_name[n] = '\0';
+        last = cursor_name;
+    }
+    if (!c->v2) {
+        char cursor[2 * PROTO_NAME_MAX + 2];
+        if (last[0]) {
+            proto_cursor_encode(last, cursor);
+            out_printf(c, tag, "OK %d %s\n", count, cursor);
+        } else {
+            out_printf(c, tag, "OK %d\n", count);
+        }
+        if (len) out_take(c, buf, len); else free(buf);
+        return;
+    }
+    size_t cap = PROTO_VARINT_MAX + len + (size_t)count * PROTO_VARINT_MAX + PROTO_VARINT_MAX + PROTO_NAME_MAX;
+    out_chunk_t *o = out_append(c, PROTO_HEADER_MAX + cap);
+    // payload first, then slide it up behind the header once its length is known
+    char *pl = o->data + PROTO_HEADER_MAX;
+    char *q = pl + proto_put_varint(pl, (uint64_t)count);
+    for (const char *p = buf, *nl; p < buf + len && (nl = memchr(p, '\n', (size_t)(buf + len - p))); p = nl + 1) {
+        q += proto_put_str(q, p, (size_t)(nl - p));
+    }
+    if (paged) q += proto_put_str(q, last, strlen(last));
+    size_t n = (size_t)(q - pl);
+    size_t h = proto_put_header(o->data, OP_OK, tag < 0 ? 0 : (uint64_t)tag, n);
+    memmove(o->data + h, pl, n);
+    o->len = (long long)(h + n);
+    free(buf);
+}
+
+// Compressed file chunk: encode the next frame once the last one is out, then
+// send what the socket takes. Returns bytes sent or -1 like send().
+static ssize_t out_send_frame(conn_t *c, out_chunk_t *o) {
+    if (o->zoff == o->zlen) {
+        char *raw = o->zbuf + ZFRAME_MAX;
+        size_t want = o->len > ZFRAME_RAW_MAX ? ZFRAME_RAW_MAX : (size_t)o->len;
+        ssize_t r = pread(o->file_fd, raw, want, o->file_off);
+        if (r <= 0) { if (r == 0) errno = EIO; return -1; }
+        int skipped = o->zenc.skip;
+        o->zlen = zenc_frame(&o->zenc, raw, (size_t)r, o->zbuf);
+        o->zoff = 0;
+        o->file_off += r;
+        o->len -= r;
+        stats_add(o->zlen - ZFRAME_HDR < (size_t)r ? STAT_Z_LZ4_FRAMES : STAT_Z_STORED_FRAMES, 1);
+        stats_add(STAT_Z_RAW_BYTES, r);
+        stats_add(STAT_Z_WIRE_BYTES, (long long)o->zlen);
+        if (!skipped && o->zenc.skip) stats_add(STAT_Z_SKIPPED, 1);
+    }
+    ssize_t w = send(c->sess.client_fd, o->zbuf + o->zoff, o->zlen - o->zoff, MSG_NOSIGNAL);
+    if (w > 0) o->zoff += (size_t)w;
+    return w;
+}
+
+// Returns 0 once all output is written, 1 if the socket is full, -1 on error.
+static int conn_flush(conn_t *c) {
+    while (c->out_head) {
+        out_chunk_t *o = c->out_head;
+        if (o->len > 0 || o->zoff < o->zlen) {
+            ssize_t w;
+            if (o->file_fd < 0) {
+                // A run of inline chunks (reply headers, a LIST buffer, further
+                // replies) goes out in one sendmsg()
+                struct iovec iov[CONN_FLUSH_IOV];
+                int n = 0;
+                for (out_chunk_t *p = o; p && p->file_fd < 0 && !p->parts && n < CONN_FLUSH_IOV; p = p->next) {
+                    if (p->len == 0) continue;
+                    iov[n].iov_base = (p->ext ? p->ext : p->data) + p->data_off;
+                    iov[n].iov_len = (size_t)p->len;
+                    n++;
+                }
+                struct msghdr mh; memset(&mh, 0, sizeof(mh));
+                mh.msg_iov = iov; mh.msg_iovlen = (size_t)n;
+                w = sendmsg(c->sess.client_fd, &mh, MSG_NOSIGNAL);
+                if (w > 0) {
+                    stats_add(STAT_REPLY_CALLS, 1);
+                    stats_add(STAT_REPLY_BYTES, w);
+                    for (long long left = w; left > 0; ) {
+                        out_chunk_t *p = c->out_head;
+                        long long k = p->len < left ? p->len : left;
+                        p->data_off += (size_t)k;
+                        p->len -= k;
+                        left -= k;
+                        if (p->len == 0) {
+                            c->out_head = p->next;
+                            if (!c->out_head) c->out_tail = NULL;
+                            out_chunk_free(p);
+                        }
+                    }
+                    continue;
+                }
+            } else if (o->zbuf) {
+                w = out_send_frame(c, o);
+                if (w >= 0) continue;
+            } else {
+                // advances file_off itself; a file that shrank under us fails with EIO
+                w = xfer_send(&o->xfer, c->sess.client_fd, o->file_fd, &o->file_off, (size_t)o->len);
+            }
+            if (w < 0) {
+                if (errno == EINTR) continue;
+                if (errno == EAGAIN || errno == EWOULDBLOCK) return 1;
+                return -1;
+            }
+            o->len -= w;
+            continue;
+        }
+        if (o->part < o->nparts) {
+            if (out_next_part(c, o) != 0) return -1;
+            continue;
+        }
+        c->out_head = o->next;
+        if (!c->out_head) c->out_tail = NULL;
+        out_chunk_free(o);
+    }
+    return 0;
+}
+
+static void upload_unreserve(conn_t *c) {
+    if (c->up_reserved > 0) quota_release(c->loop->st->quota, c->sess.username, c->up_reserved);
+    c->up_reserved = 0;
+}
+
+static void conn_close(conn_t *c) {
+    if (c->closed) return;
+    io_loop_t *lp = c->loop;
+    c->closed = 1;
+    close(c->sess.client_fd); // also drops it from the epoll set
+    out_free_all(c);
+    // A session's staged file keeps whatever arrived, for UPLOAD_STATUS to report
+    if (c->up_fd >= 0) { close(c->up_fd); if (c->up_tmp[0]) unlink(c->up_tmp); c->up_fd = -1; }
+    upload_unreserve(c);
+    xfer_close(&c->up_xfer);
+    free(c->up_z); c->up_z = NULL;
+    if (c->prev) c->prev->next = c->next; else lp->conns = c->next;
+    if (c->next) c->next->prev = c->prev;
+    c->prev = NULL;
+    // a task still holds a pointer to us; the completion path frees us instead
+    if (c->inflight == 0) { c->next = lp->graveyard; lp->graveyard = c; }
+    else c->next = NULL;
+}
+
+// The stream cannot be resynced: push out the queued error, best effort, and hang up
+static void conn_abort(conn_t *c) {
+    conn_flush(c);
+    conn_close(c);
+}
+
+// Runs on the worker thread: queue the finished task for the owning loop,
+// which only needs waking if it has not been already
+static void task_done(task_t *t) {
+    io_loop_t *lp = ((conn_t*)t->owner)->loop;
+    if (task_list_push(&lp->done, t)) loop_wake(lp);
+}
+
+// NULL if out of memory; the caller answers ERR NOMEM
+static task_t *conn_new_task(conn_t *c, task_type_t type, long long tag) {
+    task_t *t = task_pool_get(&c->loop->tasks);
+    if (!t) return NULL;
+    t->type = type;
+    t->tag = tag;
+    t->client_fd = c->sess.client_fd;
+    t->user_id = c->sess.user_id;
+    snprintf(t->username, sizeof(t->username), "%s", c->sess.username);
+    t->on_done = task_done;
+    t->owner = c;
+    return t;
+}
+
+static void conn_dispatch(conn_t *c, task_t *t) {
+    long long tag = t->tag;
+    c->inflight++;
+    // Tagged commands are pipelined: keep reading while they run. Untagged
+    // ones keep the one-at-a-time behaviour, and SIGNUP/LOGIN change the
+    // state later commands are checked against; both pause reading until
+    // nothing is in flight.
+    c->state = (tag < 0 || t->type == TASK_LOGIN || t->type == TASK_SIGNUP) ? CONN_WAIT_TASK : CONN_READ_CMD;
+    if (worker_pool_submit(&c->loop->st->worker_pool, t) != 0) {
+        c->inflight--;
+        c->state = CONN_READ_CMD;
+        task_pool_put(&c->loop->tasks, t);
+        respond_err(c, tag, "SHUTDOWN");
+    }
+}
+
+// Receive state shared by UPLOAD and UPLOAD_APPEND; the caller opens up_fd
+static void upload_reset(conn_t *c, long long tag, long long size, codec_t codec, const char *err) {
+    c->up_name[0] = '\0';
+    c->up_tag = tag;
+    c->up_size = c->up_remain = size;
+    c->up_err = err;
+    c->up_fd = -1;
+    c->up_tmp[0] = '\0';
+    c->state = CONN_READ_UPLOAD;
+    xfer_init(&c->up_xfer, c->loop->st->upload_mode);
+    c->up_codec = codec;
+    c->up_zlen = 0;
+    c->up_append = 0;
+    c->up_part = 0;
+    c->up_reserved = 0;
+    if (codec == CODEC_LZ4) c->up_z = (char*)malloc(ZFRAME_MAX + ZFRAME_RAW_MAX);
+}
+
+// Hands t to a worker and holds the body back until conn_complete() has
+// its result. If the pool is stopping, the body is drained and refused.
+static void upload_setup(conn_t *c, task_t *t) {
+    c->inflight++;
+    c->state = CONN_WAIT_SETUP;
+    if (worker_pool_submit(&c->loop->st->worker_pool, t) != 0) {
+        c->inflight--;
+        task_pool_put(&c->loop->tasks, t);
+        c->up_err = "SHUTDOWN";
+        c->state = CONN_READ_UPLOAD;
+    }
+}
+
+// Over quota: rather than read a body only to drop it, answer and hang
+// up with the body still unread. The client reconnects to go on.
+static void upload_refuse(conn_t *c, const char *err) {
+    respond_err(c, c->up_tag, err);
+    conn_abort(c);
+}
+
+static void upload_stage(conn_t *c) {
+    char basedir[1024];
+    if (ensure_user_dir_base(c->loop->st->root_dir, c->sess.username, basedir, sizeof(basedir)) != 0) { c->up_err = "IO"; return; }
+    int n = snprintf(c->up_tmp, sizeof(c->up_tmp), "%s/.tmp.upload.XXXXXX", basedir);
+    if (n <= 0 || (size_t)n >= sizeof(c->up_tmp)) { c->up_tmp[0] = '\0'; c->up_err = "IO"; return; }
+    c->up_fd = mkstemp(c->up_tmp);
+    if (c->up_fd < 0) { c->up_tmp[0] = '\0'; c->up_err = "IO"; return; }
+    // Best effort: fewer, larger extents for big uploads; size stays 0 until written
+    if (c->loop->st->prealloc && c->up_size > 0) fallocate(c->up_fd, FALLOC_FL_KEEP_SIZE, 0, (off_t)c->up_size);
+}
+
+static void upload_begin(conn_t *c, long long tag, const char *fname, long long size, codec_t codec, const char *err) {
+    upload_reset(c, tag, size, codec, err);
+    snprintf(c->up_name, sizeof(c->up_name), "%s", fname);
+    // On failure the body is still consumed so the stream stays in sync
+    if (err) return;
+    // Replacing a file only needs room for the growth; if the cache cannot
+    // size the file it replaces, a META task looks it up and reserves,
+    // since the loop never waits on SQLite.
+    server_state_t *st = c->loop->st;
+    if (st->quota) {
+        long long old_size = 0;
+        if (!st->mcache || mcache_file_size(st->mcache, c->sess.username, fname, &old_size) != 0) {
+            task_t *t = conn_new_task(c, TASK_UPLOAD_RESERVE, tag);
+            if (!t) { c->up_err = "NOMEM"; return; }
+            snprintf(t->filename, sizeof(t->filename), "%s", fname);
+            t->size = size;
+            upload_setup(c, t);
+            return;
+        }
+        c->up_reserved = quota_reserve(st->quota, c->sess.username, size - old_size);
+        if (c->up_reserved < 0) {
+            c->up_reserved = 0;
+            stats_add(STAT_QUOTA_REJECTS, 1);
+            upload_refuse(c, "QUOTA");
+            return;
+        }
+    }
+    upload_stage(c);
+}
+
+// UPLOAD_APPEND and UPLOAD_PART: the body goes straight into the session's
+// staged file, which a worker opens, locks and positions first (see
+// worker_handle_upload_open() for what each may write where)
+static void session_body_begin(conn_t *c, long long tag, long long token, long long offset, long long len, int part, const char *err) {
+    upload_reset(c, tag, len, CODEC_NONE, err);
+    c->up_append = !part;
+    c->up_part = part;
+    c->up_offset = offset;
+    c->up_token = token;
+    if (err) return;
+    task_t *t = conn_new_task(c, TASK_UPLOAD_OPEN, tag);
+    if (!t) { c->up_err = "NOMEM"; return; }
+    t->token = token;
+    t->offset = offset;
+    t->size = len;
+    t->striped = part;
+    upload_setup(c, t);
+}
+
+static void upload_feed(conn_t *c, const char *data, size_t n) {
+    if (!c->up_err && write_n(c->up_fd, data, n) < 0) c->up_err = "IO";
+    c->up_remain -= (long long)n;
+}
+
+// Compressed body: collects one frame at a time (buffered bytes first, then
+// the socket) and stages what it decodes to. Returns 0 once the declared
+// size is in, 1 to wait for more input, -1 if the connection was closed.
+static int upload_read_frames(conn_t *c) {
+    while (c->up_remain > 0) {
+        size_t need = ZFRAME_HDR;
+        uint32_t raw_len = 0, stored_len = 0;
+        if (c->up_zlen >= ZFRAME_HDR) {
+            if (zframe_header(c->up_z, &raw_len, &stored_len) != 0 || raw_len > c->up_remain) {
+                respond_err(c, -1, "PROTO");
+                conn_abort(c);
+                return -1;
+            }
+            need += stored_len;
+        }
+        if (c->up_zlen < need) {
+            size_t want = need - c->up_zlen, have = reader_buffered(&c->in);
+            if (have > 0) {
+                size_t n = have < want ? have : want;
+                memcpy(c->up_z + c->up_zlen, reader_peek(&c->in), n);
+                reader_consume(&c->in, n);
+                c->up_zlen += n;
+                continue;
+            }
+            ssize_t r = recv(c->sess.client_fd, c->up_z + c->up_zlen, want, 0);
+            if (r == 0) { conn_close(c); return -1; }
+            if (r < 0) {
+                if (errno == EINTR) continue;
+                if (errno == EAGAIN || errno == EWOULDBLOCK) return 1;
+                conn_close(c);
+                return -1;
+            }
+            c->up_zlen += (size_t)r;
+            continue;
+        }
+        char *raw = c->up_z + ZFRAME_MAX;
+        if (zframe_decode(c->up_z + ZFRAME_HDR, stored_len, raw, raw_len) != 0) {
+            respond_err(c, -1, "PROTO");
+            conn_abort(c);
+            return -1;
+        }
+        stats_add(stored_len < raw_len ? STAT_Z_LZ4_FRAMES : STAT_Z_STORED_FRAMES, 1);
+        stats_add(STAT_Z_RAW_BYTES, raw_len);
+        stats_add(STAT_Z_WIRE_BYTES, (long long)need);
+        upload_feed(c, raw, raw_len);
+        c->up_zlen = 0;
+    }
+    return 0;
+}
+
+static void upload_finish(conn_t *c) {
+    char parts[1024];
+    long long size, covered = 0;
+    // Listed before the lock goes, so a commit that gets in next sees it
+    if (c->up_part && !c->up_err &&
+        (upload_stripe_path(c->loop->st->root_dir, c->sess.username, c->up_token, parts, sizeof(parts)) != 0 ||
+         upload_stripe_add(parts, c->up_offset, c->up_size) != 0 ||
+         upload_stripe_read(parts, &size, &covered) != 0)) c->up_err = "IO";
+    if (c->up_fd >= 0) { close(c->up_fd); c->up_fd = -1; }
+    xfer_close(&c->up_xfer);
+    free(c->up_z); c->up_z = NULL;
+    if (c->up_err) {
+        if (c->up_tmp[0]) unlink(c->up_tmp);
+        upload_unreserve(c);
+        respond_err(c, c->up_tag, c->up_err);
+        c->state = CONN_READ_CMD;
+        return;
+    }
+    if (c->up_append || c->up_part) {
+        respond_size(c, c->up_tag, c->up_part ? covered : c->up_offset + c->up_size, CODEC_NONE);
+        c->state = CONN_READ_CMD;
+        return;
+    }
+    task_t *t = conn_new_task(c, TASK_UPLOAD, c->up_tag);
+    if (!t) { unlink(c->up_tmp); c->up_tmp[0] = '\0'; upload_unreserve(c); respond_err(c, c->up_tag, "NOMEM"); c->state = CONN_READ_CMD; return; }
+    snprintf(t->filename, sizeof(t->filename), "%s", c->up_name);
+    t->size = c->up_size;
+    t->reserved = c->up_reserved; // the worker converts or releases it
+    c->up_reserved = 0;
+    snprintf(t->upload_tmp_path, sizeof(t->upload_tmp_path), "%s", c->up_tmp);
+    c->up_tmp[0] = '\0';
+    conn_dispatch(c, t);
+}
+
+static void conn_respond_stats(conn_t *c, long long tag) {
+    char *buf = (char*)malloc(8192);
+    int lines = stats_format(buf, 8192);
+    respond_items(c, tag, buf, strlen(buf), lines, 0, 0);
+}
+
+static void conn_handle_request(conn_t *c, const request_t *req) {
+    long long tag = req->tag;
+    if (req->op == OP_HELLO) {
+        // Replies to earlier commands must not change framing under the client
+        if (c->inflight > 0) { respond_err(c, tag, "PROTO"); return; }
+        if (req->size != 1 && req->size != 2) { respond_err(c, tag, "VERSION"); return; }
+        // Switch after the reply: it is the last text the connection sees.
+        // Trailing words name the body codecs on offer.
+        out_printf(c, tag, "OK v%lld lz4 resume stripe\n", req->size);
+        c->v2 = (req->size == 2);
+    } else if (req->op == OP_STATS) {
+        conn_respond_stats(c, tag);
+    } else if (req->op == OP_SIGNUP || req->op == OP_LOGIN) {
+        // User names become directories next to the chunk store's
+        if (req->op == OP_SIGNUP && (!proto_valid_name(req->name) || req->name[0] == '.')) {
+            respond_err(c, tag, "PROTO");
+            return;
+        }
+        task_t *t = conn_new_task(c, req->op == OP_SIGNUP ? TASK_SIGNUP : TASK_LOGIN, tag);
+        if (!t) { respond_err(c, tag, "NOMEM"); return; }
+        snprintf(t->username, sizeof(t->username), "%s", req->name);
+        snprintf(t->password, sizeof(t->password), "%s", req->pass);
+        if (req->op == OP_SIGNUP) t->size = 104857600LL; /* 100MB default */
+        conn_dispatch(c, t);
+    } else if (req->op == OP_UPLOAD) {
+        // The body cannot be told apart from commands without knowing its framing
+        if (req->codec == CODEC_UNKNOWN) { respond_err(c, tag, "CODEC"); conn_abort(c); return; }
+        // A pipelining client has already sent the body; drain it even when
+        // refused, unless over quota (upload_refuse())
+        const char *err = !c->sess.authenticated ? "AUTH" : !proto_valid_name(req->name) ? "PROTO" : NULL;
+        upload_begin(c, tag, req->name, req->size, req->codec, err);
+    } else if (req->op == OP_UPLOAD_APPEND || req->op == OP_UPLOAD_PART) {
+        session_body_begin(c, tag, req->token, req->offset, req->size, req->op == OP_UPLOAD_PART,
+                           !c->sess.authenticated ? "AUTH" : NULL);
+    } else {
+        if (!c->sess.authenticated) { respond_err(c, tag, "AUTH"); return; }
+        if (req->op == OP_DOWNLOAD || req->op == OP_DELETE) {
+            if (!proto_valid_name(req->name)) { respond_err(c, tag, "PROTO"); return; }
+            if (req->codec == CODEC_UNKNOWN) { respond_err(c, tag, "CODEC"); return; }
+            task_t *t = conn_new_task(c, req->op == OP_DOWNLOAD ? TASK_DOWNLOAD : TASK_DELETE, tag);
+            if (!t) { respond_err(c, tag, "NOMEM"); return; }
+            snprintf(t->filename, sizeof(t->filename), "%s", req->name);
+            t->codec = req->codec;
+            conn_dispatch(c, t);
+        } else if (req->op == OP_UPLOAD_BEGIN) {
+            if (!proto_valid_name(req->name)) { respond_err(c, tag, "PROTO"); return; }
+            task_t *t = conn_new_task(c, TASK_UPLOAD_BEGIN, tag);
+            if (!t) { respond_err(c, tag, "NOMEM"); return; }
+            snprintf(t->filename, sizeof(t->filename), "%s", req->name);
+            t->size = req->size;
+            t->striped = req->striped;
+            conn_dispatch(c, t);
+        } else if (req->op == OP_UPLOAD_COMMIT || req->op == OP_UPLOAD_STATUS) {
+            task_t *t = conn_new_task(c, req->op == OP_UPLOAD_COMMIT ? TASK_UPLOAD_COMMIT : TASK_UPLOAD_STATUS, tag);
+            if (!t) { respond_err(c, tag, "NOMEM"); return; }
+            t->token = req->token;
+            conn_dispatch(c, t);
+        } else if (req->op == OP_LIST) {
+            task_t *t = conn_new_task(c, TASK_LIST, tag);
+            if (!t) { respond_err(c, tag, "NOMEM"); return; }
+            snprintf(t->filename, sizeof(t->filename), "%s", req->name);
+            t->size = req->size > PROTO_LIST_PAGE_MAX ? PROTO_LIST_PAGE_MAX : req->size;
+            conn_dispatch(c, t);
+        } else {
+            respond_err(c, tag, "UNKNOWN");
+        }
+    }
+}
+
+// Turn a finished task into response bytes; runs on the loop thread.
+static void conn_complete(conn_t *c, task_t *t) {
+    const char *err = t->result.err_msg ? t->result.err_msg : "ERR";
+    long long tag = t->tag;
+    if (t->type == TASK_UPLOAD_RESERVE) {
+        c->state = CONN_READ_UPLOAD;
+        if (t->result.status != 0) upload_refuse(c, err);
+        else { c->up_reserved = t->reserved; upload_stage(c); }
+    } else if (t->type == TASK_UPLOAD_OPEN) {
+        // Refused: drained, then answered, as before the task existed
+        c->state = CONN_READ_UPLOAD;
+        if (t->result.status != 0) c->up_err = err;
+        else c->up_fd = t->fd;
+    } else if (t->result.status != 0) {
+        respond_err(c, tag, err);
+    } else if (t->type == TASK_LOGIN) {
+        c->sess.user_id = t->user_id;
+        snprintf(c->sess.username, sizeof(c->sess.username), "%s", t->username);
+        c->sess.authenticated = 1;
+        respond_ok(c, tag);
+    } else if (t->type == TASK_DOWNLOAD && !t->result.resp_path) {
+        respond_size(c, tag, t->size, (codec_t)t->codec);
+        out_parts(c, t->result.parts, t->result.nparts, (codec_t)t->codec);
+        t->result.parts = NULL;
+    } else if (t->type == TASK_DOWNLOAD) {
+        int fd = open(t->result.resp_path, O_RDONLY);
+        struct stat fst;
+        if (fd < 0 || fstat(fd, &fst) != 0) {
+            if (fd >= 0) close(fd);
+            respond_err(c, tag, "IO");
+        } else {
+            respond_size(c, tag, (long long)fst.st_size, (codec_t)t->codec);
+            out_file(c, fd, (long long)fst.st_size, (codec_t)t->codec);
+        }
+    } else if (t->type == TASK_UPLOAD_BEGIN) {
+        respond_size(c, tag, t->token, CODEC_NONE);
+    } else if (t->type == TASK_UPLOAD_STATUS) {
+        respond_size(c, tag, t->size, CODEC_NONE);
+    } else if (t->type == TASK_LIST) {
+        task_result_t *r = &t->result;
+        respond_items(c, tag, r->list_buf, r->list_len, r->list_count, t->size > 0, r->list_more);
+        r->list_buf = NULL;
+    } else {
+        respond_ok(c, tag);
+    }
+    task_pool_put(&c->loop->tasks, t);
+}
+
+// Make as much progress as the socket allows. Edge-triggered epoll only
+// reports transitions, so every path either runs until EAGAIN or parks the
+// connection on a task whose completion drives it again.
+static void conn_drive(conn_t *c) {
+    char buf[CONN_IO_CHUNK];
+    int fd = c->sess.client_fd;
+    while (!c->closed) {
+        int fr = conn_flush(c);
+        if (fr < 0) { conn_close(c); return; }
+        if (fr > 0) return;
+        if (c->state == CONN_WAIT_TASK || c->state == CONN_WAIT_SETUP) return;
+        if (c->state == CONN_READ_UPLOAD && c->up_codec != CODEC_NONE) {
+            if (upload_read_frames(c) != 0) return;
+            upload_finish(c);
+            continue;
+        }
+        if (c->state == CONN_READ_UPLOAD) {
+            if (c->up_remain == 0) { upload_finish(c); continue; }
+            size_t have = reader_buffered(&c->in);
+            if (have > 0) {
+                size_t n = ((long long)have > c->up_remain) ? (size_t)c->up_remain : have;
+                upload_feed(c, reader_peek(&c->in), n);
+                reader_consume(&c->in, n);
+                continue;
+            }
+            // Bytes past the command line went through user space above;
+            // the rest of the body moves socket -> pipe -> file.
+            ssize_t r;
+            int file_err = 0;
+            if (c->up_err) {
+                size_t want = (c->up_remain > (long long)sizeof(buf)) ? sizeof(buf) : (size_t)c->up_remain;
+                r = recv(fd, buf, want, 0);
+            } else {
+                r = xfer_recv(&c->up_xfer, fd, c->up_fd, (size_t)c->up_remain, &file_err);
+            }
+            if (r == 0) { conn_close(c); return; }
+            if (r < 0) {
+                if (errno == EINTR) continue;
+                if (errno != EAGAIN && errno != EWOULDBLOCK) conn_close(c);
+                return;
+            }
+            if (file_err) c->up_err = "IO";
+            c->up_remain -= r;
+            continue;
+        }
+        if (c->inflight >= CONN_MAX_INFLIGHT) return; // a completion drives us again
+        request_t req;
+        if (c->v2) {
+            int used = proto_decode_request(reader_peek(&c->in), reader_buffered(&c->in), &req);
+            if (used < 0) {
+                respond_err(c, -1, "PROTO");
+                conn_abort(c);
+                return;
+            }
+            if (used > 0) {
+                reader_consume(&c->in, (size_t)used);
+                conn_handle_request(c, &req);
+                continue;
+            }
+        } else {
+            char line[CONN_LINE_MAX];
+            if (reader_next_line(&c->in, line, sizeof(line)) >= 0) {
+                if (proto_parse_line(line, &req) != 0) respond_err(c, req.tag, "PROTO");
+                else conn_handle_request(c, &req);
+                continue;
+            }
+        }
+        if (reader_buffered(&c->in) >= CONN_LINE_MAX) {
+            respond_err(c, -1, "PROTO");
+            conn_abort(c);
+            return;
+        }
+        ssize_t r = reader_fill(&c->in);
+        if (r == 0) { conn_close(c); return; }
+        if (r < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) conn_close(c);
+            return;
+        }
+    }
+}
+
+static void loop_add_conn(io_loop_t *lp, int fd) {
+    set_nonblocking(fd);
+    conn_t *c = (conn_t*)calloc(1, sizeof(conn_t));
+    c->loop = lp;
+    c->sess.client_fd = fd;
+    reader_init(&c->in, fd);
+    c->state = CONN_READ_CMD;
+    c->up_fd = -1;
+    xfer_init(&c->up_xfer, lp->st->upload_mode);
+    struct epoll_event ev; memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.ptr = c;
+    if (epoll_ctl(lp->epfd, EPOLL_CTL_ADD, fd, &ev) != 0) { perror("epoll_ctl"); close(fd); free(c); return; }
+    c->next = lp->conns;
+    if (lp->conns) lp->conns->prev = c;
+    lp->conns = c;
+}
+
+static void loop_on_wake(io_loop_t *lp) {
+    uint64_t v;
+    ssize_t r = read(lp->wake_fd, &v, sizeof(v));
+    (void)r;
+    void *item = NULL;
+    while (ts_queue_try_pop(&lp->st->client_queue, &item) == 0) loop_add_conn(lp, (int)(intptr_t)item);
+    task_t *t = task_list_take(&lp->done);
+    while (t) {
+        task_t *next = t->next;
+        conn_t *c = (conn_t*)t->owner;
+        c->inflight--;
+        if (c->closed) {
+            // nobody left to hand the reservation or the staged file to
+            if (t->type == TASK_UPLOAD_RESERVE && t->result.status == 0) quota_release(lp->st->quota, t->username, t->reserved);
+            if (t->type == TASK_UPLOAD_OPEN && t->result.status == 0) close(t->fd);
+            task_pool_put(&lp->tasks, t);
+            if (c->inflight == 0) { c->next = lp->graveyard; lp->graveyard = c; }
+        } else {
+            conn_complete(c, t);
+            if (c->state == CONN_WAIT_TASK && c->inflight == 0) c->state = CONN_READ_CMD;
+            conn_drive(c);
+        }
+        t = next;
+    }
+}
+
+static void loop_reap(io_loop_t *lp) {
+    while (lp->graveyard) {
+        conn_t *c = lp->graveyard;
+        lp->graveyard = c->next;
+        free(c);
+    }
+}
+
+static void *loop_main(void *arg) {
+    io_loop_t *lp = (io_loop_t*)arg;
+    struct epoll_event evs[LOOP_MAX_EVENTS];
+    while (!__atomic_load_n(&lp->stop, __ATOMIC_ACQUIRE)) {
+        int n = epoll_wait(lp->epfd, evs, LOOP_MAX_EVENTS, -1);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("epoll_wait");
+            break;
+        }
+        for (int i = 0; i < n; i++) {
+            if (evs[i].data.ptr == NULL) loop_on_wake(lp);
+            else conn_drive((conn_t*)evs[i].data.ptr);
+        }
+        loop_reap(lp);
+    }
+    return NULL;
+}
+
+static int loop_init(io_loop_t *lp, server_state_t *st) {
+    memset(lp, 0, sizeof(*lp));
+    lp->st = st;
+    lp->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (lp->epfd < 0) return -1;
+    lp->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (lp->wake_fd < 0) { close(lp->epfd); return -1; }
+    struct epoll_event ev; memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.ptr = NULL;
+    if (epoll_ctl(lp->epfd, EPOLL_CTL_ADD, lp->wake_fd, &ev) != 0) { close(lp->wake_fd); close(lp->epfd); return -1; }
+    return 0;
+}
+
+// Only valid once the loop thread has exited and the workers are stopped
+static void loop_destroy(io_loop_t *lp) {
+    task_t *t = task_list_take(&lp->done);
+    while (t) {
+        task_t *next = t->next;
+        conn_t *c = (conn_t*)t->owner;
+        c->inflight--;
+        if (c->closed && c->inflight == 0) { c->next = lp->graveyard; lp->graveyard = c; }
+        task_pool_put(&lp->tasks, t);
+        t = next;
+    }
+    while (lp->conns) conn_close(lp->conns);
+    loop_reap(lp);
+    task_pool_destroy(&lp->tasks);
+    close(lp->wake_fd);
+    close(lp->epfd);
+}
+
+// Thread count flag: a positive number, or "auto" for one per online CPU.
+// Returns -1 if neither.
+static int parse_threads(const char *s) {
+    if (strcmp(s, "auto") == 0) {
+        long n = sysconf(_SC_NPROCESSORS_ONLN);
+        return n > 0 ? (int)n : 1;
+    }
+    char *end;
+    long n = strtol(s, &end, 10);
+    return *s && !*end && n > 0 && n <= 4096 ? (int)n : -1;
+}
+
+static int keep_chunk(const unsigned char *hash, void *arg) {
+    return db_chunk_exists((db_t*)arg, hash);
+}
+
+int main(int argc, char **argv) {
+    int port = 9000; const char *root = "storage"; const char *dbpath = "storage/meta.db";
+    long long default_quota = 104857600LL;
+    xfer_mode_t download_mode = XFER_SENDFILE, upload_mode = XFER_SPLICE;
+    int prealloc = 1;
+    long long upload_ttl = 86400;
+    ts_queue_impl_t queue_impl = TS_QUEUE_MUTEX;
+    chunk_io_t io_backend = CHUNK_IO_BLOCKING;
+    chunk_sync_t durability = CHUNK_SYNC_STRICT;
+    int sync_interval_ms = 0;
+    int client_threads = 4, workers = 4, workers_max = 0, db_readers = 0;
+    long long queue_depth = 1024;
+    int commit_batch = 64;
+    long long meta_cache_mb = 64;
+    long long commit_wait_us = 0;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--port") == 0 && i+1 < argc) port = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--root") == 0 && i+1 < argc) root = argv[++i];
+        else if (strcmp(argv[i], "--db") == 0 && i+1 < argc) dbpath = argv[++i];
+        else if (strcmp(argv[i], "--quota-bytes") == 0 && i+1 < argc) default_quota = atoll(argv[++i]);
+        else if (strcmp(argv[i], "--download-mode") == 0 && i+1 < argc) {
+            if (xfer_parse_mode(argv[++i], &download_mode) != 0) { fprintf(stderr, "--download-mode: sendfile|splice|copy\n"); return 1; }
+        }
+        else if (strcmp(argv[i], "--upload-mode") == 0 && i+1 < argc) {
+            if (xfer_parse_mode(argv[++i], &upload_mode) != 0 || upload_mode == XFER_SENDFILE) { fprintf(stderr, "--upload-mode: splice|copy\n"); return 1; }
+        }
+        else if (strcmp(argv[i], "--no-prealloc") == 0) prealloc = 0;
+        else if (strcmp(argv[i], "--upload-ttl") == 0 && i+1 < argc) upload_ttl = atoll(argv[++i]);
+        else if (strcmp(argv[i], "--queue-impl") == 0 && i+1 < argc) {
+            if (ts_queue_parse_impl(argv[++i], &queue_impl) != 0) { fprintf(stderr, "--queue-impl: mutex|ring\n"); return 1; }
+        }
+        else if (strcmp(argv[i], "--client-threads") == 0 && i+1 < argc) {
+            if ((client_threads = parse_threads(argv[++i])) < 0) { fprintf(stderr, "--client-threads: N|auto\n"); return 1; }
+        }
+        else if (strcmp(argv[i], "--workers") == 0 && i+1 < argc) {
+            if ((workers = parse_threads(argv[++i])) < 0) { fprintf(stderr, "--workers: N|auto\n"); return 1; }
+        }
+        else if (strcmp(argv[i], "--workers-max") == 0 && i+1 < argc) {
+            if ((workers_max = parse_threads(argv[++i])) < 0) { fprintf(stderr, "--workers-max: N|auto\n"); return 1; }
+        }
+        else if (strcmp(argv[i], "--db-readers") == 0 && i+1 < argc) {
+            if ((db_readers = parse_threads(argv[++i])) < 0) { fprintf(stderr, "--db-readers: N|auto\n"); return 1; }
+        }
+        else if (strcmp(argv[i], "--commit-batch") == 0 && i+1 < argc) {
+            commit_batch = atoi(argv[++i]);
+            if (commit_batch < 1) { fprintf(stderr, "--commit-batch: N > 0\n"); return 1; }
+        }
+        else if (strcmp(argv[i], "--commit-wait-us") == 0 && i+1 < argc) {
+            commit_wait_us = atoll(argv[++i]);
+            if (commit_wait_us < 0) { fprintf(stderr, "--commit-wait-us: N >= 0\n"); return 1; }
+        }
+        else if (strcmp(argv[i], "--meta-cache-mb") == 0 && i+1 < argc) {
+            meta_cache_mb = atoll(argv[++i]);
+            if (meta_cache_mb < 0) { fprintf(stderr, "--meta-cache-mb: N >= 0\n"); return 1; }
+        }
+        else if (strcmp(argv[i], "--io-backend") == 0 && i+1 < argc) {
+            if (chunk_parse_io(argv[++i], &io_backend) != 0) { fprintf(stderr, "--io-backend: blocking|uring\n"); return 1; }
+        }
+        else if (strcmp(argv[i], "--durability") == 0 && i+1 < argc) {
+            if (chunk_parse_sync(argv[++i], &durability) != 0) { fprintf(stderr, "--durability: strict|batched|relaxed\n"); return 1; }
+        }
+        else if (strcmp(argv[i], "--sync-interval-ms") == 0 && i+1 < argc) {
+            sync_interval_ms = atoi(argv[++i]);
+            if (sync_interval_ms < 0) { fprintf(stderr, "--sync-interval-ms: N >= 0\n"); return 1; }
+        }
+        else if (strcmp(argv[i], "--queue-depth") == 0 && i+1 < argc) {
+            queue_depth = atoll(argv[++i]);
+            if (queue_depth < 1) { fprintf(stderr, "--queue-depth: N > 0\n"); return 1; }
+        }
+    }
+    // No SA_RESTART, so Ctrl+C interrupts accept(). Only the main thread
+    // takes the signal; every thread spawned below inherits the mask.
+    struct sigaction sa; memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = handle_sigint;
+    sigaction(SIGINT, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
+    sigset_t sigs, old_sigs;
+    sigemptyset(&sigs); sigaddset(&sigs, SIGINT);
+    pthread_sigmask(SIG_BLOCK, &sigs, &old_sigs);
+    mkdir(root, 0755);
+    if (chunk_set_io(io_backend) != 0) {
+        fprintf(stderr, "io_uring unavailable (%s), using blocking I/O\n", strerror(errno));
+    }
+    chunk_set_sync(durability);
+
+    server_state_t st; memset(&st, 0, sizeof(st));
+    snprintf(st.root_dir, sizeof(st.root_dir), "%s", root);
+    st.download_mode = download_mode;
+    st.upload_mode = upload_mode;
+    st.prealloc = prealloc;
+    if (ts_queue_init_impl(&st.client_queue, LISTEN_BACKLOG, queue_impl) != 0) return 1;
+    // One reader per worker that can exist, unless told otherwise
+    if (db_readers == 0) db_readers = workers_max > workers ? workers_max : workers;
+    if (db_open(&st.db, dbpath, db_readers) != 0) { fprintf(stderr, "DB open failed\n"); return 1; }
+    db_set_chunk_root(&st.db, st.root_dir);
+    // Chunks of uploads that died before their commit (a crash, say) have
+    // no row; nothing else would ever remove them
+    int swept = chunk_store_sweep(st.root_dir, keep_chunk, &st.db);
+    if (swept > 0) printf("Removed %d orphaned chunk files\n", swept);
+    if (db_group_commit(&st.db, commit_batch, commit_wait_us) != 0) { fprintf(stderr, "DB committer start failed\n"); return 1; }
+    // Relaxed leaves the WAL to be synced at checkpoints, like the chunks
+    if (durability == CHUNK_SYNC_RELAXED && db_set_synchronous(&st.db, 0) != 0) { fprintf(stderr, "DB synchronous setting failed\n"); return 1; }
+    if (durability == CHUNK_SYNC_BATCHED && syncer_start(&st.syncer, root, sync_interval_ms) != 0) { fprintf(stderr, "Syncer start failed\n"); return 1; }
+    if (lockmgr_init(&st.locks) != 0) { fprintf(stderr, "Lockmgr init failed\n"); return 1; }
+    if (meta_cache_mb > 0 && mcache_init(&st.mcache, (size_t)meta_cache_mb << 20) != 0) { fprintf(stderr, "Metadata cache init failed\n"); return 1; }
+    if (quota_init(&st.quota) != 0) { fprintf(stderr, "Quota init failed\n"); return 1; }
+
+    st.loop_count = client_threads;
+    st.loops = (io_loop_t*)calloc((size_t)client_threads, sizeof(io_loop_t));
+    for (int i = 0; i < client_threads; i++) {
+        if (loop_init(&st.loops[i], &st) != 0) { perror("event loop"); return 1; }
+        pthread_create(&st.loops[i].thread, NULL, loop_main, &st.loops[i]);
+    }
+
+    st.worker_pool.upload_ttl = upload_ttl;
+    st.worker_pool.mcache = st.mcache;
+    st.worker_pool.quota = st.quota;
+    st.worker_pool.syncer = st.syncer;
+    st.worker_pool.max_workers = workers_max;
+    if (worker_pool_start(&st.worker_pool, workers, (size_t)queue_depth, queue_impl, st.root_dir, &st.db, st.locks) != 0) { fprintf(stderr, "Worker pool start failed\n"); return 1; }
+    pthread_sigmask(SIG_SETMASK, &old_sigs, NULL);
+
+    int lfd = create_listener(port);
+    fprintf(stdout, "Server listening on %d\n", port);
+    int next_loop = 0;
+    while (g_running) {
+        struct sockaddr_in cli; socklen_t cl = sizeof(cli);
+        int cfd = accept(lfd, (struct sockaddr*)&cli, &cl);
+        if (cfd < 0) { if (errno == EINTR) continue; perror("accept"); break; }
+        char ip[64];
+        const char *ipstr = inet_ntop(AF_INET, &cli.sin_addr, ip, sizeof(ip)) ? ip : "?";
+        int cport = ntohs(cli.sin_port);
+        fprintf(stdout, "Client connected %s:%d\n", ipstr, cport);
+        if (ts_queue_push(&st.client_queue, (void*)(intptr_t)cfd) != 0) { close(cfd); break; }
+        loop_wake(&st.loops[next_loop]);
+        next_loop = (next_loop + 1) % st.loop_count;
+    }
+    close(lfd);
+
+    ts_queue_close(&st.client_queue);
+    for (int i = 0; i < st.loop_count; i++) {
+        __atomic_store_n(&st.loops[i].stop, 1, __ATOMIC_RELEASE);
+        loop_wake(&st.loops[i]);
+    }
+    for (int i = 0; i < st.loop_count; i++) pthread_join(st.loops[i].thread, NULL);
+    void *item = NULL;
+    while (ts_queue_try_pop(&st.client_queue, &item) == 0) close((int)(intptr_t)item);
+
+    // Queued tasks still run; their completions land on the loops' lists
+    worker_pool_stop(&st.worker_pool);
+    syncer_stop(st.syncer);
+    for (int i = 0; i < st.loop_count; i++) loop_destroy(&st.loops[i]);
+    free(st.loops);
+    ts_queue_destroy(&st.client_queue);
+    db_close(&st.db);
+    lockmgr_destroy(st.locks);
+    mcache_destroy(st.mcache);
+    quota_destroy(st.quota);
+    stats_dump(stdout);
+    (void)default_quota; // currently default quota applies on signup
+    return 0;
+}
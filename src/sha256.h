@@ -0,0 +1,21 @@
+#ifndef SHA256_H
+#define SHA256_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SHA256_LEN 32
+
+typedef struct {
+    uint32_t h[8];
+    uint64_t total; // bytes fed so far
+    unsigned char block[64];
+    size_t used;    // bytes waiting in block
+} sha256_t;
+
+void sha256_init(sha256_t *s);
+void sha256_update(sha256_t *s, const void *data, size_t n);
+void sha256_final(sha256_t *s, unsigned char out[SHA256_LEN]);
+void sha256(const void *data, size_t n, unsigned char out[SHA256_LEN]);
+
+#endif
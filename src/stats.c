@@ -0,0 +1,134 @@
+#include "stats.h"
+
+#include <string.h>
+
+static long long g_stats[STAT_COUNT];
+
+static const char *g_stat_names[STAT_COUNT] = {
+    "dl_sendfile_calls",
+    "dl_sendfile_bytes",
+    "dl_splice_calls",
+    "dl_splice_bytes",
+    "dl_copy_calls",
+    "dl_copy_bytes",
+    "up_splice_calls",
+    "up_splice_bytes",
+    "up_copy_calls",
+    "up_copy_bytes",
+    "reply_calls",
+    "reply_bytes",
+    "z_lz4_frames",
+    "z_stored_frames",
+    "z_skipped",
+    "z_raw_bytes",
+    "z_wire_bytes",
+    "chunks_new",
+    "chunks_dup",
+    "chunk_dup_bytes",
+    "chunks_freed",
+    "sessions_expired",
+    "lane_meta_tasks",
+    "lane_meta_depth",
+    "lane_meta_wait_us",
+    "lane_bulk_tasks",
+    "lane_bulk_depth",
+    "lane_bulk_wait_us",
+    "workers",
+    "workers_busy",
+    "db_commits",
+    "db_commit_ops",
+    "mcache_hits",
+    "mcache_misses",
+    "mcache_evictions",
+    "mcache_bytes",
+    "quota_rejects",
+    "quota_reserved",
+    "syncs",
+    "sync_waits",
+};
+
+#define HIST_BUCKETS 32 // bucket b > 0 holds [2^(b-1), 2^b); the last is open-ended
+
+static long long g_hists[HIST_COUNT][HIST_BUCKETS];
+
+static const char *g_hist_names[HIST_COUNT] = {
+    "lane_meta_wait",
+    "lane_bulk_wait",
+};
+
+// Derived bytes-per-syscall lines: {bytes counter, calls counter, name}
+static const struct { stat_id_t bytes, calls; const char *name; } g_ratios[] = {
+    { STAT_DL_SENDFILE_BYTES, STAT_DL_SENDFILE_CALLS, "dl_sendfile_bytes_per_call" },
+    { STAT_DL_SPLICE_BYTES, STAT_DL_SPLICE_CALLS, "dl_splice_bytes_per_call" },
+    { STAT_DL_COPY_BYTES, STAT_DL_COPY_CALLS, "dl_copy_bytes_per_call" },
+    { STAT_UP_SPLICE_BYTES, STAT_UP_SPLICE_CALLS, "up_splice_bytes_per_call" },
+    { STAT_UP_COPY_BYTES, STAT_UP_COPY_CALLS, "up_copy_bytes_per_call" },
+    { STAT_REPLY_BYTES, STAT_REPLY_CALLS, "reply_bytes_per_call" },
+    { STAT_LANE_META_WAIT_US, STAT_LANE_META_TASKS, "lane_meta_wait_us_per_task" },
+    { STAT_LANE_BULK_WAIT_US, STAT_LANE_BULK_TASKS, "lane_bulk_wait_us_per_task" },
+    { STAT_DB_COMMIT_OPS, STAT_DB_COMMITS, "db_ops_per_commit" },
+    { STAT_SYNC_WAITS, STAT_SYNCS, "sync_waits_per_sync" },
+};
+
+void stats_add(stat_id_t id, long long v) {
+    __atomic_fetch_add(&g_stats[id], v, __ATOMIC_RELAXED);
+}
+
+long long stats_get(stat_id_t id) {
+    return __atomic_load_n(&g_stats[id], __ATOMIC_RELAXED);
+}
+
+void stats_hist_add(hist_id_t id, long long us) {
+    int b = us > 0 ? 64 - __builtin_clzll((unsigned long long)us) : 0;
+    if (b >= HIST_BUCKETS) b = HIST_BUCKETS - 1;
+    __atomic_fetch_add(&g_hists[id][b], 1, __ATOMIC_RELAXED);
+}
+
+// Upper bound of the bucket the pct-th percentile falls in; 0 when empty
+static long long hist_percentile(hist_id_t id, int pct) {
+    long long counts[HIST_BUCKETS], total = 0;
+    for (int b = 0; b < HIST_BUCKETS; b++) {
+        counts[b] = __atomic_load_n(&g_hists[id][b], __ATOMIC_RELAXED);
+        total += counts[b];
+    }
+    long long rank = (total * pct + 99) / 100, seen = 0;
+    for (int b = 0; b < HIST_BUCKETS; b++) {
+        seen += counts[b];
+        if (seen >= rank && seen > 0) return b ? (1LL << b) - 1 : 0;
+    }
+    return 0;
+}
+
+int stats_format(char *buf, size_t cap) {
+    size_t off = 0;
+    int lines = 0;
+    if (cap == 0) return 0;
+    buf[0] = '\0';
+    for (int i = 0; i < STAT_COUNT; i++) {
+        int n = snprintf(buf + off, cap - off, "%s %lld\n", g_stat_names[i], stats_get((stat_id_t)i));
+        if (n < 0 || (size_t)n >= cap - off) { buf[off] = '\0'; return lines; }
+        off += (size_t)n; lines++;
+    }
+    for (size_t i = 0; i < sizeof(g_ratios) / sizeof(g_ratios[0]); i++) {
+        long long calls = stats_get(g_ratios[i].calls);
+        long long per = calls ? stats_get(g_ratios[i].bytes) / calls : 0;
+        int n = snprintf(buf + off, cap - off, "%s %lld\n", g_ratios[i].name, per);
+        if (n < 0 || (size_t)n >= cap - off) { buf[off] = '\0'; return lines; }
+        off += (size_t)n; lines++;
+    }
+    for (int i = 0; i < HIST_COUNT; i++) {
+        int n = snprintf(buf + off, cap - off, "%s_p50_us %lld\n%s_p99_us %lld\n",
+                         g_hist_names[i], hist_percentile((hist_id_t)i, 50),
+                         g_hist_names[i], hist_percentile((hist_id_t)i, 99));
+        if (n < 0 || (size_t)n >= cap - off) { buf[off] = '\0'; return lines; }
+        off += (size_t)n; lines += 2;
+    }
+    return lines;
+}
+
+void stats_dump(FILE *out) {
+    char buf[8192];
+    stats_format(buf, sizeof(buf));
+    fputs(buf, out);
+    fflush(out);
+}
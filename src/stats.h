@@ -0,0 +1,69 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stddef.h>
+#include <stdio.h>
+
+// Process-wide counters; cheap relaxed atomics, safe from any thread
+typedef enum {
+    STAT_DL_SENDFILE_CALLS,
+    STAT_DL_SENDFILE_BYTES,
+    STAT_DL_SPLICE_CALLS,
+    STAT_DL_SPLICE_BYTES,
+    STAT_DL_COPY_CALLS,
+    STAT_DL_COPY_BYTES,
+    STAT_UP_SPLICE_CALLS,
+    STAT_UP_SPLICE_BYTES,
+    STAT_UP_COPY_CALLS,
+    STAT_UP_COPY_BYTES,
+    STAT_REPLY_CALLS,    // sendmsg() calls for inline replies (headers, LIST, errors)
+    STAT_REPLY_BYTES,
+    STAT_Z_LZ4_FRAMES,   // compressed bodies, both directions: frames LZ4 shrank
+    STAT_Z_STORED_FRAMES, // and frames sent verbatim
+    STAT_Z_SKIPPED,      // downloads that stopped compressing after the first frame
+    STAT_Z_RAW_BYTES,
+    STAT_Z_WIRE_BYTES,
+    STAT_CHUNKS_NEW,     // chunk store: chunks written by uploads
+    STAT_CHUNKS_DUP,     // chunks uploads found already stored
+    STAT_CHUNK_DUP_BYTES, // upload bytes those covered, never stored twice
+    STAT_CHUNKS_FREED,   // chunks removed once nothing referenced them
+    STAT_SESSIONS_EXPIRED, // resumable upload sessions dropped after the TTL
+    STAT_LANE_META_TASKS, // worker pool lanes (threadpool.h): tasks started,
+    STAT_LANE_META_DEPTH, // tasks waiting right now (a gauge),
+    STAT_LANE_META_WAIT_US, // and total time tasks spent waiting
+    STAT_LANE_BULK_TASKS,
+    STAT_LANE_BULK_DEPTH,
+    STAT_LANE_BULK_WAIT_US,
+    STAT_WORKERS,        // worker threads running (a gauge; moves under --workers-max)
+    STAT_WORKERS_BUSY,   // and those inside a task right now
+    STAT_DB_COMMITS,     // metadata write transactions committed (db.h)
+    STAT_DB_COMMIT_OPS,  // and the writes they carried
+    STAT_MCACHE_HITS,    // metadata cache (mcache.h): LOGIN/LIST/quota lookups served from memory
+    STAT_MCACHE_MISSES,  // and those that went to SQLite
+    STAT_MCACHE_EVICTIONS, // accounts dropped to stay within the budget
+    STAT_MCACHE_BYTES,   // memory held (a gauge)
+    STAT_QUOTA_REJECTS,  // uploads refused up front by quota reservations (quota.h)
+    STAT_QUOTA_RESERVED, // bytes reserved by uploads in flight (a gauge)
+    STAT_SYNCS,          // --durability batched (syncer.h): filesystem flushes
+    STAT_SYNC_WAITS,     // and the uploads they covered
+    STAT_COUNT
+} stat_id_t;
+
+// Latency distributions in power-of-two microsecond buckets; formatted as
+// p50/p99 upper bounds
+typedef enum {
+    HIST_LANE_META_WAIT,
+    HIST_LANE_BULK_WAIT,
+    HIST_COUNT
+} hist_id_t;
+
+void stats_add(stat_id_t id, long long v);
+long long stats_get(stat_id_t id);
+void stats_hist_add(hist_id_t id, long long us);
+
+// Writes "name value\n" lines (counters plus derived ratios) into buf;
+// returns the number of lines
+int stats_format(char *buf, size_t cap);
+void stats_dump(FILE *out);
+
+#endif
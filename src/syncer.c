@@ -0,0 +1,108 @@
+#define _GNU_SOURCE
+#include "syncer.h"
+#include "stats.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+// Waiters take tickets; a flush started once tickets up to `target` were
+// handed out covers them all. Failed ranges are kept as one span, which
+// only loses an older failure if its waiters slept through two flushes.
+struct syncer {
+    int fd, interval_ms;
+    pthread_mutex_t mu;
+    pthread_cond_t cond, done_cond; // syncer wakeup; flush finished
+    unsigned long long issued, done;
+    unsigned long long fail_lo, fail_hi; // tickets in (fail_lo, fail_hi] failed
+    int stop;
+    pthread_t thread;
+};
+
+static void *syncer_main(void *arg) {
+    syncer_t *s = (syncer_t*)arg;
+    struct timespec last = {0, 0};
+    pthread_mutex_lock(&s->mu);
+    for (;;) {
+        while (s->issued == s->done && !s->stop) pthread_cond_wait(&s->cond, &s->mu);
+        if (s->issued == s->done) break; // stopping, nobody waiting
+        // No sooner than interval_ms after the previous flush began; the
+        // uploads that arrive meanwhile ride along
+        if (s->interval_ms > 0 && !s->stop) {
+            struct timespec ts = last;
+            ts.tv_sec += s->interval_ms / 1000;
+            ts.tv_nsec += (long)(s->interval_ms % 1000) * 1000000L;
+            if (ts.tv_nsec >= 1000000000L) { ts.tv_sec++; ts.tv_nsec -= 1000000000L; }
+            while (!s->stop) {
+                if (pthread_cond_timedwait(&s->cond, &s->mu, &ts) == ETIMEDOUT) break;
+            }
+        }
+        unsigned long long from = s->done, target = s->issued;
+        pthread_mutex_unlock(&s->mu);
+        clock_gettime(CLOCK_MONOTONIC, &last);
+        int rc = syncfs(s->fd);
+        stats_add(STAT_SYNCS, 1);
+        stats_add(STAT_SYNC_WAITS, (long long)(target - from));
+        pthread_mutex_lock(&s->mu);
+        if (rc != 0) {
+            if (s->fail_hi != from) s->fail_lo = from;
+            s->fail_hi = target;
+        }
+        s->done = target;
+        pthread_cond_broadcast(&s->done_cond);
+    }
+    pthread_mutex_unlock(&s->mu);
+    return NULL;
+}
+
+int syncer_start(syncer_t **out, const char *fs_path, int interval_ms) {
+    syncer_t *s = (syncer_t*)calloc(1, sizeof(*s));
+    if (!s) return -1;
+    if ((s->fd = open(fs_path, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0) { free(s); return -1; }
+    s->interval_ms = interval_ms > 0 ? interval_ms : 0;
+    pthread_mutex_init(&s->mu, NULL);
+    // The interval is measured on the monotonic clock
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&s->cond, &attr);
+    pthread_condattr_destroy(&attr);
+    pthread_cond_init(&s->done_cond, NULL);
+    if (pthread_create(&s->thread, NULL, syncer_main, s) != 0) {
+        pthread_cond_destroy(&s->done_cond);
+        pthread_cond_destroy(&s->cond);
+        pthread_mutex_destroy(&s->mu);
+        close(s->fd);
+        free(s);
+        return -1;
+    }
+    *out = s;
+    return 0;
+}
+
+void syncer_stop(syncer_t *s) {
+    if (!s) return;
+    pthread_mutex_lock(&s->mu);
+    s->stop = 1;
+    pthread_cond_signal(&s->cond);
+    pthread_mutex_unlock(&s->mu);
+    pthread_join(s->thread, NULL);
+    pthread_cond_destroy(&s->done_cond);
+    pthread_cond_destroy(&s->cond);
+    pthread_mutex_destroy(&s->mu);
+    close(s->fd);
+    free(s);
+}
+
+int syncer_wait(syncer_t *s) {
+    pthread_mutex_lock(&s->mu);
+    unsigned long long ticket = ++s->issued;
+    pthread_cond_signal(&s->cond);
+    while (s->done < ticket) pthread_cond_wait(&s->done_cond, &s->mu);
+    int rc = ticket > s->fail_lo && ticket <= s->fail_hi ? -1 : 0;
+    pthread_mutex_unlock(&s->mu);
+    return rc;
+}
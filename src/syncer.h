@@ -0,0 +1,19 @@
+#ifndef SYNCER_H
+#define SYNCER_H
+
+// Background syncer for --durability batched: chunks are written without
+// an fsync each, and an upload waits here before its manifest commits. One
+// thread runs syncfs() on the storage filesystem for everyone waiting (at
+// most one every interval_ms) and then wakes them all, so a burst of small
+// uploads shares one flush, renames and new directories included.
+typedef struct syncer syncer_t;
+
+// fs_path: any directory on the filesystem to flush (the storage root)
+int syncer_start(syncer_t **out, const char *fs_path, int interval_ms);
+void syncer_stop(syncer_t *s);
+
+// Returns 0 once everything written before the call is on disk; -1 if the
+// flush that covered it failed
+int syncer_wait(syncer_t *s);
+
+#endif
@@ -1,7 +1,13 @@
+#define _GNU_SOURCE
 #include "threadpool.h"
 #include "db.h"
+#include "mcache.h"
+#include "quota.h"
+#include "syncer.h"
 #include "util.h"
+#include "stats.h"
 
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -9,41 +15,88 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <fcntl.h>
+#include <time.h>
+#include <sys/file.h>
+#include <sys/random.h>
 
 static void task_result_init(task_result_t *r) {
-    pthread_mutex_init(&r->mutex, NULL);
-    pthread_cond_init(&r->done_cv, NULL);
-    r->done = 0;
     r->status = 0;
     r->err_msg = NULL;
     r->resp_path = NULL;
-    r->list_names = NULL;
+    r->parts = NULL;
+    r->nparts = 0;
+    r->list_buf = NULL;
+    r->list_len = 0;
     r->list_count = 0;
+    r->list_more = 0;
 }
 
 static void task_result_destroy(task_result_t *r) {
-    pthread_mutex_destroy(&r->mutex);
-    pthread_cond_destroy(&r->done_cv);
-    free(r->err_msg);
     free(r->resp_path);
-    if (r->list_names) {
-        for (int i = 0; i < r->list_count; i++) free(r->list_names[i]);
-        free(r->list_names);
-    }
+    free(r->parts);
+    free(r->list_buf);
 }
 
 void task_init(task_t *t) {
-    memset(t, 0, sizeof(*t));
+    memset(t, 0, offsetof(task_t, username));
+    t->username[0] = t->filename[0] = t->password[0] = t->upload_tmp_path[0] = '\0';
     task_result_init(&t->result);
 }
 
 void task_free(task_t *t) {
-    free(t->username);
-    free(t->filename);
-    free(t->upload_tmp_path);
     task_result_destroy(&t->result);
 }
 
+#define TASK_POOL_MAX 1024 // spare tasks a pool keeps; more go back to the heap
+
+task_t *task_pool_get(task_pool_t *p) {
+    task_t *t = p->free;
+    if (t) {
+        p->free = t->next;
+        p->count--;
+    } else if (!(t = (task_t*)malloc(sizeof(task_t)))) {
+        return NULL;
+    }
+    task_init(t);
+    return t;
+}
+
+void task_pool_put(task_pool_t *p, task_t *t) {
+    task_free(t);
+    if (p->count >= TASK_POOL_MAX) { free(t); return; }
+    t->next = p->free;
+    p->free = t;
+    p->count++;
+}
+
+void task_pool_destroy(task_pool_t *p) {
+    while (p->free) {
+        task_t *t = p->free;
+        p->free = t->next;
+        free(t);
+    }
+    p->count = 0;
+}
+
+int task_list_push(task_t **list, task_t *t) {
+    task_t *head = __atomic_load_n(list, __ATOMIC_RELAXED);
+    do {
+        t->next = head;
+    } while (!__atomic_compare_exchange_n(list, &head, t, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    return head == NULL;
+}
+
+task_t *task_list_take(task_t **list) {
+    task_t *t = __atomic_exchange_n(list, NULL, __ATOMIC_ACQUIRE), *prev = NULL;
+    while (t) { // pushed newest first
+        task_t *next = t->next;
+        t->next = prev;
+        prev = t;
+        t = next;
+    }
+    return prev;
+}
+
 static int ensure_user_dir(const char *root, const char *username, char *out_path, size_t out_sz) {
     int n = snprintf(out_path, out_sz, "%s/%s", root, username);
     if (n <= 0 || (size_t)n >= out_sz) return -1;
@@ -59,149 +112,641 @@ static int join_user_file(const char *root, const char *username, const char *na
     return 0;
 }
 
-static int move_file(const char *src, const char *dst) {
-    if (rename(src, dst) == 0) return 0;
-    // fallback copy
-    int in = open(src, O_RDONLY);
-    if (in < 0) return -1;
-    int out = open(dst, O_WRONLY | O_CREAT | O_TRUNC, 0644);
-    if (out < 0) { close(in); return -1; }
-    char buf[64 * 1024];
-    ssize_t r;
-    while ((r = read(in, buf, sizeof(buf))) > 0) {
-        if (write_n(out, buf, (size_t)r) < 0) { close(in); close(out); return -1; }
-    }
-    close(in); close(out);
-    unlink(src);
+int upload_session_path(const char *root, const char *username, long long token, char *out, size_t cap) {
+    if (ensure_user_dir(root, username, out, cap) != 0) return -1;
+    size_t len = strlen(out);
+    int n = snprintf(out + len, cap - len, "/.upload.%016llx", (unsigned long long)token);
+    if (n <= 0 || (size_t)n >= cap - len) return -1;
+    return 0;
+}
+
+int upload_stripe_path(const char *root, const char *username, long long token, char *out, size_t cap) {
+    if (upload_session_path(root, username, token, out, cap) != 0) return -1;
+    size_t len = strlen(out);
+    int n = snprintf(out + len, cap - len, ".parts");
+    if (n <= 0 || (size_t)n >= cap - len) return -1;
+    return 0;
+}
+
+int upload_stripe_add(const char *path, long long offset, long long len) {
+    char line[64];
+    int n = snprintf(line, sizeof(line), "%lld %lld\n", offset, len);
+    int fd = open(path, O_WRONLY | O_APPEND);
+    if (fd < 0) return -1;
+    int rc = write(fd, line, (size_t)n) == n ? 0 : -1;
+    close(fd);
+    return rc;
+}
+
+static int range_cmp(const void *a, const void *b) {
+    long long x = ((const long long*)a)[0], y = ((const long long*)b)[0];
+    return (x > y) - (x < y);
+}
+
+int upload_stripe_read(const char *path, long long *size, long long *covered) {
+    FILE *f = fopen(path, "r");
+    if (!f) return -1;
+    if (fscanf(f, "%lld", size) != 1) { fclose(f); return -1; }
+    long long (*ranges)[2] = NULL, off, len;
+    size_t n = 0, cap = 0;
+    while (fscanf(f, "%lld %lld", &off, &len) == 2) {
+        if (n == cap) { cap = cap ? cap * 2 : 16; ranges = realloc(ranges, sizeof(*ranges) * cap); }
+        ranges[n][0] = off;
+        ranges[n][1] = off + len;
+        n++;
+    }
+    fclose(f);
+    if (n > 0) qsort(ranges, n, sizeof(*ranges), range_cmp);
+    long long end = 0;
+    *covered = 0;
+    for (size_t i = 0; i < n; i++) {
+        long long from = ranges[i][0] > end ? ranges[i][0] : end;
+        if (ranges[i][1] > from) { *covered += ranges[i][1] - from; end = ranges[i][1]; }
+    }
+    free(ranges);
     return 0;
 }
 
+static char *hash_password(const char *pw) {
+    // For MVP: NOT secure; replace with argon2/bcrypt later
+    size_t n = strlen(pw);
+    char *out = (char*)malloc(n * 2 + 1);
+    for (size_t i = 0; i < n; i++) { out[i*2] = pw[i]; out[i*2+1] = 'x'; }
+    out[n*2] = '\0';
+    return out;
+}
+
 static void set_error(task_result_t *res, const char *msg) {
     res->status = -1;
-    free(res->err_msg);
-    res->err_msg = strdup(msg);
+    res->err_msg = msg;
+}
+
+// user_mode on the task's user, then file_mode on its file. The lock
+// manager only fails when it cannot allocate, and then nothing is held and
+// the client gets ERR SERVER rather than an unguarded write.
+static int lock_file(worker_pool_t *wp, task_t *t, lock_mode_t user_mode, lock_mode_t file_mode) {
+    if (lockmgr_user_lock(wp->locks, t->username, user_mode) == 0) {
+        if (lockmgr_file_lock(wp->locks, t->username, t->filename, file_mode) == 0) return 0;
+        lockmgr_user_unlock(wp->locks, t->username, user_mode);
+    }
+    set_error(&t->result, "SERVER");
+    return -1;
+}
+
+static void unlock_file(worker_pool_t *wp, task_t *t, lock_mode_t user_mode, lock_mode_t file_mode) {
+    lockmgr_file_unlock(wp->locks, t->username, t->filename, file_mode);
+    lockmgr_user_unlock(wp->locks, t->username, user_mode);
 }
 
 static void worker_handle_upload(worker_pool_t *wp, task_t *t, db_t *db) {
-    // Serialize conflicting ops: user write and file write
-    lockmgr_user_lock(wp->locks, t->username, 1);
-    lockmgr_file_lock(wp->locks, t->username, t->filename, 1);
+    // Exclusive on the file only: other files of the user go on in
+    // parallel, and used_bytes moves inside db_put_manifest's transaction
+    if (lock_file(wp, t, LOCK_IX, LOCK_X) != 0) goto unlocked;
     char final_path[1024];
     if (join_user_file(wp->root_dir, t->username, t->filename, final_path, sizeof(final_path)) != 0) {
         set_error(&t->result, "PATH");
         goto out;
     }
-    // Move temp file into place
-    if (move_file(t->upload_tmp_path, final_path) != 0) {
-        set_error(&t->result, "MOVE");
-        goto out;
+    // Chunks already on disk are not written again; db_put_manifest()
+    // rewrites any that a concurrent release removed meanwhile (db.h). The ones this
+    // upload wrote are handed back to the committer if it does not commit.
+    chunk_ref_t *refs = NULL, *written = NULL;
+    int nrefs = 0, nwritten = 0, nfreed = 0, fresh = 0;
+    long long fresh_bytes = 0, delta = 0;
+    if (chunk_store_file(wp->root_dir, t->upload_tmp_path, &refs, &nrefs, &written, &nwritten) != 0) {
+        set_error(&t->result, "IO");
+        goto discard;
     }
-    long long delta = 0;
-    if (db_upsert_file(db, t->user_id, t->filename, t->size, &delta) != 0) {
-        set_error(&t->result, "DB");
-        goto out;
+    // Batched durability: the new chunks reach the disk, along with other
+    // uploads', before a manifest can point at them
+    if (wp->syncer && syncer_wait(wp->syncer) != 0) {
+        set_error(&t->result, "IO");
+        goto discard;
+    }
+    if (wp->quota) quota_begin(wp->quota, t->username);
+    int rc = db_put_manifest(db, t->user_id, t->filename, t->size, t->upload_tmp_path, refs, nrefs, 1,
+                             &delta, &nfreed, &fresh, &fresh_bytes);
+    if (rc != 0) {
+        if (wp->quota) quota_end(wp->quota, t->username);
+        if (rc == DB_QUOTA) stats_add(STAT_QUOTA_REJECTS, 1);
+        set_error(&t->result, rc == DB_QUOTA ? "QUOTA" : "DB");
+        goto discard;
+    }
+    // Still under the file's X lock, so writes to one file reach the
+    // cache in commit order
+    if (wp->mcache) mcache_file_set(wp->mcache, t->username, t->filename, t->size);
+    if (wp->quota) {
+        quota_commit(wp->quota, t->username, t->reserved, delta);
+        quota_end(wp->quota, t->username);
     }
+    stats_add(STAT_CHUNKS_NEW, fresh);
+    stats_add(STAT_CHUNKS_DUP, nrefs - fresh);
+    stats_add(STAT_CHUNK_DUP_BYTES, t->size - fresh_bytes);
+    stats_add(STAT_CHUNKS_FREED, nfreed);
+    unlink(final_path); // a whole copy from before the chunk store
+    goto done;
+discard:
+    db_discard_chunks(db, written, nwritten);
+done:
+    free(refs);
+    free(written);
 out:
-    lockmgr_file_unlock(wp->locks, t->username, t->filename, 1);
-    lockmgr_user_unlock(wp->locks, t->username, 1);
+    unlock_file(wp, t, LOCK_IX, LOCK_X);
+unlocked:
+    // a failed commit keeps the session's staged bytes, and its reservation,
+    // for another try
+    if (t->type == TASK_UPLOAD || t->result.status == 0) unlink(t->upload_tmp_path);
+    if (wp->quota && t->type == TASK_UPLOAD && t->result.status != 0) quota_release(wp->quota, t->username, t->reserved);
 }
 
-static void worker_handle_download(worker_pool_t *wp, task_t *t, db_t *db) {
+// Drops sessions idle for longer than the TTL. An append in progress keeps
+// the staged file's mtime fresh, which counts as a sign of life.
+static void sweep_sessions(worker_pool_t *wp, db_t *db) {
+    long long now = (long long)time(NULL), cutoff = now - wp->upload_ttl;
+    db_session_t *stale = NULL;
+    int n = 0;
+    if (db_session_stale(db, cutoff, &stale, &n) != 0) return;
+    for (int i = 0; i < n; i++) {
+        struct stat st;
+        if (stat(stale[i].path, &st) == 0 && (long long)st.st_mtime >= cutoff) {
+            db_session_touch(db, stale[i].token, (long long)st.st_mtime);
+            continue;
+        }
+        char parts[1100];
+        snprintf(parts, sizeof(parts), "%s.parts", stale[i].path);
+        unlink(parts);
+        unlink(stale[i].path);
+        db_session_delete(db, stale[i].token);
+        if (wp->quota) quota_unhold(wp->quota, stale[i].token, 1);
+        stats_add(STAT_SESSIONS_EXPIRED, 1);
+    }
+    free(stale);
+}
+
+// Replacing a file only needs room for the growth. The bytes reserved, or
+// -1 with QUOTA set on the task.
+static long long reserve_upload(worker_pool_t *wp, task_t *t, db_t *db) {
+    long long old_size = 0, reserved;
+    if (db_get_file_size(db, t->user_id, t->filename, &old_size) != 0) old_size = 0;
+    if ((reserved = quota_reserve(wp->quota, t->username, t->size - old_size)) < 0) {
+        stats_add(STAT_QUOTA_REJECTS, 1);
+        set_error(&t->result, "QUOTA");
+    }
+    return reserved;
+}
+
+static void worker_handle_upload_begin(worker_pool_t *wp, task_t *t, db_t *db) {
+    // Refused here, before the client sends a byte of the body
+    long long reserved = 0;
+    if (wp->quota && (reserved = reserve_upload(wp, t, db)) < 0) return;
+    char path[1024];
+    int fd = -1;
+    for (int tries = 0; fd < 0 && tries < 8; tries++) {
+        uint64_t r = 0;
+        if (getrandom(&r, sizeof(r), 0) != (ssize_t)sizeof(r)) break;
+        t->token = (long long)(r >> 1);
+        if (t->token == 0 || upload_session_path(wp->root_dir, t->username, t->token, path, sizeof(path)) != 0) continue;
+        fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0644);
+    }
+    if (fd < 0) { set_error(&t->result, "IO"); goto fail; }
+    char parts[1024];
+    if (t->striped) {
+        // Parts land anywhere in the file: reserve all of it up front (best
+        // effort), then start the list of what has arrived
+        if (t->size > 0) fallocate(fd, 0, 0, (off_t)t->size);
+        int pfd = -1;
+        char line[32];
+        int n = snprintf(line, sizeof(line), "%lld\n", t->size);
+        if (upload_stripe_path(wp->root_dir, t->username, t->token, parts, sizeof(parts)) != 0 ||
+            (pfd = open(parts, O_WRONLY | O_CREAT | O_EXCL, 0644)) < 0 || write(pfd, line, (size_t)n) != n) {
+            if (pfd >= 0) { close(pfd); unlink(parts); }
+            close(fd);
+            unlink(path);
+            set_error(&t->result, "IO");
+            goto fail;
+        }
+        close(pfd);
+    }
+    close(fd);
+    if (db_session_create(db, t->token, t->user_id, t->filename, t->size, path) != 0) {
+        if (t->striped) unlink(parts);
+        unlink(path);
+        set_error(&t->result, "DB");
+        goto fail;
+    }
+    if (wp->quota) quota_hold(wp->quota, t->token, t->username, reserved);
+    return;
+fail:
+    if (wp->quota) quota_release(wp->quota, t->username, reserved);
+}
+
+// The loop holds the UPLOAD's body back until this is done; on success it
+// owns t->reserved
+static void worker_handle_upload_reserve(worker_pool_t *wp, task_t *t, db_t *db) {
+    if ((t->reserved = reserve_upload(wp, t, db)) < 0) t->reserved = 0;
+}
+
+// UPLOAD_APPEND goes into the staged file at offset, which may rewind over
+// staged bytes but not skip past them. UPLOAD_PART takes any range of a
+// striped session, from any number of connections at once: each has its
+// own descriptor positioned at its range (a pwrite() that splice can carry
+// on), and a shared lock that keeps UPLOAD_COMMIT out until it is done.
+static void worker_handle_upload_open(worker_pool_t *wp, task_t *t, db_t *db) {
     (void)db;
-    lockmgr_file_lock(wp->locks, t->username, t->filename, 0);
+    char path[1024], parts[1024];
+    struct stat st;
+    long long size, covered;
+    if (upload_session_path(wp->root_dir, t->username, t->token, path, sizeof(path)) != 0 ||
+        upload_stripe_path(wp->root_dir, t->username, t->token, parts, sizeof(parts)) != 0 ||
+        (t->fd = open(path, O_WRONLY)) < 0) {
+        t->fd = -1;
+        set_error(&t->result, "NOSESSION");
+        return;
+    }
+    if (t->striped) {
+        if (upload_stripe_read(parts, &size, &covered) != 0) set_error(&t->result, "STRIPE");
+        else if (t->offset > size || t->size > size - t->offset) set_error(&t->result, "OFFSET");
+        else if (flock(t->fd, LOCK_SH | LOCK_NB) != 0) set_error(&t->result, "BUSY");
+        else if (lseek(t->fd, (off_t)t->offset, SEEK_SET) < 0) set_error(&t->result, "IO");
+    } else {
+        // One writer per session: a stale connection may still be mid-append
+        if (access(parts, F_OK) == 0) set_error(&t->result, "STRIPE");
+        else if (flock(t->fd, LOCK_EX | LOCK_NB) != 0) set_error(&t->result, "BUSY");
+        else if (fstat(t->fd, &st) != 0 || t->offset > (long long)st.st_size) set_error(&t->result, "OFFSET");
+        else if (ftruncate(t->fd, (off_t)t->offset) != 0 || lseek(t->fd, (off_t)t->offset, SEEK_SET) < 0) set_error(&t->result, "IO");
+    }
+    if (t->result.status != 0) { close(t->fd); t->fd = -1; }
+}
+
+// The staged file's length is the progress, or for a striped session what
+// its parts cover; no session row needed
+static void worker_handle_upload_status(worker_pool_t *wp, task_t *t, db_t *db) {
+    (void)db;
+    char path[1024], parts[1024];
+    struct stat st;
+    long long size;
+    if (upload_session_path(wp->root_dir, t->username, t->token, path, sizeof(path)) != 0 ||
+        stat(path, &st) != 0) set_error(&t->result, "NOSESSION");
+    else if (upload_stripe_path(wp->root_dir, t->username, t->token, parts, sizeof(parts)) != 0 ||
+             upload_stripe_read(parts, &size, &t->size) != 0) t->size = (long long)st.st_size;
+}
+
+// Stores a fully staged session like a one-shot UPLOAD
+static void worker_handle_upload_commit(worker_pool_t *wp, task_t *t, db_t *db) {
+    char path[1024];
+    if (db_session_get(db, t->token, t->user_id, t->filename, sizeof(t->filename), &t->size) != 0 ||
+        upload_session_path(wp->root_dir, t->username, t->token, path, sizeof(path)) != 0) {
+        set_error(&t->result, "NOSESSION");
+        return;
+    }
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        if (fd >= 0) close(fd);
+        set_error(&t->result, "NOSESSION");
+        return;
+    }
+    // An APPEND still writing holds the lock; committing under it would
+    // store a torn file
+    if (flock(fd, LOCK_EX | LOCK_NB) != 0) { close(fd); set_error(&t->result, "BUSY"); return; }
+    // Parts hold the same lock shared while they write, and list themselves
+    // before letting go of it
+    char parts[1024];
+    long long parts_size, covered;
+    int striped = upload_stripe_path(wp->root_dir, t->username, t->token, parts, sizeof(parts)) == 0 &&
+                  upload_stripe_read(parts, &parts_size, &covered) == 0;
+    if (striped && covered != t->size) { close(fd); set_error(&t->result, "INCOMPLETE"); return; }
+    if ((long long)st.st_size != t->size) { close(fd); set_error(&t->result, "SIZE"); return; }
+    snprintf(t->upload_tmp_path, sizeof(t->upload_tmp_path), "%s", path);
+    t->reserved = wp->quota ? quota_held(wp->quota, t->token) : 0;
+    worker_handle_upload(wp, t, db);
+    close(fd);
+    if (t->result.status == 0) {
+        if (striped) unlink(parts);
+        db_session_delete(db, t->token);
+        if (wp->quota) quota_unhold(wp->quota, t->token, 0); // converted by the upload
+    }
+}
+
+static void worker_handle_download(worker_pool_t *wp, task_t *t, db_t *db) {
+    if (lock_file(wp, t, LOCK_IS, LOCK_S) != 0) return;
     char final_path[1024];
     if (join_user_file(wp->root_dir, t->username, t->filename, final_path, sizeof(final_path)) != 0) {
         set_error(&t->result, "PATH");
         goto out;
     }
     struct stat st;
-    if (stat(final_path, &st) != 0) {
+    if (stat(final_path, &st) == 0) {
+        t->size = st.st_size;
+        t->result.resp_path = strdup(final_path);
+    } else if (db_get_manifest(db, t->user_id, t->filename, &t->result.parts, &t->result.nparts, &t->size) != 0) {
         set_error(&t->result, "NOFILE");
-        goto out;
     }
-    t->size = st.st_size;
-    t->result.resp_path = strdup(final_path);
 out:
-    lockmgr_file_unlock(wp->locks, t->username, t->filename, 0);
+    unlock_file(wp, t, LOCK_IS, LOCK_S);
 }
 
 static void worker_handle_delete(worker_pool_t *wp, task_t *t, db_t *db) {
-    lockmgr_user_lock(wp->locks, t->username, 1);
-    lockmgr_file_lock(wp->locks, t->username, t->filename, 1);
+    if (lock_file(wp, t, LOCK_IX, LOCK_X) != 0) return;
     char final_path[1024];
     if (join_user_file(wp->root_dir, t->username, t->filename, final_path, sizeof(final_path)) != 0) {
         set_error(&t->result, "PATH");
         goto out;
     }
-    struct stat st;
-    long long sz = 0;
-    if (stat(final_path, &st) == 0) sz = st.st_size;
-    unlink(final_path);
+    unlink(final_path); // stored whole, from before the chunk store
     long long del_sz = 0;
-    if (db_delete_file(db, t->user_id, t->filename, &del_sz) != 0) {
+    int nfreed = 0;
+    // The chunks it freed are removed by the committer (db.h)
+    if (wp->quota) quota_begin(wp->quota, t->username);
+    if (db_delete_file(db, t->user_id, t->filename, &del_sz, &nfreed) != 0) {
         // if DB delete fails, try to restore? For MVP, report error.
         set_error(&t->result, "DB");
-        goto out;
+    } else {
+        if (wp->mcache) mcache_file_remove(wp->mcache, t->username, t->filename);
+        if (wp->quota) quota_charge(wp->quota, t->username, -del_sz);
     }
-    (void)sz;
+    if (wp->quota) quota_end(wp->quota, t->username);
+    stats_add(STAT_CHUNKS_FREED, nfreed);
 out:
-    lockmgr_file_unlock(wp->locks, t->username, t->filename, 1);
-    lockmgr_user_unlock(wp->locks, t->username, 1);
+    unlock_file(wp, t, LOCK_IX, LOCK_X);
+}
+
+// A miss loads the user's whole name index into the cache and serves the
+// page from it; if a write got in between (or the list is too big to
+// cache) the page comes from SQLite as before
+static int list_cached(worker_pool_t *wp, task_t *t, db_t *db) {
+    task_result_t *r = &t->result;
+    if (mcache_list(wp->mcache, t->username, t->filename, (int)t->size, &r->list_buf, &r->list_len, &r->list_count, &r->list_more) == 0) return 0;
+    unsigned long gen = mcache_gen(wp->mcache, t->username);
+    db_file_t *files;
+    int n;
+    if (db_list_all_files(db, t->user_id, &files, &n) != 0) return -1;
+    int rc = mcache_fill_list(wp->mcache, gen, t->username, files, n, t->filename, (int)t->size,
+                              &r->list_buf, &r->list_len, &r->list_count, &r->list_more);
+    free(files);
+    return rc;
 }
 
 static void worker_handle_list(worker_pool_t *wp, task_t *t, db_t *db) {
-    (void)wp;
-    // Allow concurrent readers; serialize against writers via user read lock
-    lockmgr_user_lock(wp->locks, t->username ? t->username : "", 0);
-    if (db_list_files(db, t->user_id, &t->result.list_names, &t->result.list_count) != 0) {
-        set_error(&t->result, "DB");
-        lockmgr_user_unlock(wp->locks, t->username ? t->username : "", 0);
+    // The listing is one SQLite statement (or one cache lookup), so it sees
+    // each upload or delete whole or not at all; no need to hold them off
+    // with S
+    if (lockmgr_user_lock(wp->locks, t->username, LOCK_IS) != 0) {
+        set_error(&t->result, "SERVER");
         return;
     }
-    lockmgr_user_unlock(wp->locks, t->username ? t->username : "", 0);
+    task_result_t *r = &t->result;
+    if ((!wp->mcache || list_cached(wp, t, db) != 0) &&
+        db_list_files(db, t->user_id, t->filename, (int)t->size, &r->list_buf, &r->list_len, &r->list_count, &r->list_more) != 0) {
+        set_error(&t->result, "DB");
+    }
+    lockmgr_user_unlock(wp->locks, t->username, LOCK_IS);
+}
+
+static void worker_handle_signup(worker_pool_t *wp, task_t *t, db_t *db) {
+    (void)wp;
+    char *ph = hash_password(t->password);
+    if (db_signup(db, t->username, ph, t->size) != 0) set_error(&t->result, "EXISTS");
+    free(ph);
+}
+
+static void worker_handle_login(worker_pool_t *wp, task_t *t, db_t *db) {
+    long long uid = 0, quota = 0, used = 0; char *stored = NULL;
+    unsigned long qgen = wp->quota ? quota_gen(wp->quota, t->username) : 0;
+    if (!wp->mcache || mcache_get_user(wp->mcache, t->username, &uid, &stored, &quota, &used) != 0) {
+        unsigned long gen = wp->mcache ? mcache_gen(wp->mcache, t->username) : 0;
+        if (db_get_user(db, t->username, &uid, &stored, &quota, &used) != 0) {
+            set_error(&t->result, "AUTH");
+            return;
+        }
+        if (wp->mcache) mcache_put_user(wp->mcache, gen, t->username, uid, stored, quota, used);
+    }
+    char *ph = hash_password(t->password);
+    int ok = (stored && strcmp(stored, ph) == 0);
+    free(stored); free(ph);
+    if (!ok) { set_error(&t->result, "AUTH"); return; }
+    t->user_id = uid;
+    if (wp->quota) quota_sync(wp->quota, qgen, t->username, quota, used);
+}
+
+static lane_t task_lane(task_type_t type) {
+    return (type == TASK_UPLOAD || type == TASK_UPLOAD_COMMIT) ? LANE_BULK : LANE_META;
+}
+
+static const struct { stat_id_t tasks, depth, wait_us; hist_id_t wait; } g_lane_stats[] = {
+    [LANE_META] = { STAT_LANE_META_TASKS, STAT_LANE_META_DEPTH, STAT_LANE_META_WAIT_US, HIST_LANE_META_WAIT },
+    [LANE_BULK] = { STAT_LANE_BULK_TASKS, STAT_LANE_BULK_DEPTH, STAT_LANE_BULK_WAIT_US, HIST_LANE_BULK_WAIT },
+};
+
+static void run_task(worker_pool_t *wp, task_t *t, db_t *db) {
+    lane_t lane = task_lane(t->type);
+    unsigned long long now = now_micros();
+    long long waited = now > t->queued_us ? (long long)(now - t->queued_us) : 0;
+    stats_add(g_lane_stats[lane].depth, -1);
+    stats_add(g_lane_stats[lane].tasks, 1);
+    stats_add(g_lane_stats[lane].wait_us, waited);
+    stats_hist_add(g_lane_stats[lane].wait, waited);
+    stats_add(STAT_WORKERS_BUSY, 1);
+    switch (t->type) {
+        case TASK_UPLOAD: worker_handle_upload(wp, t, db); break;
+        case TASK_DOWNLOAD: worker_handle_download(wp, t, db); break;
+        case TASK_DELETE: worker_handle_delete(wp, t, db); break;
+        case TASK_LIST: worker_handle_list(wp, t, db); break;
+        case TASK_SIGNUP: worker_handle_signup(wp, t, db); break;
+        case TASK_LOGIN: worker_handle_login(wp, t, db); break;
+        case TASK_UPLOAD_BEGIN: worker_handle_upload_begin(wp, t, db); break;
+        case TASK_UPLOAD_COMMIT: worker_handle_upload_commit(wp, t, db); break;
+        case TASK_UPLOAD_RESERVE: worker_handle_upload_reserve(wp, t, db); break;
+        case TASK_UPLOAD_OPEN: worker_handle_upload_open(wp, t, db); break;
+        case TASK_UPLOAD_STATUS: worker_handle_upload_status(wp, t, db); break;
+    }
+    stats_add(STAT_WORKERS_BUSY, -1);
+    if (t->on_done) t->on_done(t);
+}
+
+// Shared slot states; a slot is only respawned once its old thread is joined
+enum { SLOT_IDLE, SLOT_RUNNING, SLOT_EXITED };
+
+// Called when the sizer has shrunk the pool below this slot: leaves, after
+// running what is still on the slot's deque (thieves may take some too).
+// Returns 0 if the pool grew back in the meantime.
+static int worker_retire(worker_pool_t *wp, int id, db_t *db) {
+    pthread_mutex_lock(&wp->resize_mu);
+    int leave = id >= __atomic_load_n(&wp->shared_target, __ATOMIC_RELAXED);
+    if (leave) wp->slot_state[id] = SLOT_EXITED;
+    pthread_mutex_unlock(&wp->resize_mu);
+    if (!leave) return 0;
+    void *item;
+    while ((item = wsched_pop_local(&wp->sched, id))) run_task(wp, (task_t*)item, db);
+    return 1;
 }
 
 static void *worker_main(void *arg) {
-    worker_pool_t *wp = (worker_pool_t*)arg;
+    worker_t *self = (worker_t*)arg;
+    worker_pool_t *wp = self->pool;
     db_t *db = (db_t*)wp->db;
+    stats_add(STAT_WORKERS, 1);
     for (;;) {
         void *item = NULL;
-        if (ts_queue_pop(wp->task_queue, &item) != 0) break;
-        task_t *t = (task_t*)item;
-        switch (t->type) {
-            case TASK_UPLOAD: worker_handle_upload(wp, t, db); break;
-            case TASK_DOWNLOAD: worker_handle_download(wp, t, db); break;
-            case TASK_DELETE: worker_handle_delete(wp, t, db); break;
-            case TASK_LIST: worker_handle_list(wp, t, db); break;
+        if (self->id < 0) {
+            if (ts_queue_pop(&wp->meta, &item) != 0) break;
+        } else if (self->id >= __atomic_load_n(&wp->shared_target, __ATOMIC_ACQUIRE) && worker_retire(wp, self->id, db)) {
+            break;
+        } else if (ts_queue_try_pop(&wp->meta, &item) != 0) {
+            // Metadata first; a metadata submit wakes us if we sleep here
+            int rc = wsched_pop(&wp->sched, self->id, &item);
+            if (rc < 0) break; // reserved workers finish what metadata is left
+            if (rc > 0) continue;
+        }
+        run_task(wp, (task_t*)item, db);
+    }
+    stats_add(STAT_WORKERS, -1);
+    return NULL;
+}
+
+#define SIZER_TICK_MS 100
+#define GROW_TICKS 2    // ticks of more tasks waiting than idle workers before one is added
+#define SHRINK_TICKS 50 // ticks with nothing waiting and under a quarter busy before one leaves
+#define SWEEP_TICKS 600 // between sweeps of idle upload sessions, at most (a minute)
+
+// Adaptive sizing: samples the lane depth gauges and the busy workers
+// every tick and moves shared_target one slot at a time between
+// worker_count and max_workers. Only this thread starts or joins shared
+// workers once the pool is up. It also sweeps idle upload sessions, at
+// start and then every SWEEP_TICKS (or TTL, if shorter), whether or not
+// the pool may resize.
+static void *sizer_main(void *arg) {
+    worker_pool_t *wp = (worker_pool_t*)arg;
+    int least = wp->worker_count - wp->meta_workers;
+    int resizes = wp->shared_slots + wp->meta_workers > wp->worker_count;
+    long long ttl_ticks = wp->upload_ttl * 1000 / SIZER_TICK_MS;
+    int sweep_every = ttl_ticks > 0 && ttl_ticks < SWEEP_TICKS ? (int)ttl_ticks : SWEEP_TICKS;
+    int backlog = 0, idle = 0, since_sweep = sweep_every;
+    pthread_mutex_lock(&wp->resize_mu);
+    while (!wp->stopping) {
+        if (since_sweep >= sweep_every) {
+            since_sweep = 0;
+            pthread_mutex_unlock(&wp->resize_mu);
+            sweep_sessions(wp, (db_t*)wp->db);
+            pthread_mutex_lock(&wp->resize_mu);
+            if (wp->stopping) break;
+        }
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_nsec += SIZER_TICK_MS * 1000000L;
+        if (ts.tv_nsec >= 1000000000L) { ts.tv_sec++; ts.tv_nsec -= 1000000000L; }
+        pthread_cond_timedwait(&wp->resize_cv, &wp->resize_mu, &ts);
+        if (wp->stopping) break;
+        since_sweep++;
+        if (!resizes) continue;
+        int target = wp->shared_target;
+        long long running = target + wp->meta_workers;
+        long long waiting = stats_get(STAT_LANE_META_DEPTH) + stats_get(STAT_LANE_BULK_DEPTH);
+        long long busy = stats_get(STAT_WORKERS_BUSY);
+        // Reserved workers idle on an empty metadata lane do nothing for bulk
+        // tasks, hence waiting against idle rather than "all busy"
+        backlog = waiting > running - busy ? backlog + 1 : 0;
+        idle = waiting == 0 && busy * 4 < running ? idle + 1 : 0;
+        if (backlog >= GROW_TICKS && target < wp->shared_slots) {
+            backlog = 0;
+            __atomic_store_n(&wp->shared_target, target + 1, __ATOMIC_RELEASE);
+            if (wp->slot_state[target] == SLOT_EXITED) {
+                // Still finishing its deque, which the new worker will own
+                pthread_mutex_unlock(&wp->resize_mu);
+                pthread_join(wp->workers[target], NULL);
+                pthread_mutex_lock(&wp->resize_mu);
+                wp->slot_state[target] = SLOT_IDLE;
+            }
+            if (wp->slot_state[target] == SLOT_IDLE) {
+                if (pthread_create(&wp->workers[target], NULL, worker_main, &wp->slots[target]) == 0) {
+                    wp->slot_state[target] = SLOT_RUNNING;
+                } else {
+                    __atomic_store_n(&wp->shared_target, target, __ATOMIC_RELEASE);
+                }
+            }
+        } else if (idle >= SHRINK_TICKS && target > least) {
+            idle = 0;
+            __atomic_store_n(&wp->shared_target, target - 1, __ATOMIC_RELEASE);
+            // The leaving worker may be asleep in the scheduler
+            wsched_wake_all(&wp->sched);
         }
-        pthread_mutex_lock(&t->result.mutex);
-        t->result.done = 1;
-        pthread_cond_signal(&t->result.done_cv);
-        pthread_mutex_unlock(&t->result.mutex);
     }
+    pthread_mutex_unlock(&wp->resize_mu);
     return NULL;
 }
 
-int worker_pool_start(worker_pool_t *wp, ts_queue_t *task_queue, int worker_count, const char *root_dir, void *db_ptr, lockmgr_t *locks) {
-    wp->task_queue = task_queue;
+int worker_pool_start(worker_pool_t *wp, int worker_count, size_t queue_depth, ts_queue_impl_t queue_impl,
+                      const char *root_dir, void *db_ptr, lockmgr_t *locks) {
+    if (worker_count < 2) worker_count = 2;
+    wp->meta_workers = worker_count / 4 > 0 ? worker_count / 4 : 1;
+    int shared = worker_count - wp->meta_workers;
+    int most = wp->max_workers > worker_count ? wp->max_workers : worker_count;
+    wp->shared_slots = most - wp->meta_workers;
+    if (ts_queue_init_impl(&wp->meta, queue_depth, queue_impl) != 0) return -1;
+    if (wsched_init(&wp->sched, wp->shared_slots, queue_depth, queue_impl) != 0) { ts_queue_destroy(&wp->meta); return -1; }
+    int slots = wp->shared_slots + wp->meta_workers;
     wp->worker_count = worker_count;
-    wp->workers = (pthread_t*)calloc((size_t)worker_count, sizeof(pthread_t));
+    wp->shared_target = shared;
+    wp->workers = (pthread_t*)calloc((size_t)slots, sizeof(pthread_t));
+    wp->slots = (worker_t*)calloc((size_t)slots, sizeof(worker_t));
+    wp->slot_state = (int*)calloc((size_t)wp->shared_slots, sizeof(int));
     wp->root_dir = root_dir;
     wp->db = db_ptr;
     wp->locks = locks;
-    for (int i = 0; i < worker_count; i++) {
-        pthread_create(&wp->workers[i], NULL, worker_main, wp);
+    wp->stopping = 0;
+    pthread_mutex_init(&wp->resize_mu, NULL);
+    pthread_cond_init(&wp->resize_cv, NULL);
+    for (int i = 0; i < slots; i++) {
+        wp->slots[i].pool = wp;
+        wp->slots[i].id = i < wp->shared_slots ? i : -1;
+        if (i >= shared && i < wp->shared_slots) continue; // started by the sizer
+        pthread_create(&wp->workers[i], NULL, worker_main, &wp->slots[i]);
+        if (i < shared) wp->slot_state[i] = SLOT_RUNNING;
     }
+    pthread_create(&wp->sizer, NULL, sizer_main, wp);
     return 0;
 }
 
+int worker_pool_submit(worker_pool_t *wp, task_t *t) {
+    lane_t lane = task_lane(t->type);
+    t->queued_us = now_micros();
+    stats_add(g_lane_stats[lane].depth, 1);
+    int rc;
+    if (lane == LANE_META) {
+        rc = ts_queue_push(&wp->meta, t);
+        if (rc == 0) wsched_wake(&wp->sched);
+    } else {
+        rc = wsched_push(&wp->sched, t);
+    }
+    if (rc != 0) stats_add(g_lane_stats[lane].depth, -1);
+    return rc;
+}
+
 void worker_pool_stop(worker_pool_t *wp) {
-    ts_queue_close(wp->task_queue);
-    for (int i = 0; i < wp->worker_count; i++) {
-        pthread_join(wp->workers[i], NULL);
+    pthread_mutex_lock(&wp->resize_mu);
+    wp->stopping = 1;
+    pthread_cond_signal(&wp->resize_cv);
+    pthread_mutex_unlock(&wp->resize_mu);
+    pthread_join(wp->sizer, NULL);
+    ts_queue_close(&wp->meta);
+    wsched_close(&wp->sched);
+    for (int i = 0; i < wp->shared_slots + wp->meta_workers; i++) {
+        // A worker retiring from an earlier shrink may still be setting its state
+        pthread_mutex_lock(&wp->resize_mu);
+        int started = i >= wp->shared_slots || wp->slot_state[i] != SLOT_IDLE;
+        pthread_mutex_unlock(&wp->resize_mu);
+        if (started) pthread_join(wp->workers[i], NULL);
     }
     free(wp->workers);
+    free(wp->slots);
+    free(wp->slot_state);
+    wsched_destroy(&wp->sched);
+    ts_queue_destroy(&wp->meta);
+    pthread_mutex_destroy(&wp->resize_mu);
+    pthread_cond_destroy(&wp->resize_cv);
     wp->workers = NULL;
+    wp->slots = NULL;
+    wp->slot_state = NULL;
 }
 
 
@@ -2,50 +2,149 @@
 #define THREADPOOL_H
 
 #include <pthread.h>
-#include "queue.h"
+#include "wsched.h"
 #include "lockmgr.h"
+#include "chunk.h"
+#include "proto.h"
 
-typedef enum { TASK_UPLOAD, TASK_DOWNLOAD, TASK_DELETE, TASK_LIST } task_type_t;
+typedef enum {
+    TASK_UPLOAD, TASK_DOWNLOAD, TASK_DELETE, TASK_LIST, TASK_SIGNUP, TASK_LOGIN,
+    TASK_UPLOAD_BEGIN, TASK_UPLOAD_COMMIT,
+    TASK_UPLOAD_RESERVE, // UPLOAD's quota reservation when the cache cannot size the file it replaces
+    TASK_UPLOAD_OPEN,    // UPLOAD_APPEND/UPLOAD_PART: the session's staged file, ready for the body
+    TASK_UPLOAD_STATUS
+} task_type_t;
 
 typedef struct {
-    pthread_mutex_t mutex;
-    pthread_cond_t done_cv;
-    int done;
     int status; // 0 ok, -1 err
-    char *err_msg;
+    const char *err_msg; // static string
     // response payloads
     // For LIST: names combined with \n, for DOWNLOAD: temp file path to stream back
-    char *resp_path;
-    char **list_names;
+    char *resp_path;   // DOWNLOAD of a file stored whole (from before the chunk store)
+    chunk_ref_t *parts; // DOWNLOAD of a chunked file: its chunks in order
+    int nparts;
+    char *list_buf;    // list_count names, each ending in '\n'
+    size_t list_len;
     int list_count;
+    int list_more;     // paged LIST: names remain after this page
 } task_result_t;
 
-typedef struct {
+typedef struct task {
     task_type_t type;
+    long long tag;       // client's pipelining tag, -1 if the command was untagged
     int client_fd;
-    long long user_id;
-    char *username;
-    char *filename;
-    long long size;
-    char *upload_tmp_path; // path to temp uploaded content (already received by client thread)
+    long long user_id;   // LOGIN: filled in by the worker on success
+    long long size;      // UPLOAD/UPLOAD_RESERVE/UPLOAD_OPEN: payload size; UPLOAD_STATUS: filled in; SIGNUP: quota for the new account; LIST: page size, 0 = all
+    int codec;           // DOWNLOAD: codec_t the body goes out in
+    long long token;     // UPLOAD_COMMIT/OPEN/STATUS: session; UPLOAD_BEGIN: filled in by the worker
+    int striped;         // UPLOAD_BEGIN: the session takes UPLOAD_PARTs; UPLOAD_OPEN: for a part
+    long long offset;    // UPLOAD_OPEN: where the body goes in the staged file
+    int fd;              // UPLOAD_OPEN: filled in, locked and positioned; the owner closes it
+    long long reserved;  // UPLOAD/UPLOAD_COMMIT: bytes reserved against the quota (quota.h); UPLOAD_RESERVE: filled in
+    unsigned long long queued_us; // set on submit, for the lane wait counters
     task_result_t result;
+    // Completion: invoked on the worker thread once result is filled in.
+    // The owner must not touch the task again until this fires.
+    void (*on_done)(struct task *t);
+    void *owner;
+    struct task *next; // link for the owner's completion list, or a task_pool_t
+    // Inline, so a pooled task needs no allocation; task_init only clears
+    // their first byte
+    char username[PROTO_NAME_MAX + 1];
+    char filename[PROTO_NAME_MAX + 1]; // LIST: page cursor (last name already seen), "" from the start
+    char password[PROTO_PASS_MAX + 1]; // SIGNUP/LOGIN only
+    char upload_tmp_path[1024];        // temp uploaded content (already received by the event loop)
 } task_t;
 
 void task_init(task_t *t);
-void task_free(task_t *t);
+void task_free(task_t *t); // what the result holds, not the task itself
+
+// Free list of tasks for one thread (an event loop): tasks are taken and
+// put back on that thread only, so it needs no locking. Steady state, an
+// operation allocates no task.
+typedef struct {
+    task_t *free;
+    int count;
+} task_pool_t;
+
+task_t *task_pool_get(task_pool_t *p); // initialized; NULL if out of memory
+void task_pool_put(task_pool_t *p, task_t *t);
+void task_pool_destroy(task_pool_t *p);
+
+// Completed tasks on their way back to the owner: a lock-free stack any
+// thread pushes to, emptied in one exchange by the owner.
+// task_list_push returns 1 if the list was empty, i.e. the owner needs a
+// wake-up; otherwise one is already on its way.
+int task_list_push(task_t **list, task_t *t);
+// Everything pushed so far, oldest first
+task_t *task_list_take(task_t **list);
+
+// Scheduling lanes. Metadata tasks (LIST, DELETE, the DOWNLOAD lookup,
+// SIGNUP/LOGIN, UPLOAD_BEGIN and UPLOAD_STATUS, the setup before an upload
+// body) are short; bulk tasks (UPLOAD, UPLOAD_COMMIT) chunk and hash whole
+// files and can sit on SQLite's busy timeout. Bulk
+// goes through the work-stealing scheduler; metadata has its own queue,
+// served by reserved workers and, ahead of bulk, by all the others, so a
+// flood of uploads cannot hold up a LIST.
+typedef enum { LANE_META, LANE_BULK } lane_t;
+
+typedef struct worker_pool worker_pool_t;
 
 typedef struct {
-    ts_queue_t *task_queue;
-    int worker_count;
+    worker_pool_t *pool;
+    int id; // this worker's deque in pool->sched; -1: reserved for metadata
+} worker_t;
+
+struct worker_pool {
+    wsched_t sched; // bulk lane
+    ts_queue_t meta; // metadata lane
+    int meta_workers; // reserved for it: a quarter of the pool, at least one
+    int worker_count; // at start, and the least the pool shrinks to
+    // Above worker_count, the pool sizes itself up to this many workers:
+    // it grows while tasks wait with every worker busy and shrinks after a
+    // stretch of mostly idle workers. Set before start.
+    int max_workers;
+    int shared_slots;  // wsched deques, one per shared worker it may run
+    int shared_target; // slots [0, shared_target) should have a worker
+    int *slot_state;   // SLOT_* per shared slot, under resize_mu
     pthread_t *workers;
+    worker_t *slots;   // shared slots first, then the reserved workers
+    pthread_mutex_t resize_mu;
+    pthread_cond_t resize_cv;
+    int stopping;
+    pthread_t sizer; // resizes when max_workers > worker_count; sweeps upload sessions either way
     const char *root_dir;
     void *db; // db_t* opaque to avoid header dep
     lockmgr_t *locks;
-} worker_pool_t;
+    long long upload_ttl; // seconds an idle upload session is kept, swept by the sizer; set before start
+    struct mcache *mcache; // metadata cache (mcache.h) for LOGIN and LIST, NULL for none; set before start
+    struct quota *quota; // upload reservations (quota.h), NULL for none; set before start
+    struct syncer *syncer; // --durability batched (syncer.h), NULL otherwise; set before start
+};
 
-int worker_pool_start(worker_pool_t *wp, ts_queue_t *task_queue, int worker_count, const char *root_dir, void *db_ptr, lockmgr_t *locks);
+// worker_count is at least 2 (one reserved for metadata). queue_depth
+// bounds tasks waiting in each lane (submitters block beyond it);
+// queue_impl is the lanes' queue implementation.
+int worker_pool_start(worker_pool_t *wp, int worker_count, size_t queue_depth, ts_queue_impl_t queue_impl,
+                      const char *root_dir, void *db_ptr, lockmgr_t *locks);
+// Queues t for a worker; -1 once the pool is stopping
+int worker_pool_submit(worker_pool_t *wp, task_t *t);
+// Runs the tasks already queued, then joins the workers
 void worker_pool_stop(worker_pool_t *wp);
 
+// Staged file of a resumable upload session: <root>/<user>/.upload.<token>
+int upload_session_path(const char *root, const char *username, long long token, char *out, size_t cap);
+
+// A striped session also keeps <staged file>.parts: its size on the first
+// line, then "<offset> <len>" for each UPLOAD_PART that arrived whole.
+// Lines are appended in one write() each, so connections writing parts of
+// the same session need no other coordination.
+int upload_stripe_path(const char *root, const char *username, long long token, char *out, size_t cap);
+int upload_stripe_add(const char *path, long long offset, long long len);
+// -1 if the session is not striped; else its size and how many of its
+// bytes the recorded parts cover (overlaps count once)
+int upload_stripe_read(const char *path, long long *size, long long *covered);
+
 #endif
 
 
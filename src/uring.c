@@ -0,0 +1,150 @@
+#define _GNU_SOURCE
+#include "uring.h"
+
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+static int sys_setup(unsigned entries, struct io_uring_params *p) {
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int sys_register(int fd, unsigned op, const void *arg, unsigned n) {
+    return (int)syscall(__NR_io_uring_register, fd, op, arg, n);
+}
+
+int uring_init(uring_t *u, unsigned entries) {
+    memset(u, 0, sizeof(*u));
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    u->fd = sys_setup(entries, &p);
+    if (u->fd < 0) return -1;
+    u->sq_ring_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    u->cq_ring_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    u->sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+    u->sq_ring = mmap(NULL, u->sq_ring_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+    u->cq_ring = mmap(NULL, u->cq_ring_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_CQ_RING);
+    u->sqes = (struct io_uring_sqe*)mmap(NULL, u->sqes_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+    if (u->sq_ring == MAP_FAILED || u->cq_ring == MAP_FAILED || u->sqes == MAP_FAILED) {
+        int e = errno;
+        uring_free(u);
+        errno = e;
+        return -1;
+    }
+    char *sq = (char*)u->sq_ring, *cq = (char*)u->cq_ring;
+    u->sq_head = (unsigned*)(sq + p.sq_off.head);
+    u->sq_tail = (unsigned*)(sq + p.sq_off.tail);
+    u->sq_mask = (unsigned*)(sq + p.sq_off.ring_mask);
+    u->sq_array = (unsigned*)(sq + p.sq_off.array);
+    u->sq_entries = p.sq_entries;
+    u->cq_head = (unsigned*)(cq + p.cq_off.head);
+    u->cq_tail = (unsigned*)(cq + p.cq_off.tail);
+    u->cq_mask = (unsigned*)(cq + p.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+    return 0;
+}
+
+void uring_free(uring_t *u) {
+    if (u->sqes && u->sqes != MAP_FAILED) munmap(u->sqes, u->sqes_sz);
+    if (u->cq_ring && u->cq_ring != MAP_FAILED) munmap(u->cq_ring, u->cq_ring_sz);
+    if (u->sq_ring && u->sq_ring != MAP_FAILED) munmap(u->sq_ring, u->sq_ring_sz);
+    if (u->fd >= 0) close(u->fd);
+    memset(u, 0, sizeof(*u));
+    u->fd = -1;
+}
+
+int uring_register_buffers(uring_t *u, const struct iovec *iov, unsigned n) {
+    if (sys_register(u->fd, IORING_REGISTER_BUFFERS, iov, n) != 0) return -1;
+    u->fixed = 1;
+    return 0;
+}
+
+struct io_uring_sqe *uring_sqe(uring_t *u) {
+    unsigned tail = *u->sq_tail;
+    if (tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) >= u->sq_entries) {
+        if (uring_submit(u, 0) != 0) return NULL;
+        tail = *u->sq_tail;
+    }
+    unsigned idx = tail & *u->sq_mask;
+    struct io_uring_sqe *s = &u->sqes[idx];
+    memset(s, 0, sizeof(*s));
+    u->sq_array[idx] = idx;
+    // Published to the kernel on submit
+    __atomic_store_n(u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    u->queued++;
+    return s;
+}
+
+int uring_submit(uring_t *u, unsigned wait_nr) {
+    while (u->queued > 0 || wait_nr > 0) {
+        int n = sys_enter(u->fd, u->queued, wait_nr, wait_nr ? IORING_ENTER_GETEVENTS : 0);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        u->queued -= (unsigned)n < u->queued ? (unsigned)n : u->queued;
+        if (u->queued == 0) break;
+        // The kernel took only part of the batch (CQ pressure): make room
+        if (wait_nr == 0) wait_nr = 1;
+    }
+    return 0;
+}
+
+int uring_wait(uring_t *u, uint64_t *user_data, int *res) {
+    for (;;) {
+        unsigned head = *u->cq_head;
+        if (head != __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE)) {
+            struct io_uring_cqe *c = &u->cqes[head & *u->cq_mask];
+            *user_data = c->user_data;
+            *res = c->res;
+            __atomic_store_n(u->cq_head, head + 1, __ATOMIC_RELEASE);
+            return 0;
+        }
+        if (uring_submit(u, 1) != 0) return -1;
+    }
+}
+
+static void prep_rw(struct io_uring_sqe *s, int op, int fd, const void *addr, unsigned len, uint64_t off, uint64_t user_data) {
+    s->opcode = (uint8_t)op;
+    s->fd = fd;
+    s->addr = (uint64_t)(uintptr_t)addr;
+    s->len = len;
+    s->off = off;
+    s->user_data = user_data;
+}
+
+void uring_prep_read(struct io_uring_sqe *s, int fd, void *buf, unsigned len, uint64_t off, int buf_index, uint64_t user_data) {
+    prep_rw(s, buf_index >= 0 ? IORING_OP_READ_FIXED : IORING_OP_READ, fd, buf, len, off, user_data);
+    if (buf_index >= 0) s->buf_index = (uint16_t)buf_index;
+}
+
+void uring_prep_write(struct io_uring_sqe *s, int fd, const void *buf, unsigned len, uint64_t off, int buf_index, uint64_t user_data) {
+    prep_rw(s, buf_index >= 0 ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE, fd, buf, len, off, user_data);
+    if (buf_index >= 0) s->buf_index = (uint16_t)buf_index;
+}
+
+void uring_prep_fsync(struct io_uring_sqe *s, int fd, uint64_t user_data) {
+    prep_rw(s, IORING_OP_FSYNC, fd, NULL, 0, 0, user_data);
+}
+
+void uring_prep_statx(struct io_uring_sqe *s, const char *path, struct statx *out, uint64_t user_data) {
+    prep_rw(s, IORING_OP_STATX, AT_FDCWD, path, STATX_TYPE, 0, user_data);
+    s->addr2 = (uint64_t)(uintptr_t)out; // off and addr2 share a slot
+}
+
+void uring_prep_rename(struct io_uring_sqe *s, const char *from, const char *to, uint64_t user_data) {
+    prep_rw(s, IORING_OP_RENAMEAT, AT_FDCWD, from, (unsigned)AT_FDCWD, 0, user_data);
+    s->addr2 = (uint64_t)(uintptr_t)to;
+}
+
+void uring_prep_unlink(struct io_uring_sqe *s, const char *path, uint64_t user_data) {
+    prep_rw(s, IORING_OP_UNLINKAT, AT_FDCWD, path, 0, 0, user_data);
+}
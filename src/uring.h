@@ -0,0 +1,54 @@
+#ifndef URING_H
+#define URING_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+// Minimal io_uring over the raw syscalls (no liburing): one submission and
+// one completion ring, owned by a single thread. Callers fill SQEs for a
+// whole batch, submit them with one io_uring_enter(), then reap as many
+// completions as they queued. Link SQEs with IOSQE_IO_LINK to chain them
+// (a write, then its fsync); unlinked SQEs run in parallel.
+typedef struct {
+    int fd;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned sq_entries;
+    struct io_uring_sqe *sqes;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+    void *sq_ring, *cq_ring;
+    size_t sq_ring_sz, cq_ring_sz, sqes_sz;
+    unsigned queued; // filled since the last submit
+    int fixed;       // buffers are registered
+} uring_t;
+
+// -1 with errno set if the kernel has no io_uring (or it is disabled)
+int uring_init(uring_t *u, unsigned entries);
+void uring_free(uring_t *u);
+// Pins the buffers for the *_FIXED ops, which then skip the per-I/O page
+// mapping; buf_index in those ops counts into iov
+int uring_register_buffers(uring_t *u, const struct iovec *iov, unsigned n);
+
+// A zeroed SQE to fill. If the ring is full the queued ones are submitted
+// first; NULL only if that fails.
+struct io_uring_sqe *uring_sqe(uring_t *u);
+// Submits what is queued and waits until at least wait_nr completions are
+// ready. Returns 0 or -1 with errno set.
+int uring_submit(uring_t *u, unsigned wait_nr);
+// Next completion, waiting for one if none is ready. Returns 0 and fills
+// *user_data and *res (a syscall-style result, -errno on failure).
+int uring_wait(uring_t *u, uint64_t *user_data, int *res);
+
+// SQE fillers; user_data comes back with the completion. buf_index < 0
+// reads or writes an unregistered buffer.
+struct statx;
+void uring_prep_read(struct io_uring_sqe *s, int fd, void *buf, unsigned len, uint64_t off, int buf_index, uint64_t user_data);
+void uring_prep_write(struct io_uring_sqe *s, int fd, const void *buf, unsigned len, uint64_t off, int buf_index, uint64_t user_data);
+void uring_prep_fsync(struct io_uring_sqe *s, int fd, uint64_t user_data);
+void uring_prep_statx(struct io_uring_sqe *s, const char *path, struct statx *out, uint64_t user_data);
+void uring_prep_rename(struct io_uring_sqe *s, const char *from, const char *to, uint64_t user_data);
+void uring_prep_unlink(struct io_uring_sqe *s, const char *path, uint64_t user_data);
+
+#endif
@@ -79,4 +79,91 @@ uint64_t now_millis(void) {
     return (uint64_t)ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000ULL;
 }
 
+uint64_t now_micros(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000ULL;
+}
+
+
+
+void reader_init(reader_t *r, int fd) {
+    r->fd = fd;
+    r->start = r->end = 0;
+}
 
+size_t reader_buffered(const reader_t *r) { return r->end - r->start; }
+
+const char *reader_peek(const reader_t *r) { return r->buf + r->start; }
+
+void reader_consume(reader_t *r, size_t n) {
+    r->start += n;
+    if (r->start == r->end) r->start = r->end = 0;
+}
+
+ssize_t reader_fill(reader_t *r) {
+    if (r->end == sizeof(r->buf) && r->start > 0) {
+        memmove(r->buf, r->buf + r->start, r->end - r->start);
+        r->end -= r->start;
+        r->start = 0;
+    }
+    if (r->end == sizeof(r->buf)) { errno = ENOBUFS; return -1; }
+    for (;;) {
+        ssize_t n = read(r->fd, r->buf + r->end, sizeof(r->buf) - r->end);
+        if (n < 0 && errno == EINTR) continue;
+        if (n > 0) r->end += (size_t)n;
+        return n;
+    }
+}
+
+int reader_next_line(reader_t *r, char *buf, size_t maxlen) {
+    char *p = r->buf + r->start;
+    char *nl = (char*)memchr(p, '\n', r->end - r->start);
+    if (!nl) return -1;
+    size_t len = (size_t)(nl - p);
+    size_t n = len;
+    if (n > 0 && p[n-1] == '\r') n--;
+    if (n + 1 > maxlen) n = maxlen - 1;
+    memcpy(buf, p, n);
+    buf[n] = '\0';
+    reader_consume(r, len + 1);
+    return (int)n;
+}
+
+int reader_read_line(reader_t *r, char *buf, size_t maxlen) {
+    for (;;) {
+        int n = reader_next_line(r, buf, maxlen);
+        if (n >= 0) return n;
+        if (reader_buffered(r) + 1 >= maxlen) {
+            // over-long line: hand back what fits, like read_line() does
+            size_t k = maxlen - 1;
+            memcpy(buf, reader_peek(r), k);
+            buf[k] = '\0';
+            reader_consume(r, k);
+            return (int)k;
+        }
+        ssize_t got = reader_fill(r);
+        if (got == 0) return 0; // EOF
+        if (got < 0) return -1;
+    }
+}
+
+int reader_read_n(reader_t *r, void *buf, size_t n) {
+    size_t have = reader_buffered(r);
+    size_t take = have < n ? have : n;
+    memcpy(buf, reader_peek(r), take);
+    reader_consume(r, take);
+    if (take == n) return 1;
+    buf = (char*)buf + take;
+    n -= take;
+    // large payloads bypass the buffer; small reads (frame headers) refill it
+    if (n >= sizeof(r->buf)) return read_n(r->fd, buf, n);
+    while (reader_buffered(r) < n) {
+        ssize_t got = reader_fill(r);
+        if (got == 0) return 0;
+        if (got < 0) return -1;
+    }
+    memcpy(buf, reader_peek(r), n);
+    reader_consume(r, n);
+    return 1;
+}
@@ -3,6 +3,19 @@
 
 #include <stddef.h>
 #include <stdint.h>
+#include <sys/types.h>
+
+#define READER_CAP 4096
+
+// Buffered reader over a socket. One read() pulls in as much as is
+// available, so a command line costs one syscall instead of one per byte,
+// and bytes past the newline (the next command, an upload body) stay
+// buffered for whoever reads next.
+typedef struct {
+    int fd;
+    size_t start, end; // buffered bytes are buf[start, end)
+    char buf[READER_CAP];
+} reader_t;
 
 int set_nonblocking(int fd);
 int read_line(int fd, char *buf, size_t maxlen); // reads until \n, strips
@@ -10,6 +23,21 @@ int read_n(int fd, void *buf, size_t n);
 int write_n(int fd, const void *buf, size_t n);
 int send_fmt(int fd, const char *fmt, ...);
 uint64_t now_millis(void);
+uint64_t now_micros(void); // monotonic, for measuring intervals
+
+void reader_init(reader_t *r, int fd);
+// Blocking; same contracts as read_line() and read_n()
+int reader_read_line(reader_t *r, char *buf, size_t maxlen);
+int reader_read_n(reader_t *r, void *buf, size_t n);
+// Non-blocking use (event loop): one read() into free space; returns bytes
+// read, 0 on EOF, -1 with errno set (EAGAIN when nothing is pending)
+ssize_t reader_fill(reader_t *r);
+// Pops the next complete line (newline and CR stripped, truncated to
+// maxlen-1); returns its length, or -1 if no full line is buffered yet
+int reader_next_line(reader_t *r, char *buf, size_t maxlen);
+size_t reader_buffered(const reader_t *r);
+const char *reader_peek(const reader_t *r);
+void reader_consume(reader_t *r, size_t n);
 
 #endif
 
@@ -0,0 +1,239 @@
+#include "wsched.h"
+
+#include <stdlib.h>
+#include <sched.h>
+
+#define INJECT_BATCH 16 // most a worker moves from the injection queue at once
+
+// Orderings follow Le et al. with the two fences folded into the
+// neighbouring accesses (release store of bottom, seq_cst bottom/top
+// pairs), which is equivalent and what ThreadSanitizer can follow.
+
+static ws_array_t *array_new(long size) {
+    ws_array_t *a = (ws_array_t*)malloc(sizeof(*a));
+    if (!a) return NULL;
+    a->slots = (void**)calloc((size_t)size, sizeof(void*));
+    if (!a->slots) { free(a); return NULL; }
+    a->size = size;
+    a->prev = NULL;
+    return a;
+}
+
+static void *slot_get(ws_array_t *a, long i) {
+    return __atomic_load_n(&a->slots[i & (a->size - 1)], __ATOMIC_RELAXED);
+}
+
+static void slot_put(ws_array_t *a, long i, void *item) {
+    __atomic_store_n(&a->slots[i & (a->size - 1)], item, __ATOMIC_RELAXED);
+}
+
+int ws_deque_init(ws_deque_t *d, long size) {
+    long n = 16;
+    while (n < size) n <<= 1;
+    d->top = d->bottom = 0;
+    d->array = array_new(n);
+    return d->array ? 0 : -1;
+}
+
+void ws_deque_destroy(ws_deque_t *d) {
+    ws_array_t *a = d->array;
+    while (a) {
+        ws_array_t *prev = a->prev;
+        free(a->slots);
+        free(a);
+        a = prev;
+    }
+    d->array = NULL;
+}
+
+int ws_deque_push(ws_deque_t *d, void *item) {
+    long b = __atomic_load_n(&d->bottom, __ATOMIC_RELAXED);
+    long t = __atomic_load_n(&d->top, __ATOMIC_ACQUIRE);
+    ws_array_t *a = __atomic_load_n(&d->array, __ATOMIC_RELAXED);
+    if (b - t > a->size - 1) {
+        ws_array_t *g = array_new(a->size * 2);
+        if (!g) return -1;
+        for (long i = t; i < b; i++) slot_put(g, i, slot_get(a, i));
+        g->prev = a;
+        __atomic_store_n(&d->array, g, __ATOMIC_RELEASE);
+        a = g;
+    }
+    slot_put(a, b, item);
+    __atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+void *ws_deque_pop(ws_deque_t *d) {
+    long b = __atomic_load_n(&d->bottom, __ATOMIC_RELAXED) - 1;
+    ws_array_t *a = __atomic_load_n(&d->array, __ATOMIC_RELAXED);
+    __atomic_store_n(&d->bottom, b, __ATOMIC_SEQ_CST);
+    long t = __atomic_load_n(&d->top, __ATOMIC_SEQ_CST);
+    if (t > b) { // empty
+        __atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+    void *item = slot_get(a, b);
+    if (t == b) {
+        // Last item: thieves may be after it too
+        if (!__atomic_compare_exchange_n(&d->top, &t, t + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) item = NULL;
+        __atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELAXED);
+    }
+    return item;
+}
+
+void *ws_deque_steal(ws_deque_t *d) {
+    long t = __atomic_load_n(&d->top, __ATOMIC_SEQ_CST);
+    long b = __atomic_load_n(&d->bottom, __ATOMIC_SEQ_CST);
+    if (t >= b) return NULL;
+    ws_array_t *a = __atomic_load_n(&d->array, __ATOMIC_ACQUIRE);
+    void *item = slot_get(a, t);
+    if (!__atomic_compare_exchange_n(&d->top, &t, t + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) return WS_ABORT;
+    return item;
+}
+
+int wsched_init(wsched_t *s, int nworkers, size_t capacity, ts_queue_impl_t impl) {
+    s->nworkers = nworkers;
+    s->sleepers = 0;
+    s->wakes = 0;
+    s->deques = (ws_deque_t*)calloc((size_t)nworkers, sizeof(ws_deque_t));
+    s->held = (void**)calloc((size_t)nworkers * INJECT_BATCH, sizeof(void*));
+    s->nheld = (int*)calloc((size_t)nworkers, sizeof(int));
+    if (!s->deques || !s->held || !s->nheld || ts_queue_init_impl(&s->inject, capacity, impl) != 0) {
+        free(s->deques); free(s->held); free(s->nheld);
+        return -1;
+    }
+    for (int i = 0; i < nworkers; i++) {
+        if (ws_deque_init(&s->deques[i], INJECT_BATCH * 4) != 0) {
+            while (i-- > 0) ws_deque_destroy(&s->deques[i]);
+            ts_queue_destroy(&s->inject);
+            free(s->deques); free(s->held); free(s->nheld);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+void wsched_destroy(wsched_t *s) {
+    for (int i = 0; i < s->nworkers; i++) ws_deque_destroy(&s->deques[i]);
+    free(s->deques);
+    free(s->held);
+    free(s->nheld);
+    ts_queue_destroy(&s->inject);
+}
+
+void wsched_close(wsched_t *s) {
+    ts_queue_close(&s->inject);
+}
+
+int wsched_push(wsched_t *s, void *item) {
+    return ts_queue_push(&s->inject, item);
+}
+
+// Sleeping workers only watch the injection queue, so work that lands on a
+// deque (or outside the scheduler) sends them this instead
+static char g_wake;
+#define WAKE ((void*)&g_wake)
+
+// Posts a token if some sleeper has none coming yet; 1 if it did
+static int wake_one(wsched_t *s) {
+    int w = __atomic_load_n(&s->wakes, __ATOMIC_RELAXED);
+    do {
+        if (w >= __atomic_load_n(&s->sleepers, __ATOMIC_SEQ_CST)) return 0;
+    } while (!__atomic_compare_exchange_n(&s->wakes, &w, w + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED));
+    // Best effort: a full queue has nobody asleep on it anyway
+    if (ts_queue_try_push(&s->inject, WAKE) == 0) return 1;
+    __atomic_sub_fetch(&s->wakes, 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+// Whoever takes a token off the queue, sleeper or not
+static void wake_taken(wsched_t *s) {
+    __atomic_sub_fetch(&s->wakes, 1, __ATOMIC_RELAXED);
+}
+
+void wsched_wake(wsched_t *s) {
+    wake_one(s);
+}
+
+void wsched_wake_all(wsched_t *s) {
+    while (wake_one(s)) {}
+}
+
+// A worker never waits on the injection queue: what it cannot place
+// anywhere it keeps, and runs before looking for anything else
+static int hold(wsched_t *s, int id, void *item) {
+    if (s->nheld[id] == INJECT_BATCH) return -1;
+    s->held[id * INJECT_BATCH + s->nheld[id]++] = item;
+    return 0;
+}
+
+static void *unhold(wsched_t *s, int id) {
+    return s->nheld[id] > 0 ? s->held[id * INJECT_BATCH + --s->nheld[id]] : NULL;
+}
+
+int wsched_push_local(wsched_t *s, int id, void *item) {
+    if (ws_deque_push(&s->deques[id], item) != 0 && ts_queue_try_push(&s->inject, item) != 0) return hold(s, id, item);
+    wsched_wake(s);
+    return 0;
+}
+
+// Takes this worker's share of the injection queue in one go: one item to
+// run now, the rest onto its deque. Only called with nothing held, so the
+// rest always fits there if the deque cannot grow.
+static void *inject_take(wsched_t *s, int id) {
+    void *batch[INJECT_BATCH];
+    size_t n = ts_queue_size(&s->inject) / (size_t)s->nworkers + 1;
+    if (n > INJECT_BATCH) n = INJECT_BATCH;
+    n = ts_queue_try_pop_n(&s->inject, batch, n);
+    void *item = NULL;
+    int spilled = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (batch[i] == WAKE) { wake_taken(s); continue; }
+        if (!item) { item = batch[i]; continue; }
+        // Out of memory for a bigger deque: hand it back if there is room
+        if (ws_deque_push(&s->deques[id], batch[i]) == 0) spilled = 1;
+        else if (ts_queue_try_push(&s->inject, batch[i]) != 0) hold(s, id, batch[i]);
+    }
+    // More than this worker will get to soon: let a sleeper steal some
+    if (spilled) wsched_wake(s);
+    return item;
+}
+
+// Tries every other deque once, starting after id. Returns NULL only when
+// all looked empty; a lost race counts as "try again".
+static void *steal_any(wsched_t *s, int id, int *contended) {
+    *contended = 0;
+    for (int k = 1; k < s->nworkers; k++) {
+        void *item = ws_deque_steal(&s->deques[(id + k) % s->nworkers]);
+        if (item == WS_ABORT) { *contended = 1; continue; }
+        if (item) return item;
+    }
+    return NULL;
+}
+
+int wsched_pop(wsched_t *s, int id, void **out_item) {
+    for (;;) {
+        void *item = unhold(s, id);
+        if (!item) item = ws_deque_pop(&s->deques[id]);
+        if (!item) item = inject_take(s, id);
+        if (item) { *out_item = item; return 0; }
+        int contended;
+        item = steal_any(s, id, &contended);
+        if (item) { *out_item = item; return 0; }
+        if (contended) { sched_yield(); continue; }
+        // A push onto another worker's deque between the steal above and
+        // the increment goes unnoticed; that worker runs it itself
+        __atomic_add_fetch(&s->sleepers, 1, __ATOMIC_SEQ_CST);
+        int rc = ts_queue_pop(&s->inject, &item);
+        __atomic_sub_fetch(&s->sleepers, 1, __ATOMIC_RELAXED);
+        if (rc != 0) return -1; // closed and drained; the other deques are their owners' to finish
+        if (item == WAKE) { wake_taken(s); return 1; }
+        *out_item = item;
+        return 0;
+    }
+}
+
+void *wsched_pop_local(wsched_t *s, int id) {
+    void *item = unhold(s, id);
+    return item ? item : ws_deque_pop(&s->deques[id]);
+}
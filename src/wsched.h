@@ -0,0 +1,79 @@
+#ifndef WSCHED_H
+#define WSCHED_H
+
+#include <stddef.h>
+
+#include "queue.h"
+
+// Work-stealing scheduler for a fixed set of worker slots. Each worker
+// owns a Chase-Lev deque: it pushes and pops at the bottom without locks,
+// while idle workers steal from the top. Threads outside the pool (the
+// event loops) submit through a bounded injection queue (a ts_queue_t); a
+// worker takes a share of it at once into its deque, so the shared queue
+// is touched once per batch rather than once per task, and the rest of the
+// batch can be stolen.
+
+// Chase-Lev deque ("Dynamic Circular Work-Stealing Deque", with the C11
+// orderings of Le et al.). Grows on push; replaced arrays are kept until
+// ws_deque_destroy() since a thief may still be reading one.
+typedef struct ws_array {
+    long size; // power of two
+    void **slots;
+    struct ws_array *prev; // retired, freed on destroy
+} ws_array_t;
+
+typedef struct {
+    long top;    // next to steal
+    long bottom; // next free slot; owner only writes
+    ws_array_t *array;
+} ws_deque_t;
+
+int ws_deque_init(ws_deque_t *d, long size);
+void ws_deque_destroy(ws_deque_t *d);
+// Owner only
+int ws_deque_push(ws_deque_t *d, void *item);
+void *ws_deque_pop(ws_deque_t *d); // NULL if empty
+// Any thread; NULL if empty, WS_ABORT if it lost a race for the top item
+#define WS_ABORT ((void*)-1)
+void *ws_deque_steal(ws_deque_t *d);
+
+typedef struct {
+    int nworkers;
+    ws_deque_t *deques;
+    ts_queue_t inject; // from outside the pool; idle workers sleep in its pop
+    int sleepers;      // workers doing so
+    int wakes;         // wake tokens in inject not yet taken, at most sleepers
+    // Per worker, owner only: items that neither its deque (out of memory)
+    // nor a full injection queue would take, which it runs itself next
+    void **held;
+    int *nheld;
+} wsched_t;
+
+// impl picks the injection queue's implementation
+int wsched_init(wsched_t *s, int nworkers, size_t capacity, ts_queue_impl_t impl);
+void wsched_destroy(wsched_t *s);
+// Refuses new work and wakes everyone; queued items are still handed out
+void wsched_close(wsched_t *s);
+// From outside the pool: waits while the injection queue is full.
+// Returns 0, or -1 once closed.
+int wsched_push(wsched_t *s, void *item);
+// From worker id: straight onto its own deque. Never blocks: if the deque
+// cannot grow the item goes to the injection queue, or if that is full the
+// worker keeps it for its next pop. -1 only when even that is full.
+int wsched_push_local(wsched_t *s, int id, void *item);
+// Rouses one sleeping worker, if any, for work that arrived elsewhere. A
+// sleeper that already has a wake on its way is not sent another, so a
+// burst of submits costs one token per sleeper, not one per submit.
+void wsched_wake(wsched_t *s);
+// Rouses every worker sleeping right now
+void wsched_wake_all(wsched_t *s);
+// Worker id's next item: what it holds, its own deque, the injection
+// queue, then the other deques. Blocks while there is nothing. Returns 0
+// with an item, 1 when woken without one (look around and call again), or
+// -1 once closed and drained.
+int wsched_pop(wsched_t *s, int id, void **out_item);
+// Worker id's held items and own deque only, never blocking: NULL once
+// both are empty. For a worker leaving the pool to finish what it took.
+void *wsched_pop_local(wsched_t *s, int id);
+
+#endif
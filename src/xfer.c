@@ -0,0 +1,179 @@
+#define _GNU_SOURCE
+#include "xfer.h"
+#include "stats.h"
+#include "util.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+
+#define XFER_COPY_CHUNK (64 * 1024)
+#define XFER_PIPE_SIZE (1024 * 1024)
+
+void xfer_init(xfer_t *x, xfer_mode_t mode) {
+    x->mode = mode;
+    x->pipefd[0] = x->pipefd[1] = -1;
+    x->piped = 0;
+}
+
+void xfer_close(xfer_t *x) {
+    if (x->pipefd[0] >= 0) close(x->pipefd[0]);
+    if (x->pipefd[1] >= 0) close(x->pipefd[1]);
+    x->pipefd[0] = x->pipefd[1] = -1;
+    x->piped = 0;
+}
+
+// Errors meaning "this mechanism doesn't work for these fds", not "the peer went away"
+static int unsupported(int err) {
+    return err == EINVAL || err == ENOSYS || err == EOPNOTSUPP || err == EOVERFLOW;
+}
+
+static ssize_t send_copy(int sock_fd, int in_fd, off_t *off, size_t len) {
+    char buf[XFER_COPY_CHUNK];
+    size_t want = len > sizeof(buf) ? sizeof(buf) : len;
+    ssize_t r = pread(in_fd, buf, want, *off);
+    stats_add(STAT_DL_COPY_CALLS, 1);
+    if (r < 0) return -1;
+    if (r == 0) { errno = EIO; return -1; } // file shorter than announced
+    ssize_t w = send(sock_fd, buf, (size_t)r, MSG_NOSIGNAL);
+    stats_add(STAT_DL_COPY_CALLS, 1);
+    if (w < 0) return -1;
+    *off += w;
+    stats_add(STAT_DL_COPY_BYTES, w);
+    return w;
+}
+
+static int ensure_pipe(xfer_t *x) {
+    if (x->pipefd[0] >= 0) return 0;
+    if (pipe2(x->pipefd, O_CLOEXEC | O_NONBLOCK) != 0) return -1;
+    fcntl(x->pipefd[1], F_SETPIPE_SZ, XFER_PIPE_SIZE);
+    return 0;
+}
+
+static ssize_t send_splice(xfer_t *x, int sock_fd, int in_fd, off_t *off, size_t len) {
+    if (ensure_pipe(x) != 0) return -1;
+    if (x->piped == 0) {
+        loff_t pos = *off;
+        size_t want = len > XFER_PIPE_SIZE ? XFER_PIPE_SIZE : len;
+        ssize_t r = splice(in_fd, &pos, x->pipefd[1], NULL, want, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        stats_add(STAT_DL_SPLICE_CALLS, 1);
+        if (r < 0) return -1;
+        if (r == 0) { errno = EIO; return -1; }
+        x->piped = (size_t)r;
+    }
+    ssize_t w = splice(x->pipefd[0], NULL, sock_fd, NULL, x->piped, SPLICE_F_MOVE | SPLICE_F_NONBLOCK | SPLICE_F_MORE);
+    stats_add(STAT_DL_SPLICE_CALLS, 1);
+    if (w < 0) return -1;
+    x->piped -= (size_t)w;
+    *off += w;
+    stats_add(STAT_DL_SPLICE_BYTES, w);
+    return w;
+}
+
+ssize_t xfer_send(xfer_t *x, int sock_fd, int in_fd, off_t *off, size_t len) {
+    for (;;) {
+        ssize_t w;
+        if (x->mode == XFER_SENDFILE) {
+            w = sendfile(sock_fd, in_fd, off, len);
+            stats_add(STAT_DL_SENDFILE_CALLS, 1);
+            if (w > 0) stats_add(STAT_DL_SENDFILE_BYTES, w);
+            if (w == 0) { errno = EIO; return -1; }
+        } else if (x->mode == XFER_SPLICE) {
+            w = send_splice(x, sock_fd, in_fd, off, len);
+        } else {
+            return send_copy(sock_fd, in_fd, off, len);
+        }
+        if (w >= 0) return w;
+        if (errno == EINTR) continue;
+        // Degrade only while the pipe is empty so no bytes are skipped
+        if (!unsupported(errno) || x->piped != 0) return -1;
+        if (x->mode == XFER_SENDFILE) x->mode = XFER_SPLICE;
+        else { xfer_close(x); x->mode = XFER_COPY; }
+    }
+}
+
+static ssize_t recv_copy(int sock_fd, int out_fd, size_t len, int *file_err) {
+    char buf[XFER_COPY_CHUNK];
+    size_t want = len > sizeof(buf) ? sizeof(buf) : len;
+    ssize_t r = recv(sock_fd, buf, want, 0);
+    stats_add(STAT_UP_COPY_CALLS, 1);
+    if (r <= 0) return r;
+    if (write_n(out_fd, buf, (size_t)r) < 0) *file_err = 1;
+    stats_add(STAT_UP_COPY_CALLS, 1);
+    stats_add(STAT_UP_COPY_BYTES, r);
+    return r;
+}
+
+// Empties the pipe through user space: into out_fd, or nowhere if out_fd < 0
+static int drain_pipe(xfer_t *x, int out_fd, size_t left) {
+    char buf[XFER_COPY_CHUNK];
+    int rc = 0;
+    while (left > 0) {
+        ssize_t r = read(x->pipefd[0], buf, left > sizeof(buf) ? sizeof(buf) : left);
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) return -1;
+        if (out_fd >= 0 && rc == 0 && write_n(out_fd, buf, (size_t)r) < 0) rc = -1;
+        left -= (size_t)r;
+    }
+    return rc;
+}
+
+static ssize_t recv_splice(xfer_t *x, int sock_fd, int out_fd, size_t len, int *file_err) {
+    if (ensure_pipe(x) != 0) return -1;
+    size_t want = len > XFER_PIPE_SIZE ? XFER_PIPE_SIZE : len;
+    ssize_t r = splice(sock_fd, NULL, x->pipefd[1], NULL, want, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    stats_add(STAT_UP_SPLICE_CALLS, 1);
+    if (r <= 0) return r;
+    size_t left = (size_t)r;
+    while (left > 0) {
+        ssize_t w = splice(x->pipefd[0], NULL, out_fd, NULL, left, SPLICE_F_MOVE);
+        stats_add(STAT_UP_SPLICE_CALLS, 1);
+        if (w > 0) { left -= (size_t)w; continue; }
+        if (w < 0 && errno == EINTR) continue;
+        if (w < 0 && unsupported(errno)) {
+            // filesystem can't take spliced pages: finish this batch by copying
+            if (drain_pipe(x, out_fd, left) != 0) *file_err = 1;
+            xfer_close(x);
+            x->mode = XFER_COPY;
+        } else {
+            drain_pipe(x, -1, left);
+            *file_err = 1;
+        }
+        break;
+    }
+    stats_add(STAT_UP_SPLICE_BYTES, r);
+    return r;
+}
+
+ssize_t xfer_recv(xfer_t *x, int sock_fd, int out_fd, size_t len, int *file_err) {
+    *file_err = 0;
+    for (;;) {
+        if (x->mode == XFER_COPY) return recv_copy(sock_fd, out_fd, len, file_err);
+        ssize_t r = recv_splice(x, sock_fd, out_fd, len, file_err);
+        if (r >= 0) return r;
+        if (errno == EINTR) continue;
+        if (!unsupported(errno)) return -1;
+        xfer_close(x);
+        x->mode = XFER_COPY;
+    }
+}
+
+int xfer_parse_mode(const char *s, xfer_mode_t *out) {
+    if (strcmp(s, "sendfile") == 0) *out = XFER_SENDFILE;
+    else if (strcmp(s, "splice") == 0) *out = XFER_SPLICE;
+    else if (strcmp(s, "copy") == 0) *out = XFER_COPY;
+    else return -1;
+    return 0;
+}
+
+const char *xfer_mode_name(xfer_mode_t mode) {
+    switch (mode) {
+        case XFER_SENDFILE: return "sendfile";
+        case XFER_SPLICE: return "splice";
+        case XFER_COPY: return "copy";
+    }
+    return "?";
+}
@@ -0,0 +1,34 @@
+#ifndef XFER_H
+#define XFER_H
+
+#include <sys/types.h>
+
+// How file bytes move between a socket and a file. A transfer starts in the
+// configured mode and degrades sendfile -> splice -> copy if the kernel or
+// filesystem rejects it. Receiving has no sendfile step and starts at splice.
+typedef enum { XFER_SENDFILE, XFER_SPLICE, XFER_COPY } xfer_mode_t;
+
+typedef struct {
+    xfer_mode_t mode;
+    int pipefd[2]; // splice only; created on first use
+    size_t piped;  // bytes already moved from the file into the pipe
+} xfer_t;
+
+void xfer_init(xfer_t *x, xfer_mode_t mode);
+void xfer_close(xfer_t *x);
+
+// Sends up to len bytes of in_fd starting at *off to sock_fd, which may be
+// non-blocking. Advances *off past the bytes that reached the socket.
+// Returns bytes sent, or -1 with errno set (EAGAIN when the socket is full).
+ssize_t xfer_send(xfer_t *x, int sock_fd, int in_fd, off_t *off, size_t len);
+
+// Moves up to len bytes from sock_fd (may be non-blocking) to out_fd at its
+// current offset. Returns bytes consumed from the socket, 0 on EOF, or -1
+// with errno set. If writing the file fails the consumed bytes are dropped
+// and *file_err is set, so the caller can keep the stream in sync.
+ssize_t xfer_recv(xfer_t *x, int sock_fd, int out_fd, size_t len, int *file_err);
+
+int xfer_parse_mode(const char *s, xfer_mode_t *out); // 0 ok, -1 unknown
+const char *xfer_mode_name(xfer_mode_t mode);
+
+#endif
@@ -26,6 +26,79 @@ list
 quit
 CMDS
 
+# Same sequence over the text protocol old clients speak
+./bin/client --host 127.0.0.1 --port "$PORT" --proto text <<'CMDS'
+login u1 p1
+upload ./a.txt
+list
+download a.txt ./a.out
+delete a.txt
+quit
+CMDS
+
+# Compressed bodies, both protocols; the download must match byte for byte
+for proto in v2 text; do
+  rm -f ./a.out
+  ./bin/client --host 127.0.0.1 --port "$PORT" --proto "$proto" --compress lz4 <<'CMDS'
+login u1 p1
+upload ./a.txt
+download a.txt ./a.out
+delete a.txt
+quit
+CMDS
+  cmp ./a.txt ./a.out
+done
+
+# Resumable session (UPLOAD_BEGIN/APPEND/COMMIT) for every upload
+for proto in v2 text; do
+  rm -f ./a.out
+  ./bin/client --host 127.0.0.1 --port "$PORT" --proto "$proto" --resume-above 0 <<'CMDS'
+login u1 p1
+upload ./a.txt
+download a.txt ./a.out
+delete a.txt
+quit
+CMDS
+  cmp ./a.txt ./a.out
+done
+
+# Striped session: ranges over four connections at once, then one commit
+head -c 5000000 /dev/urandom > ./big.bin
+for proto in v2 text; do
+  rm -f ./big.out
+  ./bin/client --host 127.0.0.1 --port "$PORT" --proto "$proto" --resume-above 0 --streams 4 <<'CMDS'
+login u1 p1
+upload ./big.bin
+download big.bin ./big.out
+delete big.bin
+quit
+CMDS
+  cmp ./big.bin ./big.out
+done
+rm -f ./big.bin ./big.out
+
+# Over quota, a one-shot UPLOAD is refused from its header: the server
+# answers and hangs up without waiting for the body, which never comes here
+exec 3<>"/dev/tcp/127.0.0.1/$PORT"
+printf 'LOGIN u1 p1\nUPLOAD over.bin 200000000\n' >&3
+reply=$(timeout 5 cat <&3 || echo TIMEOUT)
+exec 3<&-
+[ "$reply" = $'OK\nERR QUOTA' ] || { echo "over-quota upload: got '$reply'"; exit 1; }
+
+# The client sees the same refusal, then carries on over a new connection
+truncate -s 200000000 ./over.bin
+out=$(./bin/client --host 127.0.0.1 --port "$PORT" <<'CMDS'
+login u1 p1
+upload ./over.bin
+upload ./a.txt
+delete a.txt
+quit
+CMDS
+)
+rm -f ./over.bin
+grep -q "ERR QUOTA" <<<"$out" || { echo "$out"; exit 1; }
+[ "$(grep -c '^> OK' <<<"$out")" -ge 3 ] || { echo "$out"; exit 1; }
+
 echo "OK"
 
 
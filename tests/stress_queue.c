@@ -0,0 +1,199 @@
+// Queue stress test, meant to run under ThreadSanitizer (tests/tsan_test.sh):
+// both ts_queue_t implementations with a tiny capacity, so producers and
+// consumers keep hitting full and empty and blocking on them, then wsched_t
+// over each. Every item must come out exactly once, and close must release
+// threads blocked on either end.
+//
+//   bin/stress_queue [--items N]
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "queue.h"
+#include "wsched.h"
+
+#define PRODUCERS 4
+#define CONSUMERS 4
+#define WORKERS 4
+
+static long g_items = 20000; // per producer
+static int g_failed;
+
+#define CHECK(cond, ...) do { if (!(cond)) { fprintf(stderr, __VA_ARGS__); fputc('\n', stderr); g_failed = 1; } } while (0)
+
+typedef struct {
+    ts_queue_t *q;
+    int id;
+    unsigned char *seen;
+    long taken;
+} qarg_t;
+
+static void *producer_main(void *arg) {
+    qarg_t *a = (qarg_t*)arg;
+    for (long i = 0; i < g_items; i++) {
+        uintptr_t v = (uintptr_t)(a->id * g_items + i + 1);
+        // Half the producers spin on try_push to cover it too
+        if (a->id % 2) { while (ts_queue_try_push(a->q, (void*)v) != 0) sched_yield(); }
+        else if (ts_queue_push(a->q, (void*)v) != 0) { CHECK(0, "push failed before close"); break; }
+    }
+    return NULL;
+}
+
+static void mark(qarg_t *a, void *item) {
+    uintptr_t v = (uintptr_t)item;
+    if (v == 0 || v > (uintptr_t)(PRODUCERS * g_items)) { CHECK(0, "bogus item %lu", (unsigned long)v); return; }
+    CHECK(__atomic_exchange_n(&a->seen[v - 1], 1, __ATOMIC_RELAXED) == 0, "item %lu popped twice", (unsigned long)v);
+    a->taken++;
+}
+
+static void *consumer_main(void *arg) {
+    qarg_t *a = (qarg_t*)arg;
+    for (;;) {
+        void *batch[3];
+        size_t n = a->id % 2 ? ts_queue_try_pop_n(a->q, batch, 3) : 0;
+        for (size_t i = 0; i < n; i++) mark(a, batch[i]);
+        if (n > 0) continue;
+        void *item;
+        if (ts_queue_pop(a->q, &item) != 0) break;
+        mark(a, item);
+    }
+    return NULL;
+}
+
+static void stress_queue(ts_queue_impl_t impl, const char *name) {
+    ts_queue_t q;
+    if (ts_queue_init_impl(&q, 4, impl) != 0) { CHECK(0, "%s: init", name); return; }
+    unsigned char *seen = (unsigned char*)calloc((size_t)(PRODUCERS * g_items), 1);
+    pthread_t prod[PRODUCERS], cons[CONSUMERS];
+    qarg_t pa[PRODUCERS], ca[CONSUMERS];
+    for (int i = 0; i < CONSUMERS; i++) {
+        ca[i] = (qarg_t){ &q, i, seen, 0 };
+        pthread_create(&cons[i], NULL, consumer_main, &ca[i]);
+    }
+    for (int i = 0; i < PRODUCERS; i++) {
+        pa[i] = (qarg_t){ &q, i, seen, 0 };
+        pthread_create(&prod[i], NULL, producer_main, &pa[i]);
+    }
+    for (int i = 0; i < PRODUCERS; i++) pthread_join(prod[i], NULL);
+    ts_queue_close(&q);
+    long total = 0;
+    for (int i = 0; i < CONSUMERS; i++) { pthread_join(cons[i], NULL); total += ca[i].taken; }
+    CHECK(total == PRODUCERS * g_items, "%s: %ld of %ld items came out", name, total, PRODUCERS * g_items);
+    void *item;
+    CHECK(ts_queue_try_pop(&q, &item) != 0, "%s: items left after drain", name);
+    CHECK(ts_queue_push(&q, (void*)1) != 0, "%s: push after close succeeded", name);
+    free(seen);
+    ts_queue_destroy(&q);
+}
+
+static void *blocked_pop(void *arg) {
+    void *item;
+    return (void*)(intptr_t)ts_queue_pop((ts_queue_t*)arg, &item);
+}
+
+static void *blocked_push(void *arg) {
+    return (void*)(intptr_t)ts_queue_push((ts_queue_t*)arg, (void*)1);
+}
+
+// close() must release a pop waiting on empty and a push waiting on full
+static void close_wakes(ts_queue_impl_t impl, const char *name) {
+    for (int full = 0; full < 2; full++) {
+        ts_queue_t q;
+        ts_queue_init_impl(&q, 2, impl);
+        if (full) { ts_queue_push(&q, (void*)1); ts_queue_push(&q, (void*)1); }
+        pthread_t th;
+        void *rc;
+        pthread_create(&th, NULL, full ? blocked_push : blocked_pop, &q);
+        usleep(20000);
+        ts_queue_close(&q);
+        pthread_join(th, &rc);
+        CHECK((intptr_t)rc == -1, "%s: blocked %s returned %ld after close", name, full ? "push" : "pop", (long)(intptr_t)rc);
+        ts_queue_destroy(&q);
+    }
+}
+
+// A capacity that is not a power of two holds exactly that many
+static void capacity_exact(ts_queue_impl_t impl, const char *name) {
+    ts_queue_t q;
+    if (ts_queue_init_impl(&q, 5, impl) != 0) { CHECK(0, "%s: init", name); return; }
+    int n = 0;
+    while (n < 64 && ts_queue_try_push(&q, (void*)1) == 0) n++;
+    CHECK(n == 5, "%s: capacity 5 took %d items", name, n);
+    void *item;
+    ts_queue_try_pop(&q, &item);
+    CHECK(ts_queue_try_push(&q, (void*)1) == 0, "%s: no room after a pop", name);
+    CHECK(ts_queue_try_push(&q, (void*)1) != 0, "%s: room past capacity after a pop", name);
+    ts_queue_destroy(&q);
+}
+
+// wsched: injected items plus a tree of locally spawned ones (depth in the
+// item), all counted once
+typedef struct {
+    wsched_t *s;
+    int id;
+    long total;
+    long *done;
+} warg_t;
+
+static void *sched_worker(void *arg) {
+    warg_t *a = (warg_t*)arg;
+    void *item;
+    int rc;
+    while ((rc = wsched_pop(a->s, a->id, &item)) >= 0) {
+        if (rc > 0) continue;
+        long depth = (long)(uintptr_t)item - 1;
+        for (int k = 0; depth > 0 && k < 2; k++) wsched_push_local(a->s, a->id, (void*)(uintptr_t)depth);
+        if (__atomic_add_fetch(a->done, 1, __ATOMIC_ACQ_REL) == a->total) wsched_close(a->s);
+    }
+    return NULL;
+}
+
+static void *sched_submitter(void *arg) {
+    warg_t *a = (warg_t*)arg;
+    for (long i = 0; i < g_items; i++) {
+        if (wsched_push(a->s, (void*)(uintptr_t)1) != 0) { CHECK(0, "wsched push failed before close"); break; }
+    }
+    return NULL;
+}
+
+static void stress_wsched(ts_queue_impl_t impl, const char *name) {
+    const int depth = 9, roots = 8; // each root: 2^(depth+1) - 1 tasks
+    wsched_t s;
+    if (wsched_init(&s, WORKERS, 8, impl) != 0) { CHECK(0, "%s: wsched init", name); return; }
+    long done = 0, total = 2 * g_items + (long)roots * ((2L << depth) - 1);
+    pthread_t th[WORKERS + 2];
+    warg_t args[WORKERS + 2];
+    for (int i = 0; i < WORKERS + 2; i++) {
+        args[i] = (warg_t){ &s, i, total, &done };
+        if (i < WORKERS) pthread_create(&th[i], NULL, sched_worker, &args[i]);
+    }
+    for (int r = 0; r < roots; r++) wsched_push(&s, (void*)(uintptr_t)(depth + 1));
+    for (int i = WORKERS; i < WORKERS + 2; i++) pthread_create(&th[i], NULL, sched_submitter, &args[i]);
+    for (int i = 0; i < WORKERS + 2; i++) pthread_join(th[i], NULL);
+    CHECK(done == total, "%s: wsched ran %ld of %ld", name, done, total);
+    wsched_destroy(&s);
+}
+
+int main(int argc, char **argv) {
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--items") == 0 && i + 1 < argc) g_items = atol(argv[++i]);
+        else { fprintf(stderr, "usage: stress_queue [--items N]\n"); return 1; }
+    }
+    if (g_items < 1) g_items = 1;
+    const struct { ts_queue_impl_t impl; const char *name; } impls[] = {
+        { TS_QUEUE_MUTEX, "mutex" }, { TS_QUEUE_RING, "ring" },
+    };
+    for (int i = 0; i < 2; i++) {
+        stress_queue(impls[i].impl, impls[i].name);
+        close_wakes(impls[i].impl, impls[i].name);
+        capacity_exact(impls[i].impl, impls[i].name);
+        stress_wsched(impls[i].impl, impls[i].name);
+    }
+    if (g_failed) return 1;
+    printf("QUEUE STRESS OK\n");
+    return 0;
+}
@@ -15,15 +15,38 @@ LOG_FILE=$(mktemp)
 PORT=${PORT:-9000}
 ROOT=${ROOT:-storage}
 QUOTA=${QUOTA:-104857600}
+QUEUE_IMPL=${QUEUE_IMPL:-ring}
+#batched puts uploads through the syncer thread
+DURABILITY=${DURABILITY:-batched}
 
-echo "Running TSAN server with concurrency workload..."
 #Prefer disabling ASLR to avoid TSAN 'unexpected memory mapping' on some kernels
 SETARCH_PREFIX=""
 if command -v setarch >/dev/null 2>&1; then
   SETARCH_PREFIX="setarch $(uname -m) -R"
 fi
+
+#Stress tests first: both ts_queue_t implementations and wsched, then the lock manager's modes
+for STRESS in queue lockmgr; do
+  make CFLAGS="-Wall -Wextra -Werror -O1 -g -fno-omit-frame-pointer -fsanitize=thread -pthread" \
+       LDFLAGS="-fsanitize=thread -pthread" \
+       bin/stress_$STRESS >/dev/null
+  STRESS_LOG=$(mktemp)
+  if ! TSAN_OPTIONS="halt_on_error=1 report_signal_unsafe=0" $SETARCH_PREFIX ./bin/stress_$STRESS >"$STRESS_LOG" 2>&1; then
+    echo "============== TSAN SUMMARY =============="
+    echo "Result: FAIL ($STRESS stress)"
+    echo "-----------------------------------------"
+    tail -n 30 "$STRESS_LOG"
+    exit 1
+  fi
+  cat "$STRESS_LOG"
+  rm -f "$STRESS_LOG"
+done
+
+#Small adaptive pool, so the workload also grows (and the exit joins) workers
+echo "Running TSAN server with concurrency workload..."
 TSAN_OPTIONS="halt_on_error=1 memory_limit_mb=8192 report_signal_unsafe=0" \
-  $SETARCH_PREFIX ./bin/server --port "$PORT" --root "$ROOT" --quota-bytes "$QUOTA" >"$LOG_FILE" 2>&1 &
+  $SETARCH_PREFIX ./bin/server --port "$PORT" --root "$ROOT" --quota-bytes "$QUOTA" --queue-impl "$QUEUE_IMPL" \
+  --durability "$DURABILITY" --workers 2 --workers-max 6 >"$LOG_FILE" 2>&1 &
 SVR_PID=$!
 sleep 1
 